@@ -221,7 +221,7 @@ export default class Astrometry implements RequestHandler.APIAppProvider<BackOff
                 }
 
                 console.log('Starting astrometry with ' + JSON.stringify(astrometry));
-                result = await this.imageProcessor.compute(task.cancellation, {astrometry});
+                result = await this.imageProcessor.compute(task.cancellation, {astrometry, priority: "background"});
             } catch(e) {
                 if (e instanceof CancellationToken.CancellationError) {
                     finish('empty', null, null);
@@ -913,6 +913,7 @@ export default class Camera
                     device: device
                 };
                 shootResult = ({path: value, device, uuid: newUuid});
+                this.imageProcessor.prefetch({path: value});
 
                 // Remove UPLOAD_MODE
                 // FIXME: this should be in a finally !
@@ -0,0 +1,99 @@
+import child_process from 'child_process';
+import http from 'http';
+import express from 'express';
+import Sleep from './Sleep';
+import CancellationToken from 'cancellationtoken';
+
+const minRetryDelay = 2000;
+const maxRetryDelay = 300000;
+// Runs shorter than this count as crashes for the retry delay
+const stableRunTime = 60000;
+
+// Keep a fitsviewer.cgi running in daemon mode and forward image requests to it.
+// This saves a process spawn, a cache connection and the jpeg setup per image.
+// Requests fall back to the plain cgi while the daemon is not reachable
+export default class FitsViewerDaemon {
+    private readonly exe: string;
+    private readonly socketPath: string;
+    private child: child_process.ChildProcess|null = null;
+    private startedAt: number = 0;
+    // A daemon that dies soon after its start is retried less and less often
+    private retryDelay: number = minRetryDelay;
+    private nextStart: number = 0;
+
+    constructor(exe: string, socketPath: string) {
+        this.exe = exe;
+        this.socketPath = socketPath;
+        this.lifeCycle(CancellationToken.CONTINUE);
+    }
+
+    private startExe() {
+        console.log('Starting ' + this.exe + ' daemon on ' + this.socketPath);
+        const child = child_process.spawn(this.exe, ['--daemon', this.socketPath], {
+            stdio: ['ignore', 'ignore', 'inherit'],
+        });
+        child.on('error', (err)=> {
+            console.warn("Fitsviewer daemon error : " + err);
+            // Failed spawns (ENOENT, EACCES) may not emit exit
+            if (child.pid === undefined) {
+                this.childEnded(child);
+            }
+        });
+        child.on('exit', (code, signal)=> {
+            console.warn("Fitsviewer daemon exited : " + (code !== null ? code : signal));
+            this.childEnded(child);
+        });
+        this.child = child;
+        this.startedAt = Date.now();
+    }
+
+    private childEnded(child: child_process.ChildProcess) {
+        if (this.child !== child) {
+            return;
+        }
+        this.child = null;
+        if (Date.now() - this.startedAt < stableRunTime) {
+            this.retryDelay = Math.min(this.retryDelay * 2, maxRetryDelay);
+        } else {
+            this.retryDelay = minRetryDelay;
+        }
+        this.nextStart = Date.now() + this.retryDelay;
+    }
+
+    private lifeCycle=async (ct:CancellationToken)=>{
+        while(true) {
+            if (this.child === null && Date.now() >= this.nextStart) {
+                this.startExe();
+            }
+            await Sleep(ct, 2000);
+        }
+    }
+
+    // Returns a handler that proxies to the daemon, or calls fallback on connection error
+    middleware(fallback: express.RequestHandler): express.RequestHandler {
+        return (req, res, next)=> {
+            const proxyReq = http.request({
+                socketPath: this.socketPath,
+                method: req.method,
+                path: req.originalUrl,
+                headers: {host: 'localhost'},
+            }, (proxyRes)=> {
+                res.writeHead(proxyRes.statusCode || 500, proxyRes.statusMessage, proxyRes.headers);
+                proxyRes.pipe(res);
+            });
+            proxyReq.on('error', (err)=> {
+                if (!res.headersSent) {
+                    // Undo the mount point stripping of express
+                    req.url = req.originalUrl;
+                    fallback(req, res, next);
+                } else {
+                    res.end();
+                }
+            });
+            res.on('close', ()=> {
+                proxyReq.abort();
+            });
+            proxyReq.end();
+        };
+    }
+}
@@ -357,7 +357,8 @@ export default class Focuser implements RequestHandler.APIAppImplementor<BackOff
             const moveFocuserPromise = done(nextStep()) ? undefined : moveFocuser(nextStep());
             try {
                 const starFieldResponse = await this.imageProcessor.compute(ct, {
-                    starField: { source: { path: shootResult.path }}
+                    starField: { source: { path: shootResult.path }},
+                    priority: "focus",
                 });
                 
                 const starField = starFieldResponse.stars;
@@ -24,7 +24,7 @@ export default class ImageProcessor
     compute = async <K extends keyof ProcessorTypes.Request>
             (
                 ct: CancellationToken,
-                payload: Pick<ProcessorTypes.Request, K>
+                payload: Pick<ProcessorTypes.Request, K> & ProcessorTypes.RequestOptions
             ):Promise<ProcessorTypes.Result[K]>=>
     {
         const result = await Pipe(ct,
@@ -37,6 +37,18 @@ export default class ImageProcessor
         return JSON.parse(result);
     }
 
+    // Fire and forget: the image cache loads the frame before the first view
+    prefetch = (prefetch: ProcessorTypes.ProcessorPrefetchRequest)=>{
+        Pipe(CancellationToken.CONTINUE,
+            {
+                command: ["./fitsviewer/processor"]
+            },
+            new MemoryStreams.ReadableStream(JSON.stringify({prefetch}))
+        ).catch((e)=> {
+            console.warn('Prefetch of ' + prefetch.path + ' failed', e);
+        });
+    }
+
     getAPI() {
         return {
             compute: this.compute
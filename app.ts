@@ -27,6 +27,7 @@ import TriggerExecuter from './TriggerExecuter';
 import ToolExecuter from './ToolExecuter';
 
 import Astrometry from './Astrometry';
+import FitsViewerDaemon from './FitsViewerDaemon';
 
 import { AppContext } from "./ModuleBase";
 import { BackofficeStatus } from "./shared/BackOfficeStatus";
@@ -225,7 +226,13 @@ wss.on('connection', (ws:WebSocket)=>{
 });
 
 
-app.use(cgi('fitsviewer/fitsviewer.cgi',  { nph: true, dupfd: true }));
+const fitsViewerCgi = cgi('fitsviewer/fitsviewer.cgi',  { nph: true, dupfd: true });
+if (process.env.FITSVIEWER_DAEMON !== 'false') {
+    const fitsViewerDaemon = new FitsViewerDaemon('fitsviewer/fitsviewer.cgi',
+                        process.env.FITSVIEWER_SOCKET || '/tmp/fitsviewer.sock');
+    app.use('/fitsviewer/fitsviewer.cgi', fitsViewerDaemon.middleware(fitsViewerCgi));
+}
+app.use(fitsViewerCgi);
 
 var port = parseInt(process.env.PORT || '8080');
 app.set('port', port);
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+#include "RgbDataStorage.h"
+#include "Debayer.h"
+#include "StripRenderer.h"
+
+static const char channelNames[3] = { 'R', 'G', 'B' };
+
+// Reflect an out of range coordinate (the edge is not repeated). Parity
+// is kept, and so is the bayer site
+static inline int mirror(int i, int n)
+{
+	if (n == 1) {
+		return 0;
+	}
+	while(i < 0 || i >= n) {
+		i = i < 0 ? -i : 2 * n - 2 - i;
+	}
+	return i;
+}
+
+// Copy the levels of a row with pad pixels on each side
+template<typename T> static void padRow(const T * row, const SampleLevels & levels, int w, int pad, uint16_t * dst)
+{
+	for(int x = -pad; x < w + pad; ++x) {
+		dst[x + pad] = levels.level(row[x >= 0 && x < w ? x : mirror(x, w)]);
+	}
+}
+
+static inline uint16_t clamp16(int32_t v)
+{
+	return v < 0 ? 0 : v > 65535 ? 65535 : v;
+}
+
+Debayer::Method Debayer::parseMethod(const std::string & name)
+{
+	if (name == "" || name == "bilinear") {
+		return Bilinear;
+	}
+	if (name == "edge") {
+		return EdgeAware;
+	}
+	throw std::invalid_argument("Unsupported debayer method: " + name);
+}
+
+Debayer::Debayer(const std::string & bayer, Method method)
+	:method(method)
+{
+	for(int site = 0; site < 4; ++site) {
+		siteColor[site] = -1;
+		for(int c = 0; c < 3; ++c) {
+			if (site < (int)bayer.size() && bayer[site] == channelNames[c]) {
+				siteColor[site] = c;
+			}
+		}
+	}
+
+	for(int site = 0; site < 4; ++site) {
+		int hsite = site ^ 1;
+		int vsite = site ^ 2;
+		int dsite = site ^ 3;
+		for(int c = 0; c < 3; ++c) {
+			bool h = siteColor[hsite] == c;
+			bool v = siteColor[vsite] == c;
+			bool d = siteColor[dsite] == c;
+			if (siteColor[site] == c) {
+				sources[site][c] = Center;
+			} else if (h && v) {
+				sources[site][c] = Cross;
+			} else if (h) {
+				sources[site][c] = Horizontal;
+			} else if (v) {
+				sources[site][c] = Vertical;
+			} else if (d) {
+				sources[site][c] = Diagonal;
+			} else {
+				// Color absent from the pattern
+				sources[site][c] = None;
+			}
+		}
+	}
+
+	// Green on a diagonal, red and blue on the other one
+	standard = (siteColor[0] == 1 && siteColor[3] == 1 && siteColor[1] != -1 && siteColor[2] != -1
+					&& siteColor[1] != 1 && siteColor[2] != 1 && siteColor[1] != siteColor[2])
+			|| (siteColor[1] == 1 && siteColor[2] == 1 && siteColor[0] != -1 && siteColor[3] != -1
+					&& siteColor[0] != 1 && siteColor[3] != 1 && siteColor[0] != siteColor[3]);
+}
+
+template<typename T> void Debayer::bilinear(const T * data, const SampleLevels & levels, int w, int h, uint16_t * planes[3], int y0, int y1) const
+{
+	std::vector<uint16_t> buffer(3 * (w + 2));
+	uint16_t * rows[3] = { buffer.data(), buffer.data() + (w + 2), buffer.data() + 2 * (w + 2) };
+	for(int y = y0; y < y1; ++y) {
+		for(int dy = -1; dy <= 1; ++dy) {
+			padRow(data + (long)mirror(y + dy, h) * w, levels, w, 1, rows[dy + 1]);
+		}
+		int site = 2 * (y & 1);
+		for(int c = 0; c < 3; ++c) {
+			interpolateRow(rows[0], rows[1], rows[2], w, sources[site][c], sources[site + 1][c], planes[c] + (long)y * w);
+		}
+	}
+}
+
+template<typename T> void Debayer::edgeGreen(const T * data, const SampleLevels & levels, int w, int h, uint16_t * green, int y0, int y1) const
+{
+	int pw = w + 4;
+	std::vector<uint16_t> buffer(5 * pw);
+	for(int y = y0; y < y1; ++y) {
+		for(int dy = -2; dy <= 2; ++dy) {
+			padRow(data + (long)mirror(y + dy, h) * w, levels, w, 2, buffer.data() + (dy + 2) * pw);
+		}
+		const uint16_t * up2 = buffer.data() + 2;
+		const uint16_t * up = up2 + pw;
+		const uint16_t * cur = up + pw;
+		const uint16_t * down = cur + pw;
+		const uint16_t * down2 = down + pw;
+		uint16_t * out = green + (long)y * w;
+		int site = 2 * (y & 1);
+		for(int x = 0; x < w; ++x) {
+			if (siteColor[site + (x & 1)] == 1) {
+				out[x] = cur[x];
+				continue;
+			}
+			// Estimates are scaled by 4: green average plus the laplacian of the site color
+			int32_t p2 = 2 * cur[x];
+			int32_t gradH = abs((int32_t)cur[x - 1] - cur[x + 1]) + abs(p2 - cur[x - 2] - cur[x + 2]);
+			int32_t gradV = abs((int32_t)up[x] - down[x]) + abs(p2 - up2[x] - down2[x]);
+			int32_t estH = 2 * ((int32_t)cur[x - 1] + cur[x + 1]) + p2 - cur[x - 2] - cur[x + 2];
+			int32_t estV = 2 * ((int32_t)up[x] + down[x]) + p2 - up2[x] - down2[x];
+			int32_t v;
+			if (gradH < gradV) {
+				v = (estH + 2) >> 2;
+			} else if (gradV < gradH) {
+				v = (estV + 2) >> 2;
+			} else {
+				v = (estH + estV + 4) >> 3;
+			}
+			out[x] = clamp16(v);
+		}
+	}
+}
+
+template<typename T> void Debayer::edgeRedBlue(const T * data, const SampleLevels & levels, int w, int h, uint16_t * planes[3], int y0, int y1) const
+{
+	// Red and blue are interpolated as a difference to green (offset by 32768)
+	int pw = w + 2;
+	std::vector<uint16_t> buffer(4 * pw);
+	uint16_t * rows[3] = { buffer.data(), buffer.data() + pw, buffer.data() + 2 * pw };
+	uint16_t * diff = buffer.data() + 3 * pw;
+	const uint16_t * green = planes[1];
+	for(int y = y0; y < y1; ++y) {
+		for(int dy = -1; dy <= 1; ++dy) {
+			int sy = mirror(y + dy, h);
+			const T * raw = data + (long)sy * w;
+			const uint16_t * g = green + (long)sy * w;
+			uint16_t * row = rows[dy + 1];
+			for(int x = -1; x <= w; ++x) {
+				int sx = x >= 0 && x < w ? x : mirror(x, w);
+				row[x + 1] = clamp16((int32_t)levels.level(raw[sx]) - g[sx] + 32768);
+			}
+		}
+		int site = 2 * (y & 1);
+		const uint16_t * g = green + (long)y * w;
+		for(int c = 0; c < 3; c += 2) {
+			uint16_t * out = planes[c] + (long)y * w;
+			interpolateRow(rows[0], rows[1], rows[2], w, sources[site][c], sources[site + 1][c], diff);
+			for(int x = 0; x < w; ++x) {
+				out[x] = clamp16((int32_t)g[x] + diff[x] - 32768);
+			}
+		}
+	}
+}
+
+void Debayer::run(const uint16_t * data, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const
+{
+	run(data, SampleLevels::identity(), w, h, r, g, b, threadCount);
+}
+
+template<typename T> void Debayer::run(const T * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const
+{
+	uint16_t * planes[3] = { r, g, b };
+	StripRenderer stripRenderer(threadCount);
+	const int stripRows = 64;
+	int stripCount = (h + stripRows - 1) / stripRows;
+
+	auto pass = [&](std::function<void(int y0, int y1)> fn) {
+		stripRenderer.render(stripCount, 0,
+			[&](int strip, uint8_t * unused) {
+				int y0 = strip * stripRows;
+				int y1 = y0 + stripRows < h ? y0 + stripRows : h;
+				fn(y0, y1);
+			},
+			[](int strip, uint8_t * unused) -> bool {
+				return true;
+			});
+	};
+
+	if (method == EdgeAware && standard) {
+		// Red and blue read green from neighbour strips
+		pass([&](int y0, int y1) { edgeGreen(data, levels, w, h, g, y0, y1); });
+		pass([&](int y0, int y1) { edgeRedBlue(data, levels, w, h, planes, y0, y1); });
+	} else {
+		pass([&](int y0, int y1) { bilinear(data, levels, w, h, planes, y0, y1); });
+	}
+}
+
+template void Debayer::run(const int16_t * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+template void Debayer::run(const int32_t * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+template void Debayer::run(const float * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+template void Debayer::run(const double * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+
+void SharedCache::Messages::DebayeredContent::produce(Entry * entry)
+{
+	Debayer::Method debayerMethod;
+	try {
+		debayerMethod = Debayer::parseMethod(method);
+	} catch(const std::invalid_argument & e) {
+		throw WorkerError(e.what());
+	}
+
+	ContentRequest sourceRequest;
+	sourceRequest.fitsContent = new RawContent(source);
+	EntryRef sourceEntry(entry->getServer()->getEntry(sourceRequest));
+	if (sourceEntry->hasError()) {
+		throw WorkerError(std::string("Source error : ") + sourceEntry->getErrorDetails());
+	}
+
+	RawDataStorage * rcs = (RawDataStorage*)sourceEntry->data();
+	std::string bayer = rcs->getBayer();
+	if (bayer.empty()) {
+		throw WorkerError("Not a bayer image");
+	}
+
+	entry->allocate(RgbDataStorage::requiredStorage(rcs->w, rcs->h));
+	RgbDataStorage * rgb = (RgbDataStorage*)entry->data();
+	rgb->w = rcs->w;
+	rgb->h = rcs->h;
+
+	entry->checkCancelled();
+	Debayer debayer(bayer, debayerMethod);
+	int threadCount = StripRenderer::defaultThreadCount();
+	switch(rcs->sampleType) {
+		case RawDataStorage::Int16:
+			debayer.run(rcs->samples<int16_t>(), rcs->levels, rcs->w, rcs->h, rgb->plane(0), rgb->plane(1), rgb->plane(2), threadCount);
+			break;
+		case RawDataStorage::Int32:
+			debayer.run(rcs->samples<int32_t>(), rcs->levels, rcs->w, rcs->h, rgb->plane(0), rgb->plane(1), rgb->plane(2), threadCount);
+			break;
+		case RawDataStorage::Float32:
+			debayer.run(rcs->samples<float>(), rcs->levels, rcs->w, rcs->h, rgb->plane(0), rgb->plane(1), rgb->plane(2), threadCount);
+			break;
+		case RawDataStorage::Float64:
+			debayer.run(rcs->samples<double>(), rcs->levels, rcs->w, rcs->h, rgb->plane(0), rgb->plane(1), rgb->plane(2), threadCount);
+			break;
+		default:
+			debayer.run(rcs->data, rcs->w, rcs->h, rgb->plane(0), rgb->plane(1), rgb->plane(2), threadCount);
+			break;
+	}
+}
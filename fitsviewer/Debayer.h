@@ -0,0 +1,70 @@
+#ifndef DEBAYER_H_
+#define DEBAYER_H_
+
+#include <cstdint>
+#include <string>
+
+#include "LookupTable.h"
+#include "RawDataStorage.h"
+
+// Full resolution demosaic of a bayer plane into R, G, B planes.
+//
+// Bilinear: each missing color is the average of the sites of that color
+// in the 3x3 neighborhood.
+// EdgeAware: green is interpolated along the direction of the smallest
+// gradient (Hamilton-Adams), then red and blue are bilinear interpolations
+// of their difference to green.
+//
+// Edges are mirrored (by two pixels, to keep the pattern).
+class Debayer {
+public:
+	enum Method { Bilinear, EdgeAware };
+
+	// How a channel is obtained at a site, from its 3x3 neighborhood
+	enum Source { Center, Horizontal, Vertical, Diagonal, Cross, None };
+
+	Debayer(const std::string & bayer, Method method);
+
+	// Throws std::invalid_argument for unknown names (bilinear, edge)
+	static Method parseMethod(const std::string & name);
+
+	// Fill the planes using all threads
+	void run(const uint16_t * data, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+	// Same from samples of any type, demosaiced at their levels
+	template<typename T> void run(const T * data, const SampleLevels & levels, int w, int h, uint16_t * r, uint16_t * g, uint16_t * b, int threadCount) const;
+
+	// Rows [y0, y1) of the planes
+	template<typename T> void bilinear(const T * data, const SampleLevels & levels, int w, int h, uint16_t * planes[3], int y0, int y1) const;
+	// Rows [y0, y1) of green. Must be complete before edgeRedBlue
+	template<typename T> void edgeGreen(const T * data, const SampleLevels & levels, int w, int h, uint16_t * green, int y0, int y1) const;
+	template<typename T> void edgeRedBlue(const T * data, const SampleLevels & levels, int w, int h, uint16_t * planes[3], int y0, int y1) const;
+
+	Source getSource(int site, int channel) const { return sources[site][channel]; }
+
+	// One output row of a channel. Input rows are padded by one pixel on each side.
+	// Averages round up (like pavgw) so that all levels are bit-exact
+	static void interpolateRow(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+	static void interpolateRow(LookupTable::SimdLevel level,
+							const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+
+private:
+	Method method;
+	// Color (0, 1, 2) for each site (x & 1) + 2 * (y & 1)
+	int siteColor[4];
+	Source sources[4][3];
+	// Green on both diagonals, red and blue once (edge aware requires it)
+	bool standard;
+
+	static void interpolateRowScalar(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+	static void interpolateRowSse2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+	static void interpolateRowAvx2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+	static void interpolateRowNeon(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out);
+};
+
+#endif
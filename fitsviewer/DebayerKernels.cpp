@@ -0,0 +1,225 @@
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEBAYER_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DEBAYER_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "Debayer.h"
+
+// Row kernels of Debayer. Rows are padded: pixel x of a row is at index x + 1.
+// Even and odd columns have their own source. Averages are rounded up, as
+// pavgw/urhadd do, and nested in the same order everywhere:
+//   Horizontal = avg(left, right)
+//   Vertical   = avg(up, down)
+//   Diagonal   = avg(avg(upleft, upright), avg(downleft, downright))
+//   Cross      = avg(Horizontal, Vertical)
+
+static inline uint16_t avg(uint16_t a, uint16_t b)
+{
+	return (uint32_t(a) + b + 1) >> 1;
+}
+
+static inline uint16_t scalarSource(Debayer::Source source, const uint16_t * up, const uint16_t * cur, const uint16_t * down, int x)
+{
+	switch(source) {
+		case Debayer::Center:
+			return cur[x + 1];
+		case Debayer::Horizontal:
+			return avg(cur[x], cur[x + 2]);
+		case Debayer::Vertical:
+			return avg(up[x + 1], down[x + 1]);
+		case Debayer::Diagonal:
+			return avg(avg(up[x], up[x + 2]), avg(down[x], down[x + 2]));
+		case Debayer::Cross:
+			return avg(avg(cur[x], cur[x + 2]), avg(up[x + 1], down[x + 1]));
+		default:
+			return 0;
+	}
+}
+
+void Debayer::interpolateRow(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	interpolateRow(LookupTable::bestSimdLevel(), up, cur, down, w, even, odd, out);
+}
+
+void Debayer::interpolateRow(LookupTable::SimdLevel level,
+							const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	if (!LookupTable::isSupported(level)) {
+		level = LookupTable::Scalar;
+	}
+	switch(level) {
+		case LookupTable::Avx2:
+			interpolateRowAvx2(up, cur, down, w, even, odd, out);
+			return;
+		case LookupTable::Sse41:
+			interpolateRowSse2(up, cur, down, w, even, odd, out);
+			return;
+		case LookupTable::Neon:
+			interpolateRowNeon(up, cur, down, w, even, odd, out);
+			return;
+		default:
+			interpolateRowScalar(up, cur, down, w, even, odd, out);
+			return;
+	}
+}
+
+void Debayer::interpolateRowScalar(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	int x = 0;
+	for(; x + 1 < w; x += 2) {
+		out[x] = scalarSource(even, up, cur, down, x);
+		out[x + 1] = scalarSource(odd, up, cur, down, x + 1);
+	}
+	if (x < w) {
+		out[x] = scalarSource(even, up, cur, down, x);
+	}
+}
+
+// Vector kernels start on even columns, so lane parity is column parity
+#ifdef DEBAYER_X86
+
+__attribute__((target("sse4.1")))
+static inline __m128i sseSource(Debayer::Source source, const uint16_t * up, const uint16_t * cur, const uint16_t * down, int x)
+{
+	switch(source) {
+		case Debayer::Center:
+			return _mm_loadu_si128((const __m128i*)(cur + x + 1));
+		case Debayer::Horizontal:
+			return _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(cur + x)), _mm_loadu_si128((const __m128i*)(cur + x + 2)));
+		case Debayer::Vertical:
+			return _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + x + 1)), _mm_loadu_si128((const __m128i*)(down + x + 1)));
+		case Debayer::Diagonal:
+			return _mm_avg_epu16(
+					_mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + x)), _mm_loadu_si128((const __m128i*)(up + x + 2))),
+					_mm_avg_epu16(_mm_loadu_si128((const __m128i*)(down + x)), _mm_loadu_si128((const __m128i*)(down + x + 2))));
+		case Debayer::Cross:
+			return _mm_avg_epu16(
+					_mm_avg_epu16(_mm_loadu_si128((const __m128i*)(cur + x)), _mm_loadu_si128((const __m128i*)(cur + x + 2))),
+					_mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + x + 1)), _mm_loadu_si128((const __m128i*)(down + x + 1))));
+		default:
+			return _mm_setzero_si128();
+	}
+}
+
+__attribute__((target("sse4.1")))
+void Debayer::interpolateRowSse2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	int x = 0;
+	for(; x + 8 <= w; x += 8) {
+		__m128i e = sseSource(even, up, cur, down, x);
+		__m128i o = sseSource(odd, up, cur, down, x);
+		_mm_storeu_si128((__m128i*)(out + x), _mm_blend_epi16(e, o, 0xAA));
+	}
+	interpolateRowScalar(up + x, cur + x, down + x, w - x, even, odd, out + x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avxSource(Debayer::Source source, const uint16_t * up, const uint16_t * cur, const uint16_t * down, int x)
+{
+	switch(source) {
+		case Debayer::Center:
+			return _mm256_loadu_si256((const __m256i*)(cur + x + 1));
+		case Debayer::Horizontal:
+			return _mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(cur + x)), _mm256_loadu_si256((const __m256i*)(cur + x + 2)));
+		case Debayer::Vertical:
+			return _mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(up + x + 1)), _mm256_loadu_si256((const __m256i*)(down + x + 1)));
+		case Debayer::Diagonal:
+			return _mm256_avg_epu16(
+					_mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(up + x)), _mm256_loadu_si256((const __m256i*)(up + x + 2))),
+					_mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(down + x)), _mm256_loadu_si256((const __m256i*)(down + x + 2))));
+		case Debayer::Cross:
+			return _mm256_avg_epu16(
+					_mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(cur + x)), _mm256_loadu_si256((const __m256i*)(cur + x + 2))),
+					_mm256_avg_epu16(_mm256_loadu_si256((const __m256i*)(up + x + 1)), _mm256_loadu_si256((const __m256i*)(down + x + 1))));
+		default:
+			return _mm256_setzero_si256();
+	}
+}
+
+__attribute__((target("avx2")))
+void Debayer::interpolateRowAvx2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	int x = 0;
+	for(; x + 16 <= w; x += 16) {
+		__m256i e = avxSource(even, up, cur, down, x);
+		__m256i o = avxSource(odd, up, cur, down, x);
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_blend_epi16(e, o, 0xAA));
+	}
+	interpolateRowScalar(up + x, cur + x, down + x, w - x, even, odd, out + x);
+}
+
+#else
+
+void Debayer::interpolateRowSse2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	interpolateRowScalar(up, cur, down, w, even, odd, out);
+}
+
+void Debayer::interpolateRowAvx2(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	interpolateRowScalar(up, cur, down, w, even, odd, out);
+}
+
+#endif
+
+#ifdef DEBAYER_NEON
+
+static inline uint16x8_t neonSource(Debayer::Source source, const uint16_t * up, const uint16_t * cur, const uint16_t * down, int x)
+{
+	switch(source) {
+		case Debayer::Center:
+			return vld1q_u16(cur + x + 1);
+		case Debayer::Horizontal:
+			return vrhaddq_u16(vld1q_u16(cur + x), vld1q_u16(cur + x + 2));
+		case Debayer::Vertical:
+			return vrhaddq_u16(vld1q_u16(up + x + 1), vld1q_u16(down + x + 1));
+		case Debayer::Diagonal:
+			return vrhaddq_u16(
+					vrhaddq_u16(vld1q_u16(up + x), vld1q_u16(up + x + 2)),
+					vrhaddq_u16(vld1q_u16(down + x), vld1q_u16(down + x + 2)));
+		case Debayer::Cross:
+			return vrhaddq_u16(
+					vrhaddq_u16(vld1q_u16(cur + x), vld1q_u16(cur + x + 2)),
+					vrhaddq_u16(vld1q_u16(up + x + 1), vld1q_u16(down + x + 1)));
+		default:
+			return vdupq_n_u16(0);
+	}
+}
+
+void Debayer::interpolateRowNeon(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	static const uint16_t oddLanes[8] = { 0, 0xffff, 0, 0xffff, 0, 0xffff, 0, 0xffff };
+	const uint16x8_t oddMask = vld1q_u16(oddLanes);
+	int x = 0;
+	for(; x + 8 <= w; x += 8) {
+		uint16x8_t e = neonSource(even, up, cur, down, x);
+		uint16x8_t o = neonSource(odd, up, cur, down, x);
+		vst1q_u16(out + x, vbslq_u16(oddMask, o, e));
+	}
+	interpolateRowScalar(up + x, cur + x, down + x, w - x, even, odd, out + x);
+}
+
+#else
+
+void Debayer::interpolateRowNeon(const uint16_t * up, const uint16_t * cur, const uint16_t * down, int w,
+							Source even, Source odd, uint16_t * out)
+{
+	interpolateRowScalar(up, cur, down, w, even, odd, out);
+}
+
+#endif
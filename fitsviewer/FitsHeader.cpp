@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "FitsFile.h"
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+#include "FitsHeaderStorage.h"
+
+// Optional numeric keyword
+static double readDouble(fitsfile * fptr, const char * key, double defaultValue)
+{
+	int status = 0;
+	double value;
+	if (fits_read_key_dbl(fptr, key, &value, nullptr, &status)) {
+		return defaultValue;
+	}
+	return value;
+}
+
+static std::string readBayer(fitsfile * fptr)
+{
+	int status = 0;
+	char value[FLEN_VALUE + 1];
+	if (fits_read_key_str(fptr, "BAYERPAT", value, nullptr, &status)) {
+		return "";
+	}
+	value[FLEN_VALUE] = 0;
+	std::string bayer(value);
+	if (bayer.size() != 4) {
+		return "";
+	}
+	for(int i = 0; i < 4; ++i) {
+		if (RawDataStorage::getRGBIndex(bayer[i]) == -1) {
+			return "";
+		}
+	}
+	return bayer;
+}
+
+void FitsHeaderStorage::read(fitsfile * fptr, const std::string & path)
+{
+	int status = 0;
+	long naxes[2] = {1, 1};
+
+	// Compressed images (fpack) come after an empty primary HDU
+	while(true) {
+		if (fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status)) {
+			FitsFile::throwFitsIOError(path, status);
+		}
+		if (naxis >= 2) {
+			break;
+		}
+		if (fits_movrel_hdu(fptr, 1, nullptr, &status)) {
+			throw SharedCache::WorkerError(path + ": no image found");
+		}
+	}
+	fits_get_hdu_num(fptr, &hdu);
+	if (fits_get_img_equivtype(fptr, &equivBitpix, &status)) {
+		FitsFile::throwFitsIOError(path, status);
+	}
+
+	w = naxes[0];
+	h = naxes[1];
+	bzero = readDouble(fptr, "BZERO", 0);
+	bscale = readDouble(fptr, "BSCALE", 1);
+	exptime = readDouble(fptr, "EXPTIME", readDouble(fptr, "EXPOSURE", 0));
+
+	std::string bayerStr = readBayer(fptr);
+	memset(bayer, 0, sizeof(bayer));
+	memcpy(bayer, bayerStr.c_str(), bayerStr.size());
+}
+
+void SharedCache::Messages::FitsHeader::produce(Entry * entry)
+{
+	FitsFile file;
+	file.open(path);
+
+	entry->allocate(sizeof(FitsHeaderStorage));
+	FitsHeaderStorage * header = (FitsHeaderStorage*)entry->data();
+	header->read(file.fptr, path);
+}
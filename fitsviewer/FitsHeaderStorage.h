@@ -0,0 +1,34 @@
+#ifndef FITSHEADERSTORAGE_H
+#define FITSHEADERSTORAGE_H 1
+
+#include <string>
+
+#include "fitsio.h"
+
+// Keywords of the image HDU that fitsviewer uses. Only these keywords are
+// looked up (the header is not listed), and the struct is stored as is in the
+// FitsHeader cache entry.
+struct FitsHeaderStorage {
+	// 1 for the primary HDU
+	int hdu;
+	int bitpix;
+	// BITPIX once BZERO/BSCALE are applied (USHORT_IMG for the usual camera files)
+	int equivBitpix;
+	int naxis;
+	long w, h;			// NAXIS1, NAXIS2
+	double bzero, bscale;
+	// EXPTIME (or EXPOSURE). 0 if absent
+	double exptime;
+	// Validated BAYERPAT (4 chars of R, G, B), empty otherwise
+	char bayer[5];
+
+	// Move to the first image HDU with at least 2 axes, and read its keywords.
+	// Only the first plane of cubes is used. Throws WorkerError
+	void read(fitsfile * fptr, const std::string & path);
+
+	std::string getBayer() const {
+		return std::string(bayer);
+	}
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FITSPIXELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FITSPIXELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "FitsPixels.h"
+
+static void fitsUShortToAduScalar(const uint8_t * from, uint16_t * to, long count)
+{
+	for(long i = 0; i < count; ++i) {
+		to[i] = (((uint16_t)from[2 * i] << 8) | from[2 * i + 1]) ^ 0x8000;
+	}
+}
+
+#ifdef FITSPIXELS_X86
+
+__attribute__((target("sse4.1")))
+static void fitsUShortToAduSse41(const uint8_t * from, uint16_t * to, long count)
+{
+	const __m128i sign = _mm_set1_epi16((short)0x8000);
+	long i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(from + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i*)(to + i), _mm_xor_si128(v, sign));
+	}
+	fitsUShortToAduScalar(from + 2 * i, to + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void fitsUShortToAduAvx2(const uint8_t * from, uint16_t * to, long count)
+{
+	const __m256i sign = _mm256_set1_epi16((short)0x8000);
+	long i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(from + 2 * i));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i*)(to + i), _mm256_xor_si256(v, sign));
+	}
+	fitsUShortToAduScalar(from + 2 * i, to + i, count - i);
+}
+
+#else
+
+static void fitsUShortToAduSse41(const uint8_t * from, uint16_t * to, long count)
+{
+	fitsUShortToAduScalar(from, to, count);
+}
+
+static void fitsUShortToAduAvx2(const uint8_t * from, uint16_t * to, long count)
+{
+	fitsUShortToAduScalar(from, to, count);
+}
+
+#endif
+
+#ifdef FITSPIXELS_NEON
+
+static void fitsUShortToAduNeon(const uint8_t * from, uint16_t * to, long count)
+{
+	const uint16x8_t sign = vdupq_n_u16(0x8000);
+	long i = 0;
+	for(; i + 8 <= count; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(from + 2 * i)));
+		vst1q_u16(to + i, veorq_u16(v, sign));
+	}
+	fitsUShortToAduScalar(from + 2 * i, to + i, count - i);
+}
+
+#else
+
+static void fitsUShortToAduNeon(const uint8_t * from, uint16_t * to, long count)
+{
+	fitsUShortToAduScalar(from, to, count);
+}
+
+#endif
+
+void fitsUShortToAdu(const uint8_t * from, uint16_t * to, long count)
+{
+	fitsUShortToAdu(LookupTable::bestSimdLevel(), from, to, count);
+}
+
+void fitsUShortToAdu(LookupTable::SimdLevel level, const uint8_t * from, uint16_t * to, long count)
+{
+	if (!LookupTable::isSupported(level)) {
+		level = LookupTable::Scalar;
+	}
+	switch(level) {
+		case LookupTable::Avx2:
+			fitsUShortToAduAvx2(from, to, count);
+			return;
+		case LookupTable::Sse41:
+			fitsUShortToAduSse41(from, to, count);
+			return;
+		case LookupTable::Neon:
+			fitsUShortToAduNeon(from, to, count);
+			return;
+		default:
+			fitsUShortToAduScalar(from, to, count);
+			return;
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef FITSPIXELS_H_
+#define FITSPIXELS_H_
+
+#include <cstdint>
+
+#include "LookupTable.h"
+
+// Conversion of raw FITS data units (big endian) to ADU, for the
+// uncompressed images that are read without cfitsio.
+
+// BITPIX=16, BZERO=32768: the unsigned value is the signed one with its sign bit flipped
+void fitsUShortToAdu(const uint8_t * from, uint16_t * to, long count);
+void fitsUShortToAdu(LookupTable::SimdLevel level, const uint8_t * from, uint16_t * to, long count);
+
+#endif
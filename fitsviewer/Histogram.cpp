@@ -1,4 +1,16 @@
 #include <math.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HISTOGRAM_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HISTOGRAM_NEON 1
+#include <arm_neon.h>
+#endif
 
 #include "fitsio.h"
 
@@ -6,78 +18,178 @@
 #include "SharedCacheServer.h"
 #include "RawDataStorage.h"
 #include "HistogramStorage.h"
+#include "StripRenderer.h"
 
 
-void HistogramChannelData::scanPlane(const u_int16_t * data, int w, int interline, int h)
+void HistogramChannelData::countRow(const uint16_t * data, int count, int step, uint16_t min, uint32_t * counts)
 {
-	pixcount += w*h;
-	while(h > 0) {
-		int tw = w;
-		while(tw > 0) {
-			this->data[*data - min]++;
-			data++;
-			tw--;
-		}
-		data += interline - w;
-		h--;
+	counts -= min;
+	for(int i = 0; i < count; ++i) {
+		counts[data[i * step]]++;
 	}
 }
 
-// w and h must be even
-void HistogramChannelData::scanBayer(const u_int16_t * data, int w, int interline, int h)
+template<typename T> void HistogramChannelData::countRow(const T * data, const SampleLevels & levels, int count, int step, uint16_t min, uint32_t * counts)
 {
-	pixcount += w * h / 4;
-	int th = h / 2;
-	while(th > 0) {
-		int tw = w / 2;
-		while(tw > 0) {
-			uint16_t v = *data;
-			if (v < min) {
-				std::cerr << v << "<" << min << "\n";
-			}
-			if (v > max) {
-				std::cerr << v << ">" << max << "\n";
-			}
-			this->data[v - min]++;
-			data += 2;
-			tw--;
-		}
-		data += 2 * interline - w;
-		th--;
+	counts -= min;
+	for(int i = 0; i < count; ++i) {
+		counts[levels.level(data[i * step])]++;
 	}
 }
 
-void HistogramChannelData::scanPlaneMinMax(const u_int16_t * data, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
+template<> void HistogramChannelData::countRow<uint16_t>(const uint16_t * data, const SampleLevels & levels, int count, int step, uint16_t min, uint32_t * counts)
 {
-	while(h > 0) {
-		int tw = w;
-		while(tw > 0) {
-			uint16_t v = *data;
-			if (v < min) min = v;
-			if (v > max) max = v;
-			data++;
-			tw--;
-		}
-		data += interline - w;
-		h--;
+	countRow(data, count, step, min, counts);
+}
+
+void HistogramChannelData::rowMinMax(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	rowMinMax(LookupTable::bestSimdLevel(), data, count, step, min, max);
+}
+
+template<typename T> void HistogramChannelData::rowMinMax(const T * data, const SampleLevels & levels, int count, int step, uint16_t & min, uint16_t & max)
+{
+	uint16_t vmin = min, vmax = max;
+	for(int i = 0; i < count; ++i) {
+		uint16_t v = levels.level(data[i * step]);
+		if (v < vmin) vmin = v;
+		if (v > vmax) vmax = v;
 	}
+	min = vmin;
+	max = vmax;
 }
 
-// w and h must be even
-void HistogramChannelData::scanBayerMinMax(const u_int16_t * data, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
+template<> void HistogramChannelData::rowMinMax<uint16_t>(const uint16_t * data, const SampleLevels & levels, int count, int step, uint16_t & min, uint16_t & max)
 {
-	int th = h / 2;
-	while(th > 0) {
-		int tw = w / 2;
-		while(tw > 0) {
-			uint16_t v = *data;
-			if (v < min) min = v;
-			if (v > max) max = v;
-			data += 2;
-			tw--;
-		}
-		data += 2 * interline - w;
-		th--;
+	rowMinMax(data, count, step, min, max);
+}
+
+static void rowMinMaxScalar(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	uint16_t vmin = min, vmax = max;
+	for(int i = 0; i < count; ++i) {
+		uint16_t v = data[i * step];
+		if (v < vmin) vmin = v;
+		if (v > vmax) vmax = v;
+	}
+	min = vmin;
+	max = vmax;
+}
+
+// Vector kernels read all values of the span, and only reduce the lanes
+// of wanted samples (lane parity is sample parity as they start at data)
+static void reduceLanes(const uint16_t * mins, const uint16_t * maxs, int lanes, int step, uint16_t & min, uint16_t & max)
+{
+	for(int l = 0; l < lanes; l += step) {
+		if (mins[l] < min) min = mins[l];
+		if (maxs[l] > max) max = maxs[l];
+	}
+}
+
+#ifdef HISTOGRAM_X86
+
+__attribute__((target("sse4.1")))
+static void rowMinMaxSse41(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	int span = step * (count - 1) + 1;
+	__m128i vmin = _mm_set1_epi16(-1);
+	__m128i vmax = _mm_setzero_si128();
+	int i = 0;
+	for(; i + 8 <= span; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		vmin = _mm_min_epu16(vmin, v);
+		vmax = _mm_max_epu16(vmax, v);
+	}
+	uint16_t mins[8], maxs[8];
+	_mm_storeu_si128((__m128i*)mins, vmin);
+	_mm_storeu_si128((__m128i*)maxs, vmax);
+	reduceLanes(mins, maxs, 8, step, min, max);
+	rowMinMaxScalar(data + i, count - i / step, step, min, max);
+}
+
+__attribute__((target("avx2")))
+static void rowMinMaxAvx2(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	int span = step * (count - 1) + 1;
+	__m256i vmin = _mm256_set1_epi16(-1);
+	__m256i vmax = _mm256_setzero_si256();
+	int i = 0;
+	for(; i + 16 <= span; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+		vmin = _mm256_min_epu16(vmin, v);
+		vmax = _mm256_max_epu16(vmax, v);
+	}
+	uint16_t mins[16], maxs[16];
+	_mm256_storeu_si256((__m256i*)mins, vmin);
+	_mm256_storeu_si256((__m256i*)maxs, vmax);
+	reduceLanes(mins, maxs, 16, step, min, max);
+	rowMinMaxScalar(data + i, count - i / step, step, min, max);
+}
+
+#else
+
+static void rowMinMaxSse41(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	rowMinMaxScalar(data, count, step, min, max);
+}
+
+static void rowMinMaxAvx2(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	rowMinMaxScalar(data, count, step, min, max);
+}
+
+#endif
+
+#ifdef HISTOGRAM_NEON
+
+static void rowMinMaxNeon(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	int span = step * (count - 1) + 1;
+	uint16x8_t vmin = vdupq_n_u16(0xffff);
+	uint16x8_t vmax = vdupq_n_u16(0);
+	int i = 0;
+	for(; i + 8 <= span; i += 8) {
+		uint16x8_t v = vld1q_u16(data + i);
+		vmin = vminq_u16(vmin, v);
+		vmax = vmaxq_u16(vmax, v);
+	}
+	uint16_t mins[8], maxs[8];
+	vst1q_u16(mins, vmin);
+	vst1q_u16(maxs, vmax);
+	reduceLanes(mins, maxs, 8, step, min, max);
+	rowMinMaxScalar(data + i, count - i / step, step, min, max);
+}
+
+#else
+
+static void rowMinMaxNeon(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	rowMinMaxScalar(data, count, step, min, max);
+}
+
+#endif
+
+void HistogramChannelData::rowMinMax(LookupTable::SimdLevel level, const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max)
+{
+	if (count <= 0) {
+		return;
+	}
+	if (!LookupTable::isSupported(level)) {
+		level = LookupTable::Scalar;
+	}
+	switch(level) {
+		case LookupTable::Avx2:
+			rowMinMaxAvx2(data, count, step, min, max);
+			return;
+		case LookupTable::Sse41:
+			rowMinMaxSse41(data, count, step, min, max);
+			return;
+		case LookupTable::Neon:
+			rowMinMaxNeon(data, count, step, min, max);
+			return;
+		default:
+			rowMinMaxScalar(data, count, step, min, max);
+			return;
 	}
 }
 
@@ -165,6 +277,7 @@ void SharedCache::Messages::Histogram::produce(Entry * entry)
 	}
 
 	RawDataStorage *rcs = (RawDataStorage*)sourceEntry->data();
+	entry->checkCancelled();
 
 	HistogramStorage::build(rcs, 0, 0, rcs->w - 1, rcs->h - 1, [&entry](long int size){
 		entry->allocate(size);
@@ -222,58 +335,229 @@ static bool flatWindow(int interline, int x0, int y0, int x1, int y1, int & offs
 	return true;
 }
 
-HistogramStorage * HistogramStorage::build(
-						const RawDataStorage *rcs,
+HistogramCounts::HistogramCounts(const RawDataStorage * rcs)
+{
+	std::string bayer = rcs->getBayer();
+	channelCount = rcs->hasColors() ? 3 : 1;
+	for(int site = 0; site < 4; ++site) {
+		siteChannel[site] = rcs->hasColors() ? RawDataStorage::getRGBIndex(bayer[site]) : 0;
+	}
+	for(int i = 0; i < 3; ++i) {
+		pixcount[i] = 0;
+	}
+	counts.resize(channelCount * 65536);
+}
+
+void HistogramCounts::addRows(const uint16_t * data, int w, int y0, int y1)
+{
+	addRows(data, SampleLevels::identity(), w, y0, y1);
+}
+
+template<typename T> void HistogramCounts::addRows(const T * data, const SampleLevels & levels, int w, int y0, int y1)
+{
+	for(int y = y0; y < y1; ++y) {
+		if (channelCount == 1) {
+			HistogramChannelData::countRow(data, levels, w, 1, 0, counts.data());
+			pixcount[0] += w;
+		} else {
+			for(int x = 0; x < 2 && x < w; ++x) {
+				int ch = siteChannel[x + 2 * (y & 1)];
+				int count = (w - x + 1) / 2;
+				HistogramChannelData::countRow(data + x, levels, count, 2, 0, counts.data() + ch * 65536);
+				pixcount[ch] += count;
+			}
+		}
+		data += w;
+	}
+}
+
+template void HistogramCounts::addRows(const int16_t * data, const SampleLevels & levels, int w, int y0, int y1);
+template void HistogramCounts::addRows(const int32_t * data, const SampleLevels & levels, int w, int y0, int y1);
+template void HistogramCounts::addRows(const float * data, const SampleLevels & levels, int w, int y0, int y1);
+template void HistogramCounts::addRows(const double * data, const SampleLevels & levels, int w, int y0, int y1);
+
+HistogramStorage * HistogramCounts::build(std::function<void* (long int)> allocator) const
+{
+	uint16_t min[3] = {65535,65535,65535}, max[3] = {0,0,0};
+	for(int ch = 0; ch < channelCount; ++ch) {
+		const uint32_t * c = counts.data() + ch * 65536;
+		int first = 0;
+		while(first < 65536 && !c[first]) first++;
+		int last = 65535;
+		while(last >= first && !c[last]) last--;
+		if (first <= last) {
+			min[ch] = first;
+			max[ch] = last;
+		}
+	}
+
+	HistogramStorage * hs = (HistogramStorage *)allocator(HistogramStorage::requiredStorage(channelCount, min, max));
+	hs->init(channelCount, min, max);
+	for(int ch = 0; ch < channelCount; ++ch) {
+		HistogramChannelData * channel = hs->channel(ch);
+		channel->pixcount = pixcount[ch];
+		uint32_t sampleCount = channel->sampleCount();
+		if (sampleCount) {
+			memcpy(channel->data, counts.data() + ch * 65536 + min[ch], sizeof(uint32_t) * sampleCount);
+		}
+		channel->cumulative();
+	}
+	return hs;
+}
+
+// Samples of one channel in a rectangle (every other pixel for bayer)
+template<typename T> struct ScanWindow {
+	int channel;
+	const T * data;
+	// Samples per row, and distance between them
+	int count, step;
+	int rows;
+	long rowStride;
+};
+
+// Rows of a window, scanned by one thread
+struct ScanTask {
+	int window;
+	int row0, row1;
+};
+
+// Below this sample count, threads and private histograms cost more than they save
+static const long parallelSampleCount = 1 << 18;
+
+// Histogram of the levels of samples (see SampleLevels)
+template<typename T> static HistogramStorage * buildLevels(
+						const RawDataStorage *rcs, const T * samples,
 						int x0, int y0, int x1, int y1,
 						std::function<void* (long int)> allocator) {
 	std::string bayer = rcs->getBayer();
-	// int w = rcs->w;
-	// int h = rcs->h;
+	const SampleLevels & levels = rcs->levels;
 
 	uint16_t min[3] = {65535,65535,65535}, max[3] = {0,0,0};
 	int channelCount;
-	channelCount = rcs->hasColors() ? 3 : 1;
 
+	std::vector<ScanWindow<T>> windows;
 	if (rcs->hasColors()) {
 		channelCount = 3;
 		for(int i = 0; i < 4; ++i) {
 			int offset, w, h;
 			if (bayerWindow(rcs->w, x0, y0, x1, y1, i & 1, (i & 2) >> 1, offset, w, h))
 			{
-				int hist = RawDataStorage::getRGBIndex(bayer[i]);
-				HistogramChannelData::scanBayerMinMax(rcs->data + offset, w, rcs->w, h, min[hist], max[hist]);
+				windows.push_back({RawDataStorage::getRGBIndex(bayer[i]), samples + offset, w / 2, 2, h / 2, 2L * rcs->w});
 			}
-
 		}
-
 	} else {
 		channelCount = 1;
 		int offset, w, h;
 		if (flatWindow(rcs->w, x0, y0, x1, y1, offset, w, h)) {
-			HistogramChannelData::scanPlaneMinMax(rcs->data + offset, w, rcs->w, h, min[0], max[0]);
+			windows.push_back({0, samples + offset, w, 1, h, (long)rcs->w});
+		}
+	}
+
+	// Split windows in bands of rows
+	long sampleCount = 0;
+	for(const ScanWindow<T> & window : windows) {
+		sampleCount += (long)window.count * window.rows;
+	}
+	int threadCount = sampleCount >= parallelSampleCount ? StripRenderer::defaultThreadCount() : 1;
+	std::vector<ScanTask> tasks;
+	for(int i = 0; i < (int)windows.size(); ++i) {
+		const ScanWindow<T> & window = windows[i];
+		long samples = (long)window.count * window.rows;
+		long bands = samples / parallelSampleCount;
+		if (bands > 2 * threadCount) bands = 2 * threadCount;
+		if (bands > window.rows) bands = window.rows;
+		if (bands < 1) bands = 1;
+		for(int band = 0; band < bands; ++band) {
+			tasks.push_back({i, (int)(window.rows * band / bands), (int)(window.rows * (band + 1) / bands)});
 		}
 	}
+
+	StripRenderer stripRenderer(threadCount);
+
+	stripRenderer.render(tasks.size(), 2 * sizeof(uint16_t),
+		[&](int strip, uint8_t * buffer) {
+			const ScanTask & task = tasks[strip];
+			const ScanWindow<T> & window = windows[task.window];
+			uint16_t * minMax = (uint16_t*)buffer;
+			minMax[0] = 65535;
+			minMax[1] = 0;
+			for(int row = task.row0; row < task.row1; ++row) {
+				HistogramChannelData::rowMinMax(window.data + row * window.rowStride, levels, window.count, window.step, minMax[0], minMax[1]);
+			}
+		},
+		[&](int strip, uint8_t * buffer) -> bool {
+			int ch = windows[tasks[strip].window].channel;
+			uint16_t * minMax = (uint16_t*)buffer;
+			if (minMax[0] < min[ch]) min[ch] = minMax[0];
+			if (minMax[1] > max[ch]) max[ch] = minMax[1];
+			return true;
+		});
+
 	long int size = HistogramStorage::requiredStorage(channelCount, min, max);
-	
+
 	HistogramStorage * hs = (HistogramStorage *)allocator(size);
 	hs->init(channelCount, min, max);
-	if (rcs->hasColors()) {
-		for(int i = 0; i < 4; ++i) {
-			int offset, w, h;
-			if (bayerWindow(rcs->w, x0, y0, x1, y1, i & 1, (i & 2) >> 1, offset, w, h))
-			{
-				int hist = RawDataStorage::getRGBIndex(bayer[i]);
-				hs->channel(hist)->scanBayer(rcs->data + offset, w, rcs->w, h);
+
+	for(const ScanWindow<T> & window : windows) {
+		hs->channel(window.channel)->pixcount += window.count * window.rows;
+	}
+
+	if (threadCount == 1) {
+		for(const ScanWindow<T> & window : windows) {
+			HistogramChannelData * channel = hs->channel(window.channel);
+			for(int row = 0; row < window.rows; ++row) {
+				HistogramChannelData::countRow(window.data + row * window.rowStride, levels, window.count, window.step, channel->min, channel->data);
 			}
 		}
 	} else {
-		int offset, w, h;
-		if (flatWindow(rcs->w, x0, y0, x1, y1, offset, w, h)) {
-			hs->channel(0)->scanPlane(rcs->data + offset, w, rcs->w, h);
+		// Each band is counted in a private histogram, then merged in order
+		uint32_t maxSampleCount = 0;
+		for(int i = 0; i < channelCount; ++i) {
+			uint32_t sampleCount = hs->channel(i)->sampleCount();
+			if (sampleCount > maxSampleCount) maxSampleCount = sampleCount;
 		}
+		stripRenderer.render(tasks.size(), sizeof(uint32_t) * maxSampleCount,
+			[&](int strip, uint8_t * buffer) {
+				const ScanTask & task = tasks[strip];
+				const ScanWindow<T> & window = windows[task.window];
+				HistogramChannelData * channel = hs->channel(window.channel);
+				uint32_t * counts = (uint32_t*)buffer;
+				memset(counts, 0, sizeof(uint32_t) * channel->sampleCount());
+				for(int row = task.row0; row < task.row1; ++row) {
+					HistogramChannelData::countRow(window.data + row * window.rowStride, levels, window.count, window.step, channel->min, counts);
+				}
+			},
+			[&](int strip, uint8_t * buffer) -> bool {
+				HistogramChannelData * channel = hs->channel(windows[tasks[strip].window].channel);
+				const uint32_t * counts = (const uint32_t*)buffer;
+				uint32_t sampleCount = channel->sampleCount();
+				for(uint32_t i = 0; i < sampleCount; ++i) {
+					channel->data[i] += counts[i];
+				}
+				return true;
+			});
 	}
+
 	for(int i = 0; i < channelCount; ++i) {
 		hs->channel(i)->cumulative();
 	}
 	return hs;
 }
+
+HistogramStorage * HistogramStorage::build(
+						const RawDataStorage *rcs,
+						int x0, int y0, int x1, int y1,
+						std::function<void* (long int)> allocator) {
+	switch(rcs->sampleType) {
+		case RawDataStorage::Int16:
+			return buildLevels(rcs, rcs->samples<int16_t>(), x0, y0, x1, y1, allocator);
+		case RawDataStorage::Int32:
+			return buildLevels(rcs, rcs->samples<int32_t>(), x0, y0, x1, y1, allocator);
+		case RawDataStorage::Float32:
+			return buildLevels(rcs, rcs->samples<float>(), x0, y0, x1, y1, allocator);
+		case RawDataStorage::Float64:
+			return buildLevels(rcs, rcs->samples<double>(), x0, y0, x1, y1, allocator);
+		default:
+			return buildLevels(rcs, rcs->samples<uint16_t>(), x0, y0, x1, y1, allocator);
+	}
+}
@@ -1,6 +1,11 @@
 #ifndef HISTOGRAMSTORAGE_H
 #define HISTOGRAMSTORAGE_H 1
 #include <stdint.h>
+#include <functional>
+#include <vector>
+
+#include "LookupTable.h"
+#include "RawDataStorage.h"
 
 struct HistogramChannelData {
 	uint16_t min, max;
@@ -33,12 +38,16 @@ struct HistogramChannelData {
 	}
 
 	/* ==== functions for productions ==== */
-	void scanBayer(const uint16_t * data, int w, int interline, int h);
-	void scanPlane(const uint16_t * data, int w, int interline, int h);
+	// Add data[0], data[step], ... (count values) to counts, which is indexed from min
+	static void countRow(const uint16_t * data, int count, int step, uint16_t min, uint32_t * counts);
 	// value for an adu X will be the count of adu of value up to X. This is the default form
 	void cumulative();
-	static void scanBayerMinMax(const uint16_t * data, int w, int interline, int h, uint16_t & min, uint16_t & max);
-	static void scanPlaneMinMax(const uint16_t * data, int w, int interline, int h, uint16_t & min, uint16_t & max);
+	// Extend min/max with data[0], data[step], ... (count values). step is 1 or 2
+	static void rowMinMax(const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max);
+	static void rowMinMax(LookupTable::SimdLevel level, const uint16_t * data, int count, int step, uint16_t & min, uint16_t & max);
+	// Same, at the levels of samples of any type
+	template<typename T> static void countRow(const T * data, const SampleLevels & levels, int count, int step, uint16_t min, uint32_t * counts);
+	template<typename T> static void rowMinMax(const T * data, const SampleLevels & levels, int count, int step, uint16_t & min, uint16_t & max);
 
 	/* ==== functions for usage ==== */
 	uint32_t findFirstWithAtLeast(uint32_t wantedCount) const;
@@ -101,4 +110,23 @@ struct HistogramStorage {
 	}
 };
 
+// Counts over the full 16 bits range, accumulated while a frame is decoded
+// (see RawContent). Converts to a HistogramStorage of the whole frame.
+class HistogramCounts {
+	int channelCount;
+	// Channel of each bayer site (x & 1) + 2 * (y & 1)
+	int siteChannel[4];
+	uint64_t pixcount[3];
+	std::vector<uint32_t> counts;
+public:
+	HistogramCounts(const RawDataStorage * rcs);
+
+	// Rows [y0, y1) of the frame, data points to row y0
+	void addRows(const uint16_t * data, int w, int y0, int y1);
+	// Same for samples of other types, counted at their level
+	template<typename T> void addRows(const T * data, const SampleLevels & levels, int w, int y0, int y1);
+
+	HistogramStorage * build(std::function<void* (long int)> allocator) const;
+};
+
 #endif
@@ -0,0 +1,487 @@
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "LookupTable.h"
+#include "ImageScaling.h"
+
+// Kernels first stretch whole rows to 8 bits with LookupTable::apply (vectorized),
+// then bin the 8 bits values. Results are the same as with per pixel fastGet.
+
+void applyScale(u_int16_t * data, int w, int h, const LookupTable & table, u_int8_t * result)
+{
+	table.apply(data, result, w * h);
+}
+
+void applyScaleRgb(u_int16_t * data_r, u_int16_t * data_g, u_int16_t * data_b, int w, int h,
+						const LookupTable & table_r, const LookupTable & table_g, const LookupTable & table_b,
+						u_int8_t * result)
+{
+	// Row by row, to keep the 8 bits planes in cache
+	std::vector<uint8_t> buffer(3 * w);
+	uint8_t * r = buffer.data();
+	uint8_t * g = r + w;
+	uint8_t * b = g + w;
+	for(int y = 0; y < h; ++y) {
+		long offset = (long)y * w;
+		table_r.apply(data_r + offset, r, w);
+		table_g.apply(data_g + offset, g, w);
+		table_b.apply(data_b + offset, b, w);
+		uint8_t * out = result + 3 * offset;
+		for(int x = 0; x < w; ++x) {
+			out[3 * x] = r[x];
+			out[3 * x + 1] = g[x];
+			out[3 * x + 2] = b[x];
+		}
+	}
+}
+
+static inline int32_t rectSum(const uint8_t * data, int w, int sx, int sy)
+{
+	int32_t result = 0;
+	while(sy > 0) {
+		for(int i = 0; i < sx; ++i)
+			result += data[i];
+		data += w;
+		sy--;
+	}
+	return result;
+}
+
+static inline void rectSumBayer(const uint8_t * data_r, const uint8_t * data_g, const uint8_t * data_b, int w, int sx, int sy,
+		int16_t offset_r, int16_t second_r,
+		int16_t offset_g, int16_t second_g,
+		int16_t offset_b, int16_t second_b,
+		int32_t & r, int32_t & g, int32_t & b)
+{
+	r = 0;
+	g = 0;
+	b = 0;
+
+	while(sy > 0) {
+		for(int i = 0; i < sx; i += 2)
+		{
+			r += data_r[i + offset_r];
+			if (second_r != -1) r += data_r[i + second_r];
+			g += data_g[i + offset_g];
+			if (second_g != -1) g += data_g[i + second_g];
+			b += data_b[i + offset_b];
+			if (second_b != -1) b += data_b[i + second_b];
+		}
+		data_r += 2*w;
+		data_g += 2*w;
+		data_b += 2*w;
+		sy-=2;
+	}
+}
+
+static inline void rectSumBayerRGGB(const uint8_t * data, int w, int sx, int sy,
+		int32_t & r, int32_t & g, int32_t & b)
+{
+	r = 0;
+	g = 0;
+	b = 0;
+
+	while(sy > 0) {
+		for(int i = 0; i < sx; i += 2)
+		{
+			r += data[i];
+			g += data[i + 1];
+			g += data[i + w];
+			b += data[i + w + 1];
+		}
+		data += 2*w;
+		sy-=2;
+	}
+}
+
+static inline void applyScaleBin2(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result)
+{
+	std::vector<uint8_t> rows(2 * w);
+	const uint8_t * stretched = rows.data();
+	for(int by = 0; by < h; by += 2)
+	{
+		lookupTable.apply(data, rows.data(), 2 * w);
+		for(int bx = 0; bx < w; bx += 2)
+		{
+			int16_t v = stretched[bx];
+			v += stretched[bx + 1];
+			v += stretched[bx + w];
+			v += stretched[bx + w + 1];
+			v /= 4;
+			*result = v;
+			result++;
+		}
+		data += w * 2;
+	}
+}
+
+static inline void applyScaleBinAny(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result, int bin)
+{
+	int binStep = 1 << bin;
+	std::vector<uint8_t> rows(binStep * w);
+	for(int by = 0; by < h; by += binStep)
+	{
+		bool shortY = by + binStep >= h;
+
+		int sy = shortY ? h - by : binStep;
+
+		lookupTable.apply(data, rows.data(), sy * w);
+
+		for(int bx = 0; bx < w; bx += binStep)
+		{
+			bool shortX = bx + binStep >= w;
+
+			int sx = shortX ? w - bx : binStep;
+			int32_t v = rectSum(rows.data() + bx, w, sx, sy);
+			if (shortX || shortY) {
+				v /= (sx * sy);
+			} else {
+				v = v >> (bin+bin);
+			}
+			*result = v;
+			result++;
+		}
+		data += w * binStep;
+	}
+}
+
+// data, w, h
+// result, de taille w/bin, h/bin
+void applyScaleBin(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result, int bin)
+{
+	if (bin == 1 && ((w % 2) == 0) && ((h % 2) == 0)) {
+		applyScaleBin2(data, w, h, lookupTable, result);
+	} else {
+		applyScaleBinAny(data, w, h, lookupTable, result, bin);
+	}
+}
+
+// Stretched copy of a block of bayer rows.
+// When each position of the pattern belongs to a single color, one plane holds
+// all colors, each pixel stretched with the table of its color.
+// Otherwise (degenerate patterns), there is one full plane per color.
+class BayerRows {
+	int w;
+	bool perPosition;
+	const LookupTable * positionTables[4];
+	const LookupTable * colorTables[3];
+	std::vector<uint8_t> planes[3];
+	std::vector<uint16_t> splitRow;
+	std::vector<uint8_t> splitResult;
+
+	static int position(int16_t offset, int w)
+	{
+		if (offset == 0) return 0;
+		if (offset == 1) return 1;
+		if (offset == w) return 2;
+		if (offset == w + 1) return 3;
+		return -1;
+	}
+
+	void claim(int16_t offset, const LookupTable * table)
+	{
+		if (offset == -1) return;
+		int pos = position(offset, w);
+		if (pos == -1 || (positionTables[pos] != nullptr && positionTables[pos] != table)) {
+			perPosition = false;
+			return;
+		}
+		positionTables[pos] = table;
+	}
+
+	void stretchRow(const uint16_t * from, uint8_t * to, int y)
+	{
+		const LookupTable * even = positionTables[2 * (y & 1)];
+		const LookupTable * odd = positionTables[2 * (y & 1) + 1];
+		if (even == odd) {
+			even->apply(from, to, w);
+			return;
+		}
+		// Separate even and odd columns, so that each table works on a contiguous run
+		int evenCount = (w + 1) / 2;
+		for(int x = 0; x < w; x += 2) {
+			splitRow[x / 2] = from[x];
+		}
+		for(int x = 1; x < w; x += 2) {
+			splitRow[evenCount + x / 2] = from[x];
+		}
+		even->apply(splitRow.data(), splitResult.data(), evenCount);
+		odd->apply(splitRow.data() + evenCount, splitResult.data() + evenCount, w - evenCount);
+		for(int x = 0; x < w; x += 2) {
+			to[x] = splitResult[x / 2];
+		}
+		for(int x = 1; x < w; x += 2) {
+			to[x] = splitResult[evenCount + x / 2];
+		}
+	}
+
+public:
+	const uint8_t * r, * g, * b;
+
+	BayerRows(int w, int maxRows,
+			const LookupTable & table_r, int16_t offset_r, int16_t second_r,
+			const LookupTable & table_g, int16_t offset_g, int16_t second_g,
+			const LookupTable & table_b, int16_t offset_b, int16_t second_b)
+		: w(w), perPosition(w >= 2)
+	{
+		for(int i = 0; i < 4; ++i) positionTables[i] = nullptr;
+		colorTables[0] = &table_r;
+		colorTables[1] = &table_g;
+		colorTables[2] = &table_b;
+		claim(offset_r, &table_r);
+		claim(second_r, &table_r);
+		claim(offset_g, &table_g);
+		claim(second_g, &table_g);
+		claim(offset_b, &table_b);
+		claim(second_b, &table_b);
+		for(int i = 0; i < 4; ++i) {
+			if (positionTables[i] == nullptr) positionTables[i] = &table_g;
+		}
+
+		// Sums of partial blocks may read one row and one column past the block
+		size_t planeSize = (maxRows + 1) * w + 2;
+		int planeCount = perPosition ? 1 : 3;
+		for(int i = 0; i < planeCount; ++i) {
+			planes[i].resize(planeSize);
+		}
+		if (perPosition) {
+			splitRow.resize(w);
+			splitResult.resize(w);
+			r = g = b = planes[0].data();
+		} else {
+			r = planes[0].data();
+			g = planes[1].data();
+			b = planes[2].data();
+		}
+	}
+
+	void load(const uint16_t * data, int rows)
+	{
+		int planeCount = perPosition ? 1 : 3;
+		for(int i = 0; i < planeCount; ++i) {
+			uint8_t * plane = planes[i].data();
+			if (perPosition) {
+				for(int y = 0; y < rows; ++y) {
+					stretchRow(data + y * w, plane + y * w, y);
+				}
+			} else {
+				colorTables[i]->apply(data, plane, rows * w);
+			}
+			memset(plane + rows * w, 0, planes[i].size() - rows * w);
+		}
+	}
+};
+
+static inline void applyScaleBinBayerAny(u_int16_t * data, int w, int h,
+				const LookupTable & table_r, int16_t offset_r, int16_t second_r,
+				const LookupTable & table_g, int16_t offset_g, int16_t second_g,
+				const LookupTable & table_b, int16_t offset_b, int16_t second_b,
+				u_int8_t * result, int bin)
+{
+	int binStep = 1 << bin;
+	BayerRows rows(w, binStep,
+			table_r, offset_r, second_r,
+			table_g, offset_g, second_g,
+			table_b, offset_b, second_b);
+	int div_r = second_r != -1 ? 2 : 1;
+	int div_g = second_g != -1 ? 2 : 1;
+	int div_b = second_b != -1 ? 2 : 1;
+	for(int by = 0; by < h; by += binStep)
+	{
+		bool shortY = by + binStep >= h;
+
+		int sy = shortY ? h - by : binStep;
+
+		rows.load(data, sy);
+
+		for(int bx = 0; bx < w; bx += binStep)
+		{
+			bool shortX = bx + binStep >= w;
+
+			int sx = shortX ? w - bx : binStep;
+			int32_t v_r, v_g, v_b;
+			rectSumBayer(rows.r + bx, rows.g + bx, rows.b + bx, w, sx, sy,
+					offset_r, second_r,
+					offset_g, second_g,
+					offset_b, second_b,
+					v_r, v_g, v_b);
+
+			if (shortX || shortY) {
+				v_r /= (binDiv(sx, 1) * binDiv(sy,1) * div_r);
+				v_g /= (binDiv(sx, 1) * binDiv(sy,1) * div_g);
+				v_b /= (binDiv(sx, 1) * binDiv(sy,1) * div_b);
+			} else {
+				v_r = v_r >> (2 * bin - 2 + (second_r != -1 ? 1 : 0));
+				v_g = v_g >> (2 * bin - 2 + (second_g != -1 ? 1 : 0));
+				v_b = v_b >> (2 * bin - 2 + (second_b != -1 ? 1 : 0));
+			}
+			result[0] = v_r;
+			result[1] = v_g;
+			result[2] = v_b;
+			result+=3;
+		}
+		data += w * binStep;
+	}
+}
+
+static inline void applyScaleBinBayerRGGBAny(u_int16_t * data, int w, int h,
+				const LookupTable & table_r,
+				const LookupTable & table_g,
+				const LookupTable & table_b,
+				u_int8_t * result, int bin)
+{
+	int binStep = 1 << bin;
+	BayerRows rows(w, binStep,
+			table_r, 0, -1,
+			table_g, 1, w,
+			table_b, w + 1, -1);
+
+	for(int by = 0; by < h; by += binStep)
+	{
+		bool shortY = by + binStep >= h;
+
+		int sy = shortY ? h - by : binStep;
+
+		rows.load(data, sy);
+
+		for(int bx = 0; bx < w; bx += binStep)
+		{
+			bool shortX = bx + binStep >= w;
+
+			int sx = shortX ? w - bx : binStep;
+			int32_t v_r, v_g, v_b;
+			rectSumBayerRGGB(rows.r + bx, w, sx, sy,
+					v_r, v_g, v_b);
+
+			if (shortX || shortY) {
+				v_r /= (binDiv(sx, 1) * binDiv(sy,1));
+				v_g /= (binDiv(sx, 1) * binDiv(sy,1) * 2);
+				v_b /= (binDiv(sx, 1) * binDiv(sy,1));
+			} else {
+				v_r = v_r >> (2 * bin - 2);
+				v_g = v_g >> (2 * bin - 2 + 1);
+				v_b = v_b >> (2 * bin - 2);
+			}
+
+			result[0] = v_r;
+			result[1] = v_g;
+			result[2] = v_b;
+			result+=3;
+		}
+		data += w * binStep;
+	}
+}
+
+static inline void applyScaleBinBayer2(u_int16_t * data, int w, int h,
+		const LookupTable & table_r, int16_t offset_r, int16_t second_r,
+		const LookupTable & table_g, int16_t offset_g, int16_t second_g,
+		const LookupTable & table_b, int16_t offset_b, int16_t second_b,
+		u_int8_t * result)
+{
+	BayerRows rows(w, 2,
+			table_r, offset_r, second_r,
+			table_g, offset_g, second_g,
+			table_b, offset_b, second_b);
+	for(int by = 0; by < h; by += 2)
+	{
+		rows.load(data, by + 2 <= h ? 2 : h - by);
+		for(int bx = 0; bx < w; bx += 2)
+		{
+			{
+				int32_t v_r = rows.r[bx + offset_r];
+				if (second_r != -1) {
+					v_r += rows.r[bx + second_r];
+					v_r = v_r / 2;
+				}
+				result[0] = v_r;
+			}
+
+			{
+				int32_t v_g = rows.g[bx + offset_g];
+				if (second_g != -1) {
+					v_g += rows.g[bx + second_g];
+					v_g = v_g / 2;
+				}
+				result[1] = v_g;
+			}
+
+			{
+				int32_t v_b = rows.b[bx + offset_b];
+				if (second_b != -1) {
+					v_b += rows.b[bx + second_b];
+					v_b = v_b / 2;
+				}
+				result[2] = v_b;
+			}
+			result+=3;
+		}
+		data += w * 2;
+	}
+}
+
+
+void applyScaleBinBayer(u_int16_t * data, int w, int h,
+						const LookupTable & table_r, int16_t offset_r, int16_t second_r,
+						const LookupTable & table_g, int16_t offset_g, int16_t second_g,
+						const LookupTable & table_b, int16_t offset_b, int16_t second_b,
+						u_int8_t * result, int bin)
+{
+	if (bin == 1) {
+		applyScaleBinBayer2(data, w, h,
+								table_r, offset_r, second_r,
+								table_g, offset_g, second_g,
+								table_b, offset_b, second_b,
+								result);
+	} else {
+		if (offset_r == 0 && second_r == -1 && offset_g == 1 && second_g == w && offset_b == w + 1 && second_b == -1) {
+			applyScaleBinBayerRGGBAny(data, w, h,
+				table_r,
+				table_g,
+				table_b,
+				result, bin);
+		} else {
+			applyScaleBinBayerAny(data, w, h,
+				table_r, offset_r, second_r,
+				table_g, offset_g, second_g,
+				table_b, offset_b, second_b,
+				result, bin);
+		}
+	}
+}
+
+void findBayerOffset(const std::string & bayerStr, char which, int8_t & offset, int8_t & second)
+{
+	const char * bayer = bayerStr.c_str();
+	int p = 0;
+	while((bayer[p]) && (bayer[p] != which)) {
+		p++;
+	}
+	if (!bayer[p]) {
+		offset = 0;
+		second = -1;
+		return;
+	}
+	offset = p;
+	p++;
+	while((bayer[p]) && (bayer[p] != which)) {
+		p++;
+	}
+	if (!bayer[p]) {
+		second = -1;
+	} else {
+		second = p;
+	}
+}
+
+int16_t bayerOffset(int8_t bayer, int w)
+{
+	if (bayer == -1) return -1;
+	if (bayer < 2) {
+		return bayer;
+	} else {
+		return bayer + w - 2;
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef IMAGESCALING_H_
+#define IMAGESCALING_H_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+
+class LookupTable;
+
+// Size of a dimension after a bin of 2^bin (partial blocks count)
+static inline int binDiv(int width, int bin)
+{
+	if (!bin) return width;
+	int rslt = width >> bin;
+	if ((rslt << bin) < width) {
+		rslt++;
+	}
+	return rslt;
+}
+
+// Greyscale, one output pixel per input pixel
+void applyScale(u_int16_t * data, int w, int h, const LookupTable & table, u_int8_t * result);
+
+// Greyscale, result is binDiv(w, bin) x binDiv(h, bin)
+void applyScaleBin(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result, int bin);
+
+// RGB from bayer data (bin >= 1). Offsets are from bayerOffset
+void applyScaleBinBayer(u_int16_t * data, int w, int h,
+						const LookupTable & table_r, int16_t offset_r, int16_t second_r,
+						const LookupTable & table_g, int16_t offset_g, int16_t second_g,
+						const LookupTable & table_b, int16_t offset_b, int16_t second_b,
+						u_int8_t * result, int bin);
+
+// RGB from full resolution planes (see RgbDataStorage)
+void applyScaleRgb(u_int16_t * data_r, u_int16_t * data_g, u_int16_t * data_b, int w, int h,
+						const LookupTable & table_r, const LookupTable & table_g, const LookupTable & table_b,
+						u_int8_t * result);
+
+// Position of the first/second occurence of which in a bayer pattern (-1 if none)
+void findBayerOffset(const std::string & bayerStr, char which, int8_t & offset, int8_t & second);
+
+// Convert a position in the bayer pattern to an offset in data
+int16_t bayerOffset(int8_t bayer, int w);
+
+#endif
@@ -0,0 +1,119 @@
+#include "JpegWriter.h"
+
+own_jpeg_destination_mgr::own_jpeg_destination_mgr() {
+	init_destination = &static_init_destination;
+	empty_output_buffer = &static_empty_output_buffer;
+	term_destination = &static_term_destination;
+	chunkSize = 65536;
+	output = nullptr;
+}
+
+void own_jpeg_destination_mgr::memberInit() {
+	size_t used = output->size();
+	output->resize(used + chunkSize);
+	next_output_byte = output->data() + used;
+	free_in_buffer = chunkSize;
+}
+
+void own_jpeg_destination_mgr::memberOutputBuffer() {
+	// The previous chunk is full: just grow the buffer
+	memberInit();
+}
+
+void own_jpeg_destination_mgr::memberTermDestination() {
+	output->resize(output->size() - free_in_buffer);
+	free_in_buffer = 0;
+}
+
+void own_jpeg_destination_mgr::static_init_destination(j_compress_ptr cinfo)
+{
+	((own_jpeg_destination_mgr*)cinfo->dest)->memberInit();
+}
+
+boolean own_jpeg_destination_mgr::static_empty_output_buffer(j_compress_ptr cinfo)
+{
+	((own_jpeg_destination_mgr*)cinfo->dest)->memberOutputBuffer();
+	return TRUE;
+}
+
+void own_jpeg_destination_mgr::static_term_destination(j_compress_ptr cinfo)
+{
+	((own_jpeg_destination_mgr*)cinfo->dest)->memberTermDestination();
+}
+
+JpegWriter::JpegWriter()
+{
+	width = 0;
+	height = 0;
+	channels = 0;
+	created = false;
+}
+
+JpegWriter::~JpegWriter()
+{
+	if (created) {
+		/* This is an important step since it will release a good deal of memory. */
+		jpeg_destroy_compress(&cinfo);
+	}
+}
+
+void JpegWriter::start(std::vector<uint8_t> * output, int w, int h, int channels)
+{
+	this->width = w;
+	this->height = h;
+	this->channels = channels;
+
+	/* Step 1: allocate and initialize JPEG compression object */
+	if (!created) {
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		created = true;
+	}
+
+	/* Step 2: specify data destination */
+	destMgr.output = output;
+	cinfo.dest = &destMgr;
+
+	/* Step 3: set parameters for compression */
+	cinfo.image_width = width; 	/* image width and height, in pixels */
+	cinfo.image_height = height;
+	cinfo.input_components = channels;		/* # of color components per pixel */
+	cinfo.in_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB; 	/* colorspace of input image */
+	jpeg_set_defaults(&cinfo);
+
+	jpeg_set_quality(&cinfo, 90, TRUE /* limit to baseline-JPEG values */);
+	cinfo.dct_method = JDCT_IFAST;
+
+	/* Step 4: Start compressor */
+	jpeg_start_compress(&cinfo, TRUE);
+}
+
+void JpegWriter::writeLines(uint8_t * grey, int height) {
+	JSAMPROW row_pointer[32];	/* pointer to JSAMPLE row[s] */
+	int row_stride = channels * width;	/* JSAMPLEs per row in image_buffer */
+
+	/* Step 5: while (scan lines remain to be written) */
+	int y = 0;
+	while(y < height) {
+		int count = 0;
+		for(int i = 0; i < 32 && y < height; ++i) {
+			row_pointer[i] = grey + y * row_stride;
+			y++;
+			count++;
+		}
+		(void) jpeg_write_scanlines(&cinfo, row_pointer, count);
+	}
+}
+
+void JpegWriter::finish()
+{
+	/* Step 6: Finish compression */
+	jpeg_finish_compress(&cinfo);
+
+	/* Step 7: the compression object is kept for the next image */
+}
+
+void JpegWriter::abort()
+{
+	jpeg_abort_compress(&cinfo);
+}
@@ -0,0 +1,63 @@
+#ifndef JPEGWRITER_H_
+#define JPEGWRITER_H_
+
+#include <stdio.h>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Include file for users of JPEG library.
+ * You will need to have included system headers that define at least
+ * the typedefs FILE and size_t before you can include jpeglib.h.
+ */
+#include "jpeglib.h"
+
+// Compressed data is appended to a memory buffer
+struct own_jpeg_destination_mgr : public jpeg_destination_mgr {
+	std::vector<uint8_t> * output;
+	size_t chunkSize;
+public:
+	own_jpeg_destination_mgr();
+
+	void memberInit();
+	void memberOutputBuffer();
+	void memberTermDestination();
+
+	static void static_init_destination(j_compress_ptr cinfo);
+	static boolean static_empty_output_buffer(j_compress_ptr cinfo);
+	static void static_term_destination(j_compress_ptr cinfo);
+};
+
+// The compression object is created once and reused for every image
+class JpegWriter
+{
+	int width, height, channels;
+
+	/* This struct contains the JPEG compression parameters and pointers to
+	 * working space (which is allocated as needed by the JPEG library).
+	 */
+	struct jpeg_compress_struct cinfo;
+
+	/* This struct represents a JPEG error handler. The standard error handler
+	 * will print a message on stderr and call exit() if compression fails.
+	 * It must live as long as the main JPEG parameter struct.
+	 */
+	struct jpeg_error_mgr jerr;
+	own_jpeg_destination_mgr destMgr;
+	bool created;
+public:
+	JpegWriter();
+	~JpegWriter();
+
+	// The image is appended to output
+	void start(std::vector<uint8_t> * output, int w, int h, int channels);
+
+	void writeLines(uint8_t * grey, int height);
+
+	void finish();
+
+	// Drop a partially written image
+	void abort();
+};
+
+#endif
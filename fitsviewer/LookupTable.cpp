@@ -2,6 +2,7 @@
 #include <math.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 
 #include "LookupTable.h"
 
@@ -37,6 +38,8 @@ void LookupTable::reset()
 	shift2 = 0;
 	data1 = 0;
 	data2 = 0;
+	extTable = 0;
+	extData2 = 0;
 }
 
 void LookupTable::release() {
@@ -46,6 +49,9 @@ void LookupTable::release() {
 	if (data2) {
 		free(data2);
 	}
+	if (extTable) {
+		free(extTable);
+	}
 	reset();
 }
 
@@ -376,6 +382,7 @@ void LookupTable::init(int imin, int imed, int imax)
 		this->shift2 = 16;
 		this->data2 = (uint8_t*)malloc(1);
 		this->data2[0] = 0;
+		buildExtTable(0, 1);
 	} else if (max <= 255) {
 		this->min = imin;
 		this->max = imax;
@@ -388,6 +395,7 @@ void LookupTable::init(int imin, int imed, int imax)
 		for(int i = 0; i <= max; ++i) {
 			this->data2[i] = getIntValue(imin + i, 0);
 		}
+		buildExtTable(0, max + 1);
 	} else {
 		double m = (imed - imin) * 1.0/ (imax - imin);
 
@@ -449,7 +457,24 @@ void LookupTable::init(int imin, int imed, int imax)
 		this->shift2 = best.lowInterval.min != 0 ? 16 - best.lowBit : 16 - best.highBit;
 		this->data1 = fillTable(this->min, this->split - 1, this->split, this->shift1);
 		this->data2 = fillTable(this->split, this->max, this->max, this->shift2);
+		buildExtTable(this->data1 ? sizeFor(this->min, this->split - 1, this->shift1) : 0,
+					this->data2 ? sizeFor(this->split, this->max, this->shift2) : 0);
+	}
+}
+
+void LookupTable::buildExtTable(int size1, int size2)
+{
+	extTable = (uint8_t*)malloc(2 + size1 + size2 + 4);
+	extTable[0] = 0;
+	extTable[1] = 255;
+	if (size1) {
+		memcpy(extTable + 2, data1, size1);
+	}
+	if (size2) {
+		memcpy(extTable + 2 + size1, data2, size2);
 	}
+	memset(extTable + 2 + size1 + size2, 0, 4);
+	extData2 = 2 + size1;
 }
 
 // from-to : inclusive
@@ -11,7 +11,14 @@ class LookupTable
 	uint8_t shift1, shift2;
 	uint8_t * data1;
 	uint8_t * data2;
+
+	// Copy of the tables for the vector kernels, indexed by extIndex:
+	// [0, 255, data1..., data2..., padding for 32 bits gathers]
+	uint8_t * extTable;
+	int32_t extData2;
+
 	void init(int min, int median, int max);
+	void buildExtTable(int size1, int size2);
 	void reset();
 	void release();
 
@@ -53,6 +60,24 @@ public:
 
 	int size() const;
 
+	enum SimdLevel { Scalar, Sse41, Avx2, Neon };
+
+	// Same as fastGet on count values, using the best kernel for the cpu
+	void apply(const uint16_t * from, uint8_t * to, int count) const;
+	// Force a kernel (falls back to scalar if not supported)
+	void apply(SimdLevel level, const uint16_t * from, uint8_t * to, int count) const;
+
+	static bool isSupported(SimdLevel level);
+	// Best supported level. FITSVIEWER_SIMD=scalar|sse4.1|avx2|neon overrides
+	static SimdLevel bestSimdLevel();
+
+private:
+	void applyScalar(const uint16_t * from, uint8_t * to, int count) const;
+	void applySse41(const uint16_t * from, uint8_t * to, int count) const;
+	void applyAvx2(const uint16_t * from, uint8_t * to, int count) const;
+	void applyNeon(const uint16_t * from, uint8_t * to, int count) const;
+
+public:
 #ifdef LOOKUPTABLES_CHECKING
 	static void torture();
 #endif
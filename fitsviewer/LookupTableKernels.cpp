@@ -0,0 +1,267 @@
+#include <cstdint>
+#include <string>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LOOKUPTABLE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LOOKUPTABLE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "LookupTable.h"
+
+// Vector versions of LookupTable::fastGet.
+//
+// All kernels compute, for each value, an index in extTable:
+//   value < split && value <= min  => 0 (holds 0)
+//   value < split                  => 2 + (value - min) >> shift1
+//   value >= max                   => 1 (holds 255)
+//   otherwise                      => extData2 + (value - split) >> shift2
+// This is exactly the branch sequence of fastGet, so results are bit-exact.
+
+bool LookupTable::isSupported(SimdLevel level)
+{
+	switch(level) {
+		case Scalar:
+			return true;
+#ifdef LOOKUPTABLE_X86
+		case Sse41:
+			return __builtin_cpu_supports("sse4.1");
+		case Avx2:
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef LOOKUPTABLE_NEON
+		case Neon:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static LookupTable::SimdLevel detectSimdLevel()
+{
+	const char * forced = getenv("FITSVIEWER_SIMD");
+	if (forced) {
+		std::string wanted(forced);
+		LookupTable::SimdLevel level = LookupTable::Scalar;
+		if (wanted == "sse4.1") level = LookupTable::Sse41;
+		if (wanted == "avx2") level = LookupTable::Avx2;
+		if (wanted == "neon") level = LookupTable::Neon;
+		if (LookupTable::isSupported(level)) {
+			return level;
+		}
+	}
+	if (LookupTable::isSupported(LookupTable::Avx2)) return LookupTable::Avx2;
+	if (LookupTable::isSupported(LookupTable::Sse41)) return LookupTable::Sse41;
+	if (LookupTable::isSupported(LookupTable::Neon)) return LookupTable::Neon;
+	return LookupTable::Scalar;
+}
+
+LookupTable::SimdLevel LookupTable::bestSimdLevel()
+{
+	static const SimdLevel level = detectSimdLevel();
+	return level;
+}
+
+void LookupTable::apply(const uint16_t * from, uint8_t * to, int count) const
+{
+	apply(bestSimdLevel(), from, to, count);
+}
+
+void LookupTable::apply(SimdLevel level, const uint16_t * from, uint8_t * to, int count) const
+{
+	if (!isSupported(level)) {
+		level = Scalar;
+	}
+	switch(level) {
+		case Avx2:
+			applyAvx2(from, to, count);
+			return;
+		case Sse41:
+			applySse41(from, to, count);
+			return;
+		case Neon:
+			applyNeon(from, to, count);
+			return;
+		default:
+			applyScalar(from, to, count);
+			return;
+	}
+}
+
+void LookupTable::applyScalar(const uint16_t * from, uint8_t * to, int count) const
+{
+	for(int i = 0; i < count; ++i) {
+		to[i] = fastGet(from[i]);
+	}
+}
+
+#ifdef LOOKUPTABLE_X86
+
+struct ExtIndexSse {
+	__m128i min, max, split, data2, shift1, shift2, zero, full, two;
+};
+
+__attribute__((target("sse4.1")))
+static inline __m128i extIndexSse(const ExtIndexSse & k, __m128i v)
+{
+	__m128i low = _mm_cmpgt_epi32(k.split, v);
+	__m128i lowZero = _mm_andnot_si128(_mm_cmpgt_epi32(v, k.min), low);
+	__m128i highFull = _mm_andnot_si128(_mm_or_si128(low, _mm_cmpgt_epi32(k.max, v)), _mm_set1_epi32(-1));
+
+	__m128i idx1 = _mm_add_epi32(_mm_srl_epi32(_mm_sub_epi32(v, k.min), k.shift1), k.two);
+	__m128i idx2 = _mm_add_epi32(_mm_srl_epi32(_mm_sub_epi32(v, k.split), k.shift2), k.data2);
+	__m128i idx = _mm_blendv_epi8(idx2, idx1, low);
+	idx = _mm_blendv_epi8(idx, k.zero, lowZero);
+	idx = _mm_blendv_epi8(idx, k.full, highFull);
+	return idx;
+}
+
+__attribute__((target("sse4.1")))
+void LookupTable::applySse41(const uint16_t * from, uint8_t * to, int count) const
+{
+	ExtIndexSse k;
+	k.min = _mm_set1_epi32(min);
+	k.max = _mm_set1_epi32(max);
+	k.split = _mm_set1_epi32(split);
+	k.data2 = _mm_set1_epi32(extData2);
+	k.shift1 = _mm_cvtsi32_si128(shift1);
+	k.shift2 = _mm_cvtsi32_si128(shift2);
+	k.zero = _mm_set1_epi32(0);
+	k.full = _mm_set1_epi32(1);
+	k.two = _mm_set1_epi32(2);
+
+	// No gather in sse: indexes are computed in vector, then looked up one by one
+	alignas(16) int32_t idx[8];
+	int i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i v16 = _mm_loadu_si128((const __m128i*)(from + i));
+		_mm_store_si128((__m128i*)idx, extIndexSse(k, _mm_cvtepu16_epi32(v16)));
+		_mm_store_si128((__m128i*)(idx + 4), extIndexSse(k, _mm_cvtepu16_epi32(_mm_srli_si128(v16, 8))));
+		for(int j = 0; j < 8; ++j) {
+			to[i + j] = extTable[idx[j]];
+		}
+	}
+	applyScalar(from + i, to + i, count - i);
+}
+
+struct ExtIndexAvx {
+	__m256i min, max, split, data2, zero, full, two, allOnes;
+	__m128i shift1, shift2;
+};
+
+__attribute__((target("avx2")))
+static inline __m256i extIndexAvx(const ExtIndexAvx & k, __m256i v)
+{
+	__m256i low = _mm256_cmpgt_epi32(k.split, v);
+	__m256i lowZero = _mm256_andnot_si256(_mm256_cmpgt_epi32(v, k.min), low);
+	__m256i highFull = _mm256_andnot_si256(_mm256_or_si256(low, _mm256_cmpgt_epi32(k.max, v)), k.allOnes);
+
+	__m256i idx1 = _mm256_add_epi32(_mm256_srl_epi32(_mm256_sub_epi32(v, k.min), k.shift1), k.two);
+	__m256i idx2 = _mm256_add_epi32(_mm256_srl_epi32(_mm256_sub_epi32(v, k.split), k.shift2), k.data2);
+	__m256i idx = _mm256_blendv_epi8(idx2, idx1, low);
+	idx = _mm256_blendv_epi8(idx, k.zero, lowZero);
+	idx = _mm256_blendv_epi8(idx, k.full, highFull);
+	return idx;
+}
+
+__attribute__((target("avx2")))
+void LookupTable::applyAvx2(const uint16_t * from, uint8_t * to, int count) const
+{
+	ExtIndexAvx k;
+	k.min = _mm256_set1_epi32(min);
+	k.max = _mm256_set1_epi32(max);
+	k.split = _mm256_set1_epi32(split);
+	k.data2 = _mm256_set1_epi32(extData2);
+	k.shift1 = _mm_cvtsi32_si128(shift1);
+	k.shift2 = _mm_cvtsi32_si128(shift2);
+	k.zero = _mm256_set1_epi32(0);
+	k.full = _mm256_set1_epi32(1);
+	k.two = _mm256_set1_epi32(2);
+	k.allOnes = _mm256_set1_epi32(-1);
+	const __m256i byteMask = _mm256_set1_epi32(0xff);
+
+	int i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i v0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(from + i)));
+		__m256i v1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(from + i + 8)));
+
+		// 32 bits gathers, extTable is padded for the overread
+		__m256i r0 = _mm256_and_si256(_mm256_i32gather_epi32((const int*)extTable, extIndexAvx(k, v0), 1), byteMask);
+		__m256i r1 = _mm256_and_si256(_mm256_i32gather_epi32((const int*)extTable, extIndexAvx(k, v1), 1), byteMask);
+
+		// packs work per 128 bits lane: restore order after the 32 => 16 step
+		__m256i p16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(r0, r1), 0xD8);
+		__m128i p8 = _mm_packus_epi16(_mm256_castsi256_si128(p16), _mm256_extracti128_si256(p16, 1));
+		_mm_storeu_si128((__m128i*)(to + i), p8);
+	}
+	applyScalar(from + i, to + i, count - i);
+}
+
+#else
+
+void LookupTable::applySse41(const uint16_t * from, uint8_t * to, int count) const
+{
+	applyScalar(from, to, count);
+}
+
+void LookupTable::applyAvx2(const uint16_t * from, uint8_t * to, int count) const
+{
+	applyScalar(from, to, count);
+}
+
+#endif
+
+#ifdef LOOKUPTABLE_NEON
+
+void LookupTable::applyNeon(const uint16_t * from, uint8_t * to, int count) const
+{
+	const uint32x4_t vMin = vdupq_n_u32(min);
+	const uint32x4_t vMax = vdupq_n_u32(max);
+	const uint32x4_t vSplit = vdupq_n_u32(split);
+	const uint32x4_t vData2 = vdupq_n_u32(extData2);
+	const uint32x4_t vZero = vdupq_n_u32(0);
+	const uint32x4_t vFull = vdupq_n_u32(1);
+	const uint32x4_t vTwo = vdupq_n_u32(2);
+	// Right shifts by a variable amount are left shifts by a negative one
+	const int32x4_t vShift1 = vdupq_n_s32(-(int32_t)shift1);
+	const int32x4_t vShift2 = vdupq_n_s32(-(int32_t)shift2);
+
+	uint32_t idx[8];
+	int i = 0;
+	for(; i + 8 <= count; i += 8) {
+		uint16x8_t v16 = vld1q_u16(from + i);
+		uint32x4_t halves[2] = { vmovl_u16(vget_low_u16(v16)), vmovl_u16(vget_high_u16(v16)) };
+		for(int h = 0; h < 2; ++h) {
+			uint32x4_t v = halves[h];
+			uint32x4_t low = vcltq_u32(v, vSplit);
+			uint32x4_t lowZero = vandq_u32(low, vcleq_u32(v, vMin));
+			uint32x4_t highFull = vbicq_u32(vcgeq_u32(v, vMax), low);
+
+			uint32x4_t idx1 = vaddq_u32(vshlq_u32(vsubq_u32(v, vMin), vShift1), vTwo);
+			uint32x4_t idx2 = vaddq_u32(vshlq_u32(vsubq_u32(v, vSplit), vShift2), vData2);
+			uint32x4_t r = vbslq_u32(low, idx1, idx2);
+			r = vbslq_u32(lowZero, vZero, r);
+			r = vbslq_u32(highFull, vFull, r);
+			vst1q_u32(idx + 4 * h, r);
+		}
+		for(int j = 0; j < 8; ++j) {
+			to[i + j] = extTable[idx[j]];
+		}
+	}
+	applyScalar(from + i, to + i, count - i);
+}
+
+#else
+
+void LookupTable::applyNeon(const uint16_t * from, uint8_t * to, int count) const
+{
+	applyScalar(from, to, count);
+}
+
+#endif
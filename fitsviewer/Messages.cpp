@@ -1,16 +1,306 @@
+#include <cstring>
+#include <stdexcept>
 #include "SharedCache.h"
 
 namespace SharedCache {
 	namespace Messages {
 
+		namespace {
+			// A value of a MessagePack encoded message, read in place.
+			// Offers what from_json needs of nlohmann::json: at, count and get
+			class MsgpackValue {
+				struct Item {
+					enum Kind { Nil, Boolean, Unsigned, Signed, Float, Double, String, Binary, Array, Map, Extension };
+					Kind kind;
+					// Elements of Array and Map, bytes of String, Binary and Extension,
+					// value of Boolean, Unsigned and Signed (two's complement)
+					uint64_t value;
+					// First element, or bytes
+					const uint8_t * data;
+				};
+
+				struct Field {
+					const uint8_t * key;
+					uint64_t keyLength;
+					const uint8_t * value;
+				};
+
+				const uint8_t * pos;
+				const uint8_t * end;
+				// Fields of a map, found on the first lookup. from_json looks up every
+				// field, often twice: scanning the map each time would skip its values again
+				static const int MAX_FIELDS = 16;
+				mutable Field fields[MAX_FIELDS];
+				mutable int fieldCount;
+
+				void need(const uint8_t * p, uint64_t bytes) const
+				{
+					if (p > end || bytes > (uint64_t)(end - p)) {
+						throw std::invalid_argument("truncated message");
+					}
+				}
+
+				uint64_t read(const uint8_t * p, int bytes) const
+				{
+					need(p, bytes);
+					uint64_t v = 0;
+					for(int i = 0; i < bytes; ++i) {
+						v = (v << 8) | p[i];
+					}
+					return v;
+				}
+
+				Item sized(Item::Kind kind, const uint8_t * p, int lengthBytes, int extra = 0) const
+				{
+					Item item;
+					item.kind = kind;
+					item.value = read(p + 1, lengthBytes);
+					item.data = p + 1 + lengthBytes + extra;
+					if (kind != Item::Array && kind != Item::Map) {
+						need(item.data, item.value);
+					}
+					return item;
+				}
+
+				Item fixed(Item::Kind kind, const uint8_t * p, uint64_t value, int bytes) const
+				{
+					need(p, 1 + bytes);
+					Item item;
+					item.kind = kind;
+					item.value = value;
+					item.data = p + 1;
+					return item;
+				}
+
+				Item parse(const uint8_t * p) const
+				{
+					need(p, 1);
+					uint8_t b = *p;
+					if (b <= 0x7f) return fixed(Item::Unsigned, p, b, 0);
+					if (b >= 0xe0) return fixed(Item::Signed, p, (uint64_t)(int64_t)(int8_t)b, 0);
+					if (b <= 0x8f) return fixed(Item::Map, p, b & 0x0f, 0);
+					if (b <= 0x9f) return fixed(Item::Array, p, b & 0x0f, 0);
+					if (b <= 0xbf) {
+						Item item = fixed(Item::String, p, b & 0x1f, 0);
+						need(item.data, item.value);
+						return item;
+					}
+					switch(b) {
+						case 0xc0: return fixed(Item::Nil, p, 0, 0);
+						case 0xc2: return fixed(Item::Boolean, p, 0, 0);
+						case 0xc3: return fixed(Item::Boolean, p, 1, 0);
+						case 0xc4: return sized(Item::Binary, p, 1);
+						case 0xc5: return sized(Item::Binary, p, 2);
+						case 0xc6: return sized(Item::Binary, p, 4);
+						case 0xc7: return sized(Item::Extension, p, 1, 1);
+						case 0xc8: return sized(Item::Extension, p, 2, 1);
+						case 0xc9: return sized(Item::Extension, p, 4, 1);
+						case 0xca: return fixed(Item::Float, p, 0, 4);
+						case 0xcb: return fixed(Item::Double, p, 0, 8);
+						case 0xcc: return fixed(Item::Unsigned, p, read(p + 1, 1), 1);
+						case 0xcd: return fixed(Item::Unsigned, p, read(p + 1, 2), 2);
+						case 0xce: return fixed(Item::Unsigned, p, read(p + 1, 4), 4);
+						case 0xcf: return fixed(Item::Unsigned, p, read(p + 1, 8), 8);
+						case 0xd0: return fixed(Item::Signed, p, (uint64_t)(int64_t)(int8_t)read(p + 1, 1), 1);
+						case 0xd1: return fixed(Item::Signed, p, (uint64_t)(int64_t)(int16_t)read(p + 1, 2), 2);
+						case 0xd2: return fixed(Item::Signed, p, (uint64_t)(int64_t)(int32_t)read(p + 1, 4), 4);
+						case 0xd3: return fixed(Item::Signed, p, read(p + 1, 8), 8);
+						case 0xd4: return fixed(Item::Extension, p, 1, 2);
+						case 0xd5: return fixed(Item::Extension, p, 2, 3);
+						case 0xd6: return fixed(Item::Extension, p, 4, 5);
+						case 0xd7: return fixed(Item::Extension, p, 8, 9);
+						case 0xd8: return fixed(Item::Extension, p, 16, 17);
+						case 0xd9: return sized(Item::String, p, 1);
+						case 0xda: return sized(Item::String, p, 2);
+						case 0xdb: return sized(Item::String, p, 4);
+						case 0xdc: return sized(Item::Array, p, 2);
+						case 0xdd: return sized(Item::Array, p, 4);
+						case 0xde: return sized(Item::Map, p, 2);
+						case 0xdf: return sized(Item::Map, p, 4);
+					}
+					throw std::invalid_argument("invalid message");
+				}
+
+				// Position after the value at p
+				const uint8_t * skip(const uint8_t * p) const
+				{
+					Item item = parse(p);
+					switch(item.kind) {
+						case Item::Float:
+							return item.data + 4;
+						case Item::Double:
+							return item.data + 8;
+						case Item::String:
+						case Item::Binary:
+							return item.data + item.value;
+						case Item::Extension:
+							// fixext have no length: the type byte is in data
+							return item.data + item.value + (*p >= 0xd4 && *p <= 0xd8 ? 1 : 0);
+						case Item::Array:
+						case Item::Map:
+						{
+							const uint8_t * next = item.data;
+							uint64_t values = item.kind == Item::Map ? 2 * item.value : item.value;
+							for(uint64_t i = 0; i < values; ++i) {
+								next = skip(next);
+							}
+							return next;
+						}
+						default:
+							return item.data;
+					}
+				}
+
+				void index() const
+				{
+					Item map = parse(pos);
+					if (map.kind != Item::Map) {
+						throw std::invalid_argument("invalid message: object expected");
+					}
+					if (map.value > MAX_FIELDS) {
+						throw std::invalid_argument("invalid message: too many fields");
+					}
+					const uint8_t * next = map.data;
+					for(uint64_t i = 0; i < map.value; ++i) {
+						Item k = parse(next);
+						if (k.kind != Item::String) {
+							throw std::invalid_argument("invalid message: key expected");
+						}
+						fields[i].key = k.data;
+						fields[i].keyLength = k.value;
+						fields[i].value = k.data + k.value;
+						next = skip(fields[i].value);
+					}
+					fieldCount = map.value;
+				}
+
+				// The value of key, or nullptr
+				const uint8_t * find(const char * key) const
+				{
+					if (fieldCount == -1) {
+						index();
+					}
+					size_t keyLength = strlen(key);
+					for(int i = 0; i < fieldCount; ++i) {
+						if (fields[i].keyLength == keyLength && !memcmp(fields[i].key, key, keyLength)) {
+							return fields[i].value;
+						}
+					}
+					return nullptr;
+				}
+
+				double number() const
+				{
+					Item item = parse(pos);
+					switch(item.kind) {
+						case Item::Unsigned:
+							return item.value;
+						case Item::Signed:
+							return (int64_t)item.value;
+						case Item::Float:
+						{
+							uint32_t bits = read(item.data, 4);
+							float f;
+							memcpy(&f, &bits, 4);
+							return f;
+						}
+						case Item::Double:
+						{
+							uint64_t bits = read(item.data, 8);
+							double d;
+							memcpy(&d, &bits, 8);
+							return d;
+						}
+						default:
+							throw std::invalid_argument("invalid message: number expected");
+					}
+				}
+
+				int64_t integer() const
+				{
+					Item item = parse(pos);
+					if (item.kind == Item::Unsigned || item.kind == Item::Signed) {
+						return (int64_t)item.value;
+					}
+					return (int64_t)number();
+				}
+			public:
+				MsgpackValue(const uint8_t * pos, const uint8_t * end) : pos(pos), end(end), fieldCount(-1) {}
+
+				MsgpackValue at(const char * key) const
+				{
+					const uint8_t * value = find(key);
+					if (!value) {
+						throw std::out_of_range(std::string("missing ") + key);
+					}
+					return MsgpackValue(value, end);
+				}
+
+				size_t count(const char * key) const
+				{
+					return find(key) ? 1 : 0;
+				}
+
+				template<class T> T get() const
+				{
+					T t;
+					from_json(*this, t);
+					return t;
+				}
+			};
+
+			template<> std::string MsgpackValue::get<std::string>() const
+			{
+				Item item = parse(pos);
+				if (item.kind != Item::String) {
+					throw std::invalid_argument("invalid message: string expected");
+				}
+				return std::string((const char*)item.data, item.value);
+			}
+
+			template<> bool MsgpackValue::get<bool>() const
+			{
+				Item item = parse(pos);
+				if (item.kind != Item::Boolean) {
+					throw std::invalid_argument("invalid message: boolean expected");
+				}
+				return item.value;
+			}
+
+			template<> int MsgpackValue::get<int>() const
+			{
+				return integer();
+			}
+
+			template<> long MsgpackValue::get<long>() const
+			{
+				return integer();
+			}
+
+			template<> double MsgpackValue::get<double>() const
+			{
+				return number();
+			}
+		}
+
 		void to_json(nlohmann::json&j, const RawContent & i)
 		{
 			j = nlohmann::json::object();
 			j["path"] = i.path;
 		}
 
-		void from_json(const nlohmann::json& j, RawContent & p) {
-			p.path = j.at("path").get<std::string>();
+		template<class Json> void from_json(const Json & j, RawContent & p) {
+			p.path = j.at("path").template get<std::string>();
+		}
+
+		void to_json(nlohmann::json&j, const FitsHeader & i)
+		{
+			j = nlohmann::json::object();
+			j["path"] = i.path;
+		}
+
+		template<class Json> void from_json(const Json & j, FitsHeader & p) {
+			p.path = j.at("path").template get<std::string>();
 		}
 
 		void to_json(nlohmann::json&j, const Histogram & i)
@@ -19,8 +309,78 @@ namespace SharedCache {
 			j["source"] = i.source;
 		}
 
-		void from_json(const nlohmann::json& j, Histogram & p) {
-			p.source = j.at("source").get<RawContent>();
+		template<class Json> void from_json(const Json & j, Histogram & p) {
+			p.source = j.at("source").template get<RawContent>();
+		}
+
+		void to_json(nlohmann::json&j, const RenderedImage & i)
+		{
+			j = nlohmann::json::object();
+			j["source"] = i.source;
+			j["bin"] = i.bin;
+			j["forceGreyscale"] = i.forceGreyscale;
+			j["low"] = i.low;
+			j["med"] = i.med;
+			j["high"] = i.high;
+			j["debayer"] = i.debayer;
+		}
+
+		template<class Json> void from_json(const Json & j, RenderedImage & p) {
+			p.source = j.at("source").template get<RawContent>();
+			p.bin = j.at("bin").template get<int>();
+			p.forceGreyscale = j.at("forceGreyscale").template get<bool>();
+			p.low = j.at("low").template get<double>();
+			p.med = j.at("med").template get<double>();
+			p.high = j.at("high").template get<double>();
+			p.debayer = j.at("debayer").template get<std::string>();
+		}
+
+		void to_json(nlohmann::json&j, const AduPyramid & i)
+		{
+			j = nlohmann::json::object();
+			j["source"] = i.source;
+		}
+
+		template<class Json> void from_json(const Json & j, AduPyramid & p) {
+			p.source = j.at("source").template get<RawContent>();
+		}
+
+		void to_json(nlohmann::json&j, const DebayeredContent & i)
+		{
+			j = nlohmann::json::object();
+			j["source"] = i.source;
+			j["method"] = i.method;
+		}
+
+		template<class Json> void from_json(const Json & j, DebayeredContent & p) {
+			p.source = j.at("source").template get<RawContent>();
+			p.method = j.at("method").template get<std::string>();
+		}
+
+		void to_json(nlohmann::json&j, const RenderedTile & i)
+		{
+			j = nlohmann::json::object();
+			j["source"] = i.source;
+			j["level"] = i.level;
+			j["x"] = i.x;
+			j["y"] = i.y;
+			j["forceGreyscale"] = i.forceGreyscale;
+			j["low"] = i.low;
+			j["med"] = i.med;
+			j["high"] = i.high;
+			j["debayer"] = i.debayer;
+		}
+
+		template<class Json> void from_json(const Json & j, RenderedTile & p) {
+			p.source = j.at("source").template get<RawContent>();
+			p.level = j.at("level").template get<int>();
+			p.x = j.at("x").template get<int>();
+			p.y = j.at("y").template get<int>();
+			p.forceGreyscale = j.at("forceGreyscale").template get<bool>();
+			p.low = j.at("low").template get<double>();
+			p.med = j.at("med").template get<double>();
+			p.high = j.at("high").template get<double>();
+			p.debayer = j.at("debayer").template get<std::string>();
 		}
 
 		void to_json(nlohmann::json&j, const StarField & i)
@@ -29,8 +389,8 @@ namespace SharedCache {
 			j["source"] = i.source;
 		}
 
-		void from_json(const nlohmann::json& j, StarField & p) {
-			p.source = j.at("source").get<RawContent>();
+		template<class Json> void from_json(const Json & j, StarField & p) {
+			p.source = j.at("source").template get<RawContent>();
 		}
 
 		void to_json(nlohmann::json&j, const StarOccurence & i)
@@ -93,16 +453,16 @@ namespace SharedCache {
 			j["numberOfBinInUniformize"] = i.numberOfBinInUniformize;
 		}
 
-		void from_json(const nlohmann::json& j, Astrometry & p) {
-			p.source = j.at("source").get<StarField>();
-			p.exePath = j.at("exePath").get<std::string>();
-			p.libraryPath = j.at("libraryPath").get<std::string>();
-			p.fieldMin = j.at("fieldMin").get<double>();
-			p.fieldMax = j.at("fieldMax").get<double>();
-			p.raCenterEstimate = j.at("raCenterEstimate").get<double>();
-			p.decCenterEstimate = j.at("decCenterEstimate").get<double>();
-			p.searchRadius = j.at("searchRadius").get<double>();
-			p.numberOfBinInUniformize = j.at("numberOfBinInUniformize").get<int>();
+		template<class Json> void from_json(const Json & j, Astrometry & p) {
+			p.source = j.at("source").template get<StarField>();
+			p.exePath = j.at("exePath").template get<std::string>();
+			p.libraryPath = j.at("libraryPath").template get<std::string>();
+			p.fieldMin = j.at("fieldMin").template get<double>();
+			p.fieldMax = j.at("fieldMax").template get<double>();
+			p.raCenterEstimate = j.at("raCenterEstimate").template get<double>();
+			p.decCenterEstimate = j.at("decCenterEstimate").template get<double>();
+			p.searchRadius = j.at("searchRadius").template get<double>();
+			p.numberOfBinInUniformize = j.at("numberOfBinInUniformize").template get<int>();
 		}
 
 		void to_json(nlohmann::json&j, const JsonQuery & i)
@@ -116,38 +476,111 @@ namespace SharedCache {
 			}
 		}
 
-		void from_json(const nlohmann::json& j, JsonQuery & p) {
-			if (j.find("starField") != j.end()) {
-				p.starField = new StarField(j.at("starField").get<StarField>());
+		template<class Json> void from_json(const Json & j, JsonQuery & p) {
+			if (j.count("starField")) {
+				p.starField = new StarField(j.at("starField").template get<StarField>());
 			}
-			if (j.find("astrometry") != j.end()) {
-				p.astrometry = new Astrometry(j.at("astrometry").get<Astrometry>());
+			if (j.count("astrometry")) {
+				p.astrometry = new Astrometry(j.at("astrometry").template get<Astrometry>());
 			}
 		}
 
+		ContentRequest::Priority ContentRequest::parsePriority(const std::string & str)
+		{
+			if (str == "interactive") {
+				return Interactive;
+			}
+			if (str == "focus") {
+				return Focus;
+			}
+			if (str == "background") {
+				return Background;
+			}
+			throw std::invalid_argument("invalid priority: " + str);
+		}
+
+		std::string ContentRequest::priorityName(Priority priority)
+		{
+			switch(priority) {
+				case Focus:
+					return "focus";
+				case Background:
+					return "background";
+				default:
+					return "interactive";
+			}
+		}
+
+		ContentRequest::Priority ContentRequest::effectivePriority(Priority producing) const
+		{
+			if (priority == Unspecified) {
+				return producing == Unspecified ? Interactive : producing;
+			}
+			if (producing != Unspecified && producing < priority) {
+				return producing;
+			}
+			return priority;
+		}
+
 		void to_json(nlohmann::json&j, const ContentRequest & i)
 		{
 			j = nlohmann::json::object();
+			if (i.priority != ContentRequest::Unspecified) {
+				j["priority"] = ContentRequest::priorityName(i.priority);
+			}
 			if (i.fitsContent) {
 				j["fitsContent"] = *i.fitsContent;
 			}
+			if (i.fitsHeader) {
+				j["fitsHeader"] = *i.fitsHeader;
+			}
 			if (i.histogram) {
 				j["histogram"] = *i.histogram;
 			}
+			if (i.renderedImage) {
+				j["renderedImage"] = *i.renderedImage;
+			}
+			if (i.aduPyramid) {
+				j["aduPyramid"] = *i.aduPyramid;
+			}
+			if (i.debayeredContent) {
+				j["debayeredContent"] = *i.debayeredContent;
+			}
+			if (i.renderedTile) {
+				j["renderedTile"] = *i.renderedTile;
+			}
 			if (i.jsonQuery) {
 				j["jsonQuery"] = *i.jsonQuery;
 			}
 		}
 
-		void from_json(const nlohmann::json& j, ContentRequest & p) {
-			if (j.find("fitsContent") != j.end()) {
-				p.fitsContent = new RawContent(j.at("fitsContent").get<RawContent>());
+		template<class Json> void from_json(const Json & j, ContentRequest & p) {
+			if (j.count("fitsContent")) {
+				p.fitsContent = new RawContent(j.at("fitsContent").template get<RawContent>());
+			}
+			if (j.count("fitsHeader")) {
+				p.fitsHeader = new FitsHeader(j.at("fitsHeader").template get<FitsHeader>());
+			}
+			if (j.count("histogram")) {
+				p.histogram = new Histogram(j.at("histogram").template get<Histogram>());
+			}
+			if (j.count("renderedImage")) {
+				p.renderedImage = new RenderedImage(j.at("renderedImage").template get<RenderedImage>());
+			}
+			if (j.count("aduPyramid")) {
+				p.aduPyramid = new AduPyramid(j.at("aduPyramid").template get<AduPyramid>());
 			}
-			if (j.find("histogram") != j.end()) {
-				p.histogram = new Histogram(j.at("histogram").get<Histogram>());
+			if (j.count("debayeredContent")) {
+				p.debayeredContent = new DebayeredContent(j.at("debayeredContent").template get<DebayeredContent>());
 			}
-			if (j.find("jsonQuery") != j.end()) {
-				p.jsonQuery = new JsonQuery(j.at("jsonQuery").get<JsonQuery>());
+			if (j.count("renderedTile")) {
+				p.renderedTile = new RenderedTile(j.at("renderedTile").template get<RenderedTile>());
+			}
+			if (j.count("jsonQuery")) {
+				p.jsonQuery = new JsonQuery(j.at("jsonQuery").template get<JsonQuery>());
+			}
+			if (j.count("priority")) {
+				p.priority = ContentRequest::parsePriority(j.at("priority").template get<std::string>());
 			}
 		}
 
@@ -157,7 +590,7 @@ namespace SharedCache {
 			j.object();
 		}
 
-		void from_json(const nlohmann::json& j, WorkRequest & p) {
+		template<class Json> void from_json(const Json & j, WorkRequest & p) {
 		}
 		void to_json(nlohmann::json&j, const WorkResponse & i)
 		{
@@ -168,11 +601,11 @@ namespace SharedCache {
 			j["filename"] = i.filename;
 		}
 
-		void from_json(const nlohmann::json& j, WorkResponse & p) {
-			if (j.find("content") != j.end()) {
-				p.content = new ContentRequest(j.at("content").get<ContentRequest>());
+		template<class Json> void from_json(const Json & j, WorkResponse & p) {
+			if (j.count("content")) {
+				p.content = new ContentRequest(j.at("content").template get<ContentRequest>());
 			}
-			p.filename = j["filename"].get<std::string>();
+			p.filename = j.at("filename").template get<std::string>();
 		}
 
 
@@ -185,11 +618,11 @@ namespace SharedCache {
 			j["errorDetails"] = i.errorDetails;
 		}
 
-		void from_json(const nlohmann::json& j, FinishedAnnounce & p) {
-			p.error = j.at("error").get<bool>();
-			p.size = j.at("size").get<long>();
-			p.filename = j.at("filename").get<std::string>();
-			p.errorDetails = j.at("errorDetails").get<std::string>();
+		template<class Json> void from_json(const Json & j, FinishedAnnounce & p) {
+			p.error = j.at("error").template get<bool>();
+			p.size = j.at("size").template get<long>();
+			p.filename = j.at("filename").template get<std::string>();
+			p.errorDetails = j.at("errorDetails").template get<std::string>();
 		}
 
 
@@ -199,8 +632,21 @@ namespace SharedCache {
 			j["filename"] = i.filename;
 		}
 
-		void from_json(const nlohmann::json& j, ReleasedAnnounce & p) {
-			p.filename = j.at("filename").get<std::string>();
+		template<class Json> void from_json(const Json & j, ReleasedAnnounce & p) {
+			p.filename = j.at("filename").template get<std::string>();
+		}
+
+
+		void to_json(nlohmann::json&j, const Prefetch & i)
+		{
+			j = nlohmann::json::object();
+			j["path"] = i.path;
+			j["previewBin"] = i.previewBin;
+		}
+
+		template<class Json> void from_json(const Json & j, Prefetch & p) {
+			p.path = j.at("path").template get<std::string>();
+			p.previewBin = j.count("previewBin") ? j.at("previewBin").template get<int>() : -1;
 		}
 
 
@@ -209,31 +655,43 @@ namespace SharedCache {
 			j = nlohmann::json::object();
 			if (i.contentRequest) j["contentRequest"] = *i.contentRequest;
 			if (i.workRequest) j["workRequest"] = *i.workRequest;
+			if (i.productionRequest) j["productionRequest"] = *i.productionRequest;
 			if (i.finishedAnnounce) j["finishedAnnounce"] = *i.finishedAnnounce;
 			if (i.releasedAnnounce) j["releasedAnnounce"] = *i.releasedAnnounce;
+			if (i.prefetch) j["prefetch"] = *i.prefetch;
 		}
 
-		void from_json(const nlohmann::json& j, Request & p) {
-			if (j.find("contentRequest") != j.end()) {
-				p.contentRequest = new ContentRequest(j.at("contentRequest").get<ContentRequest>());
+		template<class Json> void from_json(const Json & j, Request & p) {
+			if (j.count("contentRequest")) {
+				p.contentRequest = new ContentRequest(j.at("contentRequest").template get<ContentRequest>());
 			} else {
 				p.contentRequest = nullptr;
 			}
-			if (j.find("workRequest") != j.end()) {
-				p.workRequest = new WorkRequest(j.at("workRequest").get<WorkRequest>());
+			if (j.count("workRequest")) {
+				p.workRequest = new WorkRequest(j.at("workRequest").template get<WorkRequest>());
 			} else {
 				p.workRequest = nullptr;
 			}
-			if (j.find("finishedAnnounce") != j.end()) {
-				p.finishedAnnounce = new FinishedAnnounce(j.at("finishedAnnounce").get<FinishedAnnounce>());
+			if (j.count("productionRequest")) {
+				p.productionRequest = new ContentRequest(j.at("productionRequest").template get<ContentRequest>());
+			} else {
+				p.productionRequest = nullptr;
+			}
+			if (j.count("finishedAnnounce")) {
+				p.finishedAnnounce = new FinishedAnnounce(j.at("finishedAnnounce").template get<FinishedAnnounce>());
 			} else {
 				p.finishedAnnounce = nullptr;
 			}
-			if (j.find("releasedAnnounce") != j.end()) {
-				p.releasedAnnounce = new ReleasedAnnounce(j.at("releasedAnnounce").get<ReleasedAnnounce>());
+			if (j.count("releasedAnnounce")) {
+				p.releasedAnnounce = new ReleasedAnnounce(j.at("releasedAnnounce").template get<ReleasedAnnounce>());
 			} else {
 				p.releasedAnnounce = nullptr;
 			}
+			if (j.count("prefetch")) {
+				p.prefetch = new Prefetch(j.at("prefetch").template get<Prefetch>());
+			} else {
+				p.prefetch = nullptr;
+			}
 		}
 
 
@@ -244,11 +702,10 @@ namespace SharedCache {
 			j["errorDetails"] = i.errorDetails;
 			j["error"] = i.error;
 		}
-		void from_json(const nlohmann::json& j, ContentResult & p)
-		{
-			p.filename = j.at("filename").get<std::string>();
-			p.errorDetails = j.at("errorDetails").get<std::string>();
-			p.error = j.at("error").get<bool>();
+		template<class Json> void from_json(const Json & j, ContentResult & p) {
+			p.filename = j.at("filename").template get<std::string>();
+			p.errorDetails = j.at("errorDetails").template get<std::string>();
+			p.error = j.at("error").template get<bool>();
 		}
 
 		void to_json(nlohmann::json&j, const Result & i)
@@ -257,19 +714,50 @@ namespace SharedCache {
 			if (i.contentResult) j["contentResult"] = *i.contentResult;
 			if (i.todoResult) j["todoResult"] = *i.todoResult;
 		}
-		void from_json(const nlohmann::json& j, Result & p)
-		{
-			if (j.find("contentResult") != j.end()) {
-				p.contentResult = new ContentResult(j.at("contentResult").get<ContentResult>());
+		template<class Json> void from_json(const Json & j, Result & p) {
+			if (j.count("contentResult")) {
+				p.contentResult = new ContentResult(j.at("contentResult").template get<ContentResult>());
 			} else {
 				p.contentResult = nullptr;
 			}
-			if (j.find("todoResult") != j.end()) {
-				p.todoResult = new WorkResponse(j.at("todoResult").get<WorkResponse>());
+			if (j.count("todoResult")) {
+				p.todoResult = new WorkResponse(j.at("todoResult").template get<WorkResponse>());
 			} else {
 				p.todoResult = nullptr;
 			}
 		}
 
+
+		void fromMsgpack(const uint8_t * data, size_t size, Request & p)
+		{
+			from_json(MsgpackValue(data, data + size), p);
+		}
+
+		void fromMsgpack(const uint8_t * data, size_t size, Result & p)
+		{
+			from_json(MsgpackValue(data, data + size), p);
+		}
+
+		// For nlohmann::json::get
+		template void from_json(const nlohmann::json & j, RawContent & p);
+		template void from_json(const nlohmann::json & j, FitsHeader & p);
+		template void from_json(const nlohmann::json & j, Histogram & p);
+		template void from_json(const nlohmann::json & j, RenderedImage & p);
+		template void from_json(const nlohmann::json & j, AduPyramid & p);
+		template void from_json(const nlohmann::json & j, DebayeredContent & p);
+		template void from_json(const nlohmann::json & j, RenderedTile & p);
+		template void from_json(const nlohmann::json & j, StarField & p);
+		template void from_json(const nlohmann::json & j, Astrometry & p);
+		template void from_json(const nlohmann::json & j, JsonQuery & p);
+		template void from_json(const nlohmann::json & j, ContentRequest & p);
+		template void from_json(const nlohmann::json & j, WorkRequest & p);
+		template void from_json(const nlohmann::json & j, WorkResponse & p);
+		template void from_json(const nlohmann::json & j, FinishedAnnounce & p);
+		template void from_json(const nlohmann::json & j, ReleasedAnnounce & p);
+		template void from_json(const nlohmann::json & j, Prefetch & p);
+		template void from_json(const nlohmann::json & j, Request & p);
+		template void from_json(const nlohmann::json & j, ContentResult & p);
+		template void from_json(const nlohmann::json & j, Result & p);
+
 	}
 }
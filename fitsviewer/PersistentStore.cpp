@@ -0,0 +1,486 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+#include "json.hpp"
+#include "PersistentStore.h"
+
+namespace SharedCache {
+
+// Copy size bytes from the start of from, at the current position of to
+static bool copyData(int from, int to, long size)
+{
+	off_t offset = 0;
+	while(offset < size) {
+		ssize_t done = sendfile(to, from, &offset, size - offset);
+		if (done == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("sendfile");
+			return false;
+		}
+		if (done == 0) {
+			std::cerr << "Persistent cache: short copy\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Write size bytes of fd in a new file at path, atomically
+static bool writeFile(const std::string & path, int fd, long size)
+{
+	std::string tmpPath = path + ".tmp";
+	int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out == -1) {
+		perror(tmpPath.c_str());
+		return false;
+	}
+	bool ok = copyData(fd, out, size);
+	if (close(out) == -1) {
+		perror(tmpPath.c_str());
+		ok = false;
+	}
+	if (ok && rename(tmpPath.c_str(), path.c_str()) == -1) {
+		perror(tmpPath.c_str());
+		ok = false;
+	}
+	if (!ok) {
+		::unlink(tmpPath.c_str());
+	}
+	return ok;
+}
+
+// Copy the size bytes of the file at path into fd
+static bool readFile(const std::string & path, int fd, long size)
+{
+	int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in == -1) {
+		perror(path.c_str());
+		return false;
+	}
+	bool ok = copyData(in, fd, size);
+	close(in);
+	return ok;
+}
+
+PersistentStore::PersistentStore(const std::string & path, long maxSize):
+	path(path),
+	maxSize(maxSize)
+{
+	if (this->path.empty() || this->path[this->path.length() - 1] != '/') {
+		this->path += '/';
+	}
+	currentSize = 0;
+	generation = 0;
+	dirty = false;
+	busy = false;
+	stopping = false;
+	completionFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (completionFd == -1) {
+		perror("eventfd");
+		throw std::runtime_error("Unable to create eventfd");
+	}
+}
+
+PersistentStore::~PersistentStore()
+{
+	{
+		std::lock_guard<std::mutex> locked(lock);
+		stopping = true;
+		cond.notify_all();
+	}
+	if (thread.joinable()) {
+		thread.join();
+	}
+	close(completionFd);
+}
+
+std::string PersistentStore::indexPath() const
+{
+	return path + "index.json";
+}
+
+std::string PersistentStore::fileName(const std::string & identifier)
+{
+	// Two FNV-1a 64 bits, with different offsets
+	uint64_t h1 = 14695981039346656037ULL;
+	uint64_t h2 = 14695981039346656037ULL ^ 0x5bd1e9955bd1e995ULL;
+	for(unsigned char c : identifier) {
+		h1 = (h1 ^ c) * 1099511628211ULL;
+		h2 = (h2 ^ c) * 1099511628211ULL;
+	}
+	std::ostringstream oss;
+	oss << std::hex << std::setfill('0') << std::setw(16) << h1 << std::setw(16) << h2;
+	return oss.str();
+}
+
+bool PersistentStore::isStoreFile(const std::string & name)
+{
+	std::string hash = name;
+	if (hash.size() == 36 && hash.compare(32, 4, ".tmp") == 0) {
+		hash.resize(32);
+	}
+	if (hash.size() != 32) {
+		return false;
+	}
+	for(char c : hash) {
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void PersistentStore::load(const std::function<bool(const std::string & identifier)> & isCurrent)
+{
+	if (mkdir(path.c_str(), 0777) == -1 && errno != EEXIST) {
+		perror(path.c_str());
+		throw std::runtime_error("Unable to create persistent cache directory");
+	}
+
+	std::ifstream in(indexPath());
+	if (in) {
+		try {
+			nlohmann::json index = nlohmann::json::parse(in);
+			for(const auto & j : index.at("entries")) {
+				std::string identifier = j.at("identifier").get<std::string>();
+				Item item;
+				item.file = j.at("file").get<std::string>();
+				item.size = j.at("size").get<long>();
+				item.prodDuration = j.at("prodDuration").get<long>();
+				item.lastUse = j.at("lastUse").get<long>();
+
+				struct stat st;
+				if (item.file != fileName(identifier)
+						|| stat((path + item.file).c_str(), &st) == -1
+						|| st.st_size != item.size
+						|| !isCurrent(identifier))
+				{
+					dirty = true;
+					continue;
+				}
+				items[identifier] = item;
+				currentSize += item.size;
+			}
+		} catch(const std::exception & e) {
+			std::cerr << "Ignoring persistent cache index: " << e.what() << "\n";
+			items.clear();
+			currentSize = 0;
+			dirty = true;
+		}
+	}
+
+	// Files of dropped items, or written after the last save of the index.
+	// Other files are left alone: the directory may not be dedicated to the store
+	std::set<std::string> known;
+	for(const auto & item : items) {
+		known.insert(item.second.file);
+	}
+	DIR * dir = opendir(path.c_str());
+	if (dir == nullptr) {
+		perror(path.c_str());
+		throw std::runtime_error("Unable to read persistent cache directory");
+	}
+	struct dirent * ent;
+	while((ent = readdir(dir)) != nullptr) {
+		std::string name(ent->d_name);
+		if (!isStoreFile(name) || known.count(name)) {
+			continue;
+		}
+		if (::unlink((path + name).c_str()) == -1) {
+			perror((path + name).c_str());
+		}
+	}
+	closedir(dir);
+
+	for(auto & item : items) {
+		item.second.ready = true;
+		item.second.generation = ++generation;
+	}
+	trim();
+	std::cerr << "Persistent cache in " << path << ": " << items.size() << " entries, " << currentSize << "/" << maxSize << " bytes\n";
+	thread = std::thread([this]() { run(); });
+}
+
+void PersistentStore::queue(const std::function<void()> & job)
+{
+	jobs.push_back(job);
+	cond.notify_all();
+}
+
+void PersistentStore::run()
+{
+	std::unique_lock<std::mutex> locked(lock);
+	while(true) {
+		if (jobs.empty()) {
+			if (dirty) {
+				// Once per batch of jobs
+				locked.unlock();
+				writeIndex();
+				locked.lock();
+				continue;
+			}
+			busy = false;
+			cond.notify_all();
+			if (stopping) {
+				return;
+			}
+			cond.wait(locked);
+			continue;
+		}
+		busy = true;
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		locked.unlock();
+		job();
+		locked.lock();
+	}
+}
+
+void PersistentStore::writeIndex()
+{
+	nlohmann::json entries = nlohmann::json::array();
+	{
+		std::lock_guard<std::mutex> locked(lock);
+		for(const auto & it : items) {
+			if (!it.second.ready) {
+				continue;
+			}
+			nlohmann::json j;
+			j["identifier"] = it.first;
+			j["file"] = it.second.file;
+			j["size"] = it.second.size;
+			j["prodDuration"] = it.second.prodDuration;
+			j["lastUse"] = it.second.lastUse;
+			entries.push_back(j);
+		}
+		// On failure, written again on the next change
+		dirty = false;
+	}
+	nlohmann::json index;
+	index["entries"] = entries;
+
+	// Replaced atomically: a crash leaves either index complete
+	std::string tmpPath = indexPath() + ".tmp";
+	{
+		std::ofstream out(tmpPath);
+		out << index.dump(0);
+		if (!out) {
+			std::cerr << "Unable to write " << tmpPath << "\n";
+			return;
+		}
+	}
+	if (rename(tmpPath.c_str(), indexPath().c_str()) == -1) {
+		perror(indexPath().c_str());
+	}
+}
+
+void PersistentStore::save()
+{
+	std::lock_guard<std::mutex> locked(lock);
+	if (dirty) {
+		cond.notify_all();
+	}
+}
+
+void PersistentStore::complete(const std::function<void()> & callback)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	completions.push_back(callback);
+	uint64_t one = 1;
+	if (write(completionFd, &one, sizeof(one)) == -1) {
+		perror("eventfd write");
+	}
+}
+
+void PersistentStore::processCompletions()
+{
+	uint64_t count;
+	if (read(completionFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("eventfd read");
+	}
+	std::list<std::function<void()>> ready;
+	{
+		std::lock_guard<std::mutex> locked(lock);
+		ready.swap(completions);
+	}
+	for(auto & callback : ready) {
+		callback();
+	}
+}
+
+void PersistentStore::flush()
+{
+	{
+		std::unique_lock<std::mutex> locked(lock);
+		cond.wait(locked, [this]() { return jobs.empty() && !busy; });
+	}
+	processCompletions();
+}
+
+bool PersistentStore::contains(const std::string & identifier)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	auto it = items.find(identifier);
+	return it != items.end() && it->second.ready;
+}
+
+long PersistentStore::size()
+{
+	std::lock_guard<std::mutex> locked(lock);
+	return currentSize;
+}
+
+long PersistentStore::count()
+{
+	std::lock_guard<std::mutex> locked(lock);
+	return items.size();
+}
+
+void PersistentStore::remove(std::unordered_map<std::string, Item>::iterator it)
+{
+	std::string file = path + it->second.file;
+	currentSize -= it->second.size;
+	items.erase(it);
+	dirty = true;
+	// After a pending copy of the same file
+	queue([file]() {
+		if (::unlink(file.c_str()) == -1 && errno != ENOENT) {
+			perror(file.c_str());
+		}
+	});
+}
+
+void PersistentStore::trim()
+{
+	if (currentSize <= maxSize) {
+		return;
+	}
+	std::vector<std::pair<long, std::string>> byAge;
+	for(const auto & it : items) {
+		byAge.push_back(std::make_pair(it.second.lastUse, it.first));
+	}
+	std::sort(byAge.begin(), byAge.end());
+	for(auto & old : byAge) {
+		if (currentSize <= maxSize) {
+			break;
+		}
+		remove(items.find(old.second));
+	}
+}
+
+bool PersistentStore::store(const std::string & identifier, int fd, long size, long prodDuration)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	auto existing = items.find(identifier);
+	if (existing != items.end()) {
+		// Restored earlier: the file is still there (or being written)
+		existing->second.lastUse = time(nullptr);
+		dirty = true;
+		return true;
+	}
+	if (size > maxSize) {
+		return false;
+	}
+	int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (copy == -1) {
+		perror("dup");
+		return false;
+	}
+
+	Item item;
+	item.file = fileName(identifier);
+	item.size = size;
+	item.prodDuration = prodDuration;
+	item.lastUse = time(nullptr);
+	item.ready = false;
+	item.generation = ++generation;
+	items[identifier] = item;
+	currentSize += size;
+
+	std::string file = path + item.file;
+	long itemGeneration = item.generation;
+	queue([this, identifier, copy, size, file, itemGeneration]() {
+		bool ok = writeFile(file, copy, size);
+		close(copy);
+		std::lock_guard<std::mutex> locked(lock);
+		auto it = items.find(identifier);
+		if (it == items.end() || it->second.generation != itemGeneration) {
+			// Dropped meanwhile: its removal comes next
+			return;
+		}
+		if (ok) {
+			it->second.ready = true;
+			dirty = true;
+		} else {
+			currentSize -= it->second.size;
+			items.erase(it);
+		}
+	});
+	trim();
+	return items.find(identifier) != items.end();
+}
+
+bool PersistentStore::restore(const std::string & identifier, int fd, const std::function<void(bool ok, long size, long prodDuration)> & done)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	auto it = items.find(identifier);
+	if (it == items.end() || !it->second.ready) {
+		return false;
+	}
+	int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (copy == -1) {
+		perror("dup");
+		return false;
+	}
+	it->second.lastUse = time(nullptr);
+	dirty = true;
+
+	std::string file = path + it->second.file;
+	long size = it->second.size;
+	long prodDuration = it->second.prodDuration;
+	long itemGeneration = it->second.generation;
+	queue([this, identifier, copy, file, size, prodDuration, itemGeneration, done]() {
+		bool ok = readFile(file, copy, size);
+		close(copy);
+		if (!ok) {
+			std::lock_guard<std::mutex> locked(lock);
+			auto it = items.find(identifier);
+			if (it != items.end() && it->second.generation == itemGeneration) {
+				remove(it);
+			}
+		}
+		complete([done, ok, size, prodDuration]() { done(ok, size, prodDuration); });
+	});
+	return true;
+}
+
+void PersistentStore::invalidate(const std::string & token)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	for(auto it = items.begin(); it != items.end();) {
+		auto current = it++;
+		if (current->first.find(token) != std::string::npos) {
+			remove(current);
+		}
+	}
+}
+
+}
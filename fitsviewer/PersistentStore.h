@@ -0,0 +1,104 @@
+#ifndef PERSISTENTSTORE_H_
+#define PERSISTENTSTORE_H_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace SharedCache {
+
+// Second tier of the cache: entries evicted from memory are kept in a
+// directory, and survive restarts of the server. Data files are named after
+// a hash of the entry identifier; index.json maps identifiers to them.
+// The copies, removals and index writes are made in order by a thread of the
+// store, so that the server loop never waits for the disk. Restores complete
+// on the server loop, from processCompletions()
+class PersistentStore {
+	struct Item {
+		std::string file;
+		long size;
+		long prodDuration;
+		// time(), for least recently used first trimming
+		long lastUse;
+		// The data file is complete
+		bool ready;
+		// Tells a new item for the same identifier from a dropped one
+		long generation;
+	};
+
+	// Ends with '/'
+	std::string path;
+	long maxSize;
+
+	// Protects what follows (the items are shared with the thread)
+	std::mutex lock;
+	std::condition_variable cond;
+	long currentSize;
+	long generation;
+	std::unordered_map<std::string, Item> items;
+	// The index file is behind items
+	bool dirty;
+	// For the thread, in order
+	std::list<std::function<void()>> jobs;
+	bool busy;
+	bool stopping;
+	std::thread thread;
+	// Restore callbacks to run on the server loop
+	std::list<std::function<void()>> completions;
+	// eventfd, signaled when completions are ready
+	int completionFd;
+
+	std::string indexPath() const;
+	// The lock is held. The file is removed by the thread
+	void remove(std::unordered_map<std::string, Item>::iterator it);
+	// Drop least recently used items until under maxSize. The lock is held
+	void trim();
+	// The lock is held
+	void queue(const std::function<void()> & job);
+	void run();
+	// From the thread: write the index, if it changed
+	void writeIndex();
+	void complete(const std::function<void()> & callback);
+public:
+	PersistentStore(const std::string & path, long maxSize);
+	// Pending jobs are done first
+	~PersistentStore();
+
+	// Read the index, then start the thread. Items whose file is missing or that
+	// isCurrent rejects are dropped, and so are the files that are not in the index
+	void load(const std::function<bool(const std::string & identifier)> & isCurrent);
+	// Write the index soon, if it changed. The thread does it as well after each batch of jobs
+	void save();
+
+	// True if the item can be restored
+	bool contains(const std::string & identifier);
+	// Copy size bytes of fd (dup'ed). False if it does not fit
+	bool store(const std::string & identifier, int fd, long size, long prodDuration);
+	// Copy the data into fd (dup'ed), then call done on the server loop. The item is
+	// forgotten if it could not be read. False if there is no such item
+	bool restore(const std::string & identifier, int fd, const std::function<void(bool ok, long size, long prodDuration)> & done);
+	// Forget the items whose identifier contains token
+	void invalidate(const std::string & token);
+
+	// To watch in the server loop (readable when completions are ready)
+	int completionDescriptor() const { return completionFd; }
+	void processCompletions();
+	// Wait for the pending jobs, then process the completions
+	void flush();
+
+	long size();
+	long count();
+
+	// Name of the data file of an identifier
+	static std::string fileName(const std::string & identifier);
+	// True for the names of data files (and of their temporary copies)
+	static bool isStoreFile(const std::string & name);
+};
+
+}
+
+#endif
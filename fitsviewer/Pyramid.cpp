@@ -0,0 +1,145 @@
+#include <string.h>
+#include <vector>
+
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+#include "PyramidStorage.h"
+#include "StripRenderer.h"
+
+std::string PyramidStorage::getBayer() const {
+	if (bayer[0] == 0) {
+		return "";
+	}
+	return std::string(bayer, 4);
+}
+
+bool PyramidStorage::hasColors() const {
+	return bayer[0] != 0;
+}
+
+int PyramidStorage::topLevel(int w, int h)
+{
+	int level = 1;
+	while(level < maxLevels && (((w - 1) >> level) >= tileSize || ((h - 1) >> level) >= tileSize)) {
+		level++;
+	}
+	return level;
+}
+
+long int PyramidStorage::requiredStorage(int w, int h)
+{
+	long int size = sizeof(PyramidStorage);
+	int levelCount = topLevel(w, h);
+	for(int level = 1; level <= levelCount; ++level) {
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		size += sizeof(uint16_t) * (long)w * h;
+	}
+	return size;
+}
+
+void PyramidStorage::init(int w, int h, const char * bayer)
+{
+	this->w = w;
+	this->h = h;
+	memcpy(this->bayer, bayer, 4);
+	levelCount = topLevel(w, h);
+	levels[0].w = w;
+	levels[0].h = h;
+	levels[0].offset = 0;
+	long offset = 0;
+	for(int level = 1; level <= levelCount; ++level) {
+		levels[level].w = (levels[level - 1].w + 1) / 2;
+		levels[level].h = (levels[level - 1].h + 1) / 2;
+		levels[level].offset = offset;
+		offset += (long)levels[level].w * levels[level].h;
+	}
+}
+
+void PyramidStorage::buildLevel(const RawDataStorage * source, int level, int y0, int y1)
+{
+	const uint16_t * from = level == 1 ? source->data : levelData(level - 1);
+	int sw = levels[level - 1].w;
+	int sh = levels[level - 1].h;
+	int dw = levels[level].w;
+	uint16_t * to = levelData(level);
+
+	// Distance between two samples of the same site
+	int step = hasColors() ? 2 : 1;
+
+	// Samples of other types are averaged at their levels
+	bool convertSamples = level == 1 && source->sampleType != RawDataStorage::UInt16;
+	std::vector<uint16_t> rows(convertSamples ? 2 * sw : 0);
+
+	for(int y = y0; y < y1; ++y) {
+		int sy = step == 2 ? 4 * (y >> 1) + (y & 1) : 2 * y;
+		const uint16_t * row0;
+		const uint16_t * row1;
+		if (convertSamples) {
+			source->readLevels((long)sy * sw, sw, rows.data());
+			row0 = rows.data();
+			row1 = nullptr;
+			if (sy + step < sh) {
+				source->readLevels((long)(sy + step) * sw, sw, rows.data() + sw);
+				row1 = rows.data() + sw;
+			}
+		} else {
+			row0 = from + (long)sy * sw;
+			row1 = sy + step < sh ? row0 + step * sw : nullptr;
+		}
+		uint16_t * out = to + (long)y * dw;
+		for(int x = 0; x < dw; ++x) {
+			int sx = step == 2 ? 4 * (x >> 1) + (x & 1) : 2 * x;
+			uint32_t sum = row0[sx];
+			int count = 1;
+			bool right = sx + step < sw;
+			if (right) {
+				sum += row0[sx + step];
+				count++;
+			}
+			if (row1) {
+				sum += row1[sx];
+				count++;
+				if (right) {
+					sum += row1[sx + step];
+					count++;
+				}
+			}
+			out[x] = count == 4 ? (sum + 2) >> 2 : (sum + count / 2) / count;
+		}
+	}
+}
+
+void SharedCache::Messages::AduPyramid::produce(Entry * entry)
+{
+	ContentRequest sourceRequest;
+	sourceRequest.fitsContent = new RawContent(source);
+	EntryRef sourceEntry(entry->getServer()->getEntry(sourceRequest));
+	if (sourceEntry->hasError()) {
+		throw WorkerError(std::string("Source error : ") + sourceEntry->getErrorDetails());
+	}
+
+	RawDataStorage * rcs = (RawDataStorage*)sourceEntry->data();
+
+	entry->allocate(PyramidStorage::requiredStorage(rcs->w, rcs->h));
+	PyramidStorage * pyramid = (PyramidStorage*)entry->data();
+	pyramid->init(rcs->w, rcs->h, rcs->bayer);
+
+	// Each level depends on the previous one. Rows of a level are built concurrently
+	StripRenderer stripRenderer(StripRenderer::defaultThreadCount());
+	const int stripRows = 64;
+	for(int level = 1; level <= pyramid->levelCount; ++level) {
+		entry->checkCancelled();
+		int h = pyramid->levels[level].h;
+		stripRenderer.render((h + stripRows - 1) / stripRows, 0,
+			[&](int strip, uint8_t * unused) {
+				int y0 = strip * stripRows;
+				int y1 = y0 + stripRows < h ? y0 + stripRows : h;
+				pyramid->buildLevel(rcs, level, y0, y1);
+			},
+			[](int strip, uint8_t * unused) -> bool {
+				return true;
+			});
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef PYRAMIDSTORAGE_H
+#define PYRAMIDSTORAGE_H 1
+
+#include <stdint.h>
+#include <string>
+
+struct RawDataStorage;
+
+// Downsampled copies of an ADU plane, for tiled rendering.
+// Level n is 2^n times smaller than the original (level 0, not stored here).
+// Bayer data stay in bayer form: each site is the average of the 2x2 sites
+// of the same color in the previous level
+struct PyramidStorage {
+	// Size of a rendered tile, in output pixels
+	static const int tileSize = 256;
+	static const int maxLevels = 24;
+
+	struct Level {
+		int w, h;
+		long offset;
+	};
+
+	int w, h;		// Level 0
+	char bayer[4];
+	// Levels 1 to levelCount are available
+	int levelCount;
+	Level levels[maxLevels + 1];
+	uint16_t data[0];
+
+	std::string getBayer() const;
+	bool hasColors() const;
+
+	// Stored planes are level 1..levelCount
+	uint16_t * levelData(int level) {
+		return data + levels[level].offset;
+	}
+
+	// First level whose tiles cover the whole image
+	static int topLevel(int w, int h);
+	static long int requiredStorage(int w, int h);
+
+	void init(int w, int h, const char * bayer);
+
+	// Fill rows [y0, y1) of a level from the previous level
+	void buildLevel(const RawDataStorage * source, int level, int y0, int y1);
+};
+
+#endif
@@ -1,7 +1,21 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <vector>
+
 #include "FitsFile.h"
+#include "FitsPixels.h"
+#include "FitsHeaderStorage.h"
 #include "SharedCache.h"
 #include "SharedCacheServer.h"
 #include "RawDataStorage.h"
+#include "HistogramStorage.h"
+#include "StripRenderer.h"
 
 
 std::string RawDataStorage::getBayer() const {
@@ -19,6 +33,13 @@ void RawDataStorage::setSize(int w, int h)
 {
 	this->w = w;
 	this->h = h;
+	setSampleType(UInt16);
+}
+
+void RawDataStorage::setSampleType(SampleType type)
+{
+	sampleType = type;
+	levels = SampleLevels::identity();
 }
 
 void RawDataStorage::setBayer(const std::string & str)
@@ -33,24 +54,46 @@ void RawDataStorage::setBayer(const std::string & str)
 	}
 }
 
-long int RawDataStorage::requiredStorage(int w, int h)
+void RawDataStorage::readLevels(long offset, long count, uint16_t * to) const
 {
-	return sizeof(RawDataStorage) + (sizeof(uint16_t) * w * h);
+	switch(sampleType) {
+		case Int16:
+			levels.levels(samples<int16_t>() + offset, count, to);
+			return;
+		case Int32:
+			levels.levels(samples<int32_t>() + offset, count, to);
+			return;
+		case Float32:
+			levels.levels(samples<float>() + offset, count, to);
+			return;
+		case Float64:
+			levels.levels(samples<double>() + offset, count, to);
+			return;
+		default:
+			memcpy(to, data + offset, count * sizeof(uint16_t));
+			return;
+	}
 }
 
-static bool readKey(fitsfile * fptr, const std::string & key, std::string * o_value)
+int RawDataStorage::sampleSize(SampleType type)
 {
-	char comment[128];
-	char * value = NULL;
-	int status = 0;
-	fits_read_key_longstr(fptr, key.c_str(), &value, comment, &status);
-	// FIXME check of status == KEY_NO_EXIST
-	if (status > 0) return false;
-	if (value == NULL) return false;
-	(*o_value) = std::string(value);
-	free(value);
-	return true;
+	switch(type) {
+		case Int16:
+			return sizeof(int16_t);
+		case Int32:
+			return sizeof(int32_t);
+		case Float32:
+			return sizeof(float);
+		case Float64:
+			return sizeof(double);
+		default:
+			return sizeof(uint16_t);
+	}
+}
 
+long int RawDataStorage::requiredStorage(int w, int h, SampleType type)
+{
+	return sizeof(RawDataStorage) + ((long)sampleSize(type) * w * h);
 }
 
 int RawDataStorage::getRGBIndex(char c)
@@ -66,87 +109,388 @@ int RawDataStorage::getRGBIndex(char c)
 	return -1;
 }
 
-void SharedCache::Messages::RawContent::produce(Entry * entry)
+// Direct reads of the pixels of an uncompressed BITPIX=16, BZERO=32768 image,
+// the most common output of cameras. cfitsio is only used to locate them.
+// Rows are copied with pread rather than mapped: a capture file truncated or
+// rewritten while it is read is then an error of this production, not a SIGBUS
+// of the whole process
+class DirectDataUnit {
+	int fd;
+	off_t dataStart;
+	long rowSize;
+public:
+	DirectDataUnit() {
+		fd = -1;
+		dataStart = 0;
+		rowSize = 0;
+	}
+
+	~DirectDataUnit() {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	// False if the current HDU does not qualify (the caller then uses fits_read_pix)
+	bool open(fitsfile * fptr, const std::string & path, const FitsHeaderStorage & header);
+
+	// Big endian pixels of rows [y0, y0 + rows), in file order. Throws WorkerError
+	void read(int y0, int rows, uint8_t * buffer) const;
+};
+
+bool DirectDataUnit::open(fitsfile * fptr, const std::string & path, const FitsHeaderStorage & header)
 {
-	FitsFile file;
+	if (header.bitpix != SHORT_IMG || header.bzero != 32768 || header.bscale != 1) {
+		return false;
+	}
+
 	int status = 0;
-	int bitpix, naxis;
-	long naxes[2] = {1,1};
-	u_int16_t * data;
+	int compressed = fits_is_compressed_image(fptr, &status);
+	if (status || compressed) {
+		return false;
+	}
 
-	file.open(path.c_str());
-		if (!fits_get_img_param(file.fptr, 2, &bitpix, &naxis, naxes, &status) )
-		{
-			fprintf(stderr, "bitpix = %d\n", bitpix);
-			fprintf(stderr, "naxis = %d\n", naxis);
-		if (naxis != 2) {
-			fprintf(stderr, "unsupported axis count\n");
-		} else {
-			fprintf(stderr, "size=%ldx%ld\n", naxes[0], naxes[1]);
+	LONGLONG headStart, dataStart, dataEnd;
+	if (fits_get_hduaddrll(fptr, &headStart, &dataStart, &dataEnd, &status)) {
+		return false;
+	}
 
+	// cfitsio also reads compressed (.gz) files and extended file names: only read plain files
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	long size = 2L * header.w * header.h;
+	struct stat st;
+	char magic[6];
+	bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= dataStart + size
+				&& pread(fd, magic, 6, 0) == 6 && memcmp(magic, "SIMPLE", 6) == 0;
+	if (!ok) {
+		close(fd);
+		return false;
+	}
+	posix_fadvise(fd, dataStart, size, POSIX_FADV_SEQUENTIAL);
+	this->fd = fd;
+	this->dataStart = dataStart;
+	this->rowSize = 2L * header.w;
+	return true;
+}
+
+void DirectDataUnit::read(int y0, int rows, uint8_t * buffer) const
+{
+	long size = rowSize * rows;
+	off_t offset = dataStart + rowSize * y0;
+	long done = 0;
+	while(done < size) {
+		ssize_t got = pread(fd, buffer + done, size - done, offset + done);
+		if (got == -1 && errno == EINTR) {
+			continue;
 		}
+		if (got <= 0) {
+			throw SharedCache::WorkerError(got == 0 ? "File truncated while reading" : std::string("Read error: ") + strerror(errno));
+		}
+		done += got;
+	}
+}
+
+// FITSVIEWER_FUSED_HISTOGRAM=0 disables it
+static bool fusedHistogram()
+{
+	const char * env = getenv("FITSVIEWER_FUSED_HISTOGRAM");
+	return env == nullptr || std::string(env) != "0";
+}
+
+// Produce the histogram entry of the frame, unless someone else already did
+void SharedCache::Messages::RawContent::publishHistogram(Entry * entry, const HistogramCounts & counts)
+{
+	ContentRequest histogramRequest;
+	histogramRequest.histogram.build();
+	histogramRequest.histogram->source = *this;
 
-		int w = naxes[0];
-		int h = naxes[1];
+	Entry * histogramEntry = entry->getServer()->startProduction(histogramRequest);
+	if (histogramEntry == nullptr) {
+		return;
+	}
+	try {
+		counts.build([histogramEntry](long int size) {
+			histogramEntry->allocate(size);
+			return histogramEntry->data();
+		});
+		histogramEntry->produced();
+	} catch(const std::exception & e) {
+		histogramEntry->failed(e.what());
+	}
+	delete histogramEntry;
+}
 
-		int hdupos = 1;
-		int nkeys;
-		char card[FLEN_CARD];
-		std::string bayer = "";
-		std::string cardBAYERPAT;
-		for (; !status; hdupos++)  /* Main loop through each extension */
-		{
-			fits_get_hdrspace(file.fptr, &nkeys, NULL, &status); /* get # of keywords */
+// Rows converted (and counted) together
+static const int rowBlock = 64;
 
-			fprintf(stderr, "Header listing for HDU #%d:\n", hdupos);
+// Read the rows of the image HDU by bands. The tiles of compressed images
+// (fpack) are independent: bands of whole tile rows are then decoded
+// concurrently, each thread through its own cfitsio handle.
+class BandReader {
+	fitsfile * fptr;
+	const std::string & path;
+	const FitsHeaderStorage & header;
+	int bandRows;
+	int threadCount;
 
-			for (int ii = 1; ii <= nkeys; ii++) { /* Read and print each keywords */
+	std::mutex handleMutex;
+	// Idle handles opened for the helper threads
+	std::vector<fitsfile*> handles;
 
-				if (fits_read_record(file.fptr, ii, card, &status))break;
-				fprintf(stderr, "%s\n", card);
-			}
-			fprintf(stderr, "END\n\n");  /* terminate listing with END */
+	fitsfile * acquireHandle();
+	void releaseHandle(fitsfile * handle);
+	void readRows(fitsfile * from, int fitsType, uint8_t * target, int sampleSize, int y0, int y1);
+public:
+	BandReader(fitsfile * fptr, const std::string & path, const FitsHeaderStorage & header);
+	~BandReader();
 
-			if (readKey(file.fptr, "BAYERPAT", &bayer) && bayer.size() > 0) {
-				fprintf(stderr, "BAYER detected");
-			}
-			fits_movrel_hdu(file.fptr, 1, NULL, &status);  /* try to move to next HDU */
+	// Fill target with w * h samples of fitsType, and call done(y0, y1) for
+	// each band, in order, on the calling thread. Throws WorkerError, or what
+	// done throws (reading then stops)
+	void read(int fitsType, void * target, int sampleSize, const std::function<void(int y0, int y1)> & done);
+};
+
+BandReader::BandReader(fitsfile * fptr, const std::string & path, const FitsHeaderStorage & header)
+	: fptr(fptr), path(path), header(header)
+{
+	bandRows = rowBlock;
+	threadCount = 1;
+
+	int status = 0;
+	int compressed = fits_is_compressed_image(fptr, &status);
+	if (status || !compressed) {
+		return;
+	}
+	long tile[2] = {0, 0};
+	if (fits_get_tile_dim(fptr, 2, tile, &status) == 0 && tile[1] > 0) {
+		bandRows = ((rowBlock + tile[1] - 1) / tile[1]) * tile[1];
+	}
+	// Separate handles can only be used concurrently with a thread safe cfitsio
+	if (fits_is_reentrant()) {
+		threadCount = StripRenderer::defaultThreadCount();
+	}
+}
+
+BandReader::~BandReader()
+{
+	for(auto handle : handles) {
+		int status = 0;
+		fits_close_file(handle, &status);
+	}
+}
+
+fitsfile * BandReader::acquireHandle()
+{
+	{
+		std::lock_guard<std::mutex> lock(handleMutex);
+		if (!handles.empty()) {
+			fitsfile * result = handles.back();
+			handles.pop_back();
+			return result;
 		}
+	}
+	fitsfile * result = nullptr;
+	int status = 0;
+	if (fits_open_file(&result, path.c_str(), READONLY, &status)) {
+		FitsFile::throwFitsIOError(std::string("unable to open : ") + path, status);
+	}
+	if (fits_movabs_hdu(result, header.hdu, nullptr, &status)) {
+		fits_close_file(result, &status);
+		FitsFile::throwFitsIOError(path, status);
+	}
+	return result;
+}
 
-		status = 0;
-		if (bayer.size() > 0) {
-			if (bayer.size() != 4) {
-				fprintf(stderr, "Ignoring bayer pattern: %s\n", bayer.c_str());
-				bayer = "";
-			} else {
-				bool valid = true;
-				for(int i = 0; i < 4; ++i) {
-					if (RawDataStorage::getRGBIndex(bayer[i]) == -1) {
-						valid = false;
-						break;
-					}
+void BandReader::releaseHandle(fitsfile * handle)
+{
+	std::lock_guard<std::mutex> lock(handleMutex);
+	handles.push_back(handle);
+}
+
+void BandReader::readRows(fitsfile * from, int fitsType, uint8_t * target, int sampleSize, int y0, int y1)
+{
+	// cfitsio reads one coordinate per axis: cubes use their first plane
+	long fpixels[9] = {1, y0 + 1, 1, 1, 1, 1, 1, 1, 1};
+	long offset = (long)y0 * header.w;
+	int status = 0;
+	if (fits_read_pix(from, fitsType, fpixels, (long)header.w * (y1 - y0), NULL, target + offset * sampleSize, NULL, &status)) {
+		FitsFile::throwFitsIOError(path, status);
+	}
+}
+
+void BandReader::read(int fitsType, void * target, int sampleSize, const std::function<void(int y0, int y1)> & done)
+{
+	int h = header.h;
+	int bandCount = (h + bandRows - 1) / bandRows;
+	uint8_t * bytes = (uint8_t*)target;
+
+	if (threadCount <= 1) {
+		for(int band = 0; band < bandCount; ++band) {
+			int y0 = band * bandRows;
+			int y1 = y0 + bandRows < h ? y0 + bandRows : h;
+			readRows(fptr, fitsType, bytes, sampleSize, y0, y1);
+			done(y0, y1);
+		}
+		return;
+	}
+
+	// Producers must not throw: errors are reported by the consumer
+	std::vector<std::string> errors(bandCount);
+	std::string error;
+	StripRenderer stripRenderer(threadCount);
+	stripRenderer.render(bandCount, 0,
+		[&](int band, uint8_t * unused) {
+			int y0 = band * bandRows;
+			int y1 = y0 + bandRows < h ? y0 + bandRows : h;
+			try {
+				fitsfile * handle = acquireHandle();
+				try {
+					readRows(handle, fitsType, bytes, sampleSize, y0, y1);
+				} catch(...) {
+					releaseHandle(handle);
+					throw;
 				}
-				if (!valid) {
-					fprintf(stderr, "Ignoring bayer pattern: %s\n", bayer.c_str());
-					bayer = "";
+				releaseHandle(handle);
+			} catch(const std::exception & e) {
+				errors[band] = e.what();
+				if (errors[band].empty()) {
+					errors[band] = "decompression failed";
 				}
 			}
+		},
+		[&](int band, uint8_t * unused) -> bool {
+			if (!errors[band].empty()) {
+				error = errors[band];
+				return false;
+			}
+			int y0 = band * bandRows;
+			int y1 = y0 + bandRows < h ? y0 + bandRows : h;
+			done(y0, y1);
+			return true;
+		});
+	if (!error.empty()) {
+		throw SharedCache::WorkerError(error);
+	}
+}
+
+// Samples that are not unsigned 8/16 bits are kept in their own type
+static RawDataStorage::SampleType sampleType(int equivBitpix, int & fitsType)
+{
+	switch(equivBitpix) {
+		case BYTE_IMG:
+		case USHORT_IMG:
+			fitsType = TUSHORT;
+			return RawDataStorage::UInt16;
+		case SBYTE_IMG:
+		case SHORT_IMG:
+			fitsType = TSHORT;
+			return RawDataStorage::Int16;
+		case LONG_IMG:
+			fitsType = TINT;
+			return RawDataStorage::Int32;
+		case FLOAT_IMG:
+			fitsType = TFLOAT;
+			return RawDataStorage::Float32;
+		default:
+			// ULONG_IMG, LONGLONG_IMG, DOUBLE_IMG
+			fitsType = TDOUBLE;
+			return RawDataStorage::Float64;
+	}
+}
+
+// Read the samples in their own type, then fit the display levels to their range.
+// The histogram needs the levels: it is counted afterwards
+template<typename T> static void readSamples(SharedCache::Entry * entry, BandReader & reader, int fitsType, RawDataStorage * storage, HistogramCounts * counts)
+{
+	int w = storage->w;
+	int h = storage->h;
+	T * samples = storage->samples<T>();
+	SampleRange<T> range;
+	reader.read(fitsType, samples, sizeof(T), [&](int y0, int y1) {
+		entry->checkCancelled();
+		range.add(samples + (long)y0 * w, (long)w * (y1 - y0));
+	});
+	storage->levels = range.levels();
+
+	if (counts) {
+		for(int y = 0; y < h; y += rowBlock) {
+			entry->checkCancelled();
+			int rows = y + rowBlock < h ? rowBlock : h - y;
+			counts->addRows(samples + (long)y * w, storage->levels, w, y, y + rows);
 		}
+	}
+}
+
+void SharedCache::Messages::RawContent::produce(Entry * entry)
+{
+	FitsFile file;
+	file.open(path.c_str());
 
-		entry->allocate(RawDataStorage::requiredStorage(w, h));
-		RawDataStorage * storage = (RawDataStorage*)entry->data();
+	FitsHeaderStorage header;
+	header.read(file.fptr, path);
 
-		storage->setSize(w, h);
-		storage->setBayer(bayer);
+	int w = header.w;
+	int h = header.h;
 
-		long fpixels[2]= {1,1};
-		if (!fits_read_pix(file.fptr, TUSHORT, fpixels, naxes[0] * naxes[1], NULL, &storage->data, NULL, &status)) {
-			return;
-		} else {
-			FitsFile::throwFitsIOError(path, status);
+	int fitsType;
+	RawDataStorage::SampleType type = sampleType(header.equivBitpix, fitsType);
+
+	entry->allocate(RawDataStorage::requiredStorage(w, h, type));
+	RawDataStorage * storage = (RawDataStorage*)entry->data();
+
+	storage->setSize(w, h);
+	storage->setBayer(header.getBayer());
+	storage->setSampleType(type);
+
+	DirectDataUnit direct;
+	bool isDirect = direct.open(file.fptr, path, header);
+	bool fused = fusedHistogram();
+
+	// Count the histogram of each block of rows while it is still in cache
+	std::unique_ptr<HistogramCounts> counts(fused ? new HistogramCounts(storage) : nullptr);
+
+	if (isDirect) {
+		// Big endian rows of a block, converted while they are in cache
+		std::vector<uint8_t> raw(2L * w * rowBlock);
+		for(int y = 0; y < h; y += rowBlock) {
+			entry->checkCancelled();
+			int rows = y + rowBlock < h ? rowBlock : h - y;
+			uint16_t * block = storage->data + (long)y * w;
+			direct.read(y, rows, raw.data());
+			fitsUShortToAdu(raw.data(), block, (long)w * rows);
+			if (counts) {
+				counts->addRows(block, w, y, y + rows);
+			}
 		}
 	} else {
-		FitsFile::throwFitsIOError(path, status);
+		BandReader reader(file.fptr, path, header);
+		switch(type) {
+			case RawDataStorage::Int16:
+				readSamples<int16_t>(entry, reader, fitsType, storage, counts.get());
+				break;
+			case RawDataStorage::Int32:
+				readSamples<int32_t>(entry, reader, fitsType, storage, counts.get());
+				break;
+			case RawDataStorage::Float32:
+				readSamples<float>(entry, reader, fitsType, storage, counts.get());
+				break;
+			case RawDataStorage::Float64:
+				readSamples<double>(entry, reader, fitsType, storage, counts.get());
+				break;
+			default:
+				reader.read(TUSHORT, storage->data, sizeof(uint16_t), [&](int y0, int y1) {
+					entry->checkCancelled();
+					if (counts) {
+						counts->addRows(storage->data + (long)y0 * w, w, y0, y1);
+					}
+				});
+				break;
+		}
+	}
+	if (counts) {
+		publishHistogram(entry, *counts);
 	}
 }
-
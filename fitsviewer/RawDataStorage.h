@@ -1,20 +1,132 @@
 #ifndef RAWDATASTORAGE_H
 #define RAWDATASTORAGE_H 1
 
+#include <cstdint>
+#include <cmath>
+#include <limits>
 #include <string>
 
+// 16 bits display levels of the samples of a plane, for the histogram, the
+// lookup tables and the display planes (pyramid, debayer):
+// level = (value - zero) / scale, rounded and clamped. Blank (NaN) samples
+// are at level 0. uint16_t samples are their own level
+struct SampleLevels {
+	double zero, scale;
+
+	static SampleLevels identity() {
+		SampleLevels result = {0, 1};
+		return result;
+	}
+
+	template<typename T> uint16_t level(T v) const {
+		if (v != v) {
+			return 0;
+		}
+		double l = std::floor(((double)v - zero) * (1.0 / scale) + 0.5);
+		return l <= 0 ? 0 : l >= 65535 ? 65535 : (uint16_t)l;
+	}
+
+	uint16_t level(uint16_t v) const {
+		return v;
+	}
+
+	// Sample value of a level (or of a distance in levels, with zero = 0)
+	double value(double level) const {
+		return zero + level * scale;
+	}
+
+	template<typename T> void levels(const T * from, long count, uint16_t * to) const {
+		for(long i = 0; i < count; ++i) {
+			to[i] = level(from[i]);
+		}
+	}
+};
+
+// Extent of the samples of a plane, accumulated while it is read
+template<typename T> struct SampleRange {
+	bool any;
+	bool integral;
+	T min, max;
+
+	SampleRange() : any(false), integral(true), min(0), max(0) {}
+
+	void add(const T * data, long count) {
+		for(long i = 0; i < count; ++i) {
+			T v = data[i];
+			if (v != v) {
+				continue;
+			}
+			if (!any) {
+				min = v;
+				max = v;
+				any = true;
+			} else if (v < min) {
+				min = v;
+			} else if (v > max) {
+				max = v;
+			}
+			if (!std::numeric_limits<T>::is_integer && integral && (double)v != std::floor((double)v)) {
+				integral = false;
+			}
+		}
+	}
+
+	// Integers that fit in 16 bits keep exact levels (only shifted when negative).
+	// Other data are stretched over the 16 bits
+	SampleLevels levels() const {
+		SampleLevels result = SampleLevels::identity();
+		if (!any) {
+			return result;
+		}
+		double dmin = min, dmax = max;
+		if (integral && dmin >= 0 && dmax <= 65535) {
+			return result;
+		}
+		result.zero = dmin;
+		if (!integral || dmax - dmin > 65535) {
+			result.scale = (dmax - dmin) / 65535;
+		}
+		if (!(result.scale > 0)) {
+			result.scale = 1;
+		}
+		return result;
+	}
+};
+
 struct RawDataStorage {
+	// Type of the samples. 8 and 16 bits unsigned data are UInt16, other types
+	// keep the values read by cfitsio (after BZERO/BSCALE)
+	enum SampleType { UInt16, Int16, Int32, Float32, Float64 };
+
 	int w, h; 		// naxes[0], naxes[1]
 	char bayer[4];
+	int32_t sampleType;
+	// Identity for UInt16
+	SampleLevels levels;
+	// Samples, in rows. Other types than UInt16 are read through samples<T>()
 	uint16_t data[0];
 
 	// Empty for grayscale. pattern in the form RGGB otherwise
 	std::string getBayer() const;
 	bool hasColors() const;
 
+	// Also resets to UInt16 samples
 	void setSize(int w, int h);
 	void setBayer(const std::string & bayer);
+	void setSampleType(SampleType type);
+
+	template<typename T> T * samples() {
+		return (T*)data;
+	}
+
+	template<typename T> const T * samples() const {
+		return (const T*)data;
+	}
+
+	// Levels of count samples from offset, whatever their type
+	void readLevels(long offset, long count, uint16_t * to) const;
 
+	// UInt16 only
 	uint16_t getAdu(int x, int y) const {
 		return data[x + y * w];
 	}
@@ -23,7 +135,8 @@ struct RawDataStorage {
 		data[x + y * w] = adu;
 	}
 
-	static long int requiredStorage(int w, int h);
+	static int sampleSize(SampleType type);
+	static long int requiredStorage(int w, int h, SampleType type = UInt16);
 
 	static int getRGBIndex(char c);
 };
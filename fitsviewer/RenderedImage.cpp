@@ -0,0 +1,324 @@
+#include <math.h>
+#include <iostream>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+#include "HistogramStorage.h"
+#include "LookupTable.h"
+#include "ImageScaling.h"
+#include "StripRenderer.h"
+#include "JpegWriter.h"
+#include "PyramidStorage.h"
+#include "RgbDataStorage.h"
+
+// Stretch for a channel, with levels relative to its histogram
+static LookupTable * channelTable(HistogramStorage * histogramStorage, int channel, double low, double med, double high)
+{
+	auto channelStorage = histogramStorage->channel(channel);
+	int lowAdu = channelStorage->getLevel(low);
+	int highAdu = channelStorage->getLevel(high);
+	int medAdu = round(lowAdu + (highAdu - lowAdu) * med);
+	return new LookupTable(lowAdu, medAdu, highAdu);
+}
+
+// Full resolution planes of a bayer image
+static SharedCache::EntryRef * getDebayered(SharedCache::Entry * entry, const SharedCache::Messages::RawContent & source, const std::string & method)
+{
+	SharedCache::Messages::ContentRequest rgbRequest;
+	rgbRequest.debayeredContent.build();
+	rgbRequest.debayeredContent->source = source;
+	rgbRequest.debayeredContent->method = method;
+	SharedCache::EntryRef * rgbEntry = new SharedCache::EntryRef(entry->getServer()->getEntry(rgbRequest));
+	if ((*rgbEntry)->hasError()) {
+		std::string details = (*rgbEntry)->getErrorDetails();
+		delete rgbEntry;
+		throw SharedCache::WorkerError(std::string("Debayer error : ") + details);
+	}
+	return rgbEntry;
+}
+
+static void storeJpeg(SharedCache::Entry * entry, const std::vector<uint8_t> & jpeg)
+{
+	entry->allocate(jpeg.size());
+	memcpy(entry->data(), jpeg.data(), jpeg.size());
+}
+
+// Render a jpeg of the ADU plane, stretched using the histogram levels.
+// Colour images at bin 0 are read from rgb
+static void renderJpeg(RawDataStorage * storage, RgbDataStorage * rgb, HistogramStorage * histogramStorage,
+						const SharedCache::Messages::RenderedImage & request,
+						std::vector<uint8_t> & jpeg)
+{
+	int bin = request.bin;
+	double low = request.low;
+	double med = request.med;
+	double high = request.high;
+
+	int w = storage->w;
+	int h = storage->h;
+	std::string bayer = storage->getBayer();
+
+	bool color = request.forceGreyscale ? false : bayer.length() > 0;
+
+	StripRenderer stripRenderer(StripRenderer::defaultThreadCount());
+	JpegWriter writer;
+	int channels = color ? 3 : 1;
+	writer.start(&jpeg, binDiv(w, bin), binDiv(h, bin), channels);
+
+	// Strips are scaled concurrently. Keep up to 32 output lines per strip,
+	// but use thinner strips when the result is too small to feed all threads
+	int stripLines = 32;
+	while(stripLines > 1 && binDiv(h, bin) < stripLines * 4 * stripRenderer.getThreadCount()) {
+		stripLines /= 2;
+	}
+	int stripHeight = stripLines << bin;
+	int stripCount = (h + stripHeight - 1) / stripHeight;
+	long stripSize = channels * binDiv(w, bin) * stripLines;
+
+	auto stripRows = [h, stripHeight](int strip) -> int {
+		int yleft = h - strip * stripHeight;
+		if (yleft > stripHeight) yleft = stripHeight;
+		return yleft;
+	};
+
+	// Samples of other types are rendered at their levels, converted by strip
+	auto stripData = [&](int strip, int rows, std::vector<uint16_t> & levels) -> uint16_t * {
+		long offset = (long)strip * stripHeight * w;
+		if (storage->sampleType == RawDataStorage::UInt16) {
+			return storage->data + offset;
+		}
+		levels.resize((long)rows * w);
+		storage->readLevels(offset, levels.size(), levels.data());
+		return levels.data();
+	};
+
+	StripRenderer::Consumer toJpeg = [&](int strip, uint8_t * result) -> bool {
+		writer.writeLines(result, binDiv(stripRows(strip), bin));
+		return true;
+	};
+
+	// do histogram for each channel !
+	if (color) {
+		std::unique_ptr<LookupTable> table_r(channelTable(histogramStorage, 0, low, med, high));
+		std::unique_ptr<LookupTable> table_g(channelTable(histogramStorage, 1, low, med, high));
+		std::unique_ptr<LookupTable> table_b(channelTable(histogramStorage, 2, low, med, high));
+
+		// Do: R, G, B
+		int8_t offset_r, second_r;
+		int8_t offset_g, second_g;
+		int8_t offset_b, second_b;
+		findBayerOffset(bayer, 'R', offset_r, second_r);
+		findBayerOffset(bayer, 'G', offset_g, second_g);
+		findBayerOffset(bayer, 'B', offset_b, second_b);
+
+		stripRenderer.render(stripCount, stripSize,
+			[&](int strip, uint8_t * result) {
+				if (bin == 0) {
+					long offset = (long)strip * stripHeight * w;
+					applyScaleRgb(rgb->plane(0) + offset, rgb->plane(1) + offset, rgb->plane(2) + offset, w, stripRows(strip),
+							*table_r, *table_g, *table_b,
+							result);
+					return;
+				}
+				std::vector<uint16_t> levels;
+				applyScaleBinBayer(stripData(strip, stripRows(strip), levels), w, stripRows(strip),
+						*table_r, bayerOffset(offset_r, w), bayerOffset(second_r, w),
+						*table_g, bayerOffset(offset_g, w), bayerOffset(second_g, w),
+						*table_b, bayerOffset(offset_b, w), bayerOffset(second_b, w),
+						result,
+						bin);
+			},
+			toJpeg);
+	} else {
+		std::unique_ptr<LookupTable> lookupTable(channelTable(histogramStorage, 0, low, med, high));
+
+		// faire le bin !
+		stripRenderer.render(stripCount, stripSize,
+			[&](int strip, uint8_t * result) {
+				std::vector<uint16_t> levels;
+				uint16_t * data = stripData(strip, stripRows(strip), levels);
+				if (bin > 0) {
+					applyScaleBin(data, w, stripRows(strip), *lookupTable, result, bin);
+				} else {
+					applyScale(data, w, stripRows(strip), *lookupTable, result);
+				}
+			},
+			toJpeg);
+	}
+	writer.finish();
+}
+
+void SharedCache::Messages::RenderedImage::produce(Entry * entry)
+{
+	ContentRequest sourceRequest;
+	sourceRequest.fitsContent = new RawContent(source);
+	EntryRef sourceEntry(entry->getServer()->getEntry(sourceRequest));
+	if (sourceEntry->hasError()) {
+		throw WorkerError(std::string("Source error : ") + sourceEntry->getErrorDetails());
+	}
+
+	ContentRequest histogramRequest;
+	histogramRequest.histogram.build();
+	histogramRequest.histogram->source = source;
+	EntryRef histogramEntry(entry->getServer()->getEntry(histogramRequest));
+	if (histogramEntry->hasError()) {
+		throw WorkerError(std::string("Histogram error : ") + histogramEntry->getErrorDetails());
+	}
+
+	RawDataStorage * storage = (RawDataStorage*)sourceEntry->data();
+	std::unique_ptr<EntryRef> rgbEntry;
+	if (bin == 0 && !forceGreyscale && storage->hasColors()) {
+		rgbEntry.reset(getDebayered(entry, source, debayer));
+	}
+	entry->checkCancelled();
+
+	std::vector<uint8_t> jpeg;
+	renderJpeg(storage, rgbEntry ? (RgbDataStorage*)(*rgbEntry)->data() : nullptr,
+				(HistogramStorage*)histogramEntry->data(), *this, jpeg);
+
+	storeJpeg(entry, jpeg);
+}
+
+// Copy a rectangle of a plane (so that kernels see a contiguous image)
+static void copyRegion(const uint16_t * plane, int planeW, int x0, int y0, int w, int h, std::vector<uint16_t> & region)
+{
+	region.resize((long)w * h);
+	for(int y = 0; y < h; ++y) {
+		memcpy(region.data() + (long)y * w, plane + (long)(y0 + y) * planeW + x0, w * sizeof(uint16_t));
+	}
+}
+
+// Same from the samples of the source, at their levels
+static void copyRegion(const RawDataStorage * storage, int x0, int y0, int w, int h, std::vector<uint16_t> & region)
+{
+	region.resize((long)w * h);
+	for(int y = 0; y < h; ++y) {
+		storage->readLevels((long)(y0 + y) * storage->w + x0, w, region.data() + (long)y * w);
+	}
+}
+
+void SharedCache::Messages::RenderedTile::produce(Entry * entry)
+{
+	ContentRequest sourceRequest;
+	sourceRequest.fitsContent = new RawContent(source);
+	EntryRef sourceEntry(entry->getServer()->getEntry(sourceRequest));
+	if (sourceEntry->hasError()) {
+		throw WorkerError(std::string("Source error : ") + sourceEntry->getErrorDetails());
+	}
+	RawDataStorage * storage = (RawDataStorage*)sourceEntry->data();
+
+	std::string bayer = storage->getBayer();
+	bool color = forceGreyscale ? false : bayer.length() > 0;
+
+	if (level < 0 || level > PyramidStorage::topLevel(storage->w, storage->h)) {
+		throw WorkerError("Invalid tile level");
+	}
+
+	// Bayer tiles are binned from the previous level, except full resolution ones which are debayered
+	int bin = color && level > 0 ? 1 : 0;
+	int plane = level - bin;
+
+	const uint16_t * planeData;
+	int planeW, planeH;
+	std::unique_ptr<EntryRef> planeEntry;
+	RgbDataStorage * rgb = nullptr;
+	if (color && level == 0) {
+		planeEntry.reset(getDebayered(entry, source, debayer));
+		rgb = (RgbDataStorage*)(*planeEntry)->data();
+		planeData = nullptr;
+		planeW = rgb->w;
+		planeH = rgb->h;
+	} else if (plane == 0) {
+		planeData = nullptr;
+		planeW = storage->w;
+		planeH = storage->h;
+	} else {
+		ContentRequest pyramidRequest;
+		pyramidRequest.aduPyramid.build();
+		pyramidRequest.aduPyramid->source = source;
+		planeEntry.reset(new EntryRef(entry->getServer()->getEntry(pyramidRequest)));
+		if ((*planeEntry)->hasError()) {
+			throw WorkerError(std::string("Pyramid error : ") + (*planeEntry)->getErrorDetails());
+		}
+		PyramidStorage * pyramid = (PyramidStorage*)(*planeEntry)->data();
+		planeData = pyramid->levelData(plane);
+		planeW = pyramid->levels[plane].w;
+		planeH = pyramid->levels[plane].h;
+	}
+
+	int regionSize = PyramidStorage::tileSize << bin;
+	int x0 = x * regionSize;
+	int y0 = y * regionSize;
+	if (x < 0 || y < 0 || x0 >= planeW || y0 >= planeH) {
+		throw WorkerError("Tile out of image");
+	}
+	int w = x0 + regionSize < planeW ? regionSize : planeW - x0;
+	int h = y0 + regionSize < planeH ? regionSize : planeH - y0;
+
+	ContentRequest histogramRequest;
+	histogramRequest.histogram.build();
+	histogramRequest.histogram->source = source;
+	EntryRef histogramEntry(entry->getServer()->getEntry(histogramRequest));
+	if (histogramEntry->hasError()) {
+		throw WorkerError(std::string("Histogram error : ") + histogramEntry->getErrorDetails());
+	}
+	HistogramStorage * histogramStorage = (HistogramStorage*)histogramEntry->data();
+	entry->checkCancelled();
+
+	// Only the pixels of the tile are read
+	std::vector<uint16_t> region;
+	if (planeData) {
+		copyRegion(planeData, planeW, x0, y0, w, h, region);
+	} else if (!rgb) {
+		copyRegion(storage, x0, y0, w, h, region);
+	}
+
+	int channels = color ? 3 : 1;
+	std::vector<uint8_t> result(channels * binDiv(w, bin) * binDiv(h, bin));
+	if (rgb) {
+		std::unique_ptr<LookupTable> table_r(channelTable(histogramStorage, 0, low, med, high));
+		std::unique_ptr<LookupTable> table_g(channelTable(histogramStorage, 1, low, med, high));
+		std::unique_ptr<LookupTable> table_b(channelTable(histogramStorage, 2, low, med, high));
+
+		std::vector<uint16_t> region_g, region_b;
+		copyRegion(rgb->plane(0), planeW, x0, y0, w, h, region);
+		copyRegion(rgb->plane(1), planeW, x0, y0, w, h, region_g);
+		copyRegion(rgb->plane(2), planeW, x0, y0, w, h, region_b);
+		applyScaleRgb(region.data(), region_g.data(), region_b.data(), w, h,
+				*table_r, *table_g, *table_b,
+				result.data());
+	} else if (color) {
+		std::unique_ptr<LookupTable> table_r(channelTable(histogramStorage, 0, low, med, high));
+		std::unique_ptr<LookupTable> table_g(channelTable(histogramStorage, 1, low, med, high));
+		std::unique_ptr<LookupTable> table_b(channelTable(histogramStorage, 2, low, med, high));
+
+		int8_t offset_r, second_r;
+		int8_t offset_g, second_g;
+		int8_t offset_b, second_b;
+		findBayerOffset(bayer, 'R', offset_r, second_r);
+		findBayerOffset(bayer, 'G', offset_g, second_g);
+		findBayerOffset(bayer, 'B', offset_b, second_b);
+
+		applyScaleBinBayer(region.data(), w, h,
+				*table_r, bayerOffset(offset_r, w), bayerOffset(second_r, w),
+				*table_g, bayerOffset(offset_g, w), bayerOffset(second_g, w),
+				*table_b, bayerOffset(offset_b, w), bayerOffset(second_b, w),
+				result.data(),
+				bin);
+	} else {
+		std::unique_ptr<LookupTable> lookupTable(channelTable(histogramStorage, 0, low, med, high));
+		applyScale(region.data(), w, h, *lookupTable, result.data());
+	}
+
+	std::vector<uint8_t> jpeg;
+	JpegWriter writer;
+	writer.start(&jpeg, binDiv(w, bin), binDiv(h, bin), channels);
+	writer.writeLines(result.data(), binDiv(h, bin));
+	writer.finish();
+
+	storeJpeg(entry, jpeg);
+}
@@ -0,0 +1,20 @@
+#ifndef RGBDATASTORAGE_H
+#define RGBDATASTORAGE_H 1
+
+#include <stdint.h>
+
+// Full resolution colour image, as three planes (R, G, B)
+struct RgbDataStorage {
+	int w, h;
+	uint16_t data[0];
+
+	uint16_t * plane(int channel) {
+		return data + (long)channel * w * h;
+	}
+
+	static long int requiredStorage(int w, int h) {
+		return sizeof(RgbDataStorage) + 3 * sizeof(uint16_t) * (long)w * h;
+	}
+};
+
+#endif
@@ -27,7 +27,7 @@ namespace SharedCache {
 	}
 
 
-	Entry::Entry(Cache * cache, const Messages::ContentResult & result):
+	Entry::Entry(Cache * cache, const Messages::ContentResult & result, int fd):
 			cache(cache),
 			filename(result.filename),
 			wasReady(true)
@@ -36,7 +36,7 @@ namespace SharedCache {
 		dataSize = 0;
 		wasMmapped = false;
 		released = false;
-		fd = -1;
+		this->fd = fd;
 		if (!result.error) {
 			error = false;
 			errorDetails = "";
@@ -47,7 +47,7 @@ namespace SharedCache {
 
 	}
 
-	Entry::Entry(Cache * cache, const Messages::WorkResponse & result):
+	Entry::Entry(Cache * cache, const Messages::WorkResponse & result, int fd):
 						cache(cache),
 						filename(result.filename),
 						wasReady(false),
@@ -57,7 +57,7 @@ namespace SharedCache {
 		dataSize = 0;
 		wasMmapped = false;
 		released = false;
-		fd = -1;
+		this->fd = fd;
 	}
 
 	Entry::~Entry()
@@ -74,15 +74,10 @@ namespace SharedCache {
 		return wasReady;
 	}
 
-	void Entry::open() {
-		if (fd != -1) {
-			return;
-		}
-		std::string path = cache->basePath  + filename;
-		fd = ::open(path.c_str(), O_CLOEXEC | (wasReady ? O_RDONLY : O_RDWR));
+	void Entry::checkFd() const {
 		if (fd == -1) {
-			perror(path.c_str());
-			throw std::runtime_error("Failed to open data file");
+			std::cerr << "No data file received for " << filename << "\n";
+			throw std::runtime_error("No data file");
 		}
 	}
 
@@ -90,7 +85,7 @@ namespace SharedCache {
 	{
 		assert(!wasReady);
 		assert(!wasMmapped);
-		open();
+		checkFd();
 		wasMmapped = true;
 		if (size) {
 			posix_fallocate(fd, 0, size);
@@ -100,13 +95,14 @@ namespace SharedCache {
 				std::cerr << "mmap of fd " << fd << " for " << filename << " failed\n";
 				throw std::runtime_error("Mmap failed");
 			}
+			cache->adviseMapping(mmapped, size);
 		}
 		dataSize = size;
 	}
 
 	void * Entry::data() {
 		if (!wasMmapped) {
-			open();
+			checkFd();
 			struct stat statbuf;
 			if (fstat(fd, &statbuf) == -1) {
 				perror("stat");
@@ -120,6 +116,7 @@ namespace SharedCache {
 					perror("mmap");
 					throw std::runtime_error("Mmap failed");
 				}
+				cache->adviseMapping(mmapped, dataSize);
 			}
 			wasMmapped = true;
 		}
@@ -137,6 +134,11 @@ namespace SharedCache {
 	}
 
 	void Entry::produced() {
+		// The server seals memfd entries against writes: no writable mapping may remain
+		if (wasMmapped && mmapped) {
+			munmap(mmapped, dataSize);
+			mmapped = nullptr;
+		}
 		Messages::Request request;
 		request.finishedAnnounce = new Messages::FinishedAnnounce();
 		request.finishedAnnounce->filename = filename;
@@ -158,7 +160,17 @@ namespace SharedCache {
 		released = true;
 	}
 
+	void Entry::checkCancelled() const {
+		if (cache->channel ? cache->channel->isCancelled() : SharedCacheServer::processCancelled) {
+			throw WorkerError("Cancelled");
+		}
+	}
+
 	void Entry::release() {
+		if (wasReady && error) {
+			released = true;
+			return;
+		}
 		Messages::Request request;
 		request.releasedAnnounce = new Messages::ReleasedAnnounce();
 		request.releasedAnnounce->filename = filename;
@@ -166,10 +178,114 @@ namespace SharedCache {
 		released = true;
 	}
 
-	Cache::Cache(const std::string & path, long maxSize) :
-				basePath(path)
+	CacheConfig::CacheConfig() :
+				path("/tmp/fitsviewer.cache"),
+				maxSize(128*1024*1024),
+				backing(File),
+				workerThreads(false),
+				cancelDelay(500),
+				persistentPath(""),
+				persistentMaxSize(1024L*1024*1024)
+	{
+	}
+
+	long CacheConfig::parseSize(const std::string & str)
+	{
+		size_t end = 0;
+		long result;
+		try {
+			result = std::stol(str, &end);
+		} catch(const std::exception & e) {
+			throw std::invalid_argument("invalid cache size: " + str);
+		}
+		std::string unit = str.substr(end);
+		if (unit == "k" || unit == "K") {
+			result *= 1024;
+		} else if (unit == "m" || unit == "M") {
+			result *= 1024 * 1024;
+		} else if (unit == "g" || unit == "G") {
+			result *= 1024L * 1024 * 1024;
+		} else if (unit != "") {
+			throw std::invalid_argument("invalid cache size: " + str);
+		}
+		if (result <= 0) {
+			throw std::invalid_argument("invalid cache size: " + str);
+		}
+		return result;
+	}
+
+	CacheConfig::Backing CacheConfig::parseBacking(const std::string & str)
+	{
+		if (str == "" || str == "file") {
+			return File;
+		}
+		if (str == "tmpfs") {
+			return Tmpfs;
+		}
+		if (str == "hugepages") {
+			return HugePages;
+		}
+		if (str == "memfd") {
+			return Memfd;
+		}
+		throw std::invalid_argument("invalid cache backing: " + str);
+	}
+
+	long CacheConfig::parseDelay(const std::string & str)
+	{
+		size_t end = 0;
+		long result;
+		try {
+			result = std::stol(str, &end);
+		} catch(const std::exception & e) {
+			throw std::invalid_argument("invalid cancel delay: " + str);
+		}
+		if (end != str.size() || result < 0) {
+			throw std::invalid_argument("invalid cancel delay: " + str);
+		}
+		return result;
+	}
+
+	CacheConfig CacheConfig::fromEnvironment()
+	{
+		CacheConfig result;
+		const char * env;
+		if ((env = getenv("FITSVIEWER_CACHE_BACKING"))) {
+			result.backing = parseBacking(env);
+		}
+		if (result.backing == Tmpfs || result.backing == HugePages) {
+			result.path = "/dev/shm/fitsviewer.cache";
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_DIR")) && env[0]) {
+			result.path = env;
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_SIZE")) && env[0]) {
+			result.maxSize = parseSize(env);
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_WORKERS")) && env[0]) {
+			std::string workers(env);
+			if (workers != "threads" && workers != "processes") {
+				throw std::invalid_argument("invalid cache workers: " + workers);
+			}
+			result.workerThreads = workers == "threads";
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_CANCEL_DELAY")) && env[0]) {
+			result.cancelDelay = parseDelay(env);
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_PERSIST_DIR")) && env[0]) {
+			result.persistentPath = env;
+		}
+		if ((env = getenv("FITSVIEWER_CACHE_PERSIST_SIZE")) && env[0]) {
+			result.persistentMaxSize = parseSize(env);
+		}
+		return result;
+	}
+
+	Cache::Cache(const CacheConfig & config) :
+				basePath(config.path),
+				channel(nullptr),
+				config(config)
 	{
-		this->maxSize = maxSize;
 		if (basePath.length() == 0 || basePath[0] != '/') {
 			throw std::runtime_error("invalide base path");
 		}
@@ -177,32 +293,69 @@ namespace SharedCache {
 		if (basePath[basePath.length() - 1] != '/') {
 			basePath += '/';
 		}
+		this->config.path = basePath;
 
 		init();
 	}
 
-	Cache::Cache(const std::string & path, long maxSize, int fd) :
-				basePath(path)
+	Cache::Cache(const CacheConfig & config, int fd) :
+				basePath(config.path),
+				channel(nullptr),
+				config(config)
 	{
-		this->maxSize = maxSize;
 		this->clientFd = fd;
 	}
 
-	Messages::Result Cache::clientSend(const Messages::Request & request)
+	Cache::Cache(const CacheConfig & config, LocalChannel * channel) :
+				basePath(config.path),
+				clientFd(-1),
+				channel(channel),
+				config(config)
+	{
+	}
+
+	void Cache::adviseMapping(void * addr, unsigned long int size) const
+	{
+		if (config.backing == CacheConfig::HugePages) {
+			// Only effective on tmpfs with shmem_enabled=advise (or within_size)
+			if (madvise(addr, size, MADV_HUGEPAGE) == -1) {
+				perror("madvise");
+			}
+		}
+	}
+
+	bool protocolDebug()
 	{
-		std::string str;
+		static bool result = getenv("FITSVIEWER_CACHE_DEBUG") != nullptr;
+		return result;
+	}
+
+	Messages::Result Cache::clientSend(const Messages::Request & request, int * fd)
+	{
+		if (channel) {
+			return channel->call(request, fd);
+		}
 		{
 			nlohmann::json j = request;
-			str = j.dump();
+			if (protocolDebug()) {
+				std::cerr << "Sending " << j.dump() << "\n";
+			}
+			clientSendMessage(nlohmann::json::to_msgpack(j));
 		}
-		std::cerr << "Sending " << str << "\n";
-		clientSendMessage(str.data(), str.length());
-		char buffer[SharedCache::MAX_MESSAGE_SIZE];
-		int sze = clientWaitMessage(buffer);
-		std::string received(buffer, sze);
-		std::cerr << "Received: " << received << "\n";
-		auto jsonResult = nlohmann::json::parse(received);
-		return jsonResult.get<Messages::Result>();
+		std::vector<uint8_t> buffer;
+		int receivedFd;
+		clientWaitMessage(buffer, receivedFd);
+		if (fd) {
+			*fd = receivedFd;
+		} else if (receivedFd != -1) {
+			close(receivedFd);
+		}
+		Messages::Result result;
+		Messages::fromMsgpack(buffer.data(), buffer.size(), result);
+		if (protocolDebug()) {
+			std::cerr << "Received: " << nlohmann::json(result).dump() << "\n";
+		}
+		return result;
 	}
 
 	Entry * Cache::getEntry(const Messages::ContentRequest & wanted)
@@ -210,8 +363,43 @@ namespace SharedCache {
 		Messages::Request request;
 		request.contentRequest = new Messages::ContentRequest(wanted);
 
-		Messages::Result r = clientSend(request);
-		return new Entry(this, *r.contentResult);
+		int fd;
+		Messages::Result r = clientSend(request, &fd);
+		if (!r.todoResult) {
+			return new Entry(this, *r.contentResult, fd);
+		}
+
+		// Worker thread, and nobody has it yet: produce it here
+		Entry * todo = new Entry(this, *r.todoResult, fd);
+		SharedCacheServer::produce(todo, *r.todoResult->content);
+		delete(todo);
+
+		Messages::Result produced = clientSend(request, &fd);
+		return new Entry(this, *produced.contentResult, fd);
+	}
+
+	void Cache::prefetch(const Messages::Prefetch & wanted)
+	{
+		Messages::Request request;
+		request.prefetch = new Messages::Prefetch(wanted);
+
+		clientSend(request);
+	}
+
+	Entry * Cache::startProduction(const Messages::ContentRequest & wanted)
+	{
+		Messages::Request request;
+		request.productionRequest = new Messages::ContentRequest(wanted);
+
+		int fd;
+		Messages::Result r = clientSend(request, &fd);
+		if (!r.todoResult) {
+			if (fd != -1) {
+				close(fd);
+			}
+			return nullptr;
+		}
+		return new Entry(this, *r.todoResult, fd);
 	}
 
 
@@ -236,69 +424,132 @@ namespace SharedCache {
 		return true;
 	}
 
-	void Cache::clientSendMessage(const void * data, int length)
+	// Transfer all the bytes, or throw
+	static void writeFully(int fd, const uint8_t * data, size_t length)
 	{
-		if (length > MAX_MESSAGE_SIZE - 2) {
-			throw std::runtime_error("Message too big");
-		}
-		uint16_t size = length + 2;
-		int wr = write(clientFd, &size, 2);
-		if (wr == -1) {
-			perror("write");
-			throw std::runtime_error("write");
-		}
-		if (wr < 2) {
-			throw std::runtime_error("short write");
+		while(length > 0) {
+			ssize_t wr = write(fd, data, length);
+			if (wr == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("write");
+				throw std::runtime_error("write");
+			}
+			data += wr;
+			length -= wr;
 		}
+	}
 
-		wr = write(clientFd, data, length);
-		if (wr == -1) {
-			perror("write");
-			throw std::runtime_error("write");
-		}
-		if (wr < length) {
-			throw std::runtime_error("short write");
+	static void readFully(int fd, uint8_t * data, size_t length)
+	{
+		while(length > 0) {
+			ssize_t rd = read(fd, data, length);
+			if (rd == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("read");
+				throw std::runtime_error("read");
+			}
+			if (rd == 0) {
+				throw std::runtime_error("short read");
+			}
+			data += rd;
+			length -= rd;
 		}
 	}
 
-	int Cache::clientWaitMessage(char * buffer)
+	// Read at least one byte, and the descriptor that comes with it (-1 if none)
+	static size_t readWithFd(int sock, uint8_t * data, size_t length, int & fd)
 	{
-		uint16_t size;
-		int readen = read(clientFd, &size, 2);
-		if (readen == -1) {
-			perror("read");
-			throw std::runtime_error("read");
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct iovec iov;
+		iov.iov_base = data;
+		iov.iov_len = length;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		ssize_t rd;
+		while((rd = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+			if (errno != EINTR) {
+				perror("recvmsg");
+				throw std::runtime_error("recvmsg");
+			}
 		}
-		if (readen < 2) {
+		if (rd == 0) {
 			throw std::runtime_error("short read");
 		}
-		if (size > MAX_MESSAGE_SIZE) {
-			throw std::runtime_error("invalid size");
+
+		fd = -1;
+		for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		if (msg.msg_flags & MSG_CTRUNC) {
+			if (fd != -1) {
+				close(fd);
+			}
+			throw std::runtime_error("descriptor lost");
 		}
-		readen = read(clientFd, buffer, size);
-		if (readen == -1) {
-			perror("read");
-			throw std::runtime_error("read");
+		return rd;
+	}
+
+	void Cache::clientSendMessage(const std::vector<uint8_t> & payload)
+	{
+		if (payload.size() > MAX_MESSAGE_SIZE) {
+			throw std::runtime_error("Message too big");
 		}
-		if (readen < size) {
-			throw std::runtime_error("short read");
+		uint32_t size = payload.size();
+		writeFully(clientFd, (const uint8_t*)&size, MESSAGE_HEADER_SIZE);
+		writeFully(clientFd, payload.data(), payload.size());
+	}
+
+	void Cache::clientWaitMessage(std::vector<uint8_t> & buffer, int & fd)
+	{
+		uint32_t size;
+		// The server attaches the descriptor to the first byte of the message
+		size_t got = readWithFd(clientFd, (uint8_t*)&size, MESSAGE_HEADER_SIZE, fd);
+		try {
+			readFully(clientFd, ((uint8_t*)&size) + got, MESSAGE_HEADER_SIZE - got);
+			if (size == 0 || size > MAX_MESSAGE_SIZE) {
+				throw std::runtime_error("invalid size");
+			}
+			buffer.resize(size);
+			readFully(clientFd, buffer.data(), size);
+		} catch(...) {
+			if (fd != -1) {
+				close(fd);
+			}
+			throw;
 		}
-		return size;
 	}
 
 	void Cache::setSockAddr(const std::string basePath, struct sockaddr_un & addr)
 	{
 		memset(&addr, 0, sizeof(addr));
 		addr.sun_family = AF_UNIX;
-		strncpy(addr.sun_path + 1, basePath.c_str(), sizeof(addr.sun_path)-2);
+		std::string name = basePath + "#" + std::to_string(PROTOCOL_VERSION);
+		strncpy(addr.sun_path + 1, name.c_str(), sizeof(addr.sun_path)-2);
 	}
 
 	void Cache::init()
 	{
-		int rslt = mkdir(basePath.c_str(), 0777);
-		if (rslt == -1 && errno != EEXIST) {
-			perror(basePath.c_str());
-			throw std::runtime_error("Unable to create cache directory");
+		// Memfd entries don't live in the directory: the path only names the socket
+		if (config.backing != CacheConfig::Memfd) {
+			int rslt = mkdir(basePath.c_str(), 0777);
+			if (rslt == -1 && errno != EEXIST) {
+				perror(basePath.c_str());
+				throw std::runtime_error("Unable to create cache directory");
+			}
 		}
 
 
@@ -307,7 +558,7 @@ namespace SharedCache {
 		}
 		for(int i = 0; i < 3; ++i) {
 			if (i > 0) usleep(5000);
-			(new SharedCacheServer(basePath, maxSize))->init();
+			(new SharedCacheServer(config))->init();
 			if (connectExisting()) {
 				return;
 			}
@@ -3,15 +3,27 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include <cstdint>
 #include "json.hpp"
 
+class HistogramCounts;
+
 // create a file in /tmp (0 size)
 // adjust its size
 // initialize the structure
 // create a semaphore
 // mark it ready
 namespace SharedCache {
-	const int MAX_MESSAGE_SIZE = 32768;
+	// Messages are MessagePack encoded, after their uint32_t payload length (host order)
+	const uint32_t MESSAGE_HEADER_SIZE = 4;
+	const uint32_t MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+	// Part of the server socket name: peers of different versions don't meet
+	const int PROTOCOL_VERSION = 3;
+
+	// Requests and results are logged (as json) when FITSVIEWER_CACHE_DEBUG is set
+	bool protocolDebug();
+
 	class Entry;
 
 	template<class M> class ChildPtr {
@@ -70,11 +82,23 @@ namespace SharedCache {
 		struct RawContent {
 			std::string path;
 
+			// Also publishes the Histogram entry, counted while decoding
 			void produce(Entry * entry);
+			void publishHistogram(Entry * entry, const HistogramCounts & counts);
 		};
 
 		void to_json(nlohmann::json&j, const RawContent & i);
-		void from_json(const nlohmann::json& j, RawContent & p);
+		template<class Json> void from_json(const Json & j, RawContent & p);
+
+		// The keywords of a fits that are needed before loading pixels (see FitsHeaderStorage)
+		struct FitsHeader {
+			std::string path;
+
+			void produce(Entry * entry);
+		};
+
+		void to_json(nlohmann::json&j, const FitsHeader & i);
+		template<class Json> void from_json(const Json & j, FitsHeader & p);
 
 		struct Histogram {
 			RawContent source;
@@ -82,7 +106,58 @@ namespace SharedCache {
 		};
 
 		void to_json(nlohmann::json&j, const Histogram & i);
-		void from_json(const nlohmann::json& j, Histogram & p);
+		template<class Json> void from_json(const Json & j, Histogram & p);
+
+		// A jpeg preview of a fits
+		struct RenderedImage {
+			RawContent source;
+			// This is a power of two of the actual bin (0 => 1x1)
+			int bin;
+			bool forceGreyscale;
+			// Levels, relative to the histogram
+			double low, med, high;
+			// Method for full resolution colour (see DebayeredContent)
+			std::string debayer;
+			void produce(Entry * entry);
+		};
+
+		void to_json(nlohmann::json&j, const RenderedImage & i);
+		template<class Json> void from_json(const Json & j, RenderedImage & p);
+
+		// Downsampled planes of a fits (see PyramidStorage)
+		struct AduPyramid {
+			RawContent source;
+			void produce(Entry * entry);
+		};
+
+		void to_json(nlohmann::json&j, const AduPyramid & i);
+		template<class Json> void from_json(const Json & j, AduPyramid & p);
+
+		// Full resolution RGB planes of a bayer fits (see RgbDataStorage)
+		struct DebayeredContent {
+			RawContent source;
+			// bilinear or edge (see Debayer)
+			std::string method;
+			void produce(Entry * entry);
+		};
+
+		void to_json(nlohmann::json&j, const DebayeredContent & i);
+		template<class Json> void from_json(const Json & j, DebayeredContent & p);
+
+		// A jpeg of PyramidStorage::tileSize pixels (less on the right/bottom edges)
+		struct RenderedTile {
+			RawContent source;
+			// The tile covers the pixels [x * tileSize << level, (x + 1) * tileSize << level)
+			int level;
+			int x, y;
+			bool forceGreyscale;
+			double low, med, high;
+			std::string debayer;
+			void produce(Entry * entry);
+		};
+
+		void to_json(nlohmann::json&j, const RenderedTile & i);
+		template<class Json> void from_json(const Json & j, RenderedTile & p);
 
 		struct StarOccurence {
 			double x, y;
@@ -99,7 +174,7 @@ namespace SharedCache {
 			void produce(Entry * entry);
 		};
 		void to_json(nlohmann::json&j, const StarField & i);
-		void from_json(const nlohmann::json& j, StarField & p);
+		template<class Json> void from_json(const Json & j, StarField & p);
 
 		struct StarFieldResult {
 			int width, height;
@@ -130,7 +205,7 @@ namespace SharedCache {
 			void produce(Entry * entry);
 		};
 		void to_json(nlohmann::json&j, const Astrometry & i);
-		void from_json(const nlohmann::json& j, Astrometry & p);
+		template<class Json> void from_json(const Json & j, Astrometry & p);
 
 		// These queries produce json output
 		struct JsonQuery {
@@ -139,39 +214,67 @@ namespace SharedCache {
 			void produce(Entry * entry);
 		};
 		void to_json(nlohmann::json&j, const JsonQuery & i);
-		void from_json(const nlohmann::json& j, JsonQuery & p);
+		template<class Json> void from_json(const Json & j, JsonQuery & p);
 
 		struct ContentRequest {
+			// Scheduling class: workers take the most urgent requests first.
+			// Not part of the cache key. Unspecified requests of workers (dependencies)
+			// inherit the class of what they produce, the others are interactive
+			enum Priority { Unspecified = -1, Interactive, Focus, Background };
+
 			ChildPtr<RawContent> fitsContent;
+			ChildPtr<FitsHeader> fitsHeader;
 			ChildPtr<Histogram> histogram;
+			ChildPtr<RenderedImage> renderedImage;
+			ChildPtr<AduPyramid> aduPyramid;
+			ChildPtr<DebayeredContent> debayeredContent;
+			ChildPtr<RenderedTile> renderedTile;
 			ChildPtr<JsonQuery> jsonQuery;
+			Priority priority;
+
+			ContentRequest() : priority(Unspecified) {}
+
+			// interactive, focus or background. Throws std::invalid_argument
+			static Priority parsePriority(const std::string & str);
+			static std::string priorityName(Priority priority);
+			// Class of the request, made by a worker that produces at producing
+			// (Unspecified for consumers). A worker never gets less urgent than its work
+			Priority effectivePriority(Priority producing) const;
 
+			// Producers that run external tools (astrometry) may crash: keep them
+			// in worker processes
+			bool needsIsolation() const;
+
+			// Without the priority (see SharedCacheServer::identify for the cache key)
 			std::string uniqKey() const
 			{
-				nlohmann::json debug = *this;
-				return debug.dump(0);
+				nlohmann::json key = *this;
+				key.erase("priority");
+				return key.dump(0);
 			}
 
 			void produce(Entry * entry);
 		};
 
 		void to_json(nlohmann::json&j, const ContentRequest & i);
-		void from_json(const nlohmann::json& j, ContentRequest & p);
+		template<class Json> void from_json(const Json & j, ContentRequest & p);
 
 		struct WorkRequest {
 		};
 
 		void to_json(nlohmann::json&j, const WorkRequest & i);
-		void from_json(const nlohmann::json& j, WorkRequest & p);
+		template<class Json> void from_json(const Json & j, WorkRequest & p);
 
 
+		// The data file of the entry comes along (SCM_RIGHTS)
 		struct WorkResponse {
 			ChildPtr<ContentRequest> content;
+			// Identifies the entry in the announces
 			std::string filename;
 		};
 
 		void to_json(nlohmann::json&j, const WorkResponse & i);
-		void from_json(const nlohmann::json& j, WorkResponse & p);
+		template<class Json> void from_json(const Json & j, WorkResponse & p);
 
 		struct FinishedAnnounce {
 			bool error;
@@ -181,26 +284,43 @@ namespace SharedCache {
 		};
 
 		void to_json(nlohmann::json&j, const FinishedAnnounce & i);
-		void from_json(const nlohmann::json& j, FinishedAnnounce & p);
+		template<class Json> void from_json(const Json & j, FinishedAnnounce & p);
 
 		struct ReleasedAnnounce {
 			std::string filename;
 		};
 
 		void to_json(nlohmann::json&j, const ReleasedAnnounce & i);
-		void from_json(const nlohmann::json& j, ReleasedAnnounce & p);
+		template<class Json> void from_json(const Json & j, ReleasedAnnounce & p);
+
+		// Load a new frame in the background, before anybody asks: its header,
+		// content and histogram, then optionally a preview (RenderedImage with
+		// default levels). Answered at once
+		struct Prefetch {
+			std::string path;
+			// Bin of the preview, -1 for none
+			int previewBin;
+		};
+
+		void to_json(nlohmann::json&j, const Prefetch & i);
+		template<class Json> void from_json(const Json & j, Prefetch & p);
 
 		struct Request {
 			ChildPtr<ContentRequest> contentRequest;
 			ChildPtr<WorkRequest> workRequest;
+			// A worker offers to produce a content as a by-product of its current work.
+			// Granted (with a todoResult) only if nobody has it yet
+			ChildPtr<ContentRequest> productionRequest;
 			ChildPtr<FinishedAnnounce> finishedAnnounce;
 			ChildPtr<ReleasedAnnounce> releasedAnnounce;
+			ChildPtr<Prefetch> prefetch;
 		};
 
 		void to_json(nlohmann::json&j, const Request & i);
-		void from_json(const nlohmann::json& j, Request & p);
+		template<class Json> void from_json(const Json & j, Request & p);
 
-		// Return a content key (a file).
+		// Return a content key. Unless in error, the data file of the entry
+		// comes along (SCM_RIGHTS): it has no path.
 		// if not ready, it is up to the caller to actually produce the content
 		struct ContentResult {
 			bool error;
@@ -209,7 +329,7 @@ namespace SharedCache {
 		};
 
 		void to_json(nlohmann::json&j, const ContentResult & i);
-		void from_json(const nlohmann::json& j, ContentResult & p);
+		template<class Json> void from_json(const Json & j, ContentResult & p);
 
 		struct Result {
 			ChildPtr<ContentResult> contentResult;
@@ -217,7 +337,12 @@ namespace SharedCache {
 		};
 
 		void to_json(nlohmann::json&j, const Result & i);
-		void from_json(const nlohmann::json& j, Result & p);
+		template<class Json> void from_json(const Json & j, Result & p);
+
+		// Decode a message straight from its MessagePack encoding, without a json document.
+		// The from_json above are shared with nlohmann::json
+		void fromMsgpack(const uint8_t * data, size_t size, Request & p);
+		void fromMsgpack(const uint8_t * data, size_t size, Result & p);
 
 	}
 
@@ -236,7 +361,44 @@ namespace SharedCache {
 		void operator=(const EntryRef & other) = delete;
 	};
 
+	// Location, size and backing of the cache, shared by all the processes using it.
+	// Read from the environment:
+	//   FITSVIEWER_CACHE_DIR      directory of the entries (also names the server socket)
+	//   FITSVIEWER_CACHE_SIZE     bytes, with an optional k, M or G suffix
+	//   FITSVIEWER_CACHE_BACKING  file (default), tmpfs, hugepages (tmpfs with
+	//                             transparent huge pages requested on the mappings),
+	//                             or memfd (sealed anonymous memory, no directory)
+	//   FITSVIEWER_CACHE_WORKERS  processes (default): each production runs in a forked worker,
+	//                             threads: a pool of worker threads in the server, one per core.
+	//                             Dependencies are produced by the thread that needs them.
+	//                             Isolated requests still go to worker processes
+	// Entries are anonymous files (O_TMPFILE or memfd): they vanish with their last
+	// descriptor, so nothing is left behind by a crash.
+	struct CacheConfig {
+		enum Backing { File, Tmpfs, HugePages, Memfd };
+
+		std::string path;
+		long maxSize;
+		Backing backing;
+		bool workerThreads;
+		// Milliseconds a production may stay unneeded before it is cancelled
+		long cancelDelay;
+		// Directory of the persistent tier, for evicted entries. Disabled if empty
+		std::string persistentPath;
+		long persistentMaxSize;
+
+		// /tmp/fitsviewer.cache, 128MB, File, worker processes, 500ms, no persistent tier (1GB)
+		CacheConfig();
+
+		// Throws std::invalid_argument for malformed values
+		static CacheConfig fromEnvironment();
+		static long parseSize(const std::string & str);
+		static Backing parseBacking(const std::string & str);
+		static long parseDelay(const std::string & str);
+	};
+
 	class Cache;
+	class LocalChannel;
 	class Entry {
 		friend class Cache;
 		friend class EntryRef;
@@ -255,9 +417,10 @@ namespace SharedCache {
 		// either one of produced/failed/release was already called
 		bool released;
 
-		Entry(Cache * cache, const Messages::ContentResult & result);
-		Entry(Cache * cache, const Messages::WorkResponse & tobuild);
-		void open();
+		// fd is the data file received with the result (owned by the entry)
+		Entry(Cache * cache, const Messages::ContentResult & result, int fd);
+		Entry(Cache * cache, const Messages::WorkResponse & tobuild, int fd);
+		void checkFd() const;
 	public:
 		~Entry();
 
@@ -270,6 +433,10 @@ namespace SharedCache {
 		void * data();
 		unsigned long int size();
 
+		// For producers, between steps: throws a WorkerError if the server
+		// cancelled the production
+		void checkCancelled() const;
+
 		bool hasError() const { return error; };
 		std::string getErrorDetails() const { return errorDetails; };
 
@@ -282,24 +449,39 @@ namespace SharedCache {
 		friend class SharedCacheServer;
 		std::string basePath;
 		int clientFd;
-		long maxSize;
+		// For worker threads: the server is reached in memory, not over clientFd
+		LocalChannel * channel;
+		CacheConfig config;
 
-		// Wait a message and returns its size
-		int clientWaitMessage(char * buffer);
-		void clientSendMessage(const void * data, int length);
-		Messages::Result clientSend(const Messages::Request & request);
+		// Wait a message and returns its payload, and the descriptor that came along (or -1)
+		void clientWaitMessage(std::vector<uint8_t> & buffer, int & fd);
+		void clientSendMessage(const std::vector<uint8_t> & payload);
+		// A received descriptor is returned in fd if not null, closed otherwise
+		Messages::Result clientSend(const Messages::Request & request, int * fd = nullptr);
 
 		// Try to connect
 		void init();
 		bool connectExisting();
 
-		Cache(const std::string & path, long maxSize, int fd);
+		Cache(const CacheConfig & config, int fd);
+		Cache(const CacheConfig & config, LocalChannel * channel);
+
+		// Apply the backing options to a fresh mapping of an entry
+		void adviseMapping(void * addr, unsigned long int size) const;
 
 	public:
-		Cache(const std::string & path, long maxSize);
+		Cache(const CacheConfig & config);
 
 		Entry * getEntry(const Messages::ContentRequest & wanted);
 
+		// Fire and forget: the server produces the entries at background priority
+		void prefetch(const Messages::Prefetch & wanted);
+
+		// For workers: take the production of another entry, if it is not known yet.
+		// Returns nullptr if it is already produced or being produced. Otherwise, the caller
+		// must call produced() or failed() on the entry.
+		Entry * startProduction(const Messages::ContentRequest & wanted);
+
 		static void setSockAddr(const std::string basePath, struct sockaddr_un & addr);
 	};
 }
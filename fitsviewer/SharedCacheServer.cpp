@@ -6,6 +6,8 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -13,16 +15,20 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <signal.h>
+#include <time.h>
 #include <assert.h>
 #include <iostream>
-#include <dirent.h>
+#include <thread>
 
+#include "fitsio.h"
 #include "SharedCacheServer.h"
 #include "SharedCacheServerClient.h"
+#include "StripRenderer.h"
 
 namespace SharedCache {
 
@@ -32,6 +38,13 @@ long now()
 	return nowCpt++;
 }
 
+long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 
 ClientError::ClientError(const std::string & msg) : std::runtime_error(msg) {}
 WorkerError::WorkerError(const std::string & msg) : std::runtime_error(msg) {}
@@ -42,46 +55,150 @@ WorkerError WorkerError::fromErrno(int fromErrno, const std::string & msg) {
 	return WorkerError(msg + ": " + std::string(errorMessage));
 }
 
-ClientFifo::ClientFifo(Getter getter, Setter setter) : setter(setter), getter(getter) {}
+ClientFifo::ClientFifo(Flag flag, Position position) : flag(flag), position(position) {}
 
 void ClientFifo::add(Client * c) {
-	if ((c->*getter)()) {
+	if (c->*flag) {
 		return;
 	}
-	(c->*setter)(true);
-	push_back(c);
+	c->*flag = true;
+	c->*position = insert(end(), c);
 }
 
 void ClientFifo::remove(Client * c) {
-	if (!(c->*getter)()) {
+	if (!(c->*flag)) {
 		return;
 	}
-	auto where = std::find(begin(), end(), c);
-	if (where != end()) {
-		erase(where);
-	}
-	(c->*setter)(false);
+	erase(c->*position);
+	c->*flag = false;
+}
+
+bool EvictionOrder::operator()(const CacheFileDesc * first, const CacheFileDesc * second) const
+{
+	return CacheFileDesc::compare_priority(first, second);
 }
 
 void Client::kill()
 {
-	if (killed) {
+	if (killed || (!channel && workerPid == -1)) {
 		return;
 	}
+	// Workers stop at the next checkpoint of their producer
 	killed = true;
-	::kill(-workerPid, SIGINT);
+	killedAt = nowMs();
+	if (channel) {
+		channel->cancelled = true;
+	} else {
+		::kill(workerPid, SIGUSR1);
+		long serial = this->serial;
+		SharedCacheServer * server = this->server;
+		Client * c = this;
+		server->schedule(server->config.cancelDelay, [server, c, serial]() { server->interruptIfStuck(c, serial); });
+	}
+	if (waitingConsumer) {
+		// Don't wait for a dependency that is now useless
+		server->stopWaiting(this);
+		Messages::Result result;
+		result.contentResult.build();
+		result.contentResult->error = true;
+		result.contentResult->errorDetails = "Cancelled";
+		reply(result);
+	}
+}
+
+LocalChannel::LocalChannel(SharedCacheServer * server) : server(server)
+{
+	client = nullptr;
+	result = nullptr;
+	closed = false;
+	resultFd = -1;
+	cancelled = false;
+}
+
+Messages::Result LocalChannel::call(const Messages::Request & request, int * fd)
+{
+	{
+		std::lock_guard<std::mutex> inboxLock(server->inboxLock);
+		server->inbox.push_back(std::make_pair(client, new Messages::Request(request)));
+	}
+	uint64_t one = 1;
+	if (write(server->wakeFd, &one, sizeof(one)) == -1) {
+		perror("eventfd write");
+	}
+
+	std::unique_lock<std::mutex> locked(lock);
+	cond.wait(locked, [this]() { return result || closed; });
+	if (!result) {
+		throw std::runtime_error("Worker thread dropped by the server");
+	}
+	Messages::Result r(*result);
+	delete(result);
+	result = nullptr;
+	if (fd) {
+		*fd = resultFd;
+	} else if (resultFd != -1) {
+		::close(resultFd);
+	}
+	resultFd = -1;
+	return r;
+}
+
+void LocalChannel::deliver(const Messages::Result & result, int fd)
+{
+	std::lock_guard<std::mutex> locked(lock);
+	this->result = new Messages::Result(result);
+	resultFd = -1;
+	if (fd != -1) {
+		resultFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (resultFd == -1) {
+			perror("dup");
+		}
+	}
+	cond.notify_one();
+}
+
+void LocalChannel::close()
+{
+	std::lock_guard<std::mutex> locked(lock);
+	closed = true;
+	cond.notify_one();
+}
+
+SharedCacheServer::Stats::Stats()
+{
+	hits = 0;
+	shared = 0;
+	misses = 0;
+	evictions = 0;
+	evictedSize = 0;
+	invalidations = 0;
+	prefetches = 0;
+	cancellations = 0;
+	resumed = 0;
+	spilled = 0;
+	restored = 0;
 }
 
-SharedCacheServer::SharedCacheServer(const std::string & path, long maxSize):
-			basePath(path),
-			maxSize(maxSize),
-			waitingWorkers(&Client::isWaitingWorker, &Client::setWaitingWorker),
-			waitingConsumers(&Client::isWaitingConsumer, &Client::setWaitingConsumer)
+SharedCacheServer::SharedCacheServer(const CacheConfig & config):
+			config(config),
+			basePath(config.path),
+			maxSize(config.maxSize),
+			waitingWorkers(&Client::waitingWorker, &Client::waitingWorkerPos)
 {
 	serverFd = -1;
+	epollFd = -1;
+	wakeFd = -1;
 	fileGenerator = 0;
+	clientSerial = 0;
+	dispatchNeeded = false;
+	isolatedPending = false;
+	blockedWorkers = 0;
+	prefetchesChanged = false;
 	startedWorkerCount = 0;
+	startingWorkers = 0;
 	currentSize = 0;
+	inflation = 0;
+	persistent = nullptr;
 }
 
 SharedCacheServer::~SharedCacheServer() {
@@ -90,31 +207,47 @@ SharedCacheServer::~SharedCacheServer() {
 		Client * c = *(it++);
 		c->destroy();
 	}
+	for(auto & r : requirements) {
+		delete(r.second);
+	}
 
 	for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end();)
 	{
 		CacheFileDesc* item = (it++)->second;
 		delete(item);
 	}
+	delete(persistent);
 }
 
 
 std::string SharedCacheServer::newFilename() {
-	std::string result;
+	std::ostringstream oss;
+	oss << "data" << std::setfill('0') << std::setw(12) << (fileGenerator++);
+	return oss.str();
+}
+
+int SharedCacheServer::newEntryFd() {
 	int fd;
-	do {
-		std::ostringstream oss;
-		oss << "data" << std::setfill('0') << std::setw(12) << (fileGenerator++);
-		result = oss.str();
-		std::string path = basePath + result;
-		fd = open(path.c_str(), O_CREAT | O_EXCL, 0600);
-		if (fd == -1 && errno != EEXIST) {
-			perror(path.c_str());
-			throw std::runtime_error("Failed to create data file");
-		}
-	} while(fd == -1);
-	close(fd);
-	return result;
+	if (config.backing == CacheConfig::Memfd) {
+		fd = memfd_create("fitsviewer.cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	} else {
+		fd = open(basePath.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	}
+	if (fd == -1) {
+		perror(basePath.c_str());
+		throw std::runtime_error("Failed to create data file");
+	}
+	return fd;
+}
+
+void SharedCacheServer::seal(CacheFileDesc * cfd) {
+	if (config.backing != CacheConfig::Memfd) {
+		return;
+	}
+	// Readers can't be hit by a truncation (SIGBUS) nor see the data change
+	if (fcntl(cfd->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		perror("F_ADD_SEALS");
+	}
 }
 
 void SharedCacheServer::init() {
@@ -201,41 +334,284 @@ static void handleErrno(const char * msg)
 
 void SharedCacheServer::doAccept()
 {
-	// Accept a new client
-	int fd;
-	if ((fd = accept(serverFd, 0, 0)) == -1) {
-		handleErrno("accept");
-		return;
+	// Accept all pending clients
+	while(true) {
+		int fd;
+		if ((fd = accept4(serverFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			handleErrno("accept");
+			return;
+		}
+
+		Client * c = new Client(this, fd, -1);
+		clients.insert(c);
+		watch(c);
+	}
+}
+
+void SharedCacheServer::watch(Client * c)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = c;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, c->fd, &event) == -1) {
+		perror("epoll_ctl");
+		throw std::runtime_error("Unable to watch client");
+	}
+}
+
+void SharedCacheServer::unwatch(Client * c)
+{
+	// Workers inherit the client sockets: registrations would survive the close
+	if (epollFd != -1 && epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr) == -1) {
+		perror("epoll_ctl");
+	}
+}
+
+void SharedCacheServer::serveReadyClients()
+{
+	while(!readyClients.empty()) {
+		Client * c = *readyClients.begin();
+		readyClients.erase(readyClients.begin());
+		serve(c);
+	}
+}
+
+// Idle clients don't keep the room of a large message beyond this
+static const size_t idleBufferSize = 65536;
+
+// The descriptor is attached to the first byte sent
+static int sendWithFd(int sock, const uint8_t * data, size_t length, int fd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov;
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+bool SharedCacheServer::flush(Client * c)
+{
+	while(c->writeBufferLeft) {
+		int wr;
+		if (c->writeFd != -1) {
+			wr = sendWithFd(c->fd, c->writeBuffer.data() + c->writeBufferPos, c->writeBufferLeft, c->writeFd);
+			if (wr > 0) {
+				close(c->writeFd);
+				c->writeFd = -1;
+			}
+		} else {
+			wr = write(c->fd, c->writeBuffer.data() + c->writeBufferPos, c->writeBufferLeft);
+		}
+		if (wr == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				// Wait for the next EPOLLOUT edge
+				c->writeReady = false;
+				return true;
+			}
+			c->release();
+			return false;
+		}
+		c->writeBufferPos += wr;
+		c->writeBufferLeft -= wr;
+	}
+	if (c->writeBuffer.capacity() > idleBufferSize) {
+		std::vector<uint8_t>().swap(c->writeBuffer);
+	}
+	c->readBufferPos = 0;
+	return true;
+}
+
+void SharedCacheServer::serve(Client * c)
+{
+	if (c->writeBufferLeft) {
+		if (!c->writeReady) {
+			return;
+		}
+		if (!flush(c) || c->writeBufferLeft) {
+			return;
+		}
+	}
+
+	// Read up to EAGAIN, as no other event will come for what is already there
+	while(c->readReady) {
+		// First the header, then exactly the payload it announces
+		uint32_t wanted = MESSAGE_HEADER_SIZE;
+		if (c->readBufferPos >= MESSAGE_HEADER_SIZE) {
+			uint32_t size;
+			memcpy(&size, c->readBuffer.data(), MESSAGE_HEADER_SIZE);
+			if (size == 0 || size > MAX_MESSAGE_SIZE) {
+				std::cerr << "Client " << c->fd << " sent invalid size\n";
+				c->release();
+				return;
+			}
+			wanted += size;
+			if (c->readBuffer.size() < wanted) {
+				c->readBuffer.resize(wanted);
+			}
+		}
+		int rd = read(c->fd, c->readBuffer.data() + c->readBufferPos, wanted - c->readBufferPos);
+		if (rd == -1) {
+			if (errno == EAGAIN) {
+				c->readReady = false;
+				return;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			c->release();
+			return;
+		}
+		if (rd == 0 || c->activeRequest) {
+			if (rd != 0) {
+				std::cerr << "Client " << c->fd << " sent too much data\n";
+			} else {
+				std::cerr << "Client " << c->fd << " terminated\n";
+			}
+			c->release();
+			return;
+		}
+		c->readBufferPos += rd;
+		if (c->readBufferPos < wanted || wanted == MESSAGE_HEADER_SIZE) {
+			continue;
+		}
+		// Process a message for the client.
+		try {
+			receiveMessage(c);
+		} catch(const std::exception& ex) {
+			std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
+			c->release();
+			return;
+		}
+		try {
+			proceedNewMessage(c);
+		} catch(const ClientError & ex) {
+			std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
+			c->release();
+			return;
+		}
+		if (clients.find(c) == clients.end()) {
+			// Killed worker that announced its end
+			return;
+		}
+		if (c->writeBufferLeft) {
+			// Immediate reply: sent when this client is served again, in this turn
+			return;
+		}
 	}
+}
+
+void SharedCacheServer::schedule(long delayMs, const std::function<void()> & callback)
+{
+	timers.insert(std::make_pair(nowMs() + delayMs, callback));
+}
 
-	clients.insert(new Client(this, fd, -1));
+int SharedCacheServer::runTimers()
+{
+	while(!timers.empty()) {
+		long delay = timers.begin()->first - nowMs();
+		if (delay > 0) {
+			return delay;
+		}
+		std::function<void()> callback = timers.begin()->second;
+		timers.erase(timers.begin());
+		callback();
+	}
+	return -1;
+}
+
+void SharedCacheServer::logStatsPeriodically()
+{
+	long requests = stats.hits + stats.shared + stats.misses;
+	if (requests) {
+		logStats();
+	}
+	schedule(60000, [this]() { logStatsPeriodically(); });
 }
 
-void SharedCacheServer::receiveMessage(Client * c, uint16_t size)
+void SharedCacheServer::receiveMessage(Client * c)
 {
-//		printf("Message from %d (%d):\n", c->fd, c->readBufferPos);
-	std::string jsonStr(c->readBuffer + 2, c->readBufferPos - 2);
-//		printf("%s\n", jsonStr.c_str());
+	// Decoded in place, after the header
 	c->readBufferPos = 0;
-	auto json = nlohmann::json::parse(jsonStr);
-	c->activeRequest = new Messages::Request(json.get<Messages::Request>());
+	c->activeRequest = new Messages::Request();
+	Messages::fromMsgpack(c->readBuffer.data() + MESSAGE_HEADER_SIZE, c->readBuffer.size() - MESSAGE_HEADER_SIZE, *c->activeRequest);
+	if (c->readBuffer.size() > idleBufferSize) {
+		std::vector<uint8_t>(MESSAGE_HEADER_SIZE).swap(c->readBuffer);
+	}
 
-	nlohmann::json debug = *c->activeRequest;
-	std::cerr << "Server received request from " << c->fd << " : " << debug.dump(0) << "\n";
+	if (protocolDebug()) {
+		std::cerr << "Server received request from " << c->fd << " : " << nlohmann::json(*c->activeRequest).dump(0) << "\n";
+	}
 }
 
 // Either proceed directly the message, or put the client in a waiting queue
 void SharedCacheServer::proceedNewMessage(Client * c)
 {
 	if (c->activeRequest->contentRequest) {
-		waitingConsumers.add(c);
+		c->activeKey = identify(*c->activeRequest->contentRequest);
+		auto existing = contentByIdentifier.find(c->activeKey);
+		bool restored = existing == contentByIdentifier.end() && restore(c->activeKey);
+		if (c->activeKey == c->producedInline) {
+			// Follows its own production, counted then
+		} else if (restored) {
+			stats.hits++;
+		} else if (existing == contentByIdentifier.end()) {
+			stats.misses++;
+		} else if (existing->second->produced || existing->second->error) {
+			stats.hits++;
+		} else {
+			stats.shared++;
+		}
+		c->producedInline.clear();
+		if (existing == contentByIdentifier.end() && !restored && c->channel
+				&& !c->activeRequest->contentRequest->needsIsolation())
+		{
+			// Worker thread: produce a missing dependency there, rather than
+			// waiting for another worker to take it. It asks again once done
+			c->producedInline = c->activeKey;
+			replyTodo(c, c->activeKey, *c->activeRequest->contentRequest);
+			return;
+		}
+		waitForContent(c);
 		return;
 	}
 	if (c->activeRequest->workRequest) {
-		if (c->workerPid == -1) {
-			throw new std::runtime_error("Client is not a worker");
+		if (!c->worker) {
+			throw ClientError("Client is not a worker");
+		}
+		if (c->starting) {
+			c->starting = false;
+			startingWorkers--;
 		}
 		waitingWorkers.add(c);
+		dispatchNeeded = true;
+		return;
+	}
+	if (c->activeRequest->productionRequest) {
+		if (!c->worker) {
+			throw ClientError("Client is not a worker");
+		}
+		std::string identifier = identify(*c->activeRequest->productionRequest);
+		if (contentByIdentifier.find(identifier) == contentByIdentifier.end() && !restore(identifier)) {
+			replyTodo(c, identifier, *c->activeRequest->productionRequest);
+		} else {
+			Messages::Result result;
+			c->reply(result);
+		}
 		return;
 	}
 
@@ -255,21 +631,30 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		}
 
 		c->producing.erase(cfdLocInProducing);
-		if (c->activeRequest->finishedAnnounce->error) {
-			cfd->prodFailed(c->activeRequest->finishedAnnounce->errorDetails);
+		if (c->activeRequest->finishedAnnounce->error && c->killed) {
+			productionAborted(cfd);
+		} else if (c->activeRequest->finishedAnnounce->error) {
+			productionFailed(cfd, c->activeRequest->finishedAnnounce->errorDetails);
 		} else {
-			cfd->produced = true;
-			cfd->size = c->activeRequest->finishedAnnounce->size;
-			cfd->lastUse = now();
-			currentSize += cfd->size;
+			productionDone(cfd, c->activeRequest->finishedAnnounce->size);
 		}
 		Messages::Result result;
 		c->reply(result);
-		if (c->killed) {
-			c->release();
+		if (c->killed && c->producing.empty()) {
+			// Stopped in time: ready for the next todo
+			c->killed = false;
+			if (c->channel) {
+				c->channel->cancelled = false;
+			}
 		}
 		return;
 	}
+	if (c->activeRequest->prefetch) {
+		addPrefetch(*c->activeRequest->prefetch);
+		Messages::Result result;
+		c->reply(result);
+		return;
+	}
 	if (c->activeRequest->releasedAnnounce) {
 		std::string filename = c->activeRequest->releasedAnnounce->filename;
 		auto cfdLoc = contentByFilename.find(filename);
@@ -286,7 +671,7 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		}
 
 		c->reading.erase(cfdLocInProducing);
-		cfd->clientCount--;
+		cfd->removeReader();
 		Messages::Result result;
 		c->reply(result);
 		return;
@@ -296,72 +681,449 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 
 
 
-class SharedCacheServer::RequirementEvaluator {
-	SharedCacheServer * server;
+SharedCacheServer::Requirement::Requirement(const Messages::ContentRequest & request):
+	request(request),
+	waiters(&Client::waitingConsumer, &Client::waitingConsumerPos)
+{
+	for(int & count : demand) {
+		count = 0;
+	}
+}
 
-	std::set<std::string> dedup;
-	std::list<std::pair<Messages::ContentRequest, std::string>> requirements;
+SharedCacheServer::Priority SharedCacheServer::Requirement::priorityClass() const
+{
+	for(int priority = Messages::ContentRequest::Interactive; priority < Messages::ContentRequest::Background; ++priority) {
+		if (demand[priority]) {
+			return (Priority)priority;
+		}
+	}
+	return Messages::ContentRequest::Background;
+}
 
-public:
-	RequirementEvaluator(SharedCacheServer * server) : server(server) {}
+bool SharedCacheServer::Requirement::unrequired() const
+{
+	for(int count : demand) {
+		if (count) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	void markAsRequired(const Messages::ContentRequest & r, const std::string & key) {
-		if (!dedup.insert(key).second) {
-			return;
+void SharedCacheServer::waitForContent(Client * c)
+{
+	auto existing = contentByIdentifier.find(c->activeKey);
+	if (existing != contentByIdentifier.end() && (existing->second->produced || existing->second->error)) {
+		sendEntry(c, existing->second);
+		return;
+	}
+	c->waitClass = priorityOf(c, *c->activeRequest->contentRequest);
+	Requirement * r = addDemand(c->activeKey, *c->activeRequest->contentRequest, c->waitClass);
+	r->waiters.add(c);
+	if (c->worker) {
+		blockedWorkers++;
+	}
+}
+
+void SharedCacheServer::stopWaiting(Client * c)
+{
+	if (!c->waitingConsumer) {
+		return;
+	}
+	requirements[c->activeKey]->waiters.remove(c);
+	if (c->worker) {
+		blockedWorkers--;
+	}
+	removeDemand(c->activeKey, c->waitClass);
+}
+
+void SharedCacheServer::sendEntry(Client * c, CacheFileDesc * entry)
+{
+	Messages::Result resultMessage;
+	resultMessage.contentResult.build();
+	*resultMessage.contentResult = entry->toContentResult();
+
+	// Failed entries have no file to read nor release
+	if (!entry->error) {
+		entry->addReader();
+		c->reading.push_back(entry);
+		c->reply(resultMessage, entry->fd);
+	} else {
+		c->reply(resultMessage);
+	}
+}
+
+SharedCacheServer::Requirement * SharedCacheServer::addDemand(const std::string & key, const Messages::ContentRequest & request, Priority priority)
+{
+	Requirement *& r = requirements[key];
+	bool created = r == nullptr;
+	if (created) {
+		r = new Requirement(request);
+	}
+	Priority before = r->priorityClass();
+	r->demand[priority]++;
+
+	auto existing = contentByIdentifier.find(key);
+	if (existing != contentByIdentifier.end()) {
+		// In production: make it (and its dependencies) as urgent as its consumers
+		upgrade(existing->second, priority);
+		Client * producer = existing->second->producer;
+		if (created && producer && producer->unusedSince != -1) {
+			// Came back within the grace delay
+			stats.resumed++;
+			producer->unusedSince = -1;
+		}
+	} else if (created || priority < before) {
+		queue(key, r);
+	}
+	return r;
+}
+
+void SharedCacheServer::removeDemand(const std::string & key, Priority priority)
+{
+	auto it = requirements.find(key);
+	if (it == requirements.end()) {
+		return;
+	}
+	Requirement * r = it->second;
+	Priority before = r->priorityClass();
+	r->demand[priority]--;
+
+	auto existing = contentByIdentifier.find(key);
+	if (r->unrequired()) {
+		requirements.erase(it);
+		delete(r);
+		if (existing != contentByIdentifier.end()) {
+			productionUnneeded(existing->second);
+		}
+		return;
+	}
+	if (existing == contentByIdentifier.end() && r->priorityClass() != before) {
+		// Its position in the more urgent class is now stale
+		queue(key, r);
+	}
+}
+
+void SharedCacheServer::queue(const std::string & key, Requirement * r)
+{
+	pending[r->priorityClass()].push_back(key);
+	dispatchNeeded = true;
+	if (r->request.needsIsolation()) {
+		isolatedPending = true;
+	}
+}
+
+void SharedCacheServer::upgrade(CacheFileDesc * cfd, Priority priority)
+{
+	if (priority >= cfd->priorityClass) {
+		return;
+	}
+	cfd->priorityClass = priority;
+
+	Client * c = cfd->producer;
+	if (c == nullptr || !c->waitingConsumer) {
+		return;
+	}
+	Priority wanted = priorityOf(c, *c->activeRequest->contentRequest);
+	if (wanted < c->waitClass) {
+		// Added first, so that the requirement does not go away meanwhile
+		Priority previous = c->waitClass;
+		c->waitClass = wanted;
+		addDemand(c->activeKey, *c->activeRequest->contentRequest, wanted);
+		removeDemand(c->activeKey, previous);
+	}
+}
+
+void SharedCacheServer::replyTodo(Client * c, const std::string & identifier, const Messages::ContentRequest & request)
+{
+	CacheFileDesc * cfd = new CacheFileDesc(this, identifier, newFilename());
+	cfd->priorityClass = priorityOf(c, request);
+	startProduction(c, cfd);
+	auto required = requirements.find(identifier);
+	if (required != requirements.end()) {
+		// Consumers were waiting for a worker to take it
+		upgrade(cfd, required->second->priorityClass());
+	}
+	Messages::Result result;
+	result.todoResult.build();
+	result.todoResult->content = new Messages::ContentRequest(request);
+	result.todoResult->filename = cfd->filename;
+	c->reply(result, cfd->fd);
+}
+
+void SharedCacheServer::startProduction(Client * c, CacheFileDesc * cfd)
+{
+	if (c->producing.empty()) {
+		c->unusedSince = -1;
+	}
+	c->producing.push_back(cfd);
+	cfd->producer = c;
+}
+
+void SharedCacheServer::productionDone(CacheFileDesc * cfd, long size)
+{
+	cfd->producer = nullptr;
+	cfd->produced = true;
+	cfd->size = size;
+	cfd->lastUse = now();
+	cfd->prodDuration = nowMs() - cfd->prodStart;
+	cfd->updatePriority();
+	cfd->index();
+	seal(cfd);
+	currentSize += cfd->size;
+	completed(cfd);
+}
+
+void SharedCacheServer::productionFailed(CacheFileDesc * cfd, const std::string & message)
+{
+	cfd->producer = nullptr;
+	cfd->prodFailed(message);
+	completed(cfd);
+}
+
+void SharedCacheServer::productionAborted(CacheFileDesc * cfd)
+{
+	std::string key = cfd->identifier;
+	cfd->prodAborted();
+	auto required = requirements.find(key);
+	if (required != requirements.end()) {
+		queue(key, required->second);
+	}
+}
+
+void SharedCacheServer::completed(CacheFileDesc * cfd)
+{
+	auto it = requirements.find(cfd->identifier);
+	if (it == requirements.end()) {
+		return;
+	}
+	Requirement * r = it->second;
+	requirements.erase(it);
+	if (r->demand[Messages::ContentRequest::Background]) {
+		// Their demand goes with the requirement. They go on at the end of the turn
+		for(Prefetch & prefetch : prefetches) {
+			if (prefetch.required && prefetch.steps.front().second == cfd->identifier) {
+				prefetch.required = false;
+				prefetchesChanged = true;
+			}
 		}
-		requirements.push_back(std::pair<Messages::ContentRequest, std::string>(r, key));
 	}
+	while(!r->waiters.empty()) {
+		Client * c = r->waiters.front();
+		r->waiters.remove(c);
+		if (c->worker) {
+			blockedWorkers--;
+		}
+		sendEntry(c, cfd);
+	}
+	delete(r);
+}
 
-	bool required(const CacheFileDesc * cfd)
+void SharedCacheServer::productionUnneeded(CacheFileDesc * cfd)
+{
+	Client * c = cfd->producer;
+	if (c == nullptr || c->killed || c->unusedSince != -1 || isUsed(c)) {
+		return;
+	}
+	// Bursts of requests (like brightness changes) often come back to
+	// the same content: give them some time to reattach to this production
+	c->unusedSince = nowMs();
+	long serial = c->serial;
+	schedule(config.cancelDelay, [this, c, serial]() { checkCancel(c, serial); });
+}
+
+bool SharedCacheServer::isUsed(const Client * producer) const
+{
+	for(CacheFileDesc * cfd : producer->producing) {
+		if (requirements.find(cfd->identifier) != requirements.end()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void SharedCacheServer::checkCancel(Client * c, long serial)
+{
+	if (clients.find(c) == clients.end() || c->serial != serial) {
+		// Gone meanwhile
+		return;
+	}
+	if (c->killed || c->unusedSince == -1 || c->producing.empty()) {
+		return;
+	}
+	if (nowMs() - c->unusedSince < config.cancelDelay) {
+		// Reattached and left again: a later check is scheduled
+		return;
+	}
+	c->unusedSince = -1;
+	if (isUsed(c)) {
+		return;
+	}
+	stats.cancellations++;
+	c->kill();
+}
+
+void SharedCacheServer::interruptIfStuck(Client * c, long serial)
+{
+	if (clients.find(c) == clients.end() || c->serial != serial) {
+		return;
+	}
+	if (!c->killed || c->producing.empty() || nowMs() - c->killedAt < config.cancelDelay) {
+		return;
+	}
+	std::cerr << "Worker " << c->workerPid << " did not stop, interrupting it\n";
+	// With the programs it started (astrometry). Released when its socket closes
+	::kill(-c->workerPid, SIGINT);
+}
+
+void SharedCacheServer::dispatch()
+{
+	dispatchNeeded = false;
+
+	// The last idle worker of the pool is kept for interactive requests
+	// FIXME: check space is ok (ie don't start under low space condition)
+	int idlePoolWorkers = 0;
+	for(Client * c : waitingWorkers) {
+		if (isPoolWorker(c)) {
+			idlePoolWorkers++;
+		}
+	}
+	for(auto it = waitingWorkers.begin(); it != waitingWorkers.end();)
 	{
-		return (dedup.find(cfd->identifier) != dedup.end());
+		Client * c = (*it++);
+
+		bool reserved = isPoolWorker(c) && idlePoolWorkers <= 1;
+		CacheFileDesc * cfd = startFirst(c, reserved ? Messages::ContentRequest::Interactive : Messages::ContentRequest::Background);
+		if (cfd == nullptr) {
+			continue;
+		}
+		if (isPoolWorker(c)) {
+			idlePoolWorkers--;
+		}
+
+		Messages::Result resultMessage;
+		resultMessage.todoResult.build();
+		resultMessage.todoResult->content = new Messages::ContentRequest(requirements[cfd->identifier]->request);
+		resultMessage.todoResult->filename = cfd->filename;
+		waitingWorkers.remove(c);
+		startProduction(c, cfd);
+		c->reply(resultMessage, cfd->fd);
 	}
+	if (config.workerThreads && isolatedPending && !hasFreeWorkerProcess()) {
+		isolatedPending = hasIsolated();
+		if (isolatedPending) {
+			startWorker();
+		}
+	}
+
+	// don't allow too many idle workers (shrink back)
+	stopIdleWorkers();
+}
 
-	std::pair<CacheFileDesc *, Messages::ContentRequest> startFirst() {
-		while (!requirements.empty()) {
-			std::pair<Messages::ContentRequest, std::string> r = requirements.front();
-			requirements.pop_front();
-			auto exists = server->contentByIdentifier.find(r.second);
-			if (exists != server->contentByIdentifier.end()) {
-				// Already producing. Ingore.
+CacheFileDesc * SharedCacheServer::startFirst(const Client * worker, Priority lowest)
+{
+	for(int priority = Messages::ContentRequest::Interactive; priority <= lowest; ++priority) {
+		auto & list = pending[priority];
+		for(auto it = list.begin(); it != list.end();) {
+			auto required = requirements.find(*it);
+			if (required == requirements.end() || required->second->priorityClass() != priority
+					|| contentByIdentifier.find(*it) != contentByIdentifier.end())
+			{
+				// Not required anymore, moved to another class or already producing. Ignore.
+				it = list.erase(it);
+				continue;
+			}
+			if (!canProduce(worker, required->second->request)) {
+				++it;
 				continue;
 			}
-			return
-					std::pair<CacheFileDesc *, Messages::ContentRequest>(
-						new CacheFileDesc(server, r.second, server->newFilename()),
-						r.first);
+			list.erase(it);
+			CacheFileDesc * cfd = new CacheFileDesc(this, required->first, newFilename());
+			cfd->priorityClass = (Priority)priority;
+			return cfd;
 		}
-		return std::pair<CacheFileDesc *, Messages::ContentRequest>(nullptr, Messages::ContentRequest());
 	}
-};
+	return nullptr;
+}
+
+bool SharedCacheServer::hasIsolated() const
+{
+	for(auto & list : pending) {
+		for(auto & key : list) {
+			auto required = requirements.find(key);
+			if (required != requirements.end() && required->second->request.needsIsolation()
+					&& contentByIdentifier.find(key) == contentByIdentifier.end())
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool SharedCacheServer::produce(Entry * entry, Messages::ContentRequest & content)
+{
+	// FIXME: report errors
+	try {
+		content.produce(entry);
+
+		entry->produced();
+	} catch(WorkerError & e) {
+		entry->failed(e.what());
+	}catch(const std::exception& e) {
+		std::cerr << "Worker failed: "<< e.what() << "\n";
+		entry->failed(std::string("internal error:") + e.what());
+		return false;
+	}
+	return true;
+}
+
+volatile sig_atomic_t SharedCacheServer::processCancelled = 0;
+
+void SharedCacheServer::onCancelSignal(int signum)
+{
+	processCancelled = 1;
+}
 
 void SharedCacheServer::workerLogic(Cache * cache)
 {
+	if (!cache->channel) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = onCancelSignal;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		if (sigaction(SIGUSR1, &action, nullptr) == -1) {
+			perror("sigaction");
+		}
+	}
 	while(true) {
 		Messages::Request queryWork;
 		queryWork.workRequest.build();
 
-		Messages::Result work = cache->clientSend(queryWork);
+		int fd;
+		Messages::Result work = cache->clientSend(queryWork, &fd);
+		// A cancel signal is handled before the reply to the announce that raced with it
+		processCancelled = 0;
 
 		// Create an entry object out of work
-		Entry * entry = new Entry(cache, *work.todoResult);
+		Entry * entry = new Entry(cache, *work.todoResult, fd);
 
-		// FIXME: report errors
-		try {
-			work.todoResult->content->produce(entry);
-
-			entry->produced();
-		} catch(WorkerError & e) {
-			entry->failed(e.what());
-		}catch(const std::exception& e) {
-			std::cerr << "Worker dead: "<< e.what() << "\n";
-			entry->failed(std::string("internal error:") + e.what());
+		bool ok = produce(entry, *work.todoResult->content);
+		delete(entry);
+		// A process may be left in a bad state. Threads have to go on
+		if (!ok && !cache->channel) {
+			std::cerr << "Worker dead\n";
 			_exit(255);
 		}
-		delete(entry);
 	}
 }
 
+bool Messages::ContentRequest::needsIsolation() const
+{
+	return jsonQuery && jsonQuery->astrometry;
+}
+
 void Messages::JsonQuery::produce(Entry * entry)
 {
 	if (this->starField) {
@@ -385,10 +1147,30 @@ void Messages::ContentRequest::produce(Entry * entry)
 		this->fitsContent->produce(entry);
 		return;
 	}
+	if (this->fitsHeader) {
+		this->fitsHeader->produce(entry);
+		return;
+	}
 	if (this->histogram) {
 		this->histogram->produce(entry);
 		return;
 	}
+	if (this->renderedImage) {
+		this->renderedImage->produce(entry);
+		return;
+	}
+	if (this->aduPyramid) {
+		this->aduPyramid->produce(entry);
+		return;
+	}
+	if (this->debayeredContent) {
+		this->debayeredContent->produce(entry);
+		return;
+	}
+	if (this->renderedTile) {
+		this->renderedTile->produce(entry);
+		return;
+	}
 	if (this->jsonQuery) {
 		this->jsonQuery->produce(entry);
 		return;
@@ -432,9 +1214,23 @@ void SharedCacheServer::startWorker()
 		}
 		// FIXME: close all but fd[1]...
 		try {
-			Cache * clientCache = new Cache(basePath, maxSize, fd[1]);
-			// free all server
+			Cache * clientCache = new Cache(config, fd[1]);
+			// free all server. The epoll instance is shared with the server: leave it untouched
+			close(epollFd);
+			epollFd = -1;
+			if (wakeFd != -1) {
+				close(wakeFd);
+				wakeFd = -1;
+			}
+			// The worker threads were not forked: their channels are left as is
+			for(Client * c : clients) {
+				c->channel = nullptr;
+			}
+			// Neither was the thread of the persistent store
+			persistent = nullptr;
 			delete(this);
+			// Worker processes run one production at a time
+			StripRenderer::setThreadLimit(0);
 
 			// restore child process handling to default
 			signal(SIGCHLD, SIG_DFL);
@@ -476,279 +1272,520 @@ void SharedCacheServer::startWorker()
 
 	Client * worker = new Client(this, fd[0], pid);
 	worker->worker = true;
+	worker->starting = true;
+	startingWorkers++;
 	clients.insert(worker);
+	watch(worker);
 	std::cerr << "New worker started\n";
 	startedWorkerCount ++;
 }
 
-void SharedCacheServer::clearWorkingDirectory()
+void SharedCacheServer::startWorkerThreads()
 {
-	DIR* dir = opendir(basePath.c_str());
-	if (dir == nullptr) {
-		perror("opendir");
-		return;
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd == -1) {
+		perror("eventfd");
+		throw std::runtime_error("Unable to create eventfd");
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = this;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+		perror("epoll_ctl");
+		throw std::runtime_error("Unable to watch eventfd");
+	}
+
+	int count = std::thread::hardware_concurrency();
+	if (count < 2) {
+		count = 2;
 	}
-	dirent * entry;
-	while((entry = readdir(dir))) {
-		std::string name(entry->d_name);
-		if (name == "." || name == "..") {
+	// The pool already runs a production per core: productions use a single thread
+	StripRenderer::setThreadLimit(1);
+	for(int i = 0; i < count; ++i) {
+		LocalChannel * channel = new LocalChannel(this);
+		Client * c = new Client(this, -1, -1);
+		c->worker = true;
+		c->channel = channel;
+		channel->client = c;
+		clients.insert(c);
+
+		Cache * cache = new Cache(config, channel);
+		std::thread([cache]() {
+			try {
+				workerLogic(cache);
+			} catch(const std::exception & e) {
+				std::cerr << "Worker thread dead: " << e.what() << "\n";
+			}
+		}).detach();
+	}
+	std::cerr << count << " worker threads started\n";
+}
+
+void SharedCacheServer::receiveLocalMessages()
+{
+	uint64_t count;
+	if (read(wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("eventfd read");
+	}
+
+	std::list<std::pair<Client*, Messages::Request*>> received;
+	{
+		std::lock_guard<std::mutex> locked(inboxLock);
+		received.swap(inbox);
+	}
+	for(auto & message : received) {
+		Client * c = message.first;
+		if (clients.find(c) == clients.end() || c->activeRequest) {
+			// Dropped, its thread is told so by the channel
+			delete(message.second);
 			continue;
 		}
-		name = basePath + "/" + name;
-		if (unlink(name.c_str()) == -1) {
-			perror(name.c_str());
+		c->activeRequest = message.second;
+		if (protocolDebug()) {
+			std::cerr << "Server received request from thread : " << nlohmann::json(*c->activeRequest).dump(0) << "\n";
+		}
+		try {
+			proceedNewMessage(c);
+		} catch(const ClientError & ex) {
+			std::cerr << "Error on worker thread: "<< ex.what() << "\n";
+			c->release();
 		}
 	}
+}
 
-	closedir(dir);
+bool SharedCacheServer::canProduce(const Client * worker, const Messages::ContentRequest & request) const
+{
+	if (!config.workerThreads) {
+		return true;
+	}
+	return request.needsIsolation() == (worker->channel == nullptr);
 }
 
-void SharedCacheServer::evict(CacheFileDesc * item)
+bool SharedCacheServer::isPoolWorker(const Client * worker) const
 {
-	std::cerr << "Server evicts " << item->filename << " of size " << item->size << " used at " << item->lastUse << "\n";
-	currentSize -= item->size;
-	item->unlink();
-	delete(item);
+	return !config.workerThreads || worker->channel != nullptr;
 }
 
-void SharedCacheServer::server()
+Messages::ContentRequest::Priority SharedCacheServer::priorityOf(const Client * c, const Messages::ContentRequest & request) const
 {
-	clearWorkingDirectory();
+	Messages::ContentRequest::Priority producing = Messages::ContentRequest::Unspecified;
+	for(CacheFileDesc * cfd : c->producing) {
+		if (producing == Messages::ContentRequest::Unspecified || cfd->priorityClass < producing) {
+			producing = cfd->priorityClass;
+		}
+	}
+	return request.effectivePriority(producing);
+}
 
-	// Cleanup the directory
-	while(true) {
-		// Avoid deadlock: don't account waiting consumers
-		while(startedWorkerCount - waitingConsumers.size() < 2) {
-			startWorker();
+bool SharedCacheServer::hasFreeWorkerProcess() const
+{
+	if (startingWorkers) {
+		return true;
+	}
+	for(Client * c : waitingWorkers) {
+		if (c->workerPid != -1) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		// don't allow too many idle workers (shrink back)
-		while(waitingWorkers.size() > 2) {
-			// Kill some workers
-			(*waitingWorkers.begin())->release();
+void SharedCacheServer::stopIdleWorkers()
+{
+	std::vector<Client*> idle;
+	for(Client * c : waitingWorkers) {
+		if (c->workerPid != -1) {
+			idle.push_back(c);
 		}
+	}
+	for(size_t i = 2; i < idle.size(); ++i) {
+		idle[i - 2]->release();
+	}
+}
 
-		pollfd polls[clients.size() + 1];
+std::string SharedCacheServer::identify(const Messages::ContentRequest & request)
+{
+	nlohmann::json key = request;
+	key.erase("priority");
+	stampFiles(key);
+	return key.dump(0);
+}
 
-		pollfd * server;
-		int pollCount = 0;
+void SharedCacheServer::stampFiles(nlohmann::json & j)
+{
+	if (j.is_object()) {
+		auto path = j.find("path");
+		if (path != j.end() && path->is_string()) {
+			j["fileId"] = fileId(path->get<std::string>());
+		}
+	}
+	if (j.is_object() || j.is_array()) {
+		for(auto & child : j) {
+			stampFiles(child);
+		}
+	}
+}
 
-		server = polls + (pollCount++);
-		server->fd = serverFd;
-		server->events = POLLIN;
+std::string SharedCacheServer::fileId(const std::string & path)
+{
+	auto known = turnFileIds.find(path);
+	if (known != turnFileIds.end()) {
+		return known->second;
+	}
+	struct stat st;
+	std::string result;
+	if (stat(path.c_str(), &st) == 0) {
+		std::ostringstream oss;
+		oss << st.st_dev << ":" << st.st_ino << ":" << st.st_size << ":" << st.st_mtim.tv_sec << "." << std::setfill('0') << std::setw(9) << st.st_mtim.tv_nsec;
+		result = oss.str();
+	}
 
-		for(auto it = clients.begin(); it != clients.end();)
-		{
-			Client * c = *it;
-			it++;
+	auto previous = fileIds.find(path);
+	if (previous == fileIds.end()) {
+		fileIds[path] = result;
+	} else if (previous->second != result) {
+		std::string oldFileId = previous->second;
+		previous->second = result;
+		if (!oldFileId.empty()) {
+			invalidate(oldFileId);
+		}
+	}
+	turnFileIds[path] = result;
+	return result;
+}
 
-			c->poll = polls + (pollCount++);
-			c->poll->fd = c->fd;
-			if (c->writeBufferLeft) {
-				c->poll->events=POLLOUT|POLLIN;
-			} else {
-				c->poll->events=POLLIN;
-			}
+void SharedCacheServer::invalidate(const std::string & oldFileId)
+{
+	// Dependent entries (histogram, star field, ...) embed their source in their identifier
+	std::string token = "\"fileId\":\"" + oldFileId + "\"";
+	if (persistent) {
+		persistent->invalidate(token);
+	}
+	for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end();)
+	{
+		CacheFileDesc * cfd = (it++)->second;
+		if (cfd->clientCount || cfd->identifier.find(token) == std::string::npos) {
+			continue;
+		}
+		if (cfd->produced) {
+			std::cerr << "Server invalidates " << cfd->identifier << "\n";
+			stats.invalidations++;
+			evict(cfd);
+		} else if (cfd->error) {
+			delete(cfd);
 		}
+	}
+}
 
-		if (poll(polls, pollCount, 1000) == -1) {
-			perror("poll");
-			throw std::runtime_error("Unable to poll");
+bool SharedCacheServer::restore(const std::string & identifier)
+{
+	if (persistent == nullptr || !persistent->contains(identifier)) {
+		return false;
+	}
+	// In production, without producer, until the copy completes
+	CacheFileDesc * cfd = new CacheFileDesc(this, identifier, newFilename());
+	bool started = persistent->restore(identifier, cfd->fd, [this, cfd](bool ok, long size, long prodDuration) {
+		if (!ok) {
+			productionAborted(cfd);
+			return;
 		}
+		stats.restored++;
+		cfd->produced = true;
+		cfd->size = size;
+		cfd->lastUse = now();
+		cfd->prodDuration = prodDuration;
+		cfd->updatePriority();
+		cfd->index();
+		seal(cfd);
+		currentSize += size;
+		completed(cfd);
+	});
+	if (!started) {
+		cfd->prodAborted();
+	}
+	return started;
+}
 
-		if (server->revents & POLLIN) {
-			doAccept();
+bool SharedCacheServer::isCurrent(const std::string & identifier)
+{
+	std::vector<nlohmann::json> todo;
+	try {
+		todo.push_back(nlohmann::json::parse(identifier));
+	} catch(const std::exception & e) {
+		return false;
+	}
+	while(!todo.empty()) {
+		nlohmann::json j = todo.back();
+		todo.pop_back();
+		if (j.is_object()) {
+			auto path = j.find("path");
+			auto id = j.find("fileId");
+			if (path != j.end() && path->is_string() && id != j.end()
+					&& (id->get<std::string>().empty() || fileId(path->get<std::string>()) != *id))
+			{
+				return false;
+			}
+		}
+		if (j.is_object() || j.is_array()) {
+			for(auto & child : j) {
+				todo.push_back(child);
+			}
 		}
+	}
+	return true;
+}
 
-		for(auto it = clients.begin(); it != clients.end();) {
-			Client * c = *it++;
-			if (!c->poll) {
-				continue;
+// Spills are saved after each batch, this is for the last use dates
+void SharedCacheServer::savePersistentPeriodically()
+{
+	persistent->save();
+	schedule(10000, [this]() { savePersistentPeriodically(); });
+}
+
+void SharedCacheServer::addPrefetch(const Messages::Prefetch & prefetch)
+{
+	stats.prefetches++;
+	PrefetchSteps steps;
+	Messages::ContentRequest step;
+	step.priority = Messages::ContentRequest::Background;
+
+	// In the order of the viewer: size first, then the pixels and their levels
+	step.fitsHeader.build();
+	step.fitsHeader->path = prefetch.path;
+	steps.push_back(std::make_pair(step, identify(step)));
+	step.fitsHeader.clear();
+
+	step.fitsContent.build();
+	step.fitsContent->path = prefetch.path;
+	steps.push_back(std::make_pair(step, identify(step)));
+	step.fitsContent.clear();
+
+	// Usually published with the content
+	step.histogram.build();
+	step.histogram->source.path = prefetch.path;
+	steps.push_back(std::make_pair(step, identify(step)));
+	step.histogram.clear();
+
+	if (prefetch.previewBin >= 0) {
+		// Same defaults as fitsviewer's RenderRequest
+		step.renderedImage.build();
+		step.renderedImage->source.path = prefetch.path;
+		step.renderedImage->bin = prefetch.previewBin;
+		step.renderedImage->forceGreyscale = false;
+		step.renderedImage->low = 0.05;
+		step.renderedImage->med = 0.5;
+		step.renderedImage->high = 0.95;
+		step.renderedImage->debayer = "bilinear";
+		steps.push_back(std::make_pair(step, identify(step)));
+	}
+
+	prefetches.push_back(Prefetch());
+	prefetches.back().steps.swap(steps);
+	prefetches.back().required = false;
+	prefetchesChanged = true;
+	if (prefetches.size() > maxPrefetches) {
+		// A burst of captures: the oldest frames are the least likely to be viewed
+		if (prefetches.front().required) {
+			removeDemand(prefetches.front().steps.front().second, Messages::ContentRequest::Background);
+		}
+		prefetches.pop_front();
+	}
+}
+
+void SharedCacheServer::advancePrefetches()
+{
+	prefetchesChanged = false;
+	for(auto it = prefetches.begin(); it != prefetches.end();) {
+		PrefetchSteps & steps = it->steps;
+		while(!steps.empty()) {
+			auto existing = contentByIdentifier.find(steps.front().second);
+			if (existing == contentByIdentifier.end() && restore(steps.front().second)) {
+				existing = contentByIdentifier.find(steps.front().second);
 			}
-			if (c->writeBufferLeft && (c->poll->revents & POLLOUT)) {
-				int wr = write(c->fd, c->writeBuffer + c->writeBufferPos, c->writeBufferLeft);
-				if (wr == -1) {
-					if (errno == EAGAIN || errno == EINTR) {
-						// Just ignore
-						continue;
-					} else {
-						c->release();
-						continue;
-					}
-				} else {
-					c->writeBufferLeft -= wr;
-					if (c->writeBufferLeft == 0) {
-						c->readBufferPos = 0;
-					}
-				}
-			} else if ((!c->writeBufferLeft) && (c->poll->revents & POLLIN)) {
-				int rd = read(c->fd, c->readBuffer + c->readBufferPos, MAX_MESSAGE_SIZE - c->readBufferPos);
-				if (rd == -1) {
-					if (errno == EAGAIN || errno == EINTR) {
-						// Just ignore
-						continue;
-					} else {
-						c->release();
-						continue;
-					}
-				} else if (rd == 0 || c->activeRequest) {
-					if (rd != 0) {
-						std::cerr << "Client " << c->fd << " sent too much data\n";
-					} else {
-						std::cerr << "Client " << c->fd << " terminated\n";
-					}
-					c->release();
-					continue;
-				} else {
-					// FIXME: read 0 ? possible ?
-					c->readBufferPos += rd;
-					if (c->readBufferPos > 2) {
-						uint16_t size = *(uint16_t*)c->readBuffer;
-						if (size >= MAX_MESSAGE_SIZE || size <= 2) {
-							c->release();
-							continue;
-						} else if (size >= c->readBufferPos){
-							// Process a message for the client.
-							try {
-								receiveMessage(c, size);
-
-							} catch(const std::exception& ex) {
-								std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
-								c->release();
-								continue;
-							}
-							try {
-								proceedNewMessage(c);
-							} catch(const ClientError & ex) {
-								std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
-								c->release();
-								continue;
-							}
-
-						} else if (c->readBufferPos == MAX_MESSAGE_SIZE) {
-							c->release();
-							continue;
-						}
-					}
-				}
+			if (existing == contentByIdentifier.end() || !(existing->second->produced || existing->second->error)) {
+				break;
 			}
+			steps.pop_front();
+		}
+		if (steps.empty()) {
+			it = prefetches.erase(it);
+			continue;
+		}
+		if (!it->required) {
+			it->required = true;
+			addDemand(steps.front().second, steps.front().first, Messages::ContentRequest::Background);
 		}
+		++it;
+	}
+}
 
-		RequirementEvaluator evaluator(this);
+void SharedCacheServer::logStats() const
+{
+	long requests = stats.hits + stats.shared + stats.misses;
+	std::cerr << "Cache stats: " << requests << " requests, "
+			<< stats.hits << " hits, " << stats.shared << " shared, " << stats.misses << " misses"
+			<< " (hit ratio " << (requests ? 100 * (stats.hits + stats.shared) / requests : 0) << "%), "
+			<< stats.evictions << " evictions (" << stats.evictedSize << " bytes), "
+			<< stats.invalidations << " invalidations, "
+			<< stats.prefetches << " prefetches, "
+			<< stats.cancellations << " cancellations (" << stats.resumed << " resumed), "
+			<< currentSize << "/" << maxSize << " bytes used";
+	if (persistent) {
+		std::cerr << ", " << stats.spilled << " spilled, " << stats.restored << " restored, "
+				<< persistent->count() << " entries (" << persistent->size() << " bytes) on disk";
+	}
+	std::cerr << "\n";
+}
 
-		// Distribute availables resources to waiting consumers
-		// Compute required resources, and their dependencies
-		// Distribute the first required resource to a worker
+void SharedCacheServer::evict(CacheFileDesc * item)
+{
+	std::cerr << "Server evicts " << item->filename << " of size " << item->size << " used at " << item->lastUse << " produced in " << item->prodDuration << "ms\n";
+	currentSize -= item->size;
+	item->unlink();
+	delete(item);
+}
 
-		for(auto it = waitingConsumers.begin(); it != waitingConsumers.end();)
-		{
-			Client * c = (*it++);
+void SharedCacheServer::server()
+{
+	std::cerr << "Cache in " << basePath << ", " << maxSize << " bytes\n";
+	if (config.backing == CacheConfig::Tmpfs || config.backing == CacheConfig::HugePages) {
+		struct statfs fs;
+		if (statfs(basePath.c_str(), &fs) == 0 && fs.f_type != TMPFS_MAGIC) {
+			std::cerr << "Warning: " << basePath << " is not on a tmpfs\n";
+		}
+	}
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1) {
+		perror("epoll_create1");
+		throw std::runtime_error("Unable to create epoll");
+	}
+	struct epoll_event serverEvent;
+	serverEvent.events = EPOLLIN;
+	serverEvent.data.ptr = nullptr;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverFd, &serverEvent) == -1) {
+		perror("epoll_ctl");
+		throw std::runtime_error("Unable to watch server socket");
+	}
+	logStatsPeriodically();
+
+	if (!config.persistentPath.empty()) {
+		persistent = new PersistentStore(config.persistentPath, config.persistentMaxSize);
+		persistent->load([this](const std::string & identifier) { return isCurrent(identifier); });
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = persistent;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, persistent->completionDescriptor(), &event) == -1) {
+			perror("epoll_ctl");
+			throw std::runtime_error("Unable to watch persistent cache");
+		}
+		savePersistentPeriodically();
+	}
 
-			std::string identifier = c->activeRequest->contentRequest->uniqKey();
+	if (config.workerThreads && !fits_is_reentrant()) {
+		std::cerr << "Warning: cfitsio is not reentrant, using worker processes\n";
+		config.workerThreads = false;
+	}
+	if (config.workerThreads) {
+		startWorkerThreads();
+	}
 
-			auto result = contentByIdentifier.find(identifier);
-			if (result == contentByIdentifier.end() || ((!result->second->produced) && (!result->second->error))) {
-				evaluator.markAsRequired(*(c->activeRequest->contentRequest), identifier);
-			} else {
-				CacheFileDesc * entry = result->second;
-				Messages::Result resultMessage;
-				resultMessage.contentResult.build();
-				*resultMessage.contentResult = entry->toContentResult();
-
-				waitingConsumers.remove(c);
-				entry->addReader();
-				c->reading.push_back(entry);
-				c->reply(resultMessage);
+	while(true) {
+		// Avoid deadlock: don't account workers that wait for a dependency.
+		// Worker threads start the worker processes on demand (see dispatch)
+		if (!config.workerThreads) {
+			while(startedWorkerCount - blockedWorkers < 2) {
+				startWorker();
 			}
 		}
 
-		ClientLoop: for(auto it = clients.begin(); it != clients.end();) {
-			Client * c = (*it++);
-			if (c->producing.empty()) {
-				continue;
+		int timeout = runTimers();
+		if (!readyClients.empty() || dispatchNeeded || prefetchesChanged) {
+			// Timers have things to do in this turn
+			timeout = 0;
+		}
+
+		struct epoll_event events[64];
+		int eventCount = epoll_wait(epollFd, events, 64, timeout);
+		if (eventCount == -1) {
+			if (errno != EINTR) {
+				perror("epoll_wait");
+				throw std::runtime_error("Unable to wait for events");
 			}
-			if (c->killed) {
+			eventCount = 0;
+		}
+
+		for(int i = 0; i < eventCount; ++i) {
+			if (events[i].data.ptr == this) {
+				receiveLocalMessages();
 				continue;
 			}
-
-			bool reallyUsed = false;
-			for(auto producingIt = c->producing.begin(); producingIt != c->producing.end();) {
-				CacheFileDesc * producing = (*producingIt++);
-
-				if (evaluator.required(producing)) {
-					reallyUsed = true;
-					break;
-				}
+			if (persistent && events[i].data.ptr == persistent) {
+				persistent->processCompletions();
+				continue;
 			}
-			if (reallyUsed) {
+			Client * c = (Client*)events[i].data.ptr;
+			if (c == nullptr) {
+				doAccept();
 				continue;
 			}
-			// FIXME: delay the kill call for some ms...
-			// (for the case of brightness burst requests)
-			c->kill();
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				c->readReady = true;
+			}
+			if (events[i].events & EPOLLOUT) {
+				c->writeReady = true;
+			}
+			readyClients.insert(c);
 		}
 
+		// The messages update the requirements and answer the consumers
+		// of what gets produced. Only what changed is looked at below
+		serveReadyClients();
 
+		while(prefetchesChanged) {
+			advancePrefetches();
+		}
 
-		// Distribute some works
-		// FIXME: check space is ok (ie don't start under low space condition)
-		for(auto it = waitingWorkers.begin(); it != waitingWorkers.end();)
-		{
-			Client * c = (*it++);
-
-			std::pair<CacheFileDesc *, Messages::ContentRequest> entry = evaluator.startFirst();
-			if (entry.first == nullptr) {
-				break;
-			}
-
-			Messages::Result resultMessage;
-			resultMessage.todoResult.build();
-			resultMessage.todoResult->content = new Messages::ContentRequest(entry.second);
-			resultMessage.todoResult->filename = entry.first->filename;
-			waitingWorkers.remove(c);
-			c->producing.push_back(entry.first);
-			c->reply(resultMessage);
+		if (dispatchNeeded) {
+			dispatch();
 		}
 
-		// Keep cache under its nominal size
 		if (currentSize > maxSize) {
-			long wanted = currentSize - maxSize;
-			std::cerr << "Out of space condition detected. current size is " << currentSize << "/" << maxSize << "\n";
+			evictSome();
+		}
 
-			std::list<CacheFileDesc *> removables;
-			long removableSize = 0;
-			for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end();)
-			{
-				CacheFileDesc * cfd = (it++)->second;
-				if (!cfd->produced) {
-					continue;
-				}
-				if (cfd->clientCount) {
-					continue;
-				}
-				if (evaluator.required(cfd)) {
-					// For the moment, do not drop entry that are required in the future
-					// FIXME: use a level to indidcate when it will be required, then fall back to drop them
-					continue;
-				}
-
-				removables.push_back(cfd);
-				removableSize += cfd->size;
-			}
+		// Send the replies of this turn
+		serveReadyClients();
+		turnFileIds.clear();
+	}
+}
 
-			if (removableSize >= wanted && removables.size() > 1) {
-				// Sort by last recent usage
-				removables.sort(CacheFileDesc::compare_last_use);
-			}
+void SharedCacheServer::evictSome()
+{
+	long wanted = currentSize - maxSize;
+	std::cerr << "Out of space condition detected. current size is " << currentSize << "/" << maxSize << "\n";
 
-			while(wanted > 0 && removables.size()) {
-				CacheFileDesc * item = removables.front();
-				removables.pop_front();
-				wanted -= item->size;
-				evict(item);
-			}
+	for(auto it = evictable.begin(); wanted > 0 && it != evictable.end();)
+	{
+		CacheFileDesc * item = *(it++);
+		if (requirements.find(item->identifier) != requirements.end()) {
+			// For the moment, do not drop entry that are required in the future
+			// FIXME: use a level to indidcate when it will be required, then fall back to drop them
+			continue;
 		}
 
+		wanted -= item->size;
+		if (item->priority > inflation) {
+			inflation = item->priority;
+		}
+		stats.evictions++;
+		stats.evictedSize += item->size;
+		// Written by the store thread, from a copy of the descriptor
+		if (persistent && persistent->store(item->identifier, item->fd, item->size, item->prodDuration)) {
+			stats.spilled++;
+		}
+		evict(item);
 	}
+	logStats();
 }
 } /* namespace SharedCache */
@@ -8,17 +8,25 @@
 #ifndef SHAREDCACHESERVER_H_
 #define SHAREDCACHESERVER_H_
 
+#include <signal.h>
 #include <string>
 #include <list>
 #include <set>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "json.hpp"
 #include "SharedCache.h"
+#include "PersistentStore.h"
 
 namespace SharedCache {
 
 
 class Client;
 class CacheFileDesc;
+class SharedCacheServer;
 
 class ClientError : public std::runtime_error {
 public:
@@ -32,61 +40,269 @@ public:
 	static WorkerError fromErrno(int errnoValue, const std::string & msg);
 };
 
+// Clients keep their position in the fifo, for constant time removal
 class ClientFifo : public std::list<Client*> {
-	typedef bool (Client::*Getter)() const;
-	typedef void (Client::*Setter)(bool value);
+public:
+	typedef bool Client::*Flag;
+	typedef std::list<Client*>::iterator Client::*Position;
 private:
-	Getter getter;
-	Setter setter;
+	Flag flag;
+	Position position;
 public:
-	ClientFifo(Getter getter, Setter setter);
+	ClientFifo(Flag flag, Position position);
 
 	void add(Client * c);
 	void remove(Client * c);
 };
 
+// In-process link between a worker thread and the server loop. Requests are queued
+// in the server inbox, results are handed back here
+class LocalChannel {
+	friend class SharedCacheServer;
+	friend class Client;
+
+	SharedCacheServer * server;
+	Client * client;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	bool closed;
+	// Deep copy of the pending result (ChildPtr assignment would share it)
+	Messages::Result * result;
+	int resultFd;
+	// Set by the server loop when the current productions are no more needed
+	std::atomic<bool> cancelled;
+
+	LocalChannel(SharedCacheServer * server);
+	// From the server loop. fd is dup'ed
+	void deliver(const Messages::Result & result, int fd);
+	// The server dropped the client
+	void close();
+public:
+	// From the worker thread
+	Messages::Result call(const Messages::Request & request, int * fd);
+	bool isCancelled() const { return cancelled; }
+};
+
+// Eviction order: lowest priority first, then least recently used
+struct EvictionOrder {
+	bool operator()(const CacheFileDesc * first, const CacheFileDesc * second) const;
+};
+
 class SharedCacheServer {
-	class RequirementEvaluator;
 	friend class Client;
 	friend class CacheFileDesc;
+	friend class LocalChannel;
+	friend class Entry;
+	friend class Cache;
 
-	std::map<std::string, CacheFileDesc*> contentByIdentifier;
-	std::map<std::string, CacheFileDesc*> contentByFilename;
+	std::unordered_map<std::string, CacheFileDesc*> contentByIdentifier;
+	std::unordered_map<std::string, CacheFileDesc*> contentByFilename;
+	// Produced entries without reader
+	std::set<CacheFileDesc*, EvictionOrder> evictable;
 
 	std::set<Client *> clients;
+	// Serial of the next client, to recognize it in timers
+	long clientSerial;
 	// Clients that are stuck in waitOrder state
 	ClientFifo waitingWorkers;
 
-	// Clients that awaits some resources
-	ClientFifo waitingConsumers;
+	typedef Messages::ContentRequest::Priority Priority;
+
+	// Content that consumers or prefetches wait for, and that is not produced yet.
+	// Maintained from the events, so that a turn only looks at what changed
+	struct Requirement {
+		Messages::ContentRequest request;
+		// Waiting consumers and prefetches, by class
+		int demand[Messages::ContentRequest::Background + 1];
+		// Clients to answer once produced
+		ClientFifo waiters;
+
+		Requirement(const Messages::ContentRequest & request);
+		// The most urgent class that waits for it
+		Priority priorityClass() const;
+		bool unrequired() const;
+	};
+	std::unordered_map<std::string, Requirement*> requirements;
+	// Keys to start, by class, in order of arrival. Checked when taken: the ones that
+	// were started, dropped or moved to another class are skipped there
+	std::list<std::string> pending[Messages::ContentRequest::Background + 1];
+	// New pending keys or idle workers since the last dispatch
+	bool dispatchNeeded;
+	// Some pending keys may need a worker process (thread mode)
+	bool isolatedPending;
+	// Workers waiting for a dependency
+	int blockedWorkers;
 
+	CacheConfig config;
 	// Starts and terminate with '/'
 	std::string basePath;
 	long maxSize;
 	long currentSize;
+	// GreedyDual-Size aging: priority of the last evicted entry
+	double inflation;
+
+	// Counters, logged periodically to check the sizing of the cache
+	struct Stats {
+		// Content requests served from a produced entry, an entry in production, or not found
+		long hits, shared, misses;
+		long evictions, evictedSize;
+		long invalidations;
+		long prefetches;
+		// Productions cancelled, and the ones needed again within the cancel delay
+		long cancellations, resumed;
+		// Entries written to the persistent tier, and read back from it
+		long spilled, restored;
+		Stats();
+	};
+	Stats stats;
+	void logStats() const;
 
 	int serverFd;
 	long fileGenerator;
 
+	// Edge triggered: clients are registered once, with their Client* as data
+	int epollFd;
+	// Clients with pending events (or output) to handle in this turn
+	std::set<Client *> readyClients;
+	// Callbacks by deadline (nowMs)
+	std::multimap<long, std::function<void()>> timers;
+
+	// Worker processes
 	int startedWorkerCount;
+	// Worker processes that did not ask for work yet
+	int startingWorkers;
+
+	// Requests of the worker threads, waiting for the server loop
+	std::mutex inboxLock;
+	std::list<std::pair<Client*, Messages::Request*>> inbox;
+	// eventfd, signaled when the inbox gets new requests
+	int wakeFd;
+
+	// Remaining steps of each prefetch, in order. Only the first one is
+	// required (at background priority), once the previous are produced
+	typedef std::list<std::pair<Messages::ContentRequest, std::string>> PrefetchSteps;
+	struct Prefetch {
+		PrefetchSteps steps;
+		// The first step has its demand registered
+		bool required;
+	};
+	std::list<Prefetch> prefetches;
+	static const size_t maxPrefetches = 16;
+	// Some prefetch steps may have been produced
+	bool prefetchesChanged;
+	void addPrefetch(const Messages::Prefetch & prefetch);
+	void advancePrefetches();
+
+	// Last seen identity of the files used by requests, by path
+	std::map<std::string, std::string> fileIds;
+	// The ones checked in this turn: a burst of requests stats each file once
+	std::unordered_map<std::string, std::string> turnFileIds;
+
+	// Evicted entries, kept on disk. nullptr if not configured
+	PersistentStore * persistent;
+	// Load the entry from the persistent tier, in the background. True if it is now
+	// in production: the waiters are answered when the copy completes
+	bool restore(const std::string & identifier);
+	// True if the files an identifier refers to are unchanged
+	bool isCurrent(const std::string & identifier);
+	void savePersistentPeriodically();
 
 	[[ noreturn ]] void server();
 	void evict(CacheFileDesc * item);
-	void clearWorkingDirectory();
-	void receiveMessage(Client * client, uint16_t size);
+	// Keep the cache under its nominal size
+	void evictSome();
+	void receiveMessage(Client * client);
+	void logStatsPeriodically();
 	// True if the client is no more blocked
 	void proceedNewMessage(Client * blocked);
 
-	bool checkWaitingConsumer(Client * blocked);
+	// Answer the content request of c, now or once produced
+	void waitForContent(Client * c);
+	void stopWaiting(Client * c);
+	void sendEntry(Client * c, CacheFileDesc * entry);
+	// Count a consumer (or prefetch) of the given class for key
+	Requirement * addDemand(const std::string & key, const Messages::ContentRequest & request, Priority priority);
+	void removeDemand(const std::string & key, Priority priority);
+	// Put a key without production in the queue of its class
+	void queue(const std::string & key, Requirement * r);
+	// A production and the dependencies of its producer get more urgent
+	void upgrade(CacheFileDesc * cfd, Priority priority);
+
+	void startProduction(Client * c, CacheFileDesc * cfd);
+	// Have c produce the content (a new entry) itself
+	void replyTodo(Client * c, const std::string & identifier, const Messages::ContentRequest & request);
+	void productionDone(CacheFileDesc * cfd, long size);
+	void productionFailed(CacheFileDesc * cfd, const std::string & message);
+	// Interrupted: not an error of the content. Produced again if still required
+	void productionAborted(CacheFileDesc * cfd);
+	// The entry is produced (or failed): answer the ones that wait for it
+	void completed(CacheFileDesc * cfd);
+	// Nobody waits for cfd anymore. Its producer is stopped after a grace delay
+	// if none of its productions is needed again
+	void productionUnneeded(CacheFileDesc * cfd);
+	bool isUsed(const Client * producer) const;
+	void checkCancel(Client * c, long serial);
+	// The worker process did not stop at a checkpoint: interrupt it
+	void interruptIfStuck(Client * c, long serial);
+
+	// Give the pending keys to the idle workers, most urgent first
+	void dispatch();
+	// The first pending key that the worker can take, most urgent class first,
+	// down to the given class
+	CacheFileDesc * startFirst(const Client * worker, Priority lowest);
+	// Are there pending keys for worker processes ?
+	bool hasIsolated() const;
 
 	void doAccept();
 	std::string newFilename();
+	// An anonymous file for a new entry (O_TMPFILE in basePath, or memfd)
+	int newEntryFd();
+	// Memfd entries become immutable once produced
+	void seal(CacheFileDesc * cfd);
+
+	void watch(Client * c);
+	void unwatch(Client * c);
+	// Read and write what is possible for ready clients (they may be released)
+	void serveReadyClients();
+	void serve(Client * c);
+	// Returns false if the client was released
+	bool flush(Client * c);
+
+	void schedule(long delayMs, const std::function<void()> & callback);
+	// Run expired timers, and return the epoll_wait timeout until the next one
+	int runTimers();
+
+	// Cache key of a request. Each file path it refers to is completed with
+	// the identity of the file, so rewritten files are not served from the cache
+	std::string identify(const Messages::ContentRequest & request);
+	void stampFiles(nlohmann::json & j);
+	// "dev:ino:size:mtime", empty if the file can't be stat'ed
+	std::string fileId(const std::string & path);
+	// Drop the idle entries built from an older version of a file
+	void invalidate(const std::string & oldFileId);
 
 	void startWorker();
+	void startWorkerThreads();
+	void receiveLocalMessages();
+	// Worker processes beyond two idle ones are stopped
+	void stopIdleWorkers();
+	// In thread mode, worker processes are for isolated requests only
+	bool canProduce(const Client * worker, const Messages::ContentRequest & request) const;
+	bool hasFreeWorkerProcess() const;
+	// Workers that serve all the classes (not the on-demand processes of thread mode)
+	bool isPoolWorker(const Client * worker) const;
+	// A worker's requests are as urgent as what it produces
+	Priority priorityOf(const Client * c, const Messages::ContentRequest & request) const;
 
+	// Produce the content and announce the outcome. False on internal errors
+	static bool produce(Entry * entry, Messages::ContentRequest & content);
 	static void workerLogic(Cache * cache);
+	// In worker processes, set by SIGUSR1 when the server cancels the current production
+	static volatile sig_atomic_t processCancelled;
+	static void onCancelSignal(int signum);
 public:
-	SharedCacheServer(const std::string & path, long maxSize);
+	SharedCacheServer(const CacheConfig & config);
 	virtual ~SharedCacheServer();
 
 	void init();
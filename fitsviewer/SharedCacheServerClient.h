@@ -3,22 +3,31 @@
 
 #include "SharedCacheServer.h"
 
-struct pollfd;
-
 namespace SharedCache {
 
 
 long now();
+// Wall clock, in milliseconds, for production durations
+long nowMs();
 
 // Instances are either ready or beein worked on
 class CacheFileDesc {
 	friend class SharedCacheServer;
 	friend class Client;
+	friend struct EvictionOrder;
 
 	SharedCacheServer * server;
 	long size;
+	// Milliseconds between the start of the production and its announce
 	long prodDuration;
+	long prodStart;
 	long lastUse;
+	// GreedyDual-Size: entries with the lowest priority are evicted first
+	double priority;
+	// Scheduling class of the production, inherited by its dependencies
+	Messages::ContentRequest::Priority priorityClass;
+	// While in production
+	Client * producer;
 
 	bool produced;
 	long clientCount;
@@ -27,17 +36,24 @@ class CacheFileDesc {
 	std::string errorDetails;
 
 	std::string identifier;
-	// Path, without the basePath.
+	// Name of the entry in the announces. Empty once the data are dropped
 	std::string filename;
+	// The anonymous data file, passed to the producer and the readers
+	int fd;
 
 	CacheFileDesc(SharedCacheServer * server, const std::string & identifier, const std::string & filename):
 		identifier(identifier),
 		filename(filename)
 	{
 		this->server = server;
+		fd = server->newEntryFd();
 		size = 0;
 		prodDuration = 0;
+		prodStart = nowMs();
 		lastUse = now();
+		priority = 0;
+		priorityClass = Messages::ContentRequest::Interactive;
+		producer = nullptr;
 		produced = false;
 		clientCount = 0;
 		error = false;
@@ -48,29 +64,57 @@ class CacheFileDesc {
 
 	~CacheFileDesc()
 	{
+		unindex();
 		server->contentByIdentifier.erase(identifier);
 		if (filename.size()) {
 			server->contentByFilename.erase(filename);
 		}
+		if (fd != -1) {
+			close(fd);
+		}
 	}
 
+	// The storage is freed when the last reader closes its descriptor
 	void unlink()
 	{
-		std::string path = server->basePath + filename;
-		if (::unlink(path.c_str()) == -1) {
-			perror(path.c_str());
+		unindex();
+		if (fd != -1) {
+			close(fd);
+			fd = -1;
 		}
 		server->contentByFilename.erase(filename);
 		filename = "";
 	}
 
 	void addReader() {
+		unindex();
 		clientCount++;
 		lastUse = now();
+		updatePriority();
 	}
 
 	void removeReader() {
 		clientCount--;
+		index();
+	}
+
+	// Expensive entries per byte are kept longer. The server inflation makes
+	// recently used entries win over old ones of the same cost.
+	// Not to be called while indexed (priority is the eviction key)
+	void updatePriority() {
+		double cost = 1 + prodDuration;
+		priority = server->inflation + cost / (size > 0 ? size : 1);
+	}
+
+	// Maintain server->evictable
+	void index() {
+		if (produced && clientCount == 0 && filename.size()) {
+			server->evictable.insert(this);
+		}
+	}
+
+	void unindex() {
+		server->evictable.erase(this);
 	}
 
 
@@ -97,9 +141,15 @@ class CacheFileDesc {
 		return r;
 	}
 
-	static bool compare_last_use (const CacheFileDesc * first, const CacheFileDesc * second)
+	static bool compare_priority (const CacheFileDesc * first, const CacheFileDesc * second)
 	{
-		return first->lastUse < second->lastUse;
+		if (first->priority != second->priority) {
+			return first->priority < second->priority;
+		}
+		if (first->lastUse != second->lastUse) {
+			return first->lastUse < second->lastUse;
+		}
+		return first < second;
 	}
 };
 
@@ -109,58 +159,88 @@ class Client {
 	friend class ClientFifo;
 
 	SharedCacheServer * server;
+	long serial;
 
 	// Is it waiting for a todo item
 	bool waitingWorker;
+	std::list<Client*>::iterator waitingWorkerPos;
 
-	// Is it waiting for a resource
+	// Is it waiting for a resource (in the waiters of its requirement)
 	bool waitingConsumer;
+	std::list<Client*>::iterator waitingConsumerPos;
+	// The class it is accounted in the demand of its requirement
+	Messages::ContentRequest::Priority waitClass;
 
 	int fd;
 	pid_t workerPid;
+	// Worker process that did not ask for work yet
+	bool starting;
+	// Worker threads have no socket (fd is -1)
+	LocalChannel * channel;
 
-	char * readBuffer;
-	int readBufferPos;
+	// Header and payload of the incoming message
+	std::vector<uint8_t> readBuffer;
+	uint32_t readBufferPos;
 
 	Messages::Request * activeRequest;
+	// Cache key of the active content request, computed once on reception
+	std::string activeKey;
+	// Worker threads: the content they were told to produce when they asked for it
+	std::string producedInline;
 	std::list<CacheFileDesc *> reading;
 	std::list<CacheFileDesc *> producing;
 
-	char * writeBuffer;
-	int writeBufferPos;
-	int writeBufferLeft;
+	std::vector<uint8_t> writeBuffer;
+	uint32_t writeBufferPos;
+	uint32_t writeBufferLeft;
+	// Descriptor to pass with the first byte of writeBuffer (a dup, owned here)
+	int writeFd;
 
 	bool worker;
 
-	pollfd * poll;
+	// Pending epoll events, not consumed yet
+	bool readReady;
+	bool writeReady;
 
-	// Set when a signal has been sent to client. The client will be closed at its next "finished" message
+	// Set when the client was told to stop its productions. It goes on with the next todo
+	// once it announced them. Worker processes that don't in time are interrupted
 	bool killed;
+	long killedAt;
+	// nowMs() when its productions stopped being required, -1 if they are
+	long unusedSince;
 
-	Client(SharedCacheServer * server, int fd, pid_t workerPid) :readBuffer(), writeBuffer() {
+	Client(SharedCacheServer * server, int fd, pid_t workerPid) :readBuffer(MESSAGE_HEADER_SIZE), writeBuffer() {
 		this->fd = fd;
 		this->server = server;
 		this->workerPid = workerPid;
-		poll = nullptr;
+		serial = server->clientSerial++;
+		starting = false;
+		channel = nullptr;
+		readReady = false;
+		writeReady = false;
 		activeRequest = nullptr;
 		writeBufferPos = 0;
 		writeBufferLeft = 0;
+		writeFd = -1;
 		readBufferPos = 0;
-		readBuffer = (char*)malloc(MAX_MESSAGE_SIZE);
-		writeBuffer = (char*)malloc(MAX_MESSAGE_SIZE);
 		waitingConsumer = false;
+		waitClass = Messages::ContentRequest::Background;
 		waitingWorker = false;
 		worker = false;
 		killed = false;
+		killedAt = 0;
+		unusedSince = -1;
 	}
 
 	void release() {
-		for(auto it = producing.begin(); it != producing.end(); ++it)
+		std::list<CacheFileDesc *> interrupted;
+		interrupted.swap(producing);
+		for(auto it = interrupted.begin(); it != interrupted.end(); ++it)
 		{
 			if (!killed) {
-				(*it)->prodFailed("generic worker error");
+				server->productionFailed(*it, "generic worker error");
 			} else {
-				(*it)->prodAborted();
+				server->productionAborted(*it);
 			}
 		}
 		this->destroy();
@@ -176,9 +256,18 @@ private:
 	~Client()
 	{
 		if (this->fd != -1) {
+			server->unwatch(this);
 			close(this->fd);
 			this->fd = -1;
 		}
+		if (writeFd != -1) {
+			close(writeFd);
+			writeFd = -1;
+		}
+		if (channel) {
+			channel->close();
+			channel = nullptr;
+		}
 		delete(activeRequest);
 		activeRequest = nullptr;
 
@@ -191,58 +280,72 @@ private:
 		producing.clear();
 
 		server->waitingWorkers.remove(this);
-		server->waitingConsumers.remove(this);
+		server->stopWaiting(this);
+		if (starting) {
+			server->startingWorkers--;
+		}
 
-		if (worker) {
+		if (worker && workerPid != -1) {
 			server->startedWorkerCount--;
-			worker = false;
 		}
+		worker = false;
 
 		server->clients.erase(this);
-
-		free(readBuffer);
-		free(writeBuffer);
+		server->readyClients.erase(this);
 	}
 public:
-	bool send(const std::string & str)
+	// fdToPass, if not -1, is sent along (SCM_RIGHTS). The caller keeps it
+	bool send(const std::vector<uint8_t> & payload, int fdToPass = -1)
 	{
-		unsigned long l = str.length();
-		if (l > MAX_MESSAGE_SIZE - 2) {
-			std::cerr << "Unable to send message : " << str << "\n";
+		uint32_t l = payload.size();
+		if (l > MAX_MESSAGE_SIZE) {
+			std::cerr << "Unable to send message of " << l << " bytes\n";
 			release();
 			return false;
 		} else {
-
-			*((uint16_t*)writeBuffer) = l;
-			memcpy(writeBuffer + 2, str.c_str(), l);
+			writeBuffer.resize(MESSAGE_HEADER_SIZE + l);
+			memcpy(writeBuffer.data(), &l, MESSAGE_HEADER_SIZE);
+			memcpy(writeBuffer.data() + MESSAGE_HEADER_SIZE, payload.data(), l);
 			writeBufferPos = 0;
-			writeBufferLeft = 2 + l;
+			writeBufferLeft = MESSAGE_HEADER_SIZE + l;
+			if (fdToPass != -1) {
+				// The entry may be dropped before the message leaves
+				writeFd = fcntl(fdToPass, F_DUPFD_CLOEXEC, 0);
+				if (writeFd == -1) {
+					perror("dup");
+					release();
+					return false;
+				}
+			}
+			// The socket is most probably writable: try at the end of this turn
+			writeReady = true;
+			server->readyClients.insert(this);
 			return true;
 		}
 	}
 
-	bool reply(const Messages::Result & result) {
-		nlohmann::json j = result;
-		std::string reply = j.dump(0);
-
-		if (!send(reply)) {
-			return false;
+	bool reply(const Messages::Result & result, int fdToPass = -1) {
+		if (channel) {
+			// Worker threads get the result as is
+			if (protocolDebug()) {
+				std::cerr << "Server reply to thread : " << nlohmann::json(result).dump(0) << "\n";
+			}
+			channel->deliver(result, fdToPass);
+		} else {
+			nlohmann::json j = result;
+			if (protocolDebug()) {
+				std::cerr << "Server reply to " << fd << " : " << j.dump(0) << "\n";
+			}
+			if (!send(nlohmann::json::to_msgpack(j), fdToPass)) {
+				return false;
+			}
 		}
-		std::cerr << "Server reply to " << fd << " : " << reply << "\n";
 
 		delete activeRequest;
 		activeRequest = nullptr;
 		return true;
 	}
 
-	// Is it waiting for a todo item
-	bool isWaitingWorker() const { return waitingWorker; }
-	void setWaitingWorker(bool b) { waitingWorker = b; }
-
-	// Is it waiting for a resource
-	bool isWaitingConsumer() const { return waitingConsumer; }
-	void setWaitingConsumer(bool b) { waitingConsumer = b; }
-
 };
 }
 
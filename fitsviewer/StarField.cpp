@@ -49,15 +49,18 @@ public:
 
 class MultiStarFinder {
 	friend class StarFinder;
+	// Cancellation is checked between steps, and between candidates
+	SharedCache::Entry * entry;
 	RawDataStorage * content;
 	HistogramStorage * histogram;
 	const ChannelMode channelMode;
 public:
 	using StarOccurence=SharedCache::Messages::StarOccurence;
 
-	MultiStarFinder(RawDataStorage * content, HistogramStorage * histogram)
+	MultiStarFinder(SharedCache::Entry * entry, RawDataStorage * content, HistogramStorage * histogram)
 		: channelMode(content->hasColors() ? 4 : 1)
 	{
+		this->entry = entry;
 		this->content = content;
 		this->histogram = histogram;
 	}
@@ -69,6 +72,22 @@ public:
 	}
 
 	std::vector<StarOccurence> proceed(int maxCount) {
+		switch(content->sampleType) {
+			case RawDataStorage::Int16:
+				return proceed(content->samples<int16_t>(), maxCount);
+			case RawDataStorage::Int32:
+				return proceed(content->samples<int32_t>(), maxCount);
+			case RawDataStorage::Float32:
+				return proceed(content->samples<float>(), maxCount);
+			case RawDataStorage::Float64:
+				return proceed(content->samples<double>(), maxCount);
+			default:
+				return proceed(content->samples<uint16_t>(), maxCount);
+		}
+	}
+
+	// Limits come from the histogram levels, samples are compared in their own type
+	template<typename T> std::vector<StarOccurence> proceed(const T * samples, int maxCount) {
 		int blackLevelByChannel[channelMode.channelCount];
 		int blackStddevByChannel[channelMode.channelCount];
 
@@ -82,19 +101,22 @@ public:
 
 
 		int limitByChannel[channelMode.channelCount];
+		double limitValueByChannel[channelMode.channelCount];
 		for(int i = 0; i < channelMode.channelCount; ++i)
 		{
 			limitByChannel[i] = blackStddevByChannel[i] + blackLevelByChannel[i];
+			limitValueByChannel[i] = content->levels.value(limitByChannel[i]);
 
 			cerr << "channel " << i << " black at " << blackLevelByChannel[i] << " limit at " << limitByChannel[i] <<"\n";
 		}
 		BitMask notBlack(0, 0, content->w - 1, content->h - 1);
-		int ptr = 0;
+		long ptr = 0;
 		for(int y = 0; y < content->h; ++y)
 			for(int x = 0; x < content->w; ++x)
-				if (content->data[ptr++] > limitByChannel[getChannelId(x, y)]) {
+				if (samples[ptr++] > limitValueByChannel[getChannelId(x, y)]) {
 					notBlack.set(x, y, 1);
 				}
+		entry->checkCancelled();
 
 		BitMask tmp(notBlack);
 		notBlack.erode();
@@ -107,6 +129,7 @@ public:
 		//  - on les parcours
 		//  - si le nombre d'étoiles autours de la zone considérée est inferieur à la moyenne, considérer la zone
 		auto zones = notBlack.calcConnexityGroups();
+		entry->checkCancelled();
 
 		// Taille maxi d'une étoile (32 x 32)
 		int maxSurface = 2048;
@@ -119,7 +142,7 @@ public:
 				continue;
 			}
 
-			int adusum = 0;
+			double adusum = 0;
 			double xmoy = 0;
 			double ymoy = 0;
 			for(int i = 0; i < zone->size(); i += 2)
@@ -127,9 +150,10 @@ public:
 				int x = (*zone)[i];
 				int y = (*zone)[i + 1];
 
-				int v = content->getAdu(x, y);
-				v -= limitByChannel[getChannelId(x, y)];
-				if (v < 0) {
+				double v = samples[x + (long)y * content->w];
+				v -= limitValueByChannel[getChannelId(x, y)];
+				// Also skips blank (NaN) samples
+				if (!(v >= 0)) {
 					continue;
 				}
 				// FIXME : retirer le black et l'estimation du fond !
@@ -151,10 +175,10 @@ public:
 				int x = (*zone)[i];
 				int y = (*zone)[i + 1];
 
-				int v = content->getAdu(x, y);
-				v -= limitByChannel[getChannelId(x, y)];
+				double v = samples[x + (long)y * content->w];
+				v -= limitValueByChannel[getChannelId(x, y)];
 
-				if (v < 0) {
+				if (!(v >= 0)) {
 					continue;
 				}
 
@@ -189,6 +213,7 @@ public:
 		resultVec.reserve(maxCount);
 		for(const auto & star : stars)
 		{
+			entry->checkCancelled();
 			cout << star->weight << " at " << star->cx << "  " << star->cy << "\n" ;
 			StarFinder sf(content, channelMode, star->cx, star->cy, 25);
 			sf.setExcludeMask(&checkedArea);
@@ -249,7 +274,8 @@ void SharedCache::Messages::StarField::produce(SharedCache::Entry* entry)
     }
 
 	HistogramStorage * histogramStorage = (HistogramStorage*)histogram->data();
-	MultiStarFinder msf(contentStorage, histogramStorage);
+	entry->checkCancelled();
+	MultiStarFinder msf(entry, contentStorage, histogramStorage);
 	StarFieldResult result;
 	result.width = contentStorage->w;
 	result.height = contentStorage->h;
@@ -2,7 +2,7 @@
 
 #include "StarFinder.h"
 
-bool StarFinder::perform(StarOccurence & result) {
+template<typename T> bool StarFinder::perform(const T * samples, StarOccurence & result) {
     int x0 = x - windowRadius;
     int y0 = y - windowRadius;
     int x1 = x + windowRadius;
@@ -38,14 +38,16 @@ bool StarFinder::perform(StarOccurence & result) {
     
     delete(hs);
 
-    std::vector<uint16_t> maxAduByChannel(channelMode.channelCount, 0);
+    std::vector<double> maxAduByChannel(channelMode.channelCount, 0);
 
     // On remonte arbitrairement le noir
+    // (histogram levels, as sample values)
+    std::vector<double> blackByChannel(channelMode.channelCount, 0);
     for(int i = 0; i < channelMode.channelCount; ++i) {
-        blackLevelByChannel[i] += blackStddevByChannel[i];
+        blackByChannel[i] = content->levels.value(blackLevelByChannel[i] + blackStddevByChannel[i]);
     }
 
-    int maxRelAdu = 0;
+    double maxRelAdu = 0;
     int maxAduX = this->x, maxAduY = this->y;
 
     // Calcul des pixels non noirs
@@ -53,11 +55,11 @@ bool StarFinder::perform(StarOccurence & result) {
     for(int y = y0; y <= y1; ++y)
         for(int x = x0; x <= x1; ++x)
         {
-            int adu = content->getAdu(x, y);
+            double adu = samples[x + (long)y * content->w];
             int channelId = this->channelMode.getChannelId(x, y);
-            if (adu > blackLevelByChannel[channelId]) {
+            if (adu > blackByChannel[channelId]) {
                 maxAduByChannel[channelId] = adu;
-                adu -= blackLevelByChannel[channelId];
+                adu -= blackByChannel[channelId];
                 if (adu >= maxRelAdu) {
                     maxAduX = x;
                     maxAduY = y;
@@ -95,9 +97,9 @@ bool StarFinder::perform(StarOccurence & result) {
     star.grow();
     if (excludeMask != nullptr) star.substract(*excludeMask);
     
-    int64_t xSum = 0;
-    int64_t ySum = 0;
-    int64_t aduSum = 0;
+    double xSum = 0;
+    double ySum = 0;
+    double aduSum = 0;
     
     for(BitMaskIterator it = star.iterator(); it.next();)
     {
@@ -105,11 +107,12 @@ bool StarFinder::perform(StarOccurence & result) {
         int y = it.y();
 
         int channelId = channelMode.getChannelId(x, y);
-        int adu = content->getAdu(x, y);
+        double adu = samples[x + (long)y * content->w];
         // en cas d'utilisation de black, on fait en sorte de garder saturé les pixels saturés
 
-        int black = blackLevelByChannel[channelId];
-        if (adu <= black) continue;
+        double black = blackByChannel[channelId];
+        // Also skips blank (NaN) samples
+        if (!(adu > black)) continue;
         adu -= black;
 /*        this->aduSumByChannel[channelId] += adu;
         if (adu > this->aduMaxByChannel[channelId]) {
@@ -155,10 +158,10 @@ bool StarFinder::perform(StarOccurence & result) {
             int x = it.x();
             int y = it.y();
 
-            int adu = content->getAdu(x, y);
-            int black = blackLevelByChannel[channelMode.getChannelId(x, y)];
+            double adu = samples[x + (long)y * content->w];
+            double black = blackByChannel[channelMode.getChannelId(x, y)];
 
-            if (adu <= black) continue;
+            if (!(adu > black)) continue;
             adu -= black;
 
             double dx = (x - picX);
@@ -208,4 +211,19 @@ bool StarFinder::perform(StarOccurence & result) {
     result.flux = aduSum;
 
     return true;
-}
\ No newline at end of file
+}
+
+bool StarFinder::perform(StarOccurence & result) {
+	switch(content->sampleType) {
+		case RawDataStorage::Int16:
+			return perform(content->samples<int16_t>(), result);
+		case RawDataStorage::Int32:
+			return perform(content->samples<int32_t>(), result);
+		case RawDataStorage::Float32:
+			return perform(content->samples<float>(), result);
+		case RawDataStorage::Float64:
+			return perform(content->samples<double>(), result);
+		default:
+			return perform(content->samples<uint16_t>(), result);
+	}
+}
@@ -39,6 +39,10 @@ public:
 	const BitMask & getStarMask() const {
 		return star;
 	}
+
+private:
+	// Samples are compared and summed in their own type
+	template<typename T> bool perform(const T * samples, StarOccurence & details);
 };
 
 #endif
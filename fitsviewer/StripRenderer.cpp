@@ -0,0 +1,147 @@
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <exception>
+
+#include "StripRenderer.h"
+
+StripRenderer::StripRenderer(int threadCount) : threadCount(threadCount)
+{
+	if (this->threadCount < 1) {
+		this->threadCount = 1;
+	}
+}
+
+static std::atomic<int> threadLimit(0);
+
+int StripRenderer::defaultThreadCount()
+{
+	int result = std::thread::hardware_concurrency();
+	int limit = threadLimit.load();
+	if (limit > 0 && result > limit) {
+		result = limit;
+	}
+	return result > 0 ? result : 1;
+}
+
+void StripRenderer::setThreadLimit(int limit)
+{
+	threadLimit.store(limit);
+}
+
+bool StripRenderer::render(int stripCount, long stripSize, const Producer & producer, const Consumer & consumer)
+{
+	if (threadCount <= 1 || stripCount <= 2) {
+		std::vector<uint8_t> buffer(stripSize);
+		for(int strip = 0; strip < stripCount; ++strip) {
+			producer(strip, buffer.data());
+			if (!consumer(strip, buffer.data())) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Producers can be ahead of the consumer by at most slotCount strips
+	int slotCount = 2 * threadCount;
+	std::vector<uint8_t> buffers(slotCount * stripSize);
+	std::vector<bool> ready(slotCount, false);
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	int nextProduced = 0;
+	int nextConsumed = 0;
+	bool stop = false;
+	// First exception of a producer, rethrown on the calling thread
+	std::exception_ptr error;
+
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			while(!stop && nextProduced < stripCount && nextProduced >= nextConsumed + slotCount) {
+				cond.wait(lock);
+			}
+			if (stop || nextProduced >= stripCount) {
+				return;
+			}
+			int strip = nextProduced++;
+			lock.unlock();
+			try {
+				producer(strip, buffers.data() + (strip % slotCount) * stripSize);
+			} catch(...) {
+				lock.lock();
+				if (!error) {
+					error = std::current_exception();
+				}
+				stop = true;
+				cond.notify_all();
+				return;
+			}
+			lock.lock();
+			ready[strip % slotCount] = true;
+			cond.notify_all();
+		}
+	};
+
+	// Stop and join the workers however the rendering ends (the consumer may throw)
+	struct Joiner {
+		std::vector<std::thread> threads;
+		std::mutex & mutex;
+		std::condition_variable & cond;
+		bool & stop;
+
+		~Joiner() {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				stop = true;
+				cond.notify_all();
+			}
+			for(auto & thread : threads) {
+				thread.join();
+			}
+		}
+	};
+
+	bool result = true;
+	{
+		Joiner joiner{ {}, mutex, cond, stop };
+		int helperCount = threadCount < stripCount ? threadCount : stripCount;
+		for(int i = 0; i < helperCount; ++i) {
+			joiner.threads.push_back(std::thread(worker));
+		}
+
+		for(int strip = 0; strip < stripCount; ++strip) {
+			int slot = strip % slotCount;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while(!ready[slot] && !error) {
+					cond.wait(lock);
+				}
+				if (error) {
+					break;
+				}
+			}
+
+			bool ok = consumer(strip, buffers.data() + slot * stripSize);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			ready[slot] = false;
+			nextConsumed = strip + 1;
+			if (!ok) {
+				stop = true;
+				result = false;
+			}
+			cond.notify_all();
+			if (!ok) {
+				break;
+			}
+		}
+	}
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+	return result;
+}
@@ -0,0 +1,31 @@
+#ifndef STRIPRENDERER_H_
+#define STRIPRENDERER_H_
+
+#include <cstdint>
+#include <functional>
+
+// Produce strips of an image concurrently, and hand them over
+// in order to a consumer that runs on the calling thread (ie the jpeg encoder)
+class StripRenderer {
+	int threadCount;
+public:
+	// Fill buffer for the given strip. Called from any thread
+	typedef std::function<void(int strip, uint8_t * buffer)> Producer;
+	// Called in strip order. Return false to abort the rendering
+	typedef std::function<bool(int strip, uint8_t * buffer)> Consumer;
+
+	StripRenderer(int threadCount);
+
+	// Returns false if the consumer aborted
+	bool render(int stripCount, long stripSize, const Producer & producer, const Consumer & consumer);
+
+	int getThreadCount() const { return threadCount; }
+
+	// Threads for one production: one per core, unless limited
+	static int defaultThreadCount();
+	// When productions already run concurrently (worker threads), they must
+	// not each start a thread per core. 0 removes the limit
+	static void setThreadLimit(int limit);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "../FitsFile.h"
+#include "../TempDir.h"
+#include "../SharedCache.h"
+
+// Load the cache server with many concurrent consumers. Each consumer has its
+// own connection and asks for the header, the pixels or the histogram of small
+// random frames, in a cache small enough to keep evicting.
+//
+// usage: cachebench [files [requests [consumers...]]]
+// The cache lives in /tmp/fitsviewer.bench.cache unless FITSVIEWER_CACHE_DIR is set.
+// Use FITSVIEWER_CACHE_SIZE to change its size (16M by default)
+
+static void writeFrame(const std::string & path, int w, int h, int seed)
+{
+	FitsFile file;
+	file.create(path);
+	int status = 0;
+	long naxes[2] = { w, h };
+	if (fits_create_img(file.fptr, USHORT_IMG, 2, naxes, &status)) {
+		FitsFile::throwFitsIOError(path, status);
+	}
+	std::vector<uint16_t> data((long)w * h);
+	uint32_t value = seed;
+	for(size_t i = 0; i < data.size(); ++i) {
+		value = value * 1103515245 + 12345;
+		data[i] = 1000 + ((value >> 16) & 0x3fff);
+	}
+	long fpixels[2] = { 1, 1 };
+	if (fits_write_pix(file.fptr, TUSHORT, fpixels, data.size(), data.data(), &status)) {
+		FitsFile::throwFitsIOError(path, status);
+	}
+	file.close();
+}
+
+struct ConsumerResult {
+	std::vector<double> latencies;
+	long errors;
+};
+
+static void consume(const SharedCache::CacheConfig & config, const std::vector<std::string> & files, int requests, int seed, ConsumerResult & result)
+{
+	SharedCache::Cache cache(config);
+	result.errors = 0;
+	result.latencies.reserve(requests);
+	uint32_t value = seed;
+	for(int i = 0; i < requests; ++i) {
+		value = value * 1103515245 + 12345;
+		const std::string & path = files[(value >> 8) % files.size()];
+
+		SharedCache::Messages::ContentRequest request;
+		switch((value >> 4) % 3) {
+			case 0:
+				request.fitsHeader.build();
+				request.fitsHeader->path = path;
+				break;
+			case 1:
+				request.fitsContent.build();
+				request.fitsContent->path = path;
+				break;
+			default:
+				request.histogram.build();
+				request.histogram->source.path = path;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			SharedCache::EntryRef entry(cache.getEntry(request));
+			if (entry->hasError()) {
+				result.errors++;
+			}
+		}
+		auto end = std::chrono::steady_clock::now();
+		result.latencies.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	int fileCount = argc > 1 ? atoi(argv[1]) : 64;
+	int requests = argc > 2 ? atoi(argv[2]) : 200;
+	std::vector<int> consumerCounts;
+	for(int i = 3; i < argc; ++i) {
+		consumerCounts.push_back(atoi(argv[i]));
+	}
+	if (consumerCounts.empty()) {
+		consumerCounts = { 1, 16, 64, 256 };
+	}
+
+	SharedCache::CacheConfig config = SharedCache::CacheConfig::fromEnvironment();
+	if (!getenv("FITSVIEWER_CACHE_DIR")) {
+		config.path = "/tmp/fitsviewer.bench.cache";
+	}
+	if (!getenv("FITSVIEWER_CACHE_SIZE")) {
+		config.maxSize = 16 * 1024 * 1024;
+	}
+
+	TempDir dir("cachebench");
+	std::vector<std::string> files;
+	for(int i = 0; i < fileCount; ++i) {
+		files.push_back(dir.path() + "/frame" + std::to_string(i) + ".fits");
+		writeFrame(files.back(), 512, 512, i);
+	}
+
+	std::cout << fileCount << " frames, " << requests << " requests per consumer, cache of " << config.maxSize << " bytes in " << config.path << "\n";
+	std::cout << "consumers  requests/s  mean(ms)  p99(ms)  errors\n";
+	int seed = 1;
+	for(int consumers : consumerCounts) {
+		std::vector<ConsumerResult> results(consumers);
+		std::vector<std::thread> threads;
+		auto start = std::chrono::steady_clock::now();
+		for(int i = 0; i < consumers; ++i) {
+			threads.push_back(std::thread(consume, std::cref(config), std::cref(files), requests, seed++, std::ref(results[i])));
+		}
+		for(auto & thread : threads) {
+			thread.join();
+		}
+		auto end = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(end - start).count();
+
+		std::vector<double> latencies;
+		long errors = 0;
+		for(auto & result : results) {
+			latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+			errors += result.errors;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		double mean = 0;
+		for(double latency : latencies) {
+			mean += latency;
+		}
+		mean /= latencies.size();
+		double p99 = latencies[(latencies.size() * 99) / 100];
+
+		std::cout << std::setw(9) << consumers
+				<< std::fixed << std::setprecision(0) << std::setw(12) << (latencies.size() / seconds)
+				<< std::setprecision(2) << std::setw(10) << mean
+				<< std::setw(9) << p99
+				<< std::setw(8) << errors << "\n";
+	}
+	return 0;
+}
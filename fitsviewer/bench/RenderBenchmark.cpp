@@ -0,0 +1,123 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <stdlib.h>
+
+#include "../LookupTable.h"
+#include "../ImageScaling.h"
+#include "../StripRenderer.h"
+
+// Time the strip rendering of fitsviewer for each bin level,
+// serial versus all cores. The jpeg encoder is replaced by a checksum.
+//
+// usage: renderbench [width height [repeat [threads]]]
+
+struct Frame {
+	int w, h;
+	std::vector<uint16_t> data;
+
+	Frame(int w, int h) : w(w), h(h), data(w * h) {
+		uint32_t seed = 42;
+		for(size_t i = 0; i < data.size(); ++i) {
+			seed = seed * 1103515245 + 12345;
+			data[i] = 1000 + ((seed >> 16) & 0x3fff);
+		}
+	}
+};
+
+static uint32_t renderFrame(Frame & frame, const LookupTable & table, bool color, int bin, StripRenderer & renderer)
+{
+	int w = frame.w;
+	int h = frame.h;
+	uint16_t * data = frame.data.data();
+	int channels = color ? 3 : 1;
+
+	// Same strip layout as fitsviewer.cpp
+	int stripLines = 32;
+	while(stripLines > 1 && binDiv(h, bin) < stripLines * 4 * renderer.getThreadCount()) {
+		stripLines /= 2;
+	}
+	int stripHeight = stripLines << bin;
+	int stripCount = (h + stripHeight - 1) / stripHeight;
+	long stripSize = channels * binDiv(w, bin) * stripLines;
+
+	auto stripRows = [h, stripHeight](int strip) -> int {
+		int yleft = h - strip * stripHeight;
+		if (yleft > stripHeight) yleft = stripHeight;
+		return yleft;
+	};
+
+	int8_t offset_r, second_r, offset_g, second_g, offset_b, second_b;
+	findBayerOffset("RGGB", 'R', offset_r, second_r);
+	findBayerOffset("RGGB", 'G', offset_g, second_g);
+	findBayerOffset("RGGB", 'B', offset_b, second_b);
+
+	uint32_t checksum = 0;
+	renderer.render(stripCount, stripSize,
+		[&](int strip, uint8_t * result) {
+			uint16_t * stripData = data + strip * stripHeight * w;
+			if (color) {
+				applyScaleBinBayer(stripData, w, stripRows(strip),
+						table, bayerOffset(offset_r, w), bayerOffset(second_r, w),
+						table, bayerOffset(offset_g, w), bayerOffset(second_g, w),
+						table, bayerOffset(offset_b, w), bayerOffset(second_b, w),
+						result, bin);
+			} else if (bin > 0) {
+				applyScaleBin(stripData, w, stripRows(strip), table, result, bin);
+			} else {
+				applyScale(stripData, w, stripRows(strip), table, result);
+			}
+		},
+		[&](int strip, uint8_t * result) -> bool {
+			long size = channels * binDiv(w, bin) * binDiv(stripRows(strip), bin);
+			for(long i = 0; i < size; ++i) {
+				checksum = checksum * 31 + result[i];
+			}
+			return true;
+		});
+	return checksum;
+}
+
+static double timeRender(Frame & frame, const LookupTable & table, bool color, int bin, StripRenderer & renderer, int repeat, uint32_t & checksum)
+{
+	auto start = std::chrono::steady_clock::now();
+	for(int i = 0; i < repeat; ++i) {
+		checksum = renderFrame(frame, table, color, bin, renderer);
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count() / repeat;
+}
+
+int main(int argc, char ** argv)
+{
+	int w = argc > 2 ? atoi(argv[1]) : 6000;
+	int h = argc > 2 ? atoi(argv[2]) : 4000;
+	int repeat = argc > 3 ? atoi(argv[3]) : 3;
+
+	Frame frame(w, h);
+	LookupTable table(1200, 2500, 16000);
+	StripRenderer serial(1);
+	StripRenderer parallel(argc > 4 ? atoi(argv[4]) : StripRenderer::defaultThreadCount());
+
+	static const char * simdNames[] = { "scalar", "sse4.1", "avx2", "neon" };
+	std::cout << "Frame " << w << "x" << h << ", " << parallel.getThreadCount() << " threads, "
+			<< simdNames[LookupTable::bestSimdLevel()] << " lookups\n";
+	std::cout << "mode   bin   serial(ms)  parallel(ms)  speedup  checksum\n";
+	for(int color = 0; color < 2; ++color) {
+		for(int bin = color ? 1 : 0; bin <= 4; ++bin) {
+			uint32_t serialChecksum = 0, parallelChecksum = 0;
+			double serialMs = timeRender(frame, table, color, bin, serial, repeat, serialChecksum);
+			double parallelMs = timeRender(frame, table, color, bin, parallel, repeat, parallelChecksum);
+			std::cout << (color ? "bayer" : "mono ") << "  " << std::setw(3) << (1 << bin)
+					<< std::fixed << std::setprecision(1)
+					<< std::setw(13) << serialMs
+					<< std::setw(14) << parallelMs
+					<< std::setw(8) << std::setprecision(2) << (serialMs / parallelMs) << "x"
+					<< "  " << std::hex << std::setw(8) << std::setfill('0') << serialChecksum << std::dec << std::setfill(' ')
+					<< (serialChecksum != parallelChecksum ? "  CHECKSUM MISMATCH" : "")
+					<< "\n";
+		}
+	}
+	return 0;
+}
@@ -2,7 +2,16 @@
 #include <unistd.h>
 #include <cstdint>
 #include <stdio.h>
+#include <signal.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <map>
+#include <list>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <cgicc/CgiDefs.h>
 #include <cgicc/Cgicc.h>
 #include <cgicc/HTTPResponseHeader.h>
@@ -13,16 +22,6 @@
 #include <zlib.h>
 #include <stdio.h>
 
-/*
- * Include file for users of JPEG library.
- * You will need to have included system headers that define at least
- * the typedefs FILE and size_t before you can include jpeglib.h.
- * (stdio.h is sufficient on ANSI-conforming systems.)
- * You may also wish to include "jerror.h".
- */
-
-#include "jpeglib.h"
-
 /*
  * <setjmp.h> is used for the optional error recovery mechanism shown in
  * the second part of the example.
@@ -34,255 +33,81 @@
 #include "json.hpp"
 #include "fitsio.h"
 #include "SharedCache.h"
-#include "RawDataStorage.h"
-#include "HistogramStorage.h"
-#include "LookupTable.h"
+#include "FitsHeaderStorage.h"
+#include "PyramidStorage.h"
 
 using namespace std;
 using namespace cgicc;
 
 using nlohmann::json;
 
-static bool disableHttp = false;
 static bool disableOutput = false;
 
+// Destination of a reply: stdout for the cgi, the client socket in daemon mode
+struct ReplyChannel {
+	int fd;
+	bool http;
+	// Set once the peer stopped reading. Further output is dropped
+	bool failed;
 
+	ReplyChannel(int fd, bool http) : fd(fd), http(http), failed(false) {}
 
-struct own_jpeg_destination_mgr : public jpeg_destination_mgr {
-	uint8_t * buffer;
-	size_t buffSze;
-public:
-	own_jpeg_destination_mgr() {
-		init_destination = &static_init_destination;
-		empty_output_buffer = &static_empty_output_buffer;
-		term_destination = &static_term_destination;
-		buffSze = 16384;
-		buffer = (uint8_t*)malloc(buffSze);
-	}
-
-	~own_jpeg_destination_mgr() {
-		free(buffer);
-	}
-
-	void reset()
+	void writeVec(struct iovec * vecs, int count)
 	{
-		next_output_byte = buffer;
-		free_in_buffer = buffSze;
-	}
-
-	void writeBuff(size_t length)
-	{
-		int wanted, got;
-		if (length == 0) {
-			if (disableHttp) {
+		if (failed) {
+			return;
+		}
+		while(count > 0) {
+			ssize_t got = writev(fd, vecs, count);
+			if (got == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("write");
+				failed = true;
 				return;
 			}
-			const char * text = "0\r\n\r\n";
-			wanted = strlen(text);
-			got = write(1, text, wanted);
-		} else {
-			char separator[64];
-			int sepLength = snprintf(separator, 64, "%lx\r\n", length);
-
-			struct iovec vecs[3];
-			vecs[0].iov_base = separator;
-			vecs[0].iov_len = sepLength;
-			vecs[1].iov_base = buffer;
-			vecs[1].iov_len = length;
-			vecs[2].iov_base = separator + sepLength - 2;
-			vecs[2].iov_len = 2;
-
-
-			wanted = vecs[0].iov_len + length + 2;
-
-			if (disableHttp) {
-				wanted -= vecs[0].iov_len;
-				vecs[0].iov_len = 0;
-				wanted -= vecs[2].iov_len;
-				vecs[2].iov_len = 0;
+			while(count > 0 && (size_t)got >= vecs[0].iov_len) {
+				got -= vecs[0].iov_len;
+				vecs++;
+				count--;
+			}
+			if (count > 0) {
+				vecs[0].iov_base = ((char*)vecs[0].iov_base) + got;
+				vecs[0].iov_len -= got;
 			}
-
-			got = writev(1, vecs, 3);
-		}
-		if (got == -1) {
-			perror("write");
-			exit(0);
-		}
-		if (got < wanted) {
-			exit(0);
-		}
-	}
-
-	void flush()
-	{
-		size_t length = next_output_byte - buffer;
-		if (length) {
-			writeBuff(length);
-			reset();
 		}
 	}
 
-	void memberInit() {
-		reset();
-	}
-
-	void memberOutputBuffer() {
-		writeBuff(buffSze);
-		reset();
-	}
-
-	void memberTermDestination() {
-		flush();
-		writeBuff(0);
-	}
-
-	static void static_init_destination(j_compress_ptr cinfo)
-	{
-		((own_jpeg_destination_mgr*)cinfo->dest)->memberInit();
-	}
-	static boolean static_empty_output_buffer(j_compress_ptr cinfo)
-	{
-		((own_jpeg_destination_mgr*)cinfo->dest)->memberOutputBuffer();
-	}
-	static void static_term_destination(j_compress_ptr cinfo)
+	void write(const void * data, size_t length)
 	{
-		((own_jpeg_destination_mgr*)cinfo->dest)->memberTermDestination();
+		struct iovec vec;
+		vec.iov_base = (void*)data;
+		vec.iov_len = length;
+		writeVec(&vec, 1);
 	}
-};
-
 
-class JpegWriter
-{
-	int width, height, channels;
-
-	/* This struct contains the JPEG compression parameters and pointers to
-	 * working space (which is allocated as needed by the JPEG library).
-	 * It is possible to have several such structures, representing multiple
-	 * compression/decompression processes, in existence at once.  We refer
-	 * to any one struct (and its associated working data) as a "JPEG object".
-	 */
-	struct jpeg_compress_struct cinfo;
-
-	/* This struct represents a JPEG error handler.  It is declared separately
-	 * because applications often want to supply a specialized error handler
-	 * (see the second half of this file for an example).  But here we just
-	 * take the easy way out and use the standard error handler, which will
-	 * print a message on stderr and call exit() if compression fails.
-	 * Note that this struct must live as long as the main JPEG parameter
-	 * struct, to avoid dangling-pointer problems.
-	 */
-	struct jpeg_error_mgr jerr;
-	own_jpeg_destination_mgr destMgr;
-public:
-	JpegWriter(int w, int h, int channels)
+	void write(const std::string & str)
 	{
-		this->width = w;
-		this->height = h;
-		this->channels = channels;
-
+		write(str.data(), str.length());
 	}
 
-	void start()
+	void sendHttpHeader(const cgicc::HTTPResponseHeader & header)
 	{
-		if (disableOutput) return;
-
-		  /* Step 1: allocate and initialize JPEG compression object */
-
-		  /* We have to set up the error handler first, in case the initialization
-		   * step fails.  (Unlikely, but it could happen if you are out of memory.)
-		   * This routine fills in the contents of struct jerr, and returns jerr's
-		   * address which we place into the link field in cinfo.
-		   */
-		  cinfo.err = jpeg_std_error(&jerr);
-		  /* Now we can initialize the JPEG compression object. */
-		  jpeg_create_compress(&cinfo);
-
-		  /* Step 2: specify data destination (eg, a file) */
-		  /* Note: steps 2 and 3 can be done in either order. */
-
-		  /* Here we use the library-supplied code to send compressed data to a
-		   * stdio stream.  You can also write your own code to do something else.
-		   * VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
-		   * requires it in order to write binary files.
-		   */
-		  cinfo.dest = &destMgr;
-		  /* Step 3: set parameters for compression */
-
-		  /* First we supply a description of the input image.
-		   * Four fields of the cinfo struct must be filled in:
-		   */
-		  cinfo.image_width = width; 	/* image width and height, in pixels */
-		  cinfo.image_height = height;
-		  cinfo.input_components = channels;		/* # of color components per pixel */
-		  cinfo.in_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB; 	/* colorspace of input image */
-		  /* Now use the library's routine to set default compression parameters.
-		   * (You must set at least cinfo.in_color_space before calling this,
-		   * since the defaults depend on the source color space.)
-		   */
-		  jpeg_set_defaults(&cinfo);
-		  /* Now you can set any non-default parameters you wish to.
-		   * Here we just illustrate the use of quality (quantization table) scaling:
-		   */
-
-		  jpeg_set_quality(&cinfo, 90, TRUE /* limit to baseline-JPEG values */);
-		  cinfo.dct_method = JDCT_IFAST;
-
-		  // For progressive, use: jpeg_simple_progression(&cinfo);
-		  // But in that case, the compression will not be streamed.
-
-		  /* Step 4: Start compressor */
-		  /* TRUE ensures that we will write a complete interchange-JPEG file.
-		   * Pass TRUE unless you are very sure of what you're doing.
-		   */
-		  jpeg_start_compress(&cinfo, TRUE);
-
-		  destMgr.flush();
-	}
-
-	void writeLines(uint8_t * grey, int height) {
-		if (disableOutput) return;
-
-		JSAMPROW row_pointer[32];	/* pointer to JSAMPLE row[s] */
-		int row_stride;		/* physical row width in image buffer */
-
-		/* Step 5: while (scan lines remain to be written) */
-		/*           jpeg_write_scanlines(...); */
-
-		/* Here we use the library's state variable cinfo.next_scanline as the
-		 * loop counter, so that we don't have to keep track ourselves.
-		 * To keep things simple, we pass one scanline per call; you can pass
-		 * more if you wish, though.
-		 */
-		row_stride = channels * width;	/* JSAMPLEs per row in image_buffer */
-
-		int y = 0;
-		while(y < height) {
-			int count = 0;
-			for(int i = 0; i < 32 && y < height; ++i) {
-				row_pointer[i] = grey + y * row_stride;
-				y++;
-				count++;
-			}
-			(void) jpeg_write_scanlines(&cinfo, row_pointer, count);
+		if (!http) {
+			return;
 		}
+		std::ostringstream oss;
+		oss << header.getHTTPVersion() << ' ' << header.getStatusCode() << ' ' << header.getReasonPhrase() << "\r\n";
+		for(auto it = header.getHeaders().begin(); it != header.getHeaders().end(); ++it)
+		{
+			oss << *it << "\r\n";
+		}
+		oss << "\r\n";
+		write(oss.str());
 	}
-
-	void finish()
-	{
-		if (disableOutput) return;
-
-		/* Step 6: Finish compression */
-		jpeg_finish_compress(&cinfo);
-
-
-		/* Step 7: release JPEG compression object */
-		/* This is an important step since it will release a good deal of memory. */
-		jpeg_destroy_compress(&cinfo);
-	}
-
 };
 
-
 void write_png_file(u_int8_t * grey, int width, int height)
 {
         /* create file */
@@ -341,312 +166,17 @@ void write_png_file(u_int8_t * grey, int width, int height)
         fclose(fp);
 }
 
-static inline void applyScale(u_int16_t * data, int w, int h, const LookupTable & table, u_int8_t * result)
-{
-	int nbpix = w * h;
-
-	for(int i = 0; i < nbpix; ++i) {
-		result[i] = table.fastGet(data[i]);
-	}
-}
-
-static inline int binDiv(int width, int bin)
-{
-	if (!bin) return width;
-	int rslt = width >> bin;
-	if ((rslt << bin) < width) {
-		rslt++;
-	}
-	return rslt;
-}
-
-static inline int32_t rectSum(uint16_t * data, int w, int h, int sx, int sy, const LookupTable & table)
-{
-	int32_t result = 0;
-	while(sy > 0) {
-		for(int i = 0; i < sx; ++i)
-			result += table.fastGet(data[i]);
-		data += w;
-		sy--;
-	}
-	return result;
-}
-
-static inline void rectSumBayer(uint16_t * data, int w, int h, int sx, int sy,
-		const LookupTable & table_r, int16_t offset_r, int16_t second_r,
-		const LookupTable & table_g, int16_t offset_g, int16_t second_g,
-		const LookupTable & table_b, int16_t offset_b, int16_t second_b,
-		int32_t & r, int32_t & g, int32_t & b)
-{
-	r = 0;
-	g = 0;
-	b = 0;
-
-	int32_t result = 0;
-	while(sy > 0) {
-		for(int i = 0; i < sx; i += 2)
-		{
-			r += table_r.fastGet(data[i + offset_r]);
-			if (second_r != -1) r += table_r.fastGet(data[i + second_r]);
-			g += table_g.fastGet(data[i + offset_g]);
-			if (second_g != -1) g += table_g.fastGet(data[i + second_g]);
-			b += table_b.fastGet(data[i + offset_b]);
-			if (second_b != -1) b += table_b.fastGet(data[i + second_b]);
-		}
-		data += 2*w;
-		sy-=2;
-	}
-}
-
-static inline void rectSumBayerRGGB(uint16_t * data, int w, int h, int sx, int sy,
-		const LookupTable & table_r,
-		const LookupTable & table_g,
-		const LookupTable & table_b,
-		int32_t & r, int32_t & g, int32_t & b)
-{
-	r = 0;
-	g = 0;
-	b = 0;
-
-	int32_t result = 0;
-	while(sy > 0) {
-		for(int i = 0; i < sx; i += 2)
-		{
-			r += table_r.fastGet(data[i]);
-			g += table_g.fastGet(data[i + 1]);
-			g += table_g.fastGet(data[i + w]);
-			b += table_b.fastGet(data[i + w + 1]);
-		}
-		data += 2*w;
-		sy-=2;
-	}
-}
-
-static inline void applyScaleBin2(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result)
-{
-	int i = 0;
-	for(int by = 0; by < h; by += 2)
-	{
-		for(int bx = 0; bx < w; bx += 2)
-		{
-			int16_t v = lookupTable.fastGet(data[bx]);
-			v += lookupTable.fastGet(data[bx + 1]);
-			v += lookupTable.fastGet(data[bx + w]);
-			v += lookupTable.fastGet(data[bx + w + 1]);
-			v /= 4;
-			*result = v;
-			result++;
-		}
-		data += w * 2;
-	}
-}
-
-static inline void applyScaleBinAny(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result, int bin)
-{
-	int binStep = 1 << bin;
-	for(int by = 0; by < h; by += binStep)
-	{
-		bool shortY = by + binStep >= h;
-
-		int sy = shortY ? h - by : binStep;
-
-		for(int bx = 0; bx < w; bx += binStep)
-		{
-			bool shortX = bx + binStep >= w;
-
-			int sx = shortX ? w - bx : binStep;
-			int32_t v = rectSum(data + bx, w, h, sx, sy, lookupTable);
-			if (shortX || shortY) {
-				v /= (sx * sy);
-			} else {
-				v = v >> (bin+bin);
-			}
-			*result = v;
-			result++;
-		}
-		data += w * binStep;
-	}
-}
-
-// data, w, h
-// result, de taille w/bin, h/bin
-static inline void applyScaleBin(u_int16_t * data, int w, int h, const LookupTable & lookupTable, u_int8_t * result, int bin)
-{
-	if (bin == 1 && ((w % 2) == 0) && ((h % 2) == 0)) {
-		applyScaleBin2(data, w, h, lookupTable, result);
-	} else {
-		applyScaleBinAny(data, w, h, lookupTable, result, bin);
-	}
-}
-
-static inline void applyScaleBinBayerAny(u_int16_t * data, int w, int h,
-				const LookupTable & table_r, int16_t offset_r, int16_t second_r,
-				const LookupTable & table_g, int16_t offset_g, int16_t second_g,
-				const LookupTable & table_b, int16_t offset_b, int16_t second_b,
-				u_int8_t * result, int bin)
-{
-	int binStep = 1 << bin;
-	for(int by = 0; by < h; by += binStep)
-	{
-		bool shortY = by + binStep >= h;
-
-		int sy = shortY ? h - by : binStep;
-
-		for(int bx = 0; bx < w; bx += binStep)
-		{
-			bool shortX = bx + binStep >= w;
-
-			int sx = shortX ? w - bx : binStep;
-			int32_t v_r, v_g, v_b;
-			rectSumBayer(data + bx, w, h, sx, sy,
-					table_r, offset_r, second_r,
-					table_g, offset_g, second_g,
-					table_b, offset_b, second_b,
-					v_r, v_g, v_b);
-
-			if (shortX || shortY) {
-				v_r /= (binDiv(sx, 1) * binDiv(sy,1));
-				v_g /= (binDiv(sx, 1) * binDiv(sy,1));
-				v_b /= (binDiv(sx, 1) * binDiv(sy,1));
-			} else {
-				v_r = v_r >> (2 * bin - 2 + (second_r != -1 ? 1 : 0));
-				v_g = v_g >> (2 * bin - 2 + (second_g != -1 ? 1 : 0));
-				v_b = v_b >> (2 * bin - 2 + (second_b != -1 ? 1 : 0));
-			}
-			result[0] = v_r;
-			result[1] = v_g;
-			result[2] = v_b;
-			result+=3;
-		}
-		data += w * binStep;
-	}
-}
-
-static inline void applyScaleBinBayerRGGBAny(u_int16_t * data, int w, int h,
-				const LookupTable & table_r,
-				const LookupTable & table_g,
-				const LookupTable & table_b,
-				u_int8_t * result, int bin)
-{
-	int binStep = 1 << bin;
-
-	for(int by = 0; by < h; by += binStep)
-	{
-		bool shortY = by + binStep >= h;
-
-		int sy = shortY ? h - by : binStep;
-
-		for(int bx = 0; bx < w; bx += binStep)
-		{
-			bool shortX = bx + binStep >= w;
-
-			int sx = shortX ? w - bx : binStep;
-			int32_t v_r, v_g, v_b;
-			rectSumBayerRGGB(data + bx, w, h, sx, sy,
-					table_r,
-					table_g,
-					table_b,
-					v_r, v_g, v_b);
-
-			if (shortX || shortY) {
-				v_r /= (binDiv(sx, 1) * binDiv(sy,1));
-				v_g /= (binDiv(sx, 1) * binDiv(sy,1) * 2);
-				v_b /= (binDiv(sx, 1) * binDiv(sy,1));
-			} else {
-				v_r = v_r >> (2 * bin - 2);
-				v_g = v_g >> (2 * bin - 2 + 1);
-				v_b = v_b >> (2 * bin - 2);
-			}
-
-			result[0] = v_r;
-			result[1] = v_g;
-			result[2] = v_b;
-			result+=3;
-		}
-		data += w * binStep;
-	}
-}
-
-static inline void applyScaleBinBayer2(u_int16_t * data, int w, int h,
-		const LookupTable & table_r, int16_t offset_r, int16_t second_r,
-		const LookupTable & table_g, int16_t offset_g, int16_t second_g,
-		const LookupTable & table_b, int16_t offset_b, int16_t second_b,
-		u_int8_t * result)
-{
-	for(int by = 0; by < h; by += 2)
-	{
-		for(int bx = 0; bx < w; bx += 2)
-		{
-			{
-				int32_t v_r = table_r.fastGet(data[bx + offset_r]);
-				if (second_r != -1) {
-					v_r += table_r.fastGet(data[bx + second_r]);
-					v_r = v_r / 2;
-				}
-				result[0] = v_r;
-			}
-
-			{
-				int32_t v_g = table_g.fastGet(data[bx + offset_g]);
-				if (second_g != -1) {
-					v_g += table_g.fastGet(data[bx + second_g]);
-					v_g = v_g / 2;
-				}
-				result[1] = v_g;
-			}
-
-			{
-				int32_t v_b = table_b.fastGet(data[bx + offset_b]);
-				if (second_b != -1) {
-					v_b += table_b.fastGet(data[bx + second_b]);
-					v_b = v_b / 2;
-				}
-				result[2] = v_b;
-			}
-			result+=3;
-		}
-		data += w * 2;
-	}
-}
-
 
-static inline void applyScaleBinBayer(u_int16_t * data, int w, int h,
-						const LookupTable & table_r, int16_t offset_r, int16_t second_r,
-						const LookupTable & table_g, int16_t offset_g, int16_t second_g,
-						const LookupTable & table_b, int16_t offset_b, int16_t second_b,
-						u_int8_t * result, int bin)
-{
-	if (bin == 1) {
-		applyScaleBinBayer2(data, w, h,
-								table_r, offset_r, second_r,
-								table_g, offset_g, second_g,
-								table_b, offset_b, second_b,
-								result);
-	} else {
-		if (offset_r == 0 && offset_g == 1 && second_g == w && offset_b == w + 1) {
-			applyScaleBinBayerRGGBAny(data, w, h,
-				table_r,
-				table_g,
-				table_b,
-				result, bin);
-		} else {
-			applyScaleBinBayerAny(data, w, h,
-				table_r, offset_r, second_r,
-				table_g, offset_g, second_g,
-				table_b, offset_b, second_b,
-				result, bin);
-		}
-	}
-}
+typedef std::map<std::string, std::string> RequestParams;
 
-static double parseFormFloat(Cgicc & formData, const std::string & name, double defaultValue)
+static double parseFormFloat(const RequestParams & formData, const std::string & name, double defaultValue)
 {
-	std::string value = formData(name);
-	if (value == "") {
+	auto it = formData.find(name);
+	if (it == formData.end() || it->second == "") {
 		return defaultValue;
 	}
 	try {
-		return stod(value);
+		return stod(it->second);
 	} catch (const std::logic_error& ia) {
 		std::cerr << "Invalid argument: " << ia.what() << '\n';
 		return defaultValue;
@@ -675,10 +205,27 @@ static bool findArg(int & argc, char ** argv, const char * wanted)
 	return false;
 }
 
+// Find an argument with a value (--name value)
+static bool findArgValue(int & argc, char ** argv, const char * wanted, std::string & value)
+{
+	for(int i = 1; i + 1 < argc; ++i)
+	{
+		if (!strcmp(argv[i], wanted)) {
+			value = argv[i + 1];
+			removeArgs(argc, argv, i, 2);
+			return true;
+		}
+	}
+	return false;
+}
+
 class ImageDesc {
 public:
 	int width, height;
 	bool color;
+	int tileSize;
+	// Highest tile level (its tiles cover the whole image)
+	int tileLevels;
 };
 
 void to_json(nlohmann::json&j, const ImageDesc & i) {
@@ -686,238 +233,417 @@ void to_json(nlohmann::json&j, const ImageDesc & i) {
 	j["width"] = i.width;
 	j["height"] = i.height;
 	j["color"] = i.color;
+	j["tileSize"] = i.tileSize;
+	j["tileLevels"] = i.tileLevels;
 }
 
+struct RenderRequest {
+	std::string path;
+	// This is a power of two of the actual bin (0 => 1x1)
+	int bin;
+	bool wantSize;
+	bool forceGreyscale;
+	double low, med, high;
+	// A single tile (see PyramidStorage) when tileLevel >= 0
+	int tileLevel;
+	int tileX, tileY;
+	// Demosaic for colour images at full resolution (bilinear or edge)
+	std::string debayer;
+
+	RenderRequest() {
+		bin = 0;
+		tileLevel = -1;
+		tileX = 0;
+		tileY = 0;
+		wantSize = false;
+		forceGreyscale = false;
+		low = 0.05;
+		med = 0.5;
+		high = 0.95;
+		debayer = "bilinear";
+	}
+
+	void parse(const RequestParams & formData)
+	{
+		auto it = formData.find("size");
+		if (it != formData.end() && it->second == "true") {
+			wantSize = true;
+		}
 
+		it = formData.find("path");
+		if (it != formData.end() && it->second != "") {
+			path = it->second;
+		}
 
-void sendHttpHeader(const cgicc::HTTPResponseHeader & header)
-{
-	if (!disableHttp) {
-		cout << header;
-	}
-}
+		it = formData.find("bin");
+		if (it != formData.end() && it->second != "") {
+			bin = parseFormFloat(formData, "bin", 0);
+			if (bin < 0) {
+				bin = 0;
+			}
+			if (bin > 8) {
+				bin = 8;
+			}
+		}
 
+		it = formData.find("level");
+		if (it != formData.end() && it->second != "") {
+			tileLevel = parseFormFloat(formData, "level", 0);
+			if (tileLevel < 0) {
+				tileLevel = 0;
+			}
+			tileX = parseFormFloat(formData, "tileX", 0);
+			tileY = parseFormFloat(formData, "tileY", 0);
+		}
 
-static void findBayerOffset(const std::string & bayerStr, char which, int8_t & offset, int8_t & second)
-{
-	const char * bayer = bayerStr.c_str();
-	int p = 0;
-	while((bayer[p]) && (bayer[p] != which)) {
-		p++;
-	}
-	if (!bayer[p]) {
-		offset = 0;
-		second = -1;
-		return;
-	}
-	offset = p;
-	p++;
-	while((bayer[p]) && (bayer[p] != which)) {
-		p++;
-	}
-	if (!bayer[p]) {
-		second = -1;
-	} else {
-		second = p;
-	}
-}
+		it = formData.find("debayer");
+		if (it != formData.end() && it->second == "edge") {
+			debayer = "edge";
+		}
 
-static int16_t bayerOffset(int8_t bayer, int w)
-{
-	if (bayer == -1) return -1;
-	if (bayer < 2) {
-		return bayer;
-	} else {
-		return bayer + w - 2;
+		low = parseFormFloat(formData, "low", 0.05);
+		med = parseFormFloat(formData, "med", 0.5);
+		high = parseFormFloat(formData, "high", 0.95);
 	}
-}
-
-int main (int argc, char ** argv) {
-	Cgicc formData;
-	// 128Mo cache
-	SharedCache::Cache * cache = new SharedCache::Cache("/tmp/fitsviewer.cache", 128*1024*1024);
-
-	string path;
-
-	// This is a power of two of the actual bin (0 => 1x1)
-	int bin = 0;
+};
 
-	bool wantSize = findArg(argc, argv, "--size");
-	disableHttp = findArg(argc, argv, "--no-http");
-	disableOutput = findArg(argc, argv, "--no-output");
-	bool forceGreyscale = findArg(argc, argv, "--force-greyscale");
 
-	form_iterator fi;
-	fi = formData.getElement("size");
-	if ((!fi->isEmpty()) && (fi != (*formData).end()) && (**fi == "true")) {
-		wantSize = true;
+// Resources that survive between requests (one per daemon thread)
+class RenderContext {
+	SharedCache::Cache * cache;
+public:
+	RenderContext() {
+		cache = nullptr;
 	}
 
-	fi = formData.getElement("path");
-	if( !fi->isEmpty() && fi != (*formData).end()) {
-		path =  **fi;
-	} else if (argc > 1) {
-		path = std::string(argv[1]);
-	} else {
-		path = "/home/ludovic/Astronomie/Photos/Light/Essai_Light_1_secs_2017-05-21T10-02-41_009.fits";
+	~RenderContext() {
+		delete(cache);
 	}
-//	path = "/home/ludovic/Astronomie/Photos/Light/Essai_Light_1_secs_2017-05-21T10-02-41_009.fits";
 
-	fi = formData.getElement("bin");
-	if ((!fi->isEmpty()) && (fi != (*formData).end())) {
-		bin = stod(**fi);
-		if (bin < 0) {
-			bin = 0;
-		}
-		if (bin > 8) {
-			bin = 8;
+	SharedCache::Cache * getCache() {
+		if (cache == nullptr) {
+			cache = new SharedCache::Cache(SharedCache::CacheConfig::fromEnvironment());
 		}
+		return cache;
 	}
 
+	// Forget the cache connection after a protocol error
+	void dropCache() {
+		delete(cache);
+		cache = nullptr;
+	}
+};
 
+// Returns false if the request failed
+static bool render(RenderContext & context, const RenderRequest & request, ReplyChannel & output)
+{
+	SharedCache::Cache * cache = context.getCache();
+	const std::string & path = request.path;
 
 	SharedCache::Messages::ContentRequest contentRequest;
-	contentRequest.fitsContent = new SharedCache::Messages::RawContent();
-	contentRequest.fitsContent->path = path;
 
-	SharedCache::EntryRef aduPlane(cache->getEntry(contentRequest));
-	if (aduPlane->hasError()) {
-		sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 500, aduPlane->getErrorDetails().c_str()));
-		exit(1);
-	}
-	RawDataStorage * storage = (RawDataStorage *)aduPlane->data();
+	if (request.wantSize) {
+		// Only the header is read: the pixels are not loaded in the cache
+		contentRequest.fitsHeader.build();
+		contentRequest.fitsHeader->path = path;
+
+		SharedCache::EntryRef headerEntry(cache->getEntry(contentRequest));
+		if (headerEntry->hasError()) {
+			output.sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 500, headerEntry->getErrorDetails().c_str()));
+			return false;
+		}
+		FitsHeaderStorage * fitsHeader = (FitsHeaderStorage *)headerEntry->data();
 
-	if (wantSize) {
 		cgicc::HTTPResponseHeader header("HTTP/1.1", 200, "OK");
 		header.addHeader("Content-Type", "application/json");
 		header.addHeader("connection", "close");
-		sendHttpHeader(header);
+		output.sendHttpHeader(header);
 
 		ImageDesc desc;
-		desc.width = storage->w;
-		desc.height = storage->h;
-		desc.color = storage->hasColors();
+		desc.width = fitsHeader->w;
+		desc.height = fitsHeader->h;
+		desc.color = fitsHeader->bayer[0] != 0;
+		desc.tileSize = PyramidStorage::tileSize;
+		desc.tileLevels = PyramidStorage::topLevel(fitsHeader->w, fitsHeader->h);
 
 		nlohmann::json j = desc;
-		cout << j.dump() << "\n";
-		exit(0);
+		output.write(j.dump() + "\n");
+		return true;
+	}
+
+	if (request.tileLevel >= 0) {
+		contentRequest.renderedTile.build();
+		contentRequest.renderedTile->source.path = path;
+		contentRequest.renderedTile->level = request.tileLevel;
+		contentRequest.renderedTile->x = request.tileX;
+		contentRequest.renderedTile->y = request.tileY;
+		contentRequest.renderedTile->forceGreyscale = request.forceGreyscale;
+		contentRequest.renderedTile->low = request.low;
+		contentRequest.renderedTile->med = request.med;
+		contentRequest.renderedTile->high = request.high;
+		contentRequest.renderedTile->debayer = request.debayer;
+	} else {
+		contentRequest.renderedImage.build();
+		contentRequest.renderedImage->source.path = path;
+		contentRequest.renderedImage->bin = request.bin;
+		contentRequest.renderedImage->forceGreyscale = request.forceGreyscale;
+		contentRequest.renderedImage->low = request.low;
+		contentRequest.renderedImage->med = request.med;
+		contentRequest.renderedImage->high = request.high;
+		contentRequest.renderedImage->debayer = request.debayer;
+	}
+	SharedCache::EntryRef image(cache->getEntry(contentRequest));
+	if (image->hasError()) {
+		output.sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 500, image->getErrorDetails().c_str()));
+		return false;
+	}
+
+	// The jpeg is served as is from the cache
+	cgicc::HTTPResponseHeader header("HTTP/1.1", 200, "OK");
+	header.addHeader("Content-Type", "image/jpeg");
+	header.addHeader("Content-Length", std::to_string(image->size()));
+	header.addHeader("connection", "close");
+	output.sendHttpHeader(header);
+
+	if (!disableOutput) {
+		output.write(image->data(), image->size());
 	}
+	return true;
+}
+
+static int urlHexDigit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
 
-	double low = parseFormFloat(formData, "low", 0.05);
-	double med = parseFormFloat(formData, "med", 0.5);
-	double high = parseFormFloat(formData, "high", 0.95);
+static std::string urlDecode(const std::string & str)
+{
+	std::string result;
+	result.reserve(str.size());
+	for(size_t i = 0; i < str.size(); ++i)
+	{
+		char c = str[i];
+		if (c == '+') {
+			result += ' ';
+		} else if (c == '%' && i + 2 < str.size() && urlHexDigit(str[i + 1]) != -1 && urlHexDigit(str[i + 2]) != -1) {
+			result += (char)(urlHexDigit(str[i + 1]) * 16 + urlHexDigit(str[i + 2]));
+			i += 2;
+		} else {
+			result += c;
+		}
+	}
+	return result;
+}
 
-	contentRequest.fitsContent.clear();
-	contentRequest.histogram.build();
-	contentRequest.histogram->source.path = path;
-	SharedCache::EntryRef histogram(cache->getEntry(contentRequest));
-	if (histogram->hasError()) {
-		sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 500, histogram->getErrorDetails().c_str()));
-		exit(1);
+static RequestParams parseQueryString(const std::string & query)
+{
+	RequestParams result;
+	size_t pos = 0;
+	while(pos <= query.size()) {
+		size_t end = query.find('&', pos);
+		if (end == std::string::npos) {
+			end = query.size();
+		}
+		std::string item = query.substr(pos, end - pos);
+		if (item.size()) {
+			size_t eq = item.find('=');
+			if (eq == std::string::npos) {
+				result[urlDecode(item)] = "";
+			} else {
+				result[urlDecode(item.substr(0, eq))] = urlDecode(item.substr(eq + 1));
+			}
+		}
+		pos = end + 1;
 	}
+	return result;
+}
+
+// Read the request head of a daemon client and extract the query string
+static bool readHttpQuery(int fd, std::string & query)
+{
+	const int maxHeadSize = 16384;
+	std::string head;
+	char buffer[2048];
+	while(head.find("\r\n\r\n") == std::string::npos && head.find("\n\n") == std::string::npos) {
+		if (head.size() > maxHeadSize) {
+			std::cerr << "Request head too long\n";
+			return false;
+		}
+		ssize_t rd = read(fd, buffer, sizeof(buffer));
+		if (rd == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				std::cerr << "Request head timed out\n";
+				return false;
+			}
+			perror("read");
+			return false;
+		}
+		if (rd == 0) {
+			return false;
+		}
+		head.append(buffer, rd);
+	}
+
+	// GET /fitsviewer/fitsviewer.cgi?path=... HTTP/1.1
+	size_t lineEnd = head.find_first_of("\r\n");
+	std::string requestLine = head.substr(0, lineEnd);
+	size_t targetStart = requestLine.find(' ');
+	if (targetStart == std::string::npos) {
+		return false;
+	}
+	targetStart++;
+	size_t targetEnd = requestLine.find(' ', targetStart);
+	std::string target = requestLine.substr(targetStart, targetEnd == std::string::npos ? std::string::npos : targetEnd - targetStart);
+	size_t queryStart = target.find('?');
+	query = queryStart == std::string::npos ? "" : target.substr(queryStart + 1);
+	return true;
+}
 
-	HistogramStorage * histogramStorage = (HistogramStorage*)histogram->data();
+// Time allowed to a client to send its request head
+static const int requestHeadTimeout = 10;
 
-	int w = storage->w;
-	int h = storage->h;
-	std::string bayer = storage->getBayer();
+static void daemonThread(int serverFd, RenderContext * context)
+{
+	while(true) {
+		int fd = accept(serverFd, nullptr, nullptr);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+				return;
+			}
+			// Out of descriptors or memory: keep the thread in the pool, and retry
+			usleep(100000);
+			continue;
+		}
+
+		struct timeval timeout = { requestHeadTimeout, 0 };
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+			perror("setsockopt");
+		}
 
-	uint16_t * data = storage->data;
+		ReplyChannel output(fd, true);
+		std::string query;
+		if (readHttpQuery(fd, query)) {
+			RenderRequest request;
+			request.parse(parseQueryString(query));
+			if (request.path.empty()) {
+				output.sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 400, "Missing path"));
+			} else {
+				try {
+					render(*context, request, output);
+				} catch(const std::exception & e) {
+					std::cerr << "Render of " << request.path << " failed: " << e.what() << "\n";
+					// The cache protocol may be out of sync. Reconnect for the next request
+					context->dropCache();
+					output.sendHttpHeader(cgicc::HTTPResponseHeader("HTTP/1.1", 500, "Internal error"));
+				}
+			}
+		}
+		close(fd);
+	}
+}
 
-	bool color = forceGreyscale ? false : bayer.length() > 0;
+// Serve http requests on a unix socket, using a pool of threads that keep
+// their cache connection, lookup tables and jpeg compressor between requests
+static int runDaemon(const std::string & socketPath, int threadCount)
+{
+	signal(SIGPIPE, SIG_IGN);
 
+	int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (serverFd == -1) {
+		perror("socket");
+		return 1;
+	}
 
-	cgicc::HTTPResponseHeader header("HTTP/1.1", 200, "OK");
-	header.addHeader("Content-Type", "image/jpeg");
-	header.addHeader("Transfer-Encoding", "chunked");
-	header.addHeader("connection", "close");
-	sendHttpHeader(header);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path too long: " << socketPath << "\n";
+		return 1;
+	}
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+	unlink(socketPath.c_str());
 
+	if (bind(serverFd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror(socketPath.c_str());
+		return 1;
+	}
+	if (listen(serverFd, 64) == -1) {
+		perror("listen");
+		return 1;
+	}
 
-	if (color) {
-		// Bin 1 (aka debayer) not supported.
-		if (bin < 1) {
-			bin = 1;
+	if (threadCount <= 0) {
+		threadCount = std::thread::hardware_concurrency();
+		if (threadCount <= 0) {
+			threadCount = 2;
 		}
 	}
 
-	JpegWriter writer(binDiv(w, bin), binDiv(h, bin), color > 0 ? 3 : 1);
-	writer.start();
+	// Connect all threads from here: the first connection may have to fork the cache server
+	std::vector<RenderContext*> contexts;
+	for(int i = 0; i < threadCount; ++i) {
+		contexts.push_back(new RenderContext());
+		contexts.back()->getCache();
+	}
 
-	int stripHeight = 32 << bin;
-	// do histogram for each channel !
-	if (color) {
-		int levels[3][3];
-		for(int i = 0; i < 3; ++i) {
-			auto channelStorage = histogramStorage->channel(i);
-			levels[i][0]= channelStorage->getLevel(low);
-			levels[i][2]= channelStorage->getLevel(high);
-			levels[i][1]= round(levels[i][0] + (levels[i][2] - levels[i][0]) * med);
-		}
-		std::cerr << "Levels are " << levels[0][0]  << " " << levels[0][1]<< " " << levels[0][2] << "\n";
-		std::cerr << "Levels are " << levels[1][0]  << " " << levels[1][1]<< " " << levels[1][2] << "\n";
-		std::cerr << "Levels are " << levels[2][0]  << " " << levels[2][1]<< " " << levels[2][2] << "\n";
-		u_int8_t * result = new u_int8_t[3 * binDiv(w, bin) * (stripHeight >> bin)];
-
-		LookupTable table_r(levels[0][0], levels[0][1], levels[0][2]);
-		LookupTable table_g(levels[1][0], levels[1][1], levels[1][2]);
-		LookupTable table_b(levels[2][0], levels[2][1], levels[2][2]);
-
-		int basey = 0;
-		while(basey < h) {
-			int yleft = h - basey;
-			if (yleft > stripHeight) yleft = stripHeight;
-
-
-			// Do: R, G, B
-			int8_t offset_r, second_r;
-			int8_t offset_g, second_g;
-			int8_t offset_b, second_b;
-			findBayerOffset(bayer, 'R', offset_r, second_r);
-			findBayerOffset(bayer, 'G', offset_g, second_g);
-			findBayerOffset(bayer, 'B', offset_b, second_b);
-			applyScaleBinBayer(data + basey * w, w, yleft,
-					table_r, bayerOffset(offset_r, w), bayerOffset(second_r, w),
-					table_g, bayerOffset(offset_g, w), bayerOffset(second_g, w),
-					table_b, bayerOffset(offset_b, w), bayerOffset(second_b, w),
-					result,
-					bin);
-
-
-			writer.writeLines(result, binDiv(yleft, bin));
-			fflush(stdout);
-			basey += stripHeight;
-		}
+	std::cerr << "fitsviewer daemon listening on " << socketPath << " with " << threadCount << " threads\n";
 
-		delete [] result;
-	} else {
-		auto channelStorage = histogramStorage->channel(0);
-
-		int lowAdu = channelStorage->getLevel(low);
-		int highAdu = channelStorage->getLevel(high);
-		int medAdu = round(lowAdu + (highAdu - lowAdu) * med);
-		LookupTable lookupTable(lowAdu, medAdu, highAdu);
-
-		u_int8_t * result = new u_int8_t[binDiv(w, bin) * (stripHeight >> bin)];
-
-		// faire le bin !
-		int basey = 0;
-		while(basey < h) {
-			int yleft = (h - basey);
-			if (yleft > stripHeight) yleft = stripHeight;
-			if (bin > 0) {
-				applyScaleBin(data + basey * w, w, yleft, lookupTable, result, bin);
-			} else {
-				applyScale(data + basey * w, w, yleft, lookupTable, result);
-			}
-			writer.writeLines(result, binDiv(yleft, bin));
+	std::vector<std::thread> threads;
+	for(int i = 0; i < threadCount; ++i) {
+		threads.push_back(std::thread(daemonThread, serverFd, contexts[i]));
+	}
+	for(auto & thread : threads) {
+		thread.join();
+	}
+	return 1;
+}
 
-			basey += stripHeight;
-		}
-		delete(result);
+int main (int argc, char ** argv) {
+	std::string daemonSocket;
+	if (findArgValue(argc, argv, "--daemon", daemonSocket)) {
+		std::string threads;
+		findArgValue(argc, argv, "--threads", threads);
+		disableOutput = findArg(argc, argv, "--no-output");
+		return runDaemon(daemonSocket, threads.empty() ? 0 : atoi(threads.c_str()));
+	}
+
+	Cgicc formData;
+
+	RequestParams params;
+	for(auto it = formData.getElements().begin(); it != formData.getElements().end(); ++it) {
+		params[it->getName()] = it->getValue();
 	}
-	writer.finish();
 
-	histogram->release();
+	RenderRequest request;
+	request.wantSize = findArg(argc, argv, "--size");
+	bool disableHttp = findArg(argc, argv, "--no-http");
+	disableOutput = findArg(argc, argv, "--no-output");
+	request.forceGreyscale = findArg(argc, argv, "--force-greyscale");
+
+	if (argc > 1) {
+		request.path = std::string(argv[1]);
+	} else {
+		request.path = "/home/ludovic/Astronomie/Photos/Light/Essai_Light_1_secs_2017-05-21T10-02-41_009.fits";
+	}
+//	path = "/home/ludovic/Astronomie/Photos/Light/Essai_Light_1_secs_2017-05-21T10-02-41_009.fits";
+
+	request.parse(params);
+
+	RenderContext context;
+	ReplyChannel output(1, !disableHttp);
+	if (!render(context, request, output)) {
+		return 1;
+	}
 	return 0;
 }
@@ -21,13 +21,20 @@ int main (int argc, char ** argv) {
     json request;
     std::cin >> request;
 
-	// 128Mo cache
-	SharedCache::Cache * cache = new SharedCache::Cache("/tmp/fitsviewer.cache", 128*1024*1024);
+	SharedCache::Cache * cache = new SharedCache::Cache(SharedCache::CacheConfig::fromEnvironment());
 
+    if (request.find("prefetch") != request.end()) {
+        cache->prefetch(request["prefetch"].get<SharedCache::Messages::Prefetch>());
+        return 0;
+    }
 
 	SharedCache::Messages::ContentRequest contentRequest;
     SharedCache::Messages::JsonQuery jsonQuery = request;
     contentRequest.jsonQuery = new SharedCache::Messages::JsonQuery(jsonQuery);
+    // Optional: focus, background (interactive by default)
+    if (request.find("priority") != request.end()) {
+        contentRequest.priority = SharedCache::Messages::ContentRequest::parsePriority(request["priority"].get<std::string>());
+    }
 
 
 	SharedCache::EntryRef result(cache->getEntry(contentRequest));
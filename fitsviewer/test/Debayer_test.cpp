@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../Debayer.h"
+
+static void debayer(const std::vector<uint16_t> & data, int w, int h, const char * bayer, Debayer::Method method,
+					std::vector<uint16_t> & r, std::vector<uint16_t> & g, std::vector<uint16_t> & b)
+{
+    r.resize(w * h);
+    g.resize(w * h);
+    b.resize(w * h);
+    Debayer(bayer, method).run(data.data(), w, h, r.data(), g.data(), b.data(), 2);
+}
+
+TEST_CASE( "Vector rows match scalar", "[Debayer.cpp]" ) {
+    int w = 61;
+    std::vector<uint16_t> rows[3];
+    srand(1);
+    for(int i = 0; i < 3; ++i) {
+        rows[i].resize(w + 2);
+        for(auto & v : rows[i]) {
+            v = rand() & 0xffff;
+        }
+    }
+    Debayer::Source sources[] = { Debayer::Center, Debayer::Horizontal, Debayer::Vertical, Debayer::Diagonal, Debayer::Cross, Debayer::None };
+    LookupTable::SimdLevel simdLevels[] = { LookupTable::Sse41, LookupTable::Avx2, LookupTable::Neon };
+    for(auto even : sources) {
+        for(auto odd : sources) {
+            std::vector<uint16_t> expected(w), actual(w);
+            Debayer::interpolateRow(LookupTable::Scalar, rows[0].data(), rows[1].data(), rows[2].data(), w, even, odd, expected.data());
+            for(auto level : simdLevels) {
+                Debayer::interpolateRow(level, rows[0].data(), rows[1].data(), rows[2].data(), w, even, odd, actual.data());
+                REQUIRE(actual == expected);
+            }
+        }
+    }
+}
+
+TEST_CASE( "Debayer sources", "[Debayer.cpp]" ) {
+    Debayer d("RGGB", Debayer::Bilinear);
+    // Red site
+    REQUIRE(d.getSource(0, 0) == Debayer::Center);
+    REQUIRE(d.getSource(0, 1) == Debayer::Cross);
+    REQUIRE(d.getSource(0, 2) == Debayer::Diagonal);
+    // Green site on a red row
+    REQUIRE(d.getSource(1, 0) == Debayer::Horizontal);
+    REQUIRE(d.getSource(1, 2) == Debayer::Vertical);
+    // Blue site
+    REQUIRE(d.getSource(3, 0) == Debayer::Diagonal);
+    REQUIRE(d.getSource(3, 2) == Debayer::Center);
+}
+
+TEST_CASE( "Debayer of uniform colors", "[Debayer.cpp]" ) {
+    int w = 37, h = 21;
+    const char * bayer = "GRBG";
+    uint16_t colors[3] = { 1000, 20000, 300 };
+    std::vector<uint16_t> data(w * h);
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            char c = bayer[(x & 1) + 2 * (y & 1)];
+            data[x + y * w] = colors[c == 'R' ? 0 : c == 'G' ? 1 : 2];
+        }
+    }
+
+    Debayer::Method methods[] = { Debayer::Bilinear, Debayer::EdgeAware };
+    for(auto method : methods) {
+        std::vector<uint16_t> r, g, b;
+        debayer(data, w, h, bayer, method, r, g, b);
+        for(int i = 0; i < w * h; ++i) {
+            REQUIRE(r[i] == colors[0]);
+            REQUIRE(g[i] == colors[1]);
+            REQUIRE(b[i] == colors[2]);
+        }
+    }
+}
+
+TEST_CASE( "Edge aware keeps vertical edges", "[Debayer.cpp]" ) {
+    int w = 16, h = 8;
+    // A grey scene, dark on the left, bright on the right
+    std::vector<uint16_t> data(w * h);
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            data[x + y * w] = x < 8 ? 100 : 10000;
+        }
+    }
+
+    std::vector<uint16_t> r, g, b;
+    debayer(data, w, h, "RGGB", Debayer::EdgeAware, r, g, b);
+    for(int y = 0; y < h; ++y) {
+        REQUIRE(g[7 + y * w] == 100);
+        REQUIRE(g[8 + y * w] == 10000);
+    }
+
+    REQUIRE(Debayer::parseMethod("edge") == Debayer::EdgeAware);
+    REQUIRE_THROWS(Debayer::parseMethod("vng"));
+}
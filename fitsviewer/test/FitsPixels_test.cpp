@@ -0,0 +1,31 @@
+#include <stdlib.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../FitsPixels.h"
+
+TEST_CASE( "Big endian BITPIX=16 to ADU", "[FitsPixels.cpp]" ) {
+    // -32768, -1, 0, 32767 in big endian
+    uint8_t sample[] = { 0x80, 0x00, 0xff, 0xff, 0x00, 0x00, 0x7f, 0xff };
+    uint16_t adu[4];
+    fitsUShortToAdu(LookupTable::Scalar, sample, adu, 4);
+    REQUIRE(adu[0] == 0);
+    REQUIRE(adu[1] == 32767);
+    REQUIRE(adu[2] == 32768);
+    REQUIRE(adu[3] == 65535);
+
+    std::vector<uint8_t> raw(2 * 301);
+    srand(5);
+    for(auto & v : raw) {
+        v = rand();
+    }
+    LookupTable::SimdLevel simdLevels[] = { LookupTable::Sse41, LookupTable::Avx2, LookupTable::Neon };
+    for(int count = 0; count <= 301; count += 7) {
+        std::vector<uint16_t> expected(count), actual(count);
+        fitsUShortToAdu(LookupTable::Scalar, raw.data(), expected.data(), count);
+        for(auto level : simdLevels) {
+            fitsUShortToAdu(level, raw.data(), actual.data(), count);
+            REQUIRE(actual == expected);
+        }
+    }
+}
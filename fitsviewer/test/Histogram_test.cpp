@@ -1,5 +1,9 @@
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <vector>
 
 #include "catch.hpp"
 #include "../RawDataStorage.h"
@@ -32,8 +36,7 @@ static uint16_t bayer8x6[] = {
 static RawDataStorage * buildRDS(int w, int h, uint16_t* data)
 {
     RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h)));
-    content->w = w;
-    content->h = h;
+    content->setSize(w, h);
     content->bayer[0] = 0;
     memcpy(content->data, data, w * h * sizeof(uint16_t));
     return content;
@@ -42,8 +45,7 @@ static RawDataStorage * buildRDS(int w, int h, uint16_t* data)
 static RawDataStorage * buildBayerRDS(int w, int h, uint16_t* data)
 {
     RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h)));
-    content->w = w;
-    content->h = h;
+    content->setSize(w, h);
     content->bayer[0] = 'R';
     content->bayer[1] = 'G';
     content->bayer[2] = 'G';
@@ -132,3 +134,130 @@ TEST_CASE( "Histogram scanning", "[Histogram.cpp]" ) {
     }
 };
 
+
+TEST_CASE( "Vector min/max match scalar", "[Histogram.cpp]" ) {
+    std::vector<uint16_t> data(300);
+    srand(2);
+    for(auto & v : data) {
+        v = 1000 + (rand() % 50000);
+    }
+    data[37] = 3;
+    data[38] = 65000;
+    LookupTable::SimdLevel simdLevels[] = { LookupTable::Sse41, LookupTable::Avx2, LookupTable::Neon };
+    for(int step = 1; step <= 2; ++step) {
+        for(int count = 1; count * step < 300; count += 7) {
+            uint16_t expectedMin = 65535, expectedMax = 0;
+            HistogramChannelData::rowMinMax(LookupTable::Scalar, data.data(), count, step, expectedMin, expectedMax);
+            for(auto level : simdLevels) {
+                uint16_t min = 65535, max = 0;
+                HistogramChannelData::rowMinMax(level, data.data(), count, step, min, max);
+                REQUIRE(min == expectedMin);
+                REQUIRE(max == expectedMax);
+            }
+        }
+    }
+}
+
+TEST_CASE( "Parallel histogram of a large bayer frame", "[Histogram.cpp]" ) {
+    int w = 1200, h = 900;
+    std::vector<uint16_t> pixels(w * h);
+    static uint32_t expected[3][4100];
+    srand(3);
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            uint16_t v = 100 + (rand() % 4000);
+            pixels[x + y * w] = v;
+            // RGGB
+            int ch = (x & 1) + (y & 1);
+            expected[ch][v]++;
+        }
+    }
+    std::unique_ptr<RawDataStorage> rds(buildBayerRDS(w, h, pixels.data()));
+    std::unique_ptr<HistogramStorage> hs(HistogramStorage::build(rds.get(), 0, 0, w - 1, h - 1, [](long int size){return ::operator new(size);}));
+    for(int ch = 0; ch < 3; ++ch) {
+        REQUIRE(hs->channel(ch)->pixcount == (ch == 1 ? w * h / 2 : w * h / 4));
+        REQUIRE(hs->channel(ch)->min >= 100);
+        REQUIRE(hs->channel(ch)->max < 4100);
+        for(int v = hs->channel(ch)->min; v <= hs->channel(ch)->max; ++v) {
+            REQUIRE(hs->channel(ch)->atAdu(v) == expected[ch][v]);
+        }
+    }
+}
+
+TEST_CASE( "Histogram counted while decoding matches build", "[Histogram.cpp]" ) {
+    int w = 37, h = 23;
+    std::vector<uint16_t> pixels(w * h);
+    srand(4);
+    for(auto & v : pixels) {
+        v = 500 + (rand() % 3000);
+    }
+    for(int bayer = 0; bayer < 2; ++bayer) {
+        std::unique_ptr<RawDataStorage> rds(bayer ? buildBayerRDS(w, h, pixels.data()) : buildRDS(w, h, pixels.data()));
+        std::unique_ptr<HistogramStorage> expected(HistogramStorage::build(rds.get(), 0, 0, w - 1, h - 1, [](long int size){return ::operator new(size);}));
+
+        HistogramCounts counts(rds.get());
+        // In uneven blocks of rows
+        counts.addRows(rds->data, w, 0, 5);
+        counts.addRows(rds->data + 5 * w, w, 5, h);
+        std::unique_ptr<HistogramStorage> hs(counts.build([](long int size){return ::operator new(size);}));
+
+        REQUIRE(hs->channelCount == expected->channelCount);
+        for(int ch = 0; ch < hs->channelCount; ++ch) {
+            HistogramChannelData * a = hs->channel(ch);
+            HistogramChannelData * b = expected->channel(ch);
+            REQUIRE(a->min == b->min);
+            REQUIRE(a->max == b->max);
+            REQUIRE(a->pixcount == b->pixcount);
+            for(uint32_t i = 0; i < a->sampleCount(); ++i) {
+                REQUIRE(a->data[i] == b->data[i]);
+            }
+        }
+    }
+}
+
+TEST_CASE( "Histogram of float samples is counted at their levels", "[Histogram.cpp]" ) {
+    int w = 19, h = 11;
+    std::unique_ptr<RawDataStorage> rds((RawDataStorage*)::operator new(RawDataStorage::requiredStorage(w, h, RawDataStorage::Float32)));
+    rds->setSize(w, h);
+    rds->setBayer("");
+    rds->setSampleType(RawDataStorage::Float32);
+    float * samples = rds->samples<float>();
+    srand(5);
+    for(int i = 0; i < w * h; ++i) {
+        samples[i] = (rand() % 1000) / 250.0f - 1.0f;
+    }
+    samples[7] = NAN;
+    SampleRange<float> range;
+    range.add(samples, w * h);
+    rds->levels = range.levels();
+
+    std::unique_ptr<HistogramStorage> hs(HistogramStorage::build(rds.get(), 0, 0, w - 1, h - 1, [](long int size){return ::operator new(size);}));
+    HistogramCounts counts(rds.get());
+    counts.addRows(samples, rds->levels, w, 0, h);
+    std::unique_ptr<HistogramStorage> decoded(counts.build([](long int size){return ::operator new(size);}));
+
+    // Counted from the levels of the samples, blank at 0
+    std::vector<uint16_t> levels(w * h);
+    rds->readLevels(0, w * h, levels.data());
+    uint16_t min = 65535, max = 0;
+    for(auto v : levels) {
+        if (v < min) min = v;
+        if (v > max) max = v;
+    }
+    REQUIRE(min == 0);
+    REQUIRE(max == 65535);
+    std::vector<uint32_t> expected(65536);
+    for(auto v : levels) {
+        expected[v]++;
+    }
+    for(int i = 1; i < 65536; ++i) {
+        expected[i] += expected[i - 1];
+    }
+    for(HistogramStorage * storage : { hs.get(), decoded.get() }) {
+        HistogramChannelData * ch = storage->channel(0);
+        REQUIRE(ch->min == min);
+        REQUIRE(ch->max == max);
+        REQUIRE(ch->pixcount == (uint32_t)(w * h));
+        REQUIRE(std::equal(expected.begin(), expected.end(), ch->data));
+    }
+}
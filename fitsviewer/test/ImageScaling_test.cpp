@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../LookupTable.h"
+#include "../ImageScaling.h"
+
+// Each color gets its own raw value and its own table.
+// Every output pixel, including partial blocks on the edges, must be table(value)
+TEST_CASE( "Bayer binning of uniform colors", "[ImageScaling.cpp]" ) {
+    const char * patterns[] = { "RGGB", "GRBG", "GBRG", "BGGR" };
+    LookupTable table_r(100, 1000, 4000);
+    LookupTable table_g(200, 2000, 10000);
+    LookupTable table_b(0, 5000, 60000);
+    uint16_t value_r = 1500, value_g = 3000, value_b = 20000;
+
+    for(auto pattern : patterns) {
+        for(int bin = 1; bin <= 3; ++bin) {
+            for(int w = 2; w <= 34; w += 8) {
+                int h = w + 4;
+                SECTION(std::string(pattern) + " bin " + std::to_string(bin) + " w " + std::to_string(w)) {
+                    std::vector<uint16_t> data(w * h);
+                    for(int y = 0; y < h; ++y) {
+                        for(int x = 0; x < w; ++x) {
+                            char c = pattern[(y & 1) * 2 + (x & 1)];
+                            data[y * w + x] = c == 'R' ? value_r : c == 'G' ? value_g : value_b;
+                        }
+                    }
+
+                    int8_t offset_r, second_r, offset_g, second_g, offset_b, second_b;
+                    findBayerOffset(pattern, 'R', offset_r, second_r);
+                    findBayerOffset(pattern, 'G', offset_g, second_g);
+                    findBayerOffset(pattern, 'B', offset_b, second_b);
+
+                    int bw = binDiv(w, bin), bh = binDiv(h, bin);
+                    std::vector<uint8_t> result(3 * bw * bh);
+                    applyScaleBinBayer(data.data(), w, h,
+                            table_r, bayerOffset(offset_r, w), bayerOffset(second_r, w),
+                            table_g, bayerOffset(offset_g, w), bayerOffset(second_g, w),
+                            table_b, bayerOffset(offset_b, w), bayerOffset(second_b, w),
+                            result.data(), bin);
+
+                    int errors = 0;
+                    for(int i = 0; i < bw * bh; ++i) {
+                        if (result[3 * i] != table_r.fastGet(value_r)) errors++;
+                        if (result[3 * i + 1] != table_g.fastGet(value_g)) errors++;
+                        if (result[3 * i + 2] != table_b.fastGet(value_b)) errors++;
+                    }
+                    REQUIRE(errors == 0);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE( "Greyscale binning of uniform image", "[ImageScaling.cpp]" ) {
+    LookupTable table(1000, 1200, 3000);
+    for(int bin = 0; bin <= 4; ++bin) {
+        for(int w = 1; w <= 37; w += 9) {
+            int h = w + 3;
+            std::vector<uint16_t> data(w * h, 1100);
+            std::vector<uint8_t> result(binDiv(w, bin) * binDiv(h, bin));
+            if (bin) {
+                applyScaleBin(data.data(), w, h, table, result.data(), bin);
+            } else {
+                applyScale(data.data(), w, h, table, result.data());
+            }
+            for(auto v : result) {
+                REQUIRE(v == table.fastGet(1100));
+            }
+        }
+    }
+}
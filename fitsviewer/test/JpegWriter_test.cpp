@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../JpegWriter.h"
+
+TEST_CASE( "Jpeg is written to memory", "[JpegWriter.cpp]" ) {
+    int w = 301, h = 97;
+    std::vector<uint8_t> pixels(w * h * 3);
+    for(size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (i * 7) & 255;
+    }
+
+    JpegWriter writer;
+    std::vector<uint8_t> first, second;
+    for(int channels = 1; channels <= 3; channels += 2) {
+        SECTION("channels: " + std::to_string(channels)) {
+            writer.start(&first, w, h, channels);
+            writer.writeLines(pixels.data(), h);
+            writer.finish();
+
+            REQUIRE(first.size() > 4);
+            // SOI ... EOI
+            REQUIRE(first[0] == 0xff);
+            REQUIRE(first[1] == 0xd8);
+            REQUIRE(first[first.size() - 2] == 0xff);
+            REQUIRE(first[first.size() - 1] == 0xd9);
+
+            // The compressor is reusable
+            writer.start(&second, w, h, channels);
+            writer.writeLines(pixels.data(), h);
+            writer.finish();
+            REQUIRE(first == second);
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../LookupTable.h"
+
+static int levels[][3] = {
+    {0, 0, 0},
+    {1000, 1000, 1000},
+    {0, 100, 255},
+    {300, 310, 500},
+    {0, 32768, 65535},
+    {1200, 2500, 16000},
+    {100, 101, 60000},
+    {5000, 64000, 65000},
+    {20000, 20001, 20002},
+    {-1, -1, -1}
+};
+
+TEST_CASE( "Vector lookups match fastGet", "[LookupTable.cpp]" ) {
+    std::vector<uint16_t> values(65536 + 7);
+    for(size_t i = 0; i < values.size(); ++i) {
+        values[i] = i & 65535;
+    }
+    LookupTable::SimdLevel simdLevels[] = { LookupTable::Scalar, LookupTable::Sse41, LookupTable::Avx2, LookupTable::Neon };
+
+    for(int l = 0; levels[l][0] != -1; ++l) {
+        LookupTable table(levels[l][0], levels[l][1], levels[l][2]);
+        for(auto level : simdLevels) {
+            SECTION("levels " + std::to_string(l) + " simd " + std::to_string(level)) {
+                std::vector<uint8_t> result(values.size());
+                table.apply(level, values.data(), result.data(), values.size());
+                int errors = 0;
+                for(size_t i = 0; i < values.size(); ++i) {
+                    if (result[i] != table.fastGet(values[i])) {
+                        errors++;
+                    }
+                }
+                REQUIRE(errors == 0);
+            }
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#include "catch.hpp"
+#include "../SharedCache.h"
+
+using SharedCache::Messages::ContentRequest;
+using SharedCache::Messages::RawContent;
+
+// A dependency, as built by a producer
+static ContentRequest dependency()
+{
+    ContentRequest request;
+    request.fitsContent = new RawContent();
+    request.fitsContent->path = "/frame.fits";
+    return request;
+}
+
+TEST_CASE( "Dependencies inherit the class of their producer", "[Messages.cpp]" ) {
+    // Through the wire, as sent by a worker process
+    nlohmann::json j = dependency();
+    REQUIRE(j.find("priority") == j.end());
+    ContentRequest received = j.get<ContentRequest>();
+    REQUIRE(received.priority == ContentRequest::Unspecified);
+
+    REQUIRE(received.effectivePriority(ContentRequest::Background) == ContentRequest::Background);
+    REQUIRE(received.effectivePriority(ContentRequest::Focus) == ContentRequest::Focus);
+    REQUIRE(received.effectivePriority(ContentRequest::Interactive) == ContentRequest::Interactive);
+    // Consumers are interactive by default
+    REQUIRE(received.effectivePriority(ContentRequest::Unspecified) == ContentRequest::Interactive);
+}
+
+TEST_CASE( "Explicit classes are kept", "[Messages.cpp]" ) {
+    ContentRequest request = dependency();
+    request.priority = ContentRequest::Background;
+    ContentRequest received = nlohmann::json(request).get<ContentRequest>();
+    REQUIRE(received.priority == ContentRequest::Background);
+    REQUIRE(received.effectivePriority(ContentRequest::Unspecified) == ContentRequest::Background);
+    // A worker is never less urgent than what it produces
+    REQUIRE(received.effectivePriority(ContentRequest::Interactive) == ContentRequest::Interactive);
+
+    request.priority = ContentRequest::Interactive;
+    ContentRequest interactive = nlohmann::json(request).get<ContentRequest>();
+    REQUIRE(interactive.priority == ContentRequest::Interactive);
+    REQUIRE(interactive.effectivePriority(ContentRequest::Background) == ContentRequest::Interactive);
+}
+
+TEST_CASE( "Messages decode straight from MessagePack", "[Messages.cpp]" ) {
+    SharedCache::Messages::Request request;
+    request.contentRequest = new ContentRequest(dependency());
+    request.contentRequest->priority = ContentRequest::Focus;
+    request.prefetch = new SharedCache::Messages::Prefetch();
+    request.prefetch->path = std::string(300, 'p');
+    request.prefetch->previewBin = -1;
+    std::vector<uint8_t> encoded = nlohmann::json::to_msgpack(nlohmann::json(request));
+
+    SharedCache::Messages::Request received;
+    SharedCache::Messages::fromMsgpack(encoded.data(), encoded.size(), received);
+    REQUIRE(received.contentRequest);
+    REQUIRE(received.contentRequest->fitsContent->path == "/frame.fits");
+    REQUIRE(received.contentRequest->priority == ContentRequest::Focus);
+    REQUIRE(!received.contentRequest->histogram);
+    REQUIRE(received.prefetch->path == request.prefetch->path);
+    REQUIRE(received.prefetch->previewBin == -1);
+    REQUIRE(!received.workRequest);
+    REQUIRE(!received.finishedAnnounce);
+
+    SharedCache::Messages::Result result;
+    result.contentResult = new SharedCache::Messages::ContentResult();
+    result.contentResult->error = true;
+    result.contentResult->filename = "";
+    result.contentResult->errorDetails = "failed";
+    encoded = nlohmann::json::to_msgpack(nlohmann::json(result));
+    SharedCache::Messages::Result receivedResult;
+    SharedCache::Messages::fromMsgpack(encoded.data(), encoded.size(), receivedResult);
+    REQUIRE(receivedResult.contentResult->error);
+    REQUIRE(receivedResult.contentResult->errorDetails == "failed");
+    REQUIRE(!receivedResult.todoResult);
+
+    // Truncated on the wire
+    SharedCache::Messages::Result truncated;
+    REQUIRE_THROWS(SharedCache::Messages::fromMsgpack(encoded.data(), encoded.size() - 1, truncated));
+}
@@ -0,0 +1,146 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "catch.hpp"
+#include "../TempDir.h"
+#include "../PersistentStore.h"
+
+using SharedCache::PersistentStore;
+
+// An unlinked file holding data
+static int dataFd(const TempDir & dir, const std::string & data)
+{
+    std::string path = dir.path() + "/data";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    REQUIRE(fd != -1);
+    unlink(path.c_str());
+    REQUIRE(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    return fd;
+}
+
+static std::string restored(PersistentStore & store, const TempDir & dir, const std::string & identifier)
+{
+    int fd = dataFd(dir, "");
+    bool done = false, ok = false;
+    long size = -1;
+    bool started = store.restore(identifier, fd, [&](bool restoredOk, long restoredSize, long prodDuration) {
+        done = true;
+        ok = restoredOk;
+        size = restoredSize;
+    });
+    store.flush();
+    REQUIRE(done == started);
+    std::string result;
+    if (ok) {
+        result.resize(size);
+        REQUIRE(pread(fd, &result[0], size, 0) == size);
+    }
+    close(fd);
+    return ok ? result : "<missing>";
+}
+
+static bool always(const std::string & identifier)
+{
+    return true;
+}
+
+TEST_CASE( "Persistent store survives a reload", "[PersistentStore.cpp]" ) {
+    TempDir storeDir("persistent");
+    TempDir dataDir("persistentdata");
+    {
+        PersistentStore store(storeDir.path(), 1024);
+        store.load(always);
+        int fd = dataFd(dataDir, "first content");
+        REQUIRE(store.store("{\"a\":1}", fd, 13, 42));
+        // Written in the background, from a copy of the descriptor
+        close(fd);
+        store.flush();
+        REQUIRE(store.contains("{\"a\":1}"));
+        REQUIRE(store.count() == 1);
+        REQUIRE(store.size() == 13);
+        store.save();
+    }
+
+    PersistentStore store(storeDir.path(), 1024);
+    store.load(always);
+    REQUIRE(store.contains("{\"a\":1}"));
+    REQUIRE(restored(store, dataDir, "{\"a\":1}") == "first content");
+    REQUIRE(restored(store, dataDir, "{\"b\":1}") == "<missing>");
+}
+
+TEST_CASE( "Persistent store drops outdated entries on load", "[PersistentStore.cpp]" ) {
+    TempDir storeDir("persistent");
+    TempDir dataDir("persistentdata");
+    {
+        PersistentStore store(storeDir.path(), 1024);
+        store.load(always);
+        int fd = dataFd(dataDir, "0123456789");
+        REQUIRE(store.store("old", fd, 10, 1));
+        REQUIRE(store.store("new", fd, 10, 1));
+        close(fd);
+    }
+
+    PersistentStore store(storeDir.path(), 1024);
+    store.load([](const std::string & identifier) { return identifier != "old"; });
+    REQUIRE(!store.contains("old"));
+    REQUIRE(store.contains("new"));
+    REQUIRE(store.size() == 10);
+    // The file is gone as well
+    struct stat st;
+    REQUIRE(stat((storeDir.path() + "/" + PersistentStore::fileName("old")).c_str(), &st) == -1);
+}
+
+TEST_CASE( "Persistent store only cleans its own files", "[PersistentStore.cpp]" ) {
+    TempDir storeDir("persistent");
+    std::string stray = storeDir.path() + "/" + PersistentStore::fileName("stray");
+    std::string strayTmp = stray + ".tmp";
+    std::string other = storeDir.path() + "/notes.txt";
+    for(const std::string & path : { stray, strayTmp, other }) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0600);
+        REQUIRE(fd != -1);
+        close(fd);
+    }
+
+    {
+        PersistentStore store(storeDir.path(), 1024);
+        store.load(always);
+    }
+    struct stat st;
+    REQUIRE(stat(stray.c_str(), &st) == -1);
+    REQUIRE(stat(strayTmp.c_str(), &st) == -1);
+    REQUIRE(stat(other.c_str(), &st) == 0);
+    REQUIRE(!PersistentStore::isStoreFile("index.json"));
+    REQUIRE(!PersistentStore::isStoreFile(PersistentStore::fileName("a") + ".bak"));
+}
+
+TEST_CASE( "Persistent store stays under its size", "[PersistentStore.cpp]" ) {
+    TempDir storeDir("persistent");
+    TempDir dataDir("persistentdata");
+    PersistentStore store(storeDir.path(), 25);
+    store.load(always);
+    int fd = dataFd(dataDir, "0123456789");
+    REQUIRE(store.store("{\"path\":\"a\",\"fileId\":\"1\"}", fd, 10, 1));
+    REQUIRE(store.store("{\"path\":\"b\",\"fileId\":\"2\"}", fd, 10, 1));
+    REQUIRE(store.size() == 20);
+    // Too big
+    REQUIRE(!store.store("c", fd, 30, 1));
+    // The oldest one makes room
+    REQUIRE(store.store("{\"path\":\"c\",\"fileId\":\"1\"}", fd, 10, 1));
+    REQUIRE(store.count() == 2);
+    REQUIRE(!store.contains("{\"path\":\"a\",\"fileId\":\"1\"}"));
+    close(fd);
+    store.flush();
+    REQUIRE(store.contains("{\"path\":\"c\",\"fileId\":\"1\"}"));
+    // Its removal was done after its copy
+    struct stat st;
+    REQUIRE(stat((storeDir.path() + "/" + PersistentStore::fileName("{\"path\":\"a\",\"fileId\":\"1\"}")).c_str(), &st) == -1);
+
+    store.invalidate("\"fileId\":\"1\"");
+    REQUIRE(store.count() == 1);
+    REQUIRE(store.contains("{\"path\":\"b\",\"fileId\":\"2\"}"));
+    REQUIRE(store.size() == 10);
+}
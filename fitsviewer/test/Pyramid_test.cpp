@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "catch.hpp"
+#include "../RawDataStorage.h"
+#include "../PyramidStorage.h"
+
+static RawDataStorage * buildRDS(int w, int h, const char * bayer)
+{
+    RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h)));
+    content->setSize(w, h);
+    content->setBayer(bayer);
+    return content;
+}
+
+static PyramidStorage * buildPyramid(const RawDataStorage * rds)
+{
+    PyramidStorage * pyramid = (PyramidStorage*)(::operator new(PyramidStorage::requiredStorage(rds->w, rds->h)));
+    pyramid->init(rds->w, rds->h, rds->bayer);
+    for(int level = 1; level <= pyramid->levelCount; ++level) {
+        pyramid->buildLevel(rds, level, 0, pyramid->levels[level].h);
+    }
+    return pyramid;
+}
+
+TEST_CASE( "Pyramid levels", "[Pyramid.cpp]" ) {
+    REQUIRE(PyramidStorage::topLevel(256, 256) == 1);
+    REQUIRE(PyramidStorage::topLevel(512, 300) == 1);
+    REQUIRE(PyramidStorage::topLevel(513, 300) == 2);
+    REQUIRE(PyramidStorage::topLevel(6000, 4000) == 5);
+
+    std::unique_ptr<RawDataStorage> rds(buildRDS(1001, 601, ""));
+    std::unique_ptr<PyramidStorage> pyramid(buildPyramid(rds.get()));
+    REQUIRE(pyramid->levelCount == 2);
+    REQUIRE(pyramid->levels[1].w == 501);
+    REQUIRE(pyramid->levels[1].h == 301);
+    REQUIRE(pyramid->levels[2].w == 251);
+    REQUIRE(pyramid->levels[2].h == 151);
+}
+
+TEST_CASE( "Pyramid of grey image", "[Pyramid.cpp]" ) {
+    std::unique_ptr<RawDataStorage> rds(buildRDS(5, 3, ""));
+    uint16_t pixels[] = {
+        0, 4, 8, 8, 100,
+        4, 8, 8, 8, 200,
+        1, 1, 1, 3, 7,
+    };
+    memcpy(rds->data, pixels, sizeof(pixels));
+    std::unique_ptr<PyramidStorage> pyramid(buildPyramid(rds.get()));
+
+    REQUIRE(pyramid->levels[1].w == 3);
+    REQUIRE(pyramid->levels[1].h == 2);
+    uint16_t * level1 = pyramid->levelData(1);
+    REQUIRE(level1[0] == 4);
+    REQUIRE(level1[1] == 8);
+    REQUIRE(level1[2] == 150);
+    REQUIRE(level1[3] == 1);
+    REQUIRE(level1[4] == 2);
+    REQUIRE(level1[5] == 7);
+}
+
+TEST_CASE( "Pyramid of bayer image keeps the pattern", "[Pyramid.cpp]" ) {
+    int w = 8, h = 4;
+    std::unique_ptr<RawDataStorage> rds(buildRDS(w, h, "RGGB"));
+    // Value depends on the site color and on the 4x4 block
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            int site = (x & 1) + 2 * (y & 1);
+            rds->setAdu(x, y, 1000 * site + 10 * (x / 4) + (x & 2) + (y & 2));
+        }
+    }
+    std::unique_ptr<PyramidStorage> pyramid(buildPyramid(rds.get()));
+    REQUIRE(pyramid->hasColors());
+    REQUIRE(pyramid->getBayer() == "RGGB");
+    REQUIRE(pyramid->levels[1].w == 4);
+    REQUIRE(pyramid->levels[1].h == 2);
+    uint16_t * level1 = pyramid->levelData(1);
+    for(int y = 0; y < 2; ++y) {
+        for(int x = 0; x < 4; ++x) {
+            int site = (x & 1) + 2 * (y & 1);
+            // average of +0, +2, +2, +4
+            REQUIRE(level1[x + 4 * y] == 1000 * site + 10 * (x / 2) + 2);
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#include <math.h>
+#include <memory>
+
+#include "catch.hpp"
+#include "../RawDataStorage.h"
+
+TEST_CASE( "Levels of other sample types", "[RawDataStorage.h]" ) {
+    // Signed values that fit in 16 bits are only shifted
+    int16_t shorts[] = { -100, 0, 1000 };
+    SampleRange<int16_t> shortRange;
+    shortRange.add(shorts, 3);
+    SampleLevels levels = shortRange.levels();
+    REQUIRE(levels.zero == -100);
+    REQUIRE(levels.scale == 1);
+    uint16_t adu[3];
+    levels.levels(shorts, 3, adu);
+    REQUIRE(adu[0] == 0);
+    REQUIRE(adu[1] == 100);
+    REQUIRE(adu[2] == 1100);
+
+    // Unsigned 16 bits range is kept as is
+    int32_t ushorts[] = { 5, 65535 };
+    SampleRange<int32_t> intRange;
+    intRange.add(ushorts, 2);
+    levels = intRange.levels();
+    REQUIRE(levels.zero == 0);
+    REQUIRE(levels.scale == 1);
+
+    // Floats are stretched, blank pixels ignored
+    float floats[] = { 0.5f, NAN, 1.5f, 1.0f };
+    SampleRange<float> floatRange;
+    floatRange.add(floats, 2);
+    floatRange.add(floats + 2, 2);
+    levels = floatRange.levels();
+    REQUIRE(levels.zero == 0.5);
+    uint16_t fadu[4];
+    levels.levels(floats, 4, fadu);
+    REQUIRE(fadu[0] == 0);
+    REQUIRE(fadu[1] == 0);
+    REQUIRE(fadu[2] == 65535);
+    REQUIRE(fadu[3] == 32768);
+    REQUIRE(levels.value(fadu[3]) == Approx(1.0).epsilon(1e-4));
+}
+
+TEST_CASE( "Samples are kept in their type", "[RawDataStorage.h]" ) {
+    int w = 3, h = 2;
+    std::unique_ptr<RawDataStorage> rds((RawDataStorage*)::operator new(RawDataStorage::requiredStorage(w, h, RawDataStorage::Float64)));
+    rds->setSize(w, h);
+    rds->setSampleType(RawDataStorage::Float64);
+    REQUIRE(RawDataStorage::requiredStorage(w, h, RawDataStorage::Float64) - RawDataStorage::requiredStorage(w, h) == w * h * 6);
+
+    double values[] = { -1e6, 0.25, 1e6, 3, NAN, 0 };
+    SampleRange<double> range;
+    for(int i = 0; i < w * h; ++i) {
+        rds->samples<double>()[i] = values[i];
+    }
+    range.add(rds->samples<double>(), w * h);
+    rds->levels = range.levels();
+    REQUIRE(rds->samples<double>()[1] == 0.25);
+
+    uint16_t adu[3];
+    rds->readLevels(3, 3, adu);
+    REQUIRE(adu[0] == rds->levels.level(3.0));
+    REQUIRE(adu[1] == 0);
+    REQUIRE(rds->levels.value(adu[2]) == Approx(0).margin(rds->levels.scale));
+
+    // Back to unsigned 16 bits
+    rds->setSize(w, h);
+    REQUIRE(rds->sampleType == RawDataStorage::UInt16);
+    rds->setAdu(1, 1, 1234);
+    rds->readLevels(4, 1, adu);
+    REQUIRE(adu[0] == 1234);
+}
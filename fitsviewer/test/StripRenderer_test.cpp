@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+
+#include "catch.hpp"
+#include "../StripRenderer.h"
+
+static void fillStrip(int strip, uint8_t * buffer)
+{
+    for(int i = 0; i < 16; ++i) {
+        buffer[i] = (strip * 16 + i) & 255;
+    }
+}
+
+TEST_CASE( "Strips are consumed in order", "[StripRenderer.cpp]" ) {
+    for(int threads = 1; threads <= 5; ++threads) {
+        SECTION("threads: " + std::to_string(threads)) {
+            StripRenderer renderer(threads);
+            std::vector<int> consumed;
+            bool content = true;
+            bool done = renderer.render(100, 16, fillStrip,
+                [&](int strip, uint8_t * buffer) -> bool {
+                    consumed.push_back(strip);
+                    for(int i = 0; i < 16; ++i) {
+                        if (buffer[i] != ((strip * 16 + i) & 255)) {
+                            content = false;
+                        }
+                    }
+                    return true;
+                });
+            REQUIRE(done);
+            REQUIRE(content);
+            REQUIRE(consumed.size() == 100);
+            for(int i = 0; i < 100; ++i) {
+                REQUIRE(consumed[i] == i);
+            }
+        }
+    }
+}
+
+TEST_CASE( "Strip rendering can be aborted", "[StripRenderer.cpp]" ) {
+    StripRenderer renderer(4);
+    int consumed = 0;
+    bool done = renderer.render(100, 16, fillStrip,
+        [&](int strip, uint8_t * buffer) -> bool {
+            consumed++;
+            return strip < 9;
+        });
+    REQUIRE(!done);
+    REQUIRE(consumed == 10);
+}
+
+TEST_CASE( "Strip errors are reported to the caller", "[StripRenderer.cpp]" ) {
+    for(int threads = 1; threads <= 4; ++threads) {
+        SECTION("producer, threads: " + std::to_string(threads)) {
+            StripRenderer renderer(threads);
+            int consumed = 0;
+            REQUIRE_THROWS_AS(renderer.render(100, 16,
+                [](int strip, uint8_t * buffer) {
+                    if (strip == 42) {
+                        throw std::runtime_error("strip failed");
+                    }
+                    fillStrip(strip, buffer);
+                },
+                [&](int strip, uint8_t * buffer) -> bool {
+                    consumed++;
+                    return true;
+                }), std::runtime_error);
+            REQUIRE(consumed <= 42);
+        }
+        SECTION("consumer, threads: " + std::to_string(threads)) {
+            StripRenderer renderer(threads);
+            REQUIRE_THROWS_AS(renderer.render(100, 16, fillStrip,
+                [&](int strip, uint8_t * buffer) -> bool {
+                    if (strip == 10) {
+                        throw std::runtime_error("consumer failed");
+                    }
+                    return true;
+                }), std::runtime_error);
+        }
+    }
+}
+
+TEST_CASE( "Default thread count can be limited", "[StripRenderer.cpp]" ) {
+    int unlimited = StripRenderer::defaultThreadCount();
+    StripRenderer::setThreadLimit(1);
+    REQUIRE(StripRenderer::defaultThreadCount() == 1);
+    StripRenderer::setThreadLimit(0);
+    REQUIRE(StripRenderer::defaultThreadCount() == unlimited);
+}
@@ -102,7 +102,7 @@ export type FocuserAPI = {
 
 export type ImageProcessorAPI = {
     compute: <K extends keyof ProcessorTypes.Request>
-            (payload: Pick<ProcessorTypes.Request, K>)
+            (payload: Pick<ProcessorTypes.Request, K> & ProcessorTypes.RequestOptions)
                 =>ProcessorTypes.Result[K];
 }
 
@@ -46,6 +46,13 @@ export type ProcessorAstrometryRequest = {
 
 export type ProcessorAstrometryResult = AstrometryResult;
 
+// Load a new frame in the image cache, in the background
+export type ProcessorPrefetchRequest = {
+    path: string;
+    // Also render the preview at this bin
+    previewBin?: number;
+}
+
 export type Order<Req, Res> = {
     req: Req,
     res: Res,
@@ -70,3 +77,10 @@ export type Request = {
 export type Result = {
     [k in keyof Registry]: OrderResult<Registry[k]>
 }
+
+// Scheduling class in the image cache. Defaults to interactive
+export type Priority = "interactive"|"focus"|"background";
+
+export type RequestOptions = {
+    priority?: Priority;
+}
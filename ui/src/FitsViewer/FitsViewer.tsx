@@ -17,6 +17,14 @@ type ImageSize = {
     height: number;
 }
 
+// As returned by fitsviewer.cgi?size=true
+type ImageDetails = ImageSize & {
+    color?: boolean;
+    // Tiles are available when set
+    tileSize?: number;
+    tileLevels?: number;
+}
+
 export type Levels = {
     low: number;
     medium: number;
@@ -62,7 +70,7 @@ class JQImageDisplay {
     // Same with cgi settings ?
     currentImgSrc: string|null = null;
 
-    currentDetails:ImageSize|null = null;
+    currentDetails:ImageDetails|null = null;
     currentDetailsPath: string|null = null;
 
     loadingDetailsAjax:JQueryXHR|null = null;
@@ -75,7 +83,14 @@ class JQImageDisplay {
     loadingImgPath:string|null = null;
     loadingToDisplay?:boolean = false;
     nextLoadingImgSrc:string|null = null;
-    
+
+    // Full resolution tiles of the visible area, over the preview image
+    tileLayer:JQuery<HTMLDivElement>|null = null;
+    tileImgs:{[id:string]:HTMLImageElement} = {};
+    // Path and levels of the displayed tiles
+    tileBaseSrc:string|null = null;
+    tileLevel:number|null = null;
+
     child:JQuery<HTMLDivElement>;
     
     levels: Levels;
@@ -86,7 +101,7 @@ class JQImageDisplay {
 
     touches = {};
 
-    currentImageSize:ImageSize = {width: -1, height: -1};
+    currentImageSize:ImageDetails = {width: -1, height: -1};
     currentImagePos:CompleteImagePos = {x:0, y:0, w:0, h:0, centerx: 0.5, centery: 0.5, zoomToBestfit: 1};
 
     menuTimer:NodeJS.Timeout|null = null;
@@ -223,7 +238,44 @@ class JQImageDisplay {
         return true;
     }
 
-    computeSrc(path:string|null, optionalImageSize?:ImageSize)
+    // The preview bin. When tiles are available, the preview is never more
+    // detailed than the best fit: tiles are loaded for the zoomed area
+    computeBin(imageSize:ImageDetails):number
+    {
+        var bin = 16;
+        if (this.currentImagePos.w > 0 && this.currentImagePos.h > 0
+                && imageSize.width  > -1 && imageSize.height > -1
+                && !imageSize.tileSize)
+        {
+            bin = Math.floor(Math.min(
+                imageSize.width / this.currentImagePos.w,
+                imageSize.height / this.currentImagePos.h
+            ));
+        } else if (imageSize.width > 0 && imageSize.height > 0) {
+            // Prepare for a best fit
+            const bestFit = this.getBestFitForSize(imageSize);
+            bin = Math.floor(Math.min(
+                imageSize.width / bestFit.w,
+                imageSize.height / bestFit.h
+            ));
+        }
+
+        // lower this to a 2^power
+        bin = Math.floor(Math.log2(bin));
+        if (bin < 0) {
+            bin = 0;
+        }
+        return bin;
+    }
+
+    computeLevelsParams()
+    {
+        return '&low=' + this.levels.low
+            + '&med=' + this.levels.medium
+            + '&high=' + this.levels.high;
+    }
+
+    computeSrc(path:string|null, optionalImageSize?:ImageDetails)
     {
         const imageSize = optionalImageSize || this.currentImageSize;
         let str;
@@ -231,33 +283,10 @@ class JQImageDisplay {
             if (path === undefined ){
                 throw new Error("Undefined path arrived");
             }
-            var bin = 16;
-            if (this.currentImagePos.w > 0 && this.currentImagePos.h > 0
-                 && imageSize.width  > -1 && imageSize.height > -1)
-            {
-                bin = Math.floor(Math.min(
-                    imageSize.width / this.currentImagePos.w,
-                    imageSize.height / this.currentImagePos.h
-                ));
-            } else if (imageSize.width > 0 && imageSize.height > 0) {
-                // Prepare for a best fit
-                const bestFit = this.getBestFitForSize(imageSize);
-                bin = Math.floor(Math.min(
-                    imageSize.width / bestFit.w,
-                    imageSize.height / bestFit.h
-                ));
-            }
-
-            // lower this to a 2^power
-            bin = Math.floor(Math.log2(bin));
-            if (bin < 0) {
-                bin = 0;
-            }
+            const bin = this.computeBin(imageSize);
 
             str = 'fitsviewer/fitsviewer.cgi?bin=' + bin + '&path=' + encodeURIComponent(path);
-            str += '&low=' + this.levels.low;
-            str += '&med=' + this.levels.medium;
-            str += '&high=' + this.levels.high;
+            str += this.computeLevelsParams();
         } else {
             str = "#blank";
         }
@@ -345,7 +374,7 @@ class JQImageDisplay {
         return false;
     }
 
-    gotDetails(path:string|null, rslt:ImageSize|null)
+    gotDetails(path:string|null, rslt:ImageDetails|null)
     {
         // FIXME: ajax request can be reordered (right path with the wrong request, is it important ?)
         if (path !== this.loadingDetailsPath) {
@@ -436,6 +465,10 @@ class JQImageDisplay {
         this.currentImg = result ? newImage : null;
         this.currentImgSrc = newSrc;
         this.currentImgPath = this.loadingImgPath;
+        // Tiles survive a new preview of the same image
+        if (this.tileLayer !== null) {
+            this.tileLayer.detach();
+        }
         this.child.empty();
 
         if (this.currentImg !== null) {
@@ -453,6 +486,9 @@ class JQImageDisplay {
                 $(this.currentImg).css('width', $(previousImg).css('width'));
                 $(this.currentImg).css('height', $(previousImg).css('height'));
             }
+            this.updateTiles();
+        } else {
+            this.clearTiles();
         }
 
         if (this.nextLoadingImgSrc !== null) {
@@ -741,6 +777,102 @@ class JQImageDisplay {
             }
         }
         this.currentImagePos = e;
+        this.updateTiles();
+    }
+
+    clearTiles() {
+        if (this.tileLayer !== null) {
+            this.tileLayer.remove();
+            this.tileLayer = null;
+        }
+        this.tileImgs = {};
+        this.tileLevel = null;
+        this.tileBaseSrc = null;
+    }
+
+    // Load the tiles of the visible area when the zoom requires more details than the preview
+    updateTiles() {
+        const details = this.currentImageSize;
+        const pos = this.currentImagePos;
+        if (this.currentImg === null || this.currentImgPath === null
+            || !details.tileSize || details.width <= 0 || details.height <= 0
+            || pos.w <= 0 || pos.h <= 0)
+        {
+            this.clearTiles();
+            return;
+        }
+
+        // Image pixels per screen pixel
+        const ratio = details.width / pos.w;
+        let level = Math.floor(Math.log2(ratio));
+        if (level < 0) {
+            level = 0;
+        }
+        // Bayer frames are debayered at full resolution (level 0)
+        if (level >= this.computeBin(details)) {
+            // The preview is detailed enough
+            this.clearTiles();
+            return;
+        }
+
+        const baseSrc = 'fitsviewer/fitsviewer.cgi?path=' + encodeURIComponent(this.currentImgPath)
+                        + this.computeLevelsParams();
+        if (baseSrc !== this.tileBaseSrc || level !== this.tileLevel) {
+            this.clearTiles();
+            this.tileBaseSrc = baseSrc;
+            this.tileLevel = level;
+        }
+
+        if (this.tileLayer === null) {
+            this.tileLayer = $('<div></div>') as JQuery<HTMLDivElement>;
+            this.tileLayer.css('position', 'absolute');
+            this.tileLayer.css('pointer-events', 'none');
+            this.tileLayer.css('overflow', 'hidden');
+        }
+        if (!$.contains(this.child[0], this.tileLayer[0])) {
+            this.tileLayer.insertAfter(this.currentImg);
+        }
+        this.tileLayer.css('width', pos.w + 'px');
+        this.tileLayer.css('height', pos.h + 'px');
+        this.tileLayer.css('top', pos.y + 'px');
+        this.tileLayer.css('left', pos.x + 'px');
+
+        // Visible rectangle, in image pixels
+        const span = details.tileSize << level;
+        const viewSize = { x: this.child.width()!, y: this.child.height()!};
+        const x0 = Math.max(0, -pos.x * ratio);
+        const y0 = Math.max(0, -pos.y * ratio);
+        const x1 = Math.min(details.width, (viewSize.x - pos.x) * ratio);
+        const y1 = Math.min(details.height, (viewSize.y - pos.y) * ratio);
+
+        const wanted = {};
+        for(let ty = Math.floor(y0 / span); ty * span < y1; ++ty) {
+            for(let tx = Math.floor(x0 / span); tx * span < x1; ++tx) {
+                const id = tx + ',' + ty;
+                wanted[id] = true;
+                if (Object.prototype.hasOwnProperty.call(this.tileImgs, id)) {
+                    continue;
+                }
+                const tile = new Image();
+                $(tile).css('position', 'absolute');
+                $(tile).css('display', 'block');
+                $(tile).css('left', (100 * tx * span / details.width) + '%');
+                $(tile).css('top', (100 * ty * span / details.height) + '%');
+                $(tile).css('width', (100 * Math.min(span, details.width - tx * span) / details.width) + '%');
+                $(tile).css('height', (100 * Math.min(span, details.height - ty * span) / details.height) + '%');
+                tile.src = baseSrc + '&level=' + level + '&tileX=' + tx + '&tileY=' + ty;
+                this.tileImgs[id] = tile;
+                this.tileLayer.append(tile);
+            }
+        }
+
+        // Drop the tiles that went out of view
+        for(const id of Object.keys(this.tileImgs)) {
+            if (!Object.prototype.hasOwnProperty.call(wanted, id)) {
+                $(this.tileImgs[id]).remove();
+                delete this.tileImgs[id];
+            }
+        }
     }
 
     setCurrentImagePos(imgPos:ImagePos) {